@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <library.h>
+#include <utils/debug.h>
+
+static void usage()
+{
+	printf("usage: aead_speed plugins rounds algo1 [algo2 [...]]\n");
+	exit(1);
+}
+
+/**
+ * Buffer sizes to benchmark
+ */
+struct {
+	char *name;
+	size_t len;
+} sizes[] = {
+	{"ESP small",		  64},
+	{"IKE_AUTH",		 512},
+	{"ESP MTU",			1400},
+	{"IKE_AUTH cert",	1536},
+};
+
+static void start_timing(struct timespec *start)
+{
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, start);
+}
+
+static double end_timing(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	return (end.tv_nsec - start->tv_nsec) / 1000000000.0 +
+			(end.tv_sec - start->tv_sec) * 1.0;
+}
+
+static void run_test(const proposal_token_t *token, int rounds)
+{
+	struct timespec timing;
+	u_char key[64], iv[32], assoc[8];
+	chunk_t buf;
+	aead_t *aead;
+	double time;
+	int i, round;
+
+	aead = lib->crypto->create_aead(lib->crypto, token->algorithm,
+									token->keysize / 8);
+	if (!aead)
+	{
+		printf("skipping %s, not supported\n", token->name);
+		return;
+	}
+	memset(key, 0x12, sizeof(key));
+	memset(iv, 0x34, sizeof(iv));
+	memset(assoc, 0x56, sizeof(assoc));
+	if (!aead->set_key(aead, chunk_create(key, aead->get_key_size(aead))))
+	{
+		printf("setting %s key failed\n", token->name);
+		aead->destroy(aead);
+		return;
+	}
+
+	for (i = 0; i < countof(sizes); i++)
+	{
+		buf = chunk_alloc(sizes[i].len + aead->get_icv_size(aead));
+		memset(buf.ptr, 0x78, buf.len);
+		buf.len = sizes[i].len;
+
+		start_timing(&timing);
+		for (round = 0; round < rounds; round++)
+		{
+			if (!aead->encrypt(aead, buf, chunk_create(assoc, sizeof(assoc)),
+							chunk_create(iv, aead->get_iv_size(aead)), NULL))
+			{
+				printf("%s encryption failed\n", token->name);
+				break;
+			}
+		}
+		time = end_timing(&timing);
+		printf("%s %-14s (%4zu bytes): %10.1f ops/s %8.1f MB/s\n",
+				token->name, sizes[i].name, sizes[i].len, rounds / time,
+				rounds * sizes[i].len / time / 1024 / 1024);
+		free(buf.ptr);
+	}
+	aead->destroy(aead);
+}
+
+int main(int argc, char *argv[])
+{
+	const proposal_token_t *token;
+	int rounds, i;
+
+	if (argc < 4)
+	{
+		usage();
+	}
+
+	library_init(NULL);
+	lib->plugins->load(lib->plugins, NULL, argv[1]);
+	atexit(library_deinit);
+
+	rounds = atoi(argv[2]);
+
+	for (i = 3; i < argc; i++)
+	{
+		token = lib->proposal->get_token(lib->proposal, argv[i]);
+		if (!token || token->type != ENCRYPTION_ALGORITHM ||
+			!encryption_algorithm_is_aead(token->algorithm))
+		{
+			printf("aead %s not found\n", argv[i]);
+			continue;
+		}
+		run_test(token, rounds);
+	}
+	return 0;
+}
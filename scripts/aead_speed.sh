@@ -0,0 +1,14 @@
+#!/bin/bash
+
+# Compare AES-GCM implementations on IKE_AUTH and ESP sized buffers. Set
+# libstrongswan.plugins.gcm.clmul = no in strongswan.conf to measure the
+# portable table driven GHASH of the gcm plugin. Run this script on a build
+# of a previous release to get numbers for the old bit-serial GHASH.
+
+ALGS="aes128gcm16 aes256gcm16"
+
+echo "testing gcm"
+./aead_speed "aes gcm random" 20000 $ALGS
+
+echo "testing openssl"
+./aead_speed "openssl" 20000 $ALGS
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <library.h>
+#include <utils/debug.h>
+
+#include <ipsec_policy_mgr.h>
+
+/**
+ * Number of distinct synthetic packets
+ */
+#define PACKETS 1024
+
+static void usage()
+{
+	printf("usage: policy_speed policies lookups\n");
+	printf("  installs policies roadwarrior policies (host to 10.0.0.0/8)\n");
+	printf("  plus one site-to-site policy for every 16 of them, and looks\n");
+	printf("  up lookups synthetic packets in each direction.\n");
+	exit(1);
+}
+
+static void start_timing(struct timespec *start)
+{
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, start);
+}
+
+static double end_timing(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	return (end.tv_nsec - start->tv_nsec) / 1000000000.0 +
+			(end.tv_sec - start->tv_sec) * 1.0;
+}
+
+/**
+ * Install an outbound and an inbound policy between two subnets
+ */
+static void add_policies(ipsec_policy_mgr_t *mgr, char *local, char *remote,
+						 u_int32_t reqid)
+{
+	traffic_selector_t *my_ts, *other_ts;
+	host_t *me, *other;
+	ipsec_sa_cfg_t sa = {
+		.mode = MODE_TUNNEL,
+		.reqid = reqid,
+		.esp = {
+			.use = TRUE,
+			.spi = htonl(reqid),
+		},
+	};
+	mark_t mark = {};
+
+	me = host_create_from_string("192.0.2.1", 0);
+	other = host_create_from_string("198.51.100.1", 0);
+	my_ts = traffic_selector_create_from_cidr(local, 0, 0, 65535);
+	other_ts = traffic_selector_create_from_cidr(remote, 0, 0, 65535);
+
+	mgr->add_policy(mgr, me, other, my_ts, other_ts, POLICY_OUT,
+					POLICY_IPSEC, &sa, mark, POLICY_PRIORITY_DEFAULT);
+	mgr->add_policy(mgr, other, me, other_ts, my_ts, POLICY_IN,
+					POLICY_IPSEC, &sa, mark, POLICY_PRIORITY_DEFAULT);
+
+	my_ts->destroy(my_ts);
+	other_ts->destroy(other_ts);
+	me->destroy(me);
+	other->destroy(other);
+}
+
+/**
+ * Build a synthetic IPv4 UDP packet
+ */
+static ip_packet_t *build_packet(u_int32_t src, u_int32_t dst)
+{
+	struct ip *ip;
+	chunk_t data;
+
+	data = chunk_alloc(sizeof(struct ip) + 8);
+	memset(data.ptr, 0, data.len);
+	ip = (struct ip*)data.ptr;
+	ip->ip_v = 4;
+	ip->ip_hl = sizeof(struct ip) / 4;
+	ip->ip_len = htons(data.len);
+	ip->ip_ttl = 64;
+	ip->ip_p = IPPROTO_UDP;
+	ip->ip_src.s_addr = htonl(src);
+	ip->ip_dst.s_addr = htonl(dst);
+	return ip_packet_create(data);
+}
+
+/**
+ * Look up packets in one direction
+ */
+static void run_test(ipsec_policy_mgr_t *mgr, ip_packet_t **packets,
+					 int lookups, bool inbound)
+{
+	struct timespec timing;
+	ipsec_policy_t *policy;
+	int i, found = 0;
+	double time;
+
+	start_timing(&timing);
+	for (i = 0; i < lookups; i++)
+	{
+		policy = mgr->find_by_packet(mgr, packets[i % PACKETS], inbound);
+		if (policy)
+		{
+			found++;
+			policy->destroy(policy);
+		}
+	}
+	time = end_timing(&timing);
+	printf("%-8s %d lookups, %d matched: %10.1f lookups/s\n",
+		   inbound ? "inbound" : "outbound", lookups, found, lookups / time);
+}
+
+int main(int argc, char *argv[])
+{
+	ipsec_policy_mgr_t *mgr;
+	ip_packet_t *out[PACKETS], *in[PACKETS];
+	u_int32_t host, local;
+	char remote[32];
+	int policies, lookups, i;
+
+	if (argc < 3)
+	{
+		usage();
+	}
+	policies = atoi(argv[1]);
+	lookups = atoi(argv[2]);
+	if (policies <= 0 || policies > 65536 || lookups <= 0)
+	{
+		usage();
+	}
+
+	library_init(NULL);
+	atexit(library_deinit);
+	srandom(time(NULL));
+
+	mgr = ipsec_policy_mgr_create();
+	for (i = 0; i < policies; i++)
+	{
+		/* virtual IPs out of 172.16.0.0/16 */
+		snprintf(remote, sizeof(remote), "172.16.%d.%d/32", i / 256, i % 256);
+		add_policies(mgr, "10.0.0.0/8", remote, i + 1);
+		if (i % 16 == 0)
+		{	/* remote subnets out of 172.20.0.0/14 */
+			snprintf(remote, sizeof(remote), "172.%d.%d.0/24",
+					 20 + i / 16 / 256, i / 16 % 256);
+			add_policies(mgr, "10.0.0.0/8", remote, policies + i + 1);
+		}
+	}
+
+	for (i = 0; i < PACKETS; i++)
+	{
+		local = 0x0A000000 | (random() & 0x00FFFFFF);
+		if (i % 4 == 0)
+		{	/* to a remote subnet */
+			host = ((172 << 24) | (20 << 16)) +
+					((random() % ((policies + 15) / 16)) << 8) + 1;
+		}
+		else
+		{	/* to a virtual IP */
+			host = ((172 << 24) | (16 << 16)) + random() % policies;
+		}
+		out[i] = build_packet(local, host);
+		in[i] = build_packet(host, local);
+	}
+
+	printf("%d roadwarrior and %d site-to-site policies per direction\n",
+		   policies, (policies + 15) / 16);
+	run_test(mgr, out, lookups, FALSE);
+	run_test(mgr, in, lookups, TRUE);
+
+	for (i = 0; i < PACKETS; i++)
+	{
+		out[i]->destroy(out[i]);
+		in[i]->destroy(in[i]);
+	}
+	mgr->destroy(mgr);
+	return 0;
+}
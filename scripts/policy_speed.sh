@@ -0,0 +1,11 @@
+#!/bin/bash
+
+# Measure per-packet policy lookups of libipsec with a growing number of
+# roadwarrior policies. Run this script on a build of a previous release to
+# get numbers for the linear policy list.
+
+LOOKUPS=1000000
+
+for policies in 10 100 1000 5000 20000; do
+	./policy_speed $policies $LOOKUPS
+done
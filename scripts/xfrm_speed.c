@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/xfrm.h>
+
+#include <library.h>
+#include <utils/debug.h>
+#include <threading/thread.h>
+
+#include "kernel_netlink_shared.h"
+
+/**
+ * Required by kernel_netlink_shared.c
+ */
+ENUM(xfrm_msg_names, XFRM_MSG_NEWSA, XFRM_MSG_NEWSA,
+	"XFRM_MSG_NEWSA",
+);
+
+static void usage()
+{
+	printf("usage: xfrm_speed count threads batch\n");
+	printf("  installs count ESP SAs using threads concurrent threads, each\n");
+	printf("  sending batch SAs per sendmsg() call. Run as root, preferably\n");
+	printf("  in a dedicated network namespace, all ESP SAs get flushed.\n");
+	exit(1);
+}
+
+/**
+ * Shared netlink socket
+ */
+static netlink_socket_t *socket_xfrm;
+
+/**
+ * Number of SAs each thread installs
+ */
+static int per_thread;
+
+/**
+ * Number of SAs per batch
+ */
+static int batch_size;
+
+/**
+ * Build a XFRM_MSG_NEWSA message for an ESP SA with given SPI
+ */
+static void build_sa(netlink_buf_t request, u_int32_t spi)
+{
+	struct xfrm_usersa_info *sa;
+	struct xfrm_algo *algo;
+	struct nlmsghdr *hdr;
+
+	memset(request, 0, sizeof(netlink_buf_t));
+	hdr = (struct nlmsghdr*)request;
+	hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	hdr->nlmsg_type = XFRM_MSG_NEWSA;
+	hdr->nlmsg_len = NLMSG_LENGTH(sizeof(struct xfrm_usersa_info));
+
+	sa = (struct xfrm_usersa_info*)NLMSG_DATA(hdr);
+	sa->saddr.a4 = htonl(0x0a000001);
+	sa->id.daddr.a4 = htonl(0x0a000002);
+	sa->id.spi = htonl(spi);
+	sa->id.proto = IPPROTO_ESP;
+	sa->family = AF_INET;
+	sa->mode = XFRM_MODE_TUNNEL;
+	sa->reqid = spi;
+	sa->lft.soft_byte_limit = XFRM_INF;
+	sa->lft.hard_byte_limit = XFRM_INF;
+	sa->lft.soft_packet_limit = XFRM_INF;
+	sa->lft.hard_packet_limit = XFRM_INF;
+
+	algo = netlink_reserve(hdr, sizeof(netlink_buf_t), XFRMA_ALG_CRYPT,
+						   sizeof(*algo) + 16);
+	strcpy(algo->alg_name, "cbc(aes)");
+	algo->alg_key_len = 128;
+	memset(algo->alg_key, 0x01, 16);
+
+	algo = netlink_reserve(hdr, sizeof(netlink_buf_t), XFRMA_ALG_AUTH,
+						   sizeof(*algo) + 20);
+	strcpy(algo->alg_name, "hmac(sha1)");
+	algo->alg_key_len = 160;
+	memset(algo->alg_key, 0x02, 20);
+}
+
+/**
+ * Install the SAs of a thread
+ */
+static void *install_sas(uintptr_t thread)
+{
+	netlink_buf_t *requests;
+	struct nlmsghdr **hdrs;
+	status_t *results;
+	u_int32_t spi;
+	int i, j, count, failed = 0;
+
+	requests = malloc(sizeof(netlink_buf_t) * batch_size);
+	hdrs = malloc(sizeof(struct nlmsghdr*) * batch_size);
+	results = malloc(sizeof(status_t) * batch_size);
+
+	spi = 0x1000 + thread * per_thread;
+	for (i = 0; i < per_thread; i += count)
+	{
+		count = min(batch_size, per_thread - i);
+		for (j = 0; j < count; j++)
+		{
+			build_sa(requests[j], spi++);
+			hdrs[j] = (struct nlmsghdr*)requests[j];
+		}
+		if (count == 1)
+		{
+			results[0] = socket_xfrm->send_ack(socket_xfrm, hdrs[0]);
+		}
+		else
+		{
+			socket_xfrm->send_ack_batch(socket_xfrm, hdrs, count, results);
+		}
+		for (j = 0; j < count; j++)
+		{
+			if (results[j] != SUCCESS)
+			{
+				failed++;
+			}
+		}
+	}
+	free(requests);
+	free(hdrs);
+	free(results);
+	return (void*)(uintptr_t)failed;
+}
+
+/**
+ * Flush all ESP SAs
+ */
+static void flush_sas()
+{
+	netlink_buf_t request;
+	struct xfrm_usersa_flush *flush;
+	struct nlmsghdr *hdr;
+
+	memset(&request, 0, sizeof(request));
+	hdr = (struct nlmsghdr*)request;
+	hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	hdr->nlmsg_type = XFRM_MSG_FLUSHSA;
+	hdr->nlmsg_len = NLMSG_LENGTH(sizeof(struct xfrm_usersa_flush));
+	flush = (struct xfrm_usersa_flush*)NLMSG_DATA(hdr);
+	flush->proto = IPPROTO_ESP;
+
+	if (socket_xfrm->send_ack(socket_xfrm, hdr) != SUCCESS)
+	{
+		printf("flushing SAs failed\n");
+	}
+}
+
+static double get_time(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_nsec - start->tv_nsec) / 1000000000.0 +
+			(end.tv_sec - start->tv_sec) * 1.0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec start;
+	thread_t **threads;
+	int i, count, thread_count, failed = 0;
+	double time;
+
+	if (argc < 4)
+	{
+		usage();
+	}
+	count = atoi(argv[1]);
+	thread_count = atoi(argv[2]);
+	batch_size = atoi(argv[3]);
+	if (count <= 0 || thread_count <= 0 || batch_size <= 0)
+	{
+		usage();
+	}
+	per_thread = count / thread_count;
+
+	library_init(NULL);
+	atexit(library_deinit);
+
+	socket_xfrm = netlink_socket_create(NETLINK_XFRM, NETLINK_DEFAULT_TIMEOUT);
+	if (!socket_xfrm)
+	{
+		printf("creating XFRM netlink socket failed, are we root?\n");
+		exit(1);
+	}
+	flush_sas();
+
+	threads = malloc(sizeof(thread_t*) * thread_count);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < thread_count; i++)
+	{
+		threads[i] = thread_create((thread_main_t)install_sas,
+								   (void*)(uintptr_t)i);
+	}
+	for (i = 0; i < thread_count; i++)
+	{
+		failed += (uintptr_t)threads[i]->join(threads[i]);
+	}
+	time = get_time(&start);
+	free(threads);
+
+	printf("installed %d SAs with %d threads, batch size %d: %8.3fs, "
+		   "%8.1f SAs/s, %d failed\n", per_thread * thread_count, thread_count,
+		   batch_size, time, per_thread * thread_count / time, failed);
+
+	flush_sas();
+	socket_xfrm->destroy(socket_xfrm);
+	return 0;
+}
@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Compare XFRM SA installation rates of the kernel_netlink transport using
+# concurrent threads and batched requests. Installs 100k SAs in a dedicated
+# network namespace, requires root privileges. Run this script on a build of
+# a previous release with a batch size of 1 to get numbers for the old
+# serializing transport.
+
+NS=xfrm-speed
+COUNT=100000
+
+ip netns add $NS || exit 1
+
+for THREADS in 1 4 16; do
+	for BATCH in 1 16 64; do
+		ip netns exec $NS ./xfrm_speed $COUNT $THREADS $BATCH
+	done
+done
+
+ip netns delete $NS
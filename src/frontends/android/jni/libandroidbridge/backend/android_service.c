@@ -139,7 +139,7 @@ static void receiver_esp_cb(void *data, packet_t *packet)
 static job_requeue_t handle_plain(private_android_service_t *this)
 {
 	ip_packet_t *packet;
-	chunk_t raw;
+	chunk_t buffer, raw;
 	fd_set set;
 	ssize_t len;
 	int tunfd;
@@ -179,17 +179,19 @@ static job_requeue_t handle_plain(private_android_service_t *this)
 		return JOB_REQUEUE_DIRECT;
 	}
 
-	raw = chunk_alloc(TUN_DEFAULT_MTU);
+	/* read into a pooled buffer, so the packet can be encrypted in place */
+	buffer = ipsec->buffers->get(ipsec->buffers, TUN_DEFAULT_MTU);
+	raw = chunk_create(buffer.ptr + IPSEC_BUFFER_HEADROOM, TUN_DEFAULT_MTU);
 	len = read(tunfd, raw.ptr, raw.len);
 	if (len < 0)
 	{
 		DBG1(DBG_DMN, "reading from TUN device failed: %s", strerror(errno));
-		chunk_free(&raw);
+		ipsec->buffers->put(ipsec->buffers, buffer);
 		return JOB_REQUEUE_FAIR;
 	}
 	raw.len = len;
 
-	packet = ip_packet_create(raw);
+	packet = ip_packet_create_from_buffer(buffer, raw);
 	if (packet)
 	{
 		ipsec->processor->queue_outbound(ipsec->processor, packet);
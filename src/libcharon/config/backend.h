@@ -62,7 +62,8 @@ struct backend_t {
 	 * the identities to the first auth_cfgs only.
 	 * There is no requirement for the backend to filter the configurations
 	 * using the supplied identities; but it may do so if it increases lookup
-	 * times (e.g. include hosts in SQL query).
+	 * times (e.g. include hosts in SQL query). Backends with many configs
+	 * may use a peer_cfg_index_t to do so.
 	 *
 	 * @param me		identity of ourself
 	 * @param other		identity of remote host
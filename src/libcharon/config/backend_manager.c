@@ -299,59 +299,76 @@ static void peer_enum_destroy(peer_data_t *data)
 }
 
 /**
- * convert enumerator value from match_entry to config
+ * Enumerator over candidate configs, ordered by match
  */
-static bool peer_enum_filter(linked_list_t *configs,
-							 match_entry_t **in, peer_cfg_t **out)
-{
-	*out = (*in)->cfg;
-	return TRUE;
-}
+typedef struct {
+	/** implements enumerator_t */
+	enumerator_t public;
+	/** sorted candidates */
+	match_entry_t **entries;
+	/** number of candidates */
+	u_int count;
+	/** allocated size of entries */
+	u_int size;
+	/** position of the enumerator */
+	u_int pos;
+} peer_enumerator_t;
 
 /**
- * Clean up temporary config list
+ * Insert a candidate before the first one it matches better on one and at
+ * least as good on the other criterion, otherwise append it
  */
-static void peer_enum_filter_destroy(linked_list_t *configs)
+static void insert_sorted(peer_enumerator_t *peers, match_entry_t *entry)
 {
-	match_entry_t *entry;
+	match_entry_t *current;
+	u_int i;
 
-	while (configs->remove_last(configs, (void**)&entry) == SUCCESS)
+	for (i = 0; i < peers->count; i++)
 	{
-		entry->cfg->destroy(entry->cfg);
-		free(entry);
+		current = peers->entries[i];
+		if ((entry->match_ike > current->match_ike &&
+			 entry->match_peer >= current->match_peer) ||
+			(entry->match_ike >= current->match_ike &&
+			 entry->match_peer > current->match_peer))
+		{
+			break;
+		}
 	}
-	configs->destroy(configs);
+	if (peers->count == peers->size)
+	{
+		peers->size *= 2;
+		peers->entries = realloc(peers->entries,
+								 sizeof(match_entry_t*) * peers->size);
+	}
+	memmove(&peers->entries[i + 1], &peers->entries[i],
+			sizeof(match_entry_t*) * (peers->count - i));
+	peers->entries[i] = entry;
+	peers->count++;
 }
 
-/**
- * Insert entry into match-sorted list, using helper
- */
-static void insert_sorted(match_entry_t *entry, linked_list_t *list,
-						  linked_list_t *helper)
+METHOD(enumerator_t, peer_enumerate, bool,
+	peer_enumerator_t *this, peer_cfg_t **cfg)
 {
-	match_entry_t *current;
-
-	while (list->remove_first(list, (void**)&current) == SUCCESS)
-	{
-		helper->insert_last(helper, current);
-	}
-	while (helper->remove_first(helper, (void**)&current) == SUCCESS)
+	if (this->pos == this->count)
 	{
-		if (entry && (
-			 (entry->match_ike > current->match_ike &&
-			  entry->match_peer >= current->match_peer) ||
-			 (entry->match_ike >= current->match_ike &&
-			  entry->match_peer > current->match_peer)))
-		{
-			list->insert_last(list, entry);
-			entry = NULL;
-		}
-		list->insert_last(list, current);
+		return FALSE;
 	}
-	if (entry)
+	*cfg = this->entries[this->pos++]->cfg;
+	return TRUE;
+}
+
+METHOD(enumerator_t, peer_enumerator_destroy, void,
+	peer_enumerator_t *this)
+{
+	u_int i;
+
+	for (i = 0; i < this->count; i++)
 	{
-		list->insert_last(list, entry);
+		this->entries[i]->cfg->destroy(this->entries[i]->cfg);
+		free(this->entries[i]);
 	}
+	free(this->entries);
+	free(this);
 }
 
 METHOD(backend_manager_t, create_peer_cfg_enumerator, enumerator_t*,
@@ -359,9 +376,9 @@ METHOD(backend_manager_t, create_peer_cfg_enumerator, enumerator_t*,
 	identification_t *my_id, identification_t *other_id, ike_version_t version)
 {
 	enumerator_t *enumerator;
+	peer_enumerator_t *peers;
 	peer_data_t *data;
 	peer_cfg_t *cfg;
-	linked_list_t *configs, *helper;
 
 	INIT(data,
 		.lock = this->lock,
@@ -369,7 +386,7 @@ METHOD(backend_manager_t, create_peer_cfg_enumerator, enumerator_t*,
 		.other = other_id,
 	);
 
-	/* create a sorted list with all matches */
+	/* collect all matching candidates the backends return */
 	this->lock->read_lock(this->lock);
 	enumerator = enumerator_create_nested(
 					this->backends->create_enumerator(this->backends),
@@ -380,9 +397,14 @@ METHOD(backend_manager_t, create_peer_cfg_enumerator, enumerator_t*,
 		return enumerator;
 	}
 
-	configs = linked_list_create();
-	/* only once allocated helper list for sorting */
-	helper = linked_list_create();
+	INIT(peers,
+		.public = {
+			.enumerate = (void*)_peer_enumerate,
+			.destroy = _peer_enumerator_destroy,
+		},
+		.entries = malloc(sizeof(match_entry_t*) * 8),
+		.size = 8,
+	);
 	while (enumerator->enumerate(enumerator, &cfg))
 	{
 		id_match_t match_peer_me, match_peer_other;
@@ -390,12 +412,20 @@ METHOD(backend_manager_t, create_peer_cfg_enumerator, enumerator_t*,
 		match_entry_t *entry;
 
 		match_peer_me = get_peer_match(my_id, cfg, TRUE);
+		if (!match_peer_me)
+		{
+			continue;
+		}
 		match_peer_other = get_peer_match(other_id, cfg, FALSE);
+		if (!match_peer_other)
+		{
+			continue;
+		}
 		match_ike = get_ike_match(cfg->get_ike_cfg(cfg), me, other, version);
 		DBG3(DBG_CFG, "ike config match: %d (%H %H %N)",
 			 match_ike, me, other, ike_version_names, version);
 
-		if (match_peer_me && match_peer_other && match_ike)
+		if (match_ike)
 		{
 			DBG2(DBG_CFG, "  candidate \"%s\", match: %d/%d/%d (me/other/ike)",
 				 cfg->get_name(cfg), match_peer_me, match_peer_other, match_ike);
@@ -405,15 +435,12 @@ METHOD(backend_manager_t, create_peer_cfg_enumerator, enumerator_t*,
 				.match_ike = match_ike,
 				.cfg = cfg->get_ref(cfg),
 			);
-			insert_sorted(entry, configs, helper);
+			insert_sorted(peers, entry);
 		}
 	}
 	enumerator->destroy(enumerator);
-	helper->destroy(helper);
 
-	return enumerator_create_filter(configs->create_enumerator(configs),
-									(void*)peer_enum_filter, configs,
-									(void*)peer_enum_filter_destroy);
+	return &peers->public;
 }
 
 METHOD(backend_manager_t, get_peer_cfg_by_name, peer_cfg_t*,
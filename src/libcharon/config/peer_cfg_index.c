@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "peer_cfg_index.h"
+
+#include <collections/hashtable.h>
+#include <collections/linked_list.h>
+
+typedef struct private_peer_cfg_index_t private_peer_cfg_index_t;
+
+/**
+ * Private data of an peer_cfg_index_t object.
+ */
+struct private_peer_cfg_index_t {
+
+	/**
+	 * Public peer_cfg_index_t interface.
+	 */
+	peer_cfg_index_t public;
+
+	/**
+	 * Configs by remote identity, identification_t* => bucket_t
+	 */
+	hashtable_t *buckets;
+
+	/**
+	 * Configs with a remote identity containing wildcards, as entry_t
+	 */
+	linked_list_t *wildcards;
+
+	/**
+	 * All configs in the order they were added, as entry_t
+	 */
+	linked_list_t *all;
+
+	/**
+	 * Sequence number assigned to the next added config
+	 */
+	u_int seq;
+};
+
+/**
+ * An indexed config
+ */
+typedef struct {
+
+	/**
+	 * The config
+	 */
+	peer_cfg_t *cfg;
+
+	/**
+	 * Sequence number, in the order configs were added
+	 */
+	u_int seq;
+} entry_t;
+
+/**
+ * Configs sharing the same remote identity
+ */
+typedef struct {
+
+	/**
+	 * Remote identity of the configs
+	 */
+	identification_t *id;
+
+	/**
+	 * Configs, as entry_t
+	 */
+	linked_list_t *cfgs;
+} bucket_t;
+
+/**
+ * Destroy a bucket
+ */
+static void bucket_destroy(bucket_t *this)
+{
+	this->id->destroy(this->id);
+	this->cfgs->destroy(this->cfgs);
+	free(this);
+}
+
+/**
+ * Hash an identity
+ */
+static u_int id_hash(identification_t *id)
+{
+	return id->hash(id, 0);
+}
+
+/**
+ * Compare two identities for equality
+ */
+static bool id_equals(identification_t *a, identification_t *b)
+{
+	return a->equals(a, b);
+}
+
+/**
+ * Get the remote identity a config is indexed with, NULL for wildcard configs
+ */
+static identification_t *get_remote_id(peer_cfg_t *cfg)
+{
+	enumerator_t *enumerator;
+	identification_t *id = NULL;
+	auth_cfg_t *auth;
+
+	/* configs are matched against the first auth config only */
+	enumerator = cfg->create_auth_cfg_enumerator(cfg, FALSE);
+	if (enumerator->enumerate(enumerator, &auth))
+	{
+		id = auth->get(auth, AUTH_RULE_IDENTITY);
+	}
+	enumerator->destroy(enumerator);
+
+	if (id && (id->get_type(id) == ID_ANY || id->contains_wildcards(id)))
+	{
+		return NULL;
+	}
+	return id;
+}
+
+METHOD(peer_cfg_index_t, add, void,
+	private_peer_cfg_index_t *this, peer_cfg_t *cfg)
+{
+	identification_t *id;
+	bucket_t *bucket;
+	entry_t *entry;
+
+	INIT(entry,
+		.cfg = cfg,
+		.seq = this->seq++,
+	);
+	this->all->insert_last(this->all, entry);
+
+	id = get_remote_id(cfg);
+	if (!id)
+	{
+		this->wildcards->insert_last(this->wildcards, entry);
+		return;
+	}
+	bucket = this->buckets->get(this->buckets, id);
+	if (!bucket)
+	{
+		INIT(bucket,
+			.id = id->clone(id),
+			.cfgs = linked_list_create(),
+		);
+		this->buckets->put(this->buckets, bucket->id, bucket);
+	}
+	bucket->cfgs->insert_last(bucket->cfgs, entry);
+}
+
+METHOD(peer_cfg_index_t, remove_, bool,
+	private_peer_cfg_index_t *this, peer_cfg_t *cfg)
+{
+	enumerator_t *enumerator;
+	identification_t *id;
+	bucket_t *bucket;
+	entry_t *entry, *found = NULL;
+
+	enumerator = this->all->create_enumerator(this->all);
+	while (enumerator->enumerate(enumerator, &entry))
+	{
+		if (entry->cfg == cfg)
+		{
+			this->all->remove_at(this->all, enumerator);
+			found = entry;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+	if (!found)
+	{
+		return FALSE;
+	}
+	id = get_remote_id(cfg);
+	if (!id)
+	{
+		this->wildcards->remove(this->wildcards, found, NULL);
+		free(found);
+		return TRUE;
+	}
+	bucket = this->buckets->get(this->buckets, id);
+	if (bucket)
+	{
+		bucket->cfgs->remove(bucket->cfgs, found, NULL);
+		if (bucket->cfgs->get_count(bucket->cfgs) == 0)
+		{
+			this->buckets->remove(this->buckets, bucket->id);
+			bucket_destroy(bucket);
+		}
+	}
+	free(found);
+	return TRUE;
+}
+
+/**
+ * Filter function to convert entries to configs
+ */
+static bool entry_filter(void *null, entry_t **in, peer_cfg_t **out)
+{
+	*out = (*in)->cfg;
+	return TRUE;
+}
+
+/**
+ * Enumerate the entries of a list as configs
+ */
+static enumerator_t *create_list_enumerator(linked_list_t *list)
+{
+	return enumerator_create_filter(list->create_enumerator(list),
+									(void*)entry_filter, NULL, NULL);
+}
+
+/**
+ * Enumerator merging two lists of entries, ordered by sequence number
+ */
+typedef struct {
+	/** implements enumerator_t */
+	enumerator_t public;
+	/** enumerators over the two lists */
+	enumerator_t *inner[2];
+	/** next entries of the two lists, NULL if exhausted */
+	entry_t *next[2];
+} merge_enumerator_t;
+
+/**
+ * Advance one of the inner enumerators of a merge_enumerator_t
+ */
+static void merge_advance(merge_enumerator_t *this, int i)
+{
+	if (!this->inner[i]->enumerate(this->inner[i], &this->next[i]))
+	{
+		this->next[i] = NULL;
+	}
+}
+
+METHOD(enumerator_t, merge_enumerate, bool,
+	merge_enumerator_t *this, peer_cfg_t **cfg)
+{
+	int i;
+
+	if (!this->next[0] && !this->next[1])
+	{
+		return FALSE;
+	}
+	i = !this->next[0] ||
+		(this->next[1] && this->next[1]->seq < this->next[0]->seq);
+	*cfg = this->next[i]->cfg;
+	merge_advance(this, i);
+	return TRUE;
+}
+
+METHOD(enumerator_t, merge_destroy, void,
+	merge_enumerator_t *this)
+{
+	this->inner[0]->destroy(this->inner[0]);
+	this->inner[1]->destroy(this->inner[1]);
+	free(this);
+}
+
+METHOD(peer_cfg_index_t, create_enumerator, enumerator_t*,
+	private_peer_cfg_index_t *this, identification_t *other)
+{
+	merge_enumerator_t *enumerator;
+	bucket_t *bucket;
+
+	if (!other || other->get_type(other) == ID_ANY ||
+		other->contains_wildcards(other))
+	{	/* a wildcard identity might match any config */
+		return create_list_enumerator(this->all);
+	}
+	bucket = this->buckets->get(this->buckets, other);
+	if (!bucket)
+	{
+		return create_list_enumerator(this->wildcards);
+	}
+	/* keep the order the configs were added in */
+	INIT(enumerator,
+		.public = {
+			.enumerate = (void*)_merge_enumerate,
+			.destroy = _merge_destroy,
+		},
+		.inner = {
+			bucket->cfgs->create_enumerator(bucket->cfgs),
+			this->wildcards->create_enumerator(this->wildcards),
+		},
+	);
+	merge_advance(enumerator, 0);
+	merge_advance(enumerator, 1);
+	return &enumerator->public;
+}
+
+METHOD(peer_cfg_index_t, get_count, u_int,
+	private_peer_cfg_index_t *this)
+{
+	return this->all->get_count(this->all);
+}
+
+METHOD(peer_cfg_index_t, destroy, void,
+	private_peer_cfg_index_t *this)
+{
+	enumerator_t *enumerator;
+	identification_t *id;
+	bucket_t *bucket;
+
+	enumerator = this->buckets->create_enumerator(this->buckets);
+	while (enumerator->enumerate(enumerator, &id, &bucket))
+	{
+		bucket_destroy(bucket);
+	}
+	enumerator->destroy(enumerator);
+	this->buckets->destroy(this->buckets);
+	this->wildcards->destroy(this->wildcards);
+	this->all->destroy_function(this->all, free);
+	free(this);
+}
+
+/**
+ * See header
+ */
+peer_cfg_index_t *peer_cfg_index_create()
+{
+	private_peer_cfg_index_t *this;
+
+	INIT(this,
+		.public = {
+			.add = _add,
+			.remove = _remove_,
+			.create_enumerator = _create_enumerator,
+			.get_count = _get_count,
+			.destroy = _destroy,
+		},
+		.buckets = hashtable_create((hashtable_hash_t)id_hash,
+									(hashtable_equals_t)id_equals, 32),
+		.wildcards = linked_list_create(),
+		.all = linked_list_create(),
+	);
+
+	return &this->public;
+}
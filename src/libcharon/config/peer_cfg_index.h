@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup peer_cfg_index peer_cfg_index
+ * @{ @ingroup config
+ */
+
+#ifndef PEER_CFG_INDEX_H_
+#define PEER_CFG_INDEX_H_
+
+typedef struct peer_cfg_index_t peer_cfg_index_t;
+
+#include <library.h>
+#include <config/peer_cfg.h>
+
+/**
+ * Index over peer configs, keyed by the remote identity.
+ *
+ * Backends with many configs may use this index to implement
+ * backend_t.create_peer_cfg_enumerator(). Configs with a remote identity
+ * without wildcards are hashed by that identity, all others are kept in a
+ * wildcard bucket. A lookup returns the configs in the bucket of the given
+ * remote identity and all wildcard configs, in the order they were added.
+ * The backend_manager_t scores the returned candidates.
+ *
+ * The index does not hold references to the configs, nor does it do any
+ * locking.
+ */
+struct peer_cfg_index_t {
+
+	/**
+	 * Add a config to the index.
+	 *
+	 * @param cfg		config to add
+	 */
+	void (*add)(peer_cfg_index_t *this, peer_cfg_t *cfg);
+
+	/**
+	 * Remove a config from the index.
+	 *
+	 * @param cfg		config to remove
+	 * @return			TRUE if config was found and removed
+	 */
+	bool (*remove)(peer_cfg_index_t *this, peer_cfg_t *cfg);
+
+	/**
+	 * Create an enumerator over configs possibly matching a remote identity.
+	 *
+	 * @param other		remote identity, NULL to enumerate all configs
+	 * @return			enumerator over peer_cfg_t
+	 */
+	enumerator_t* (*create_enumerator)(peer_cfg_index_t *this,
+									   identification_t *other);
+
+	/**
+	 * Get the number of indexed configs.
+	 *
+	 * @return			number of configs
+	 */
+	u_int (*get_count)(peer_cfg_index_t *this);
+
+	/**
+	 * Destroy a peer_cfg_index_t, but not the indexed configs.
+	 */
+	void (*destroy)(peer_cfg_index_t *this);
+};
+
+/**
+ * Create an empty peer_cfg_index_t.
+ *
+ * @return			peer config index
+ */
+peer_cfg_index_t *peer_cfg_index_create();
+
+#endif /** PEER_CFG_INDEX_H_ @}*/
@@ -468,6 +468,7 @@ METHOD(payload_t, verify, status_t,
 			break;
 		}
 		case AUTH_LIFETIME:
+		case SET_WINDOW_SIZE:
 		{
 			if (this->notify_data.len != 4)
 			{
@@ -26,7 +26,6 @@
 #include <processing/jobs/job.h>
 #include <processing/jobs/process_message_job.h>
 #include <processing/jobs/callback_job.h>
-#include <crypto/hashers/hasher.h>
 #include <threading/mutex.h>
 #include <networking/packet.h>
 
@@ -41,9 +40,15 @@
 /** default value for private_receiver_t.block_threshold */
 #define BLOCK_THRESHOLD_DEFAULT 5
 /** length of the secret to use for cookie calculation */
-#define SECRET_LENGTH 16
+#define SECRET_LENGTH CHUNK_MAC_KEY_LEN
+/** length of a cookie, timestamp and keyed hash */
+#define COOKIE_LENGTH (sizeof(u_int32_t) + sizeof(u_int64_t))
 /** Length of a notify payload header */
 #define NOTIFY_PAYLOAD_HEADER_LENGTH 8
+/** number of recently received initial IKE messages to track (power of 2) */
+#define INIT_SLOTS 1024
+/** default value for private_receiver_t.init_duplicate_window, in ms */
+#define INIT_DUPLICATE_WINDOW_DEFAULT 500
 
 typedef struct private_receiver_t private_receiver_t;
 
@@ -100,14 +105,35 @@ struct private_receiver_t {
 	rng_t *rng;
 
 	/**
-	 * hasher to use for cookie calculation
+	 * key for the hash over initial IKE messages
 	 */
-	hasher_t *hasher;
+	u_char init_key[CHUNK_MAC_KEY_LEN];
+
+	/**
+	 * Recently received initial IKE messages, indexed by their hash. Only
+	 * accessed by the receiving thread, so not locked.
+	 */
+	struct {
+		/** keyed hash over source and message */
+		u_int64_t hash;
+		/** time the message was received */
+		timeval_t received;
+	} inits[INIT_SLOTS];
+
+	/**
+	 * Drop identical initial IKE messages received within this many ms
+	 */
+	settings_key_t *init_duplicate_window;
+
+	/**
+	 * enable DoS protection, i.e. cookies and blocking of aggressive peers
+	 */
+	settings_key_t *dos_protection;
 
 	/**
 	 * require cookies after this many half open IKE_SAs
 	 */
-	u_int32_t cookie_threshold;
+	settings_key_t *cookie_threshold;
 
 	/**
 	 * timestamp of last cookie requested
@@ -117,17 +143,17 @@ struct private_receiver_t {
 	/**
 	 * how many half open IKE_SAs per peer before blocking
 	 */
-	u_int32_t block_threshold;
+	settings_key_t *block_threshold;
 
 	/**
 	 * Drop IKE_SA_INIT requests if processor job load exceeds this limit
 	 */
-	u_int init_limit_job_load;
+	settings_key_t *init_limit_job_load;
 
 	/**
 	 * Drop IKE_SA_INIT requests if half open IKE_SA count exceeds this limit
 	 */
-	u_int init_limit_half_open;
+	settings_key_t *init_limit_half_open;
 
 	/**
 	 * Delay for receiving incoming packets, to simulate larger RTT
@@ -190,42 +216,77 @@ static void send_notify(message_t *request, int major, exchange_type_t exchange,
 }
 
 /**
- * build a cookie
+ * send a COOKIE notify in response to an IKE_SA_INIT request packet
  */
-static bool cookie_build(private_receiver_t *this, message_t *message,
-						 u_int32_t t, chunk_t secret, chunk_t *cookie)
+static void send_cookie(packet_t *request, chunk_t cookie)
 {
-	u_int64_t spi = message->get_initiator_spi(message);
-	host_t *ip = message->get_source(message);
-	chunk_t input, hash;
+	ike_sa_id_t *ike_sa_id;
+	message_t *response;
+	host_t *src, *dst;
+	packet_t *packet;
+	u_int64_t spi;
 
-	/* COOKIE = t | sha1( IPi | SPIi | t | secret ) */
-	input = chunk_cata("cccc", ip->get_address(ip), chunk_from_thing(spi),
-					  chunk_from_thing(t), secret);
-	hash = chunk_alloca(this->hasher->get_hash_size(this->hasher));
-	if (!this->hasher->get_hash(this->hasher, input, hash.ptr))
+	memcpy(&spi, request->get_data(request).ptr, sizeof(spi));
+	response = message_create(IKEV2_MAJOR_VERSION, 0);
+	response->set_exchange_type(response, IKE_SA_INIT);
+	response->add_notify(response, FALSE, COOKIE, cookie);
+	dst = request->get_source(request);
+	src = request->get_destination(request);
+	response->set_source(response, src->clone(src));
+	response->set_destination(response, dst->clone(dst));
+	response->set_request(response, FALSE);
+	response->set_message_id(response, 0);
+	ike_sa_id = ike_sa_id_create(IKEV2_MAJOR_VERSION, spi, 0, FALSE);
+	response->set_ike_sa_id(response, ike_sa_id);
+	ike_sa_id->destroy(ike_sa_id);
+	if (response->generate(response, NULL, &packet) == SUCCESS)
 	{
-		return FALSE;
+		charon->sender->send(charon->sender, packet);
 	}
-	*cookie = chunk_cat("cc", chunk_from_thing(t), hash);
-	return TRUE;
+	response->destroy(response);
+}
+
+/**
+ * calculate the keyed hash of a cookie
+ */
+static u_int64_t cookie_mac(packet_t *packet, u_int32_t t, char *secret)
+{
+	host_t *ip = packet->get_source(packet);
+	chunk_t input, spi;
+
+	/* initiator SPI as contained in the IKE header */
+	spi = chunk_create(packet->get_data(packet).ptr, sizeof(u_int64_t));
+	input = chunk_cata("ccc", ip->get_address(ip), spi, chunk_from_thing(t));
+	return chunk_mac(input, secret);
+}
+
+/**
+ * build a cookie
+ */
+static chunk_t cookie_build(private_receiver_t *this, packet_t *packet,
+							u_int32_t t, char *secret)
+{
+	u_int64_t mac;
+
+	/* COOKIE = t | mac( IPi | SPIi | t, secret ) */
+	mac = cookie_mac(packet, t, secret);
+	return chunk_cat("cc", chunk_from_thing(t), chunk_from_thing(mac));
 }
 
 /**
  * verify a received cookie
  */
-static bool cookie_verify(private_receiver_t *this, message_t *message,
+static bool cookie_verify(private_receiver_t *this, packet_t *packet,
 						  chunk_t cookie)
 {
 	u_int32_t t, now;
-	chunk_t reference;
-	chunk_t secret;
+	u_int64_t mac;
+	char *secret;
 
 	now = time_monotonic(NULL);
 	t = *(u_int32_t*)cookie.ptr;
 
-	if (cookie.len != sizeof(u_int32_t) +
-			this->hasher->get_hash_size(this->hasher) ||
+	if (cookie.len != COOKIE_LENGTH ||
 		t < now - this->secret_offset - COOKIE_LIFETIME)
 	{
 		DBG2(DBG_NET, "received cookie lifetime expired, rejecting");
@@ -235,57 +296,43 @@ static bool cookie_verify(private_receiver_t *this, message_t *message,
 	/* check if cookie is derived from old_secret */
 	if (t + this->secret_offset > this->secret_switch)
 	{
-		secret = chunk_from_thing(this->secret);
+		secret = this->secret;
 	}
 	else
 	{
-		secret = chunk_from_thing(this->secret_old);
+		secret = this->secret_old;
 	}
 
 	/* compare own calculation against received */
-	if (!cookie_build(this, message, t, secret, &reference))
-	{
-		return FALSE;
-	}
-	if (chunk_equals(reference, cookie))
-	{
-		chunk_free(&reference);
-		return TRUE;
-	}
-	chunk_free(&reference);
-	return FALSE;
+	memcpy(&mac, cookie.ptr + sizeof(t), sizeof(mac));
+	return mac == cookie_mac(packet, t, secret);
 }
 
 /**
  * Check if a valid cookie found
  */
-static bool check_cookie(private_receiver_t *this, message_t *message)
+static bool check_cookie(private_receiver_t *this, packet_t *packet)
 {
-	packet_t *packet;
 	chunk_t data;
 
 	/* check for a cookie. We don't use our parser here and do it
 	 * quick and dirty for performance reasons.
 	 * we assume the cookie is the first payload (which is a MUST), and
 	 * the cookie's SPI length is zero. */
-	packet = message->get_packet(message);
 	data = packet->get_data(packet);
 	if (data.len <
-		 IKE_HEADER_LENGTH + NOTIFY_PAYLOAD_HEADER_LENGTH +
-		 sizeof(u_int32_t) + this->hasher->get_hash_size(this->hasher) ||
+		 IKE_HEADER_LENGTH + NOTIFY_PAYLOAD_HEADER_LENGTH + COOKIE_LENGTH ||
 		*(data.ptr + 16) != NOTIFY ||
 		*(u_int16_t*)(data.ptr + IKE_HEADER_LENGTH + 6) != htons(COOKIE))
 	{
 		/* no cookie found */
-		packet->destroy(packet);
 		return FALSE;
 	}
 	data.ptr += IKE_HEADER_LENGTH + NOTIFY_PAYLOAD_HEADER_LENGTH;
-	data.len = sizeof(u_int32_t) + this->hasher->get_hash_size(this->hasher);
-	if (!cookie_verify(this, message, data))
+	data.len = COOKIE_LENGTH;
+	if (!cookie_verify(this, packet, data))
 	{
 		DBG2(DBG_NET, "found cookie, but content invalid");
-		packet->destroy(packet);
 		return FALSE;
 	}
 	return TRUE;
@@ -297,7 +344,14 @@ static bool check_cookie(private_receiver_t *this, message_t *message)
 static bool cookie_required(private_receiver_t *this,
 							u_int half_open, u_int32_t now)
 {
-	if (this->cookie_threshold && half_open >= this->cookie_threshold)
+	u_int32_t threshold = 0;
+
+	if (this->dos_protection->get_bool(this->dos_protection, TRUE))
+	{
+		threshold = this->cookie_threshold->get_int(this->cookie_threshold,
+													COOKIE_THRESHOLD_DEFAULT);
+	}
+	if (threshold && half_open >= threshold)
 	{
 		this->last_cookie = now;
 		return TRUE;
@@ -322,34 +376,37 @@ static bool cookie_required(private_receiver_t *this,
 }
 
 /**
- * Check if we should drop IKE_SA_INIT because of cookie/overload checking
+ * Check if we should drop an IKEv2 IKE_SA_INIT request because it lacks a
+ * required cookie, and send one. This works on the raw packet data, before a
+ * message is parsed.
  */
-static bool drop_ike_sa_init(private_receiver_t *this, message_t *message)
+static bool drop_without_cookie(private_receiver_t *this, packet_t *packet)
 {
+#ifdef USE_IKEV2
 	u_int half_open;
 	u_int32_t now;
+	chunk_t data, cookie;
+
+	data = packet->get_data(packet);
+	if (data.len < IKE_HEADER_LENGTH || untoh64(data.ptr + 8) ||
+		data.ptr[18] != IKE_SA_INIT ||
+		(data.ptr[17] >> 4) != IKEV2_MAJOR_VERSION || (data.ptr[19] & 0x20))
+	{	/* not an initial IKEv2 request */
+		return FALSE;
+	}
 
 	now = time_monotonic(NULL);
 	half_open = charon->ike_sa_manager->get_half_open_count(
 										charon->ike_sa_manager, NULL);
-
-	/* check for cookies in IKEv2 */
-	if (message->get_major_version(message) == IKEV2_MAJOR_VERSION &&
-		cookie_required(this, half_open, now) && !check_cookie(this, message))
+	if (cookie_required(this, half_open, now) && !check_cookie(this, packet))
 	{
-		chunk_t cookie;
-
 		DBG2(DBG_NET, "received packet from: %#H to %#H",
-			 message->get_source(message),
-			 message->get_destination(message));
-		if (!cookie_build(this, message, now - this->secret_offset,
-						  chunk_from_thing(this->secret), &cookie))
-		{
-			return TRUE;
-		}
+			 packet->get_source(packet), packet->get_destination(packet));
+		cookie = cookie_build(this, packet, now - this->secret_offset,
+							  this->secret);
 		DBG2(DBG_NET, "sending COOKIE notify to %H",
-			 message->get_source(message));
-		send_notify(message, IKEV2_MAJOR_VERSION, IKE_SA_INIT, COOKIE, cookie);
+			 packet->get_source(packet));
+		send_cookie(packet, cookie);
 		chunk_free(&cookie);
 		if (++this->secret_used > COOKIE_REUSE)
 		{
@@ -372,11 +429,30 @@ static bool drop_ike_sa_init(private_receiver_t *this, message_t *message)
 		}
 		return TRUE;
 	}
+#endif /* USE_IKEV2 */
+	return FALSE;
+}
+
+/**
+ * Check if we should drop IKE_SA_INIT because of overload checking
+ */
+static bool drop_ike_sa_init(private_receiver_t *this, message_t *message)
+{
+	u_int half_open, limit;
+	u_int32_t threshold = 0;
+
+	half_open = charon->ike_sa_manager->get_half_open_count(
+										charon->ike_sa_manager, NULL);
 
 	/* check if peer has too many IKE_SAs half open */
-	if (this->block_threshold &&
+	if (this->dos_protection->get_bool(this->dos_protection, TRUE))
+	{
+		threshold = this->block_threshold->get_int(this->block_threshold,
+												   BLOCK_THRESHOLD_DEFAULT);
+	}
+	if (threshold &&
 		charon->ike_sa_manager->get_half_open_count(charon->ike_sa_manager,
-				message->get_source(message)) >= this->block_threshold)
+				message->get_source(message)) >= threshold)
 	{
 		DBG1(DBG_NET, "ignoring IKE_SA setup from %H, "
 			 "peer too aggressive", message->get_source(message));
@@ -384,17 +460,18 @@ static bool drop_ike_sa_init(private_receiver_t *this, message_t *message)
 	}
 
 	/* check if global half open IKE_SA limit reached */
-	if (this->init_limit_half_open &&
-		half_open >= this->init_limit_half_open)
+	limit = this->init_limit_half_open->get_int(this->init_limit_half_open, 0);
+	if (limit && half_open >= limit)
 	{
 		DBG1(DBG_NET, "ignoring IKE_SA setup from %H, half open IKE_SA "
 			 "count of %d exceeds limit of %d", message->get_source(message),
-			 half_open, this->init_limit_half_open);
+			 half_open, limit);
 		return TRUE;
 	}
 
 	/* check if job load acceptable */
-	if (this->init_limit_job_load)
+	limit = this->init_limit_job_load->get_int(this->init_limit_job_load, 0);
+	if (limit)
 	{
 		u_int jobs = 0, i;
 
@@ -402,14 +479,72 @@ static bool drop_ike_sa_init(private_receiver_t *this, message_t *message)
 		{
 			jobs += lib->processor->get_job_load(lib->processor, i);
 		}
-		if (jobs > this->init_limit_job_load)
+		if (jobs > limit)
 		{
 			DBG1(DBG_NET, "ignoring IKE_SA setup from %H, job load of %d "
 				 "exceeds limit of %d", message->get_source(message),
-				 jobs, this->init_limit_job_load);
+				 jobs, limit);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * Check if a packet contains an initial IKE message identical to one received
+ * recently. This works on the raw packet data, before a message is parsed.
+ */
+static bool is_duplicate_init(private_receiver_t *this, packet_t *packet)
+{
+	timeval_t now, until;
+	u_int64_t hash;
+	u_int16_t port;
+	u_int window, slot;
+	host_t *src;
+	chunk_t data;
+
+	window = this->init_duplicate_window->get_int(this->init_duplicate_window,
+												  INIT_DUPLICATE_WINDOW_DEFAULT);
+	data = packet->get_data(packet);
+	if (!window || data.len < IKE_HEADER_LENGTH || untoh64(data.ptr + 8))
+	{	/* initial messages have no responder SPI */
+		return FALSE;
+	}
+	switch (data.ptr[18])
+	{
+		case IKE_SA_INIT:
+			if ((data.ptr[17] >> 4) != IKEV2_MAJOR_VERSION ||
+				(data.ptr[19] & 0x20))
+			{	/* ignore responses */
+				return FALSE;
+			}
+			break;
+		case ID_PROT:
+		case AGGRESSIVE:
+			break;
+		default:
+			return FALSE;
+	}
+
+	src = packet->get_source(packet);
+	port = src->get_port(src);
+	hash = chunk_mac(src->get_address(src), this->init_key);
+	hash = chunk_mac_inc(chunk_from_thing(port), this->init_key, hash);
+	hash = chunk_mac_inc(data, this->init_key, hash);
+
+	time_monotonic(&now);
+	slot = hash & (INIT_SLOTS - 1);
+	if (this->inits[slot].hash == hash)
+	{
+		until = this->inits[slot].received;
+		timeval_add_ms(&until, window);
+		if (timercmp(&now, &until, <))
+		{
 			return TRUE;
 		}
 	}
+	this->inits[slot].hash = hash;
+	this->inits[slot].received = now;
 	return FALSE;
 }
 
@@ -488,6 +623,20 @@ static job_requeue_t receive_packets(private_receiver_t *this)
 		}
 	}
 
+	if (is_duplicate_init(this, packet))
+	{
+		DBG2(DBG_NET, "received duplicate initial IKE message from %#H, "
+			 "ignored", src);
+		packet->destroy(packet);
+		return JOB_REQUEUE_DIRECT;
+	}
+
+	if (!this->initiator_only && drop_without_cookie(this, packet))
+	{
+		packet->destroy(packet);
+		return JOB_REQUEUE_DIRECT;
+	}
+
 	/* parse message header */
 	message = message_create_from_packet(packet);
 	if (message->parse_header(message) != SUCCESS)
@@ -611,8 +760,13 @@ METHOD(receiver_t, del_esp_cb, void,
 METHOD(receiver_t, destroy, void,
 	private_receiver_t *this)
 {
-	this->rng->destroy(this->rng);
-	this->hasher->destroy(this->hasher);
+	DESTROY_IF(this->rng);
+	this->dos_protection->destroy(this->dos_protection);
+	this->cookie_threshold->destroy(this->cookie_threshold);
+	this->block_threshold->destroy(this->block_threshold);
+	this->init_limit_job_load->destroy(this->init_limit_job_load);
+	this->init_limit_half_open->destroy(this->init_limit_half_open);
+	this->init_duplicate_window->destroy(this->init_duplicate_window);
 	this->esp_cb_mutex->destroy(this->esp_cb_mutex);
 	free(this);
 }
@@ -634,20 +788,20 @@ receiver_t *receiver_create()
 		.esp_cb_mutex = mutex_create(MUTEX_TYPE_DEFAULT),
 		.secret_switch = now,
 		.secret_offset = random() % now,
+		.dos_protection = lib->settings->create_key(lib->settings,
+				"%s.dos_protection", charon->name),
+		.cookie_threshold = lib->settings->create_key(lib->settings,
+				"%s.cookie_threshold", charon->name),
+		.block_threshold = lib->settings->create_key(lib->settings,
+				"%s.block_threshold", charon->name),
+		.init_limit_job_load = lib->settings->create_key(lib->settings,
+				"%s.init_limit_job_load", charon->name),
+		.init_limit_half_open = lib->settings->create_key(lib->settings,
+				"%s.init_limit_half_open", charon->name),
+		.init_duplicate_window = lib->settings->create_key(lib->settings,
+				"%s.init_duplicate_window", charon->name),
 	);
 
-	if (lib->settings->get_bool(lib->settings,
-				"%s.dos_protection", TRUE, charon->name))
-	{
-		this->cookie_threshold = lib->settings->get_int(lib->settings,
-				"%s.cookie_threshold", COOKIE_THRESHOLD_DEFAULT, charon->name);
-		this->block_threshold = lib->settings->get_int(lib->settings,
-				"%s.block_threshold", BLOCK_THRESHOLD_DEFAULT, charon->name);
-	}
-	this->init_limit_job_load = lib->settings->get_int(lib->settings,
-				"%s.init_limit_job_load", 0, charon->name);
-	this->init_limit_half_open = lib->settings->get_int(lib->settings,
-				"%s.init_limit_half_open", 0, charon->name);
 	this->receive_delay = lib->settings->get_int(lib->settings,
 				"%s.receive_delay", 0, charon->name);
 	this->receive_delay_type = lib->settings->get_int(lib->settings,
@@ -659,19 +813,11 @@ receiver_t *receiver_create()
 	this->initiator_only = lib->settings->get_bool(lib->settings,
 				"%s.initiator_only", FALSE, charon->name),
 
-	this->hasher = lib->crypto->create_hasher(lib->crypto, HASH_PREFERRED);
-	if (!this->hasher)
-	{
-		DBG1(DBG_NET, "creating cookie hasher failed, no hashers supported");
-		free(this);
-		return NULL;
-	}
 	this->rng = lib->crypto->create_rng(lib->crypto, RNG_STRONG);
 	if (!this->rng)
 	{
 		DBG1(DBG_NET, "creating cookie RNG failed, no RNG supported");
-		this->hasher->destroy(this->hasher);
-		free(this);
+		destroy(this);
 		return NULL;
 	}
 	if (!this->rng->get_bytes(this->rng, SECRET_LENGTH, this->secret))
@@ -681,6 +827,13 @@ receiver_t *receiver_create()
 		return NULL;
 	}
 	memcpy(this->secret_old, this->secret, SECRET_LENGTH);
+	if (!this->rng->get_bytes(this->rng, sizeof(this->init_key),
+							  this->init_key))
+	{
+		DBG1(DBG_NET, "creating key for initial message hashes failed");
+		destroy(this);
+		return NULL;
+	}
 
 	lib->processor->queue_job(lib->processor,
 		(job_t*)callback_job_create_with_prio((callback_job_cb_t)receive_packets,
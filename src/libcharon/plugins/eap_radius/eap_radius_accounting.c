@@ -179,27 +179,72 @@ static void update_usage(private_eap_radius_accounting_t *this,
 }
 
 /**
- * Send a RADIUS message, wait for response
+ * Completion callback for accounting requests
  */
-static bool send_message(private_eap_radius_accounting_t *this,
-						 radius_message_t *request)
+static void message_cb(ike_sa_id_t *id, radius_message_t *request,
+					   radius_message_t *response)
 {
-	radius_message_t *response;
-	radius_client_t *client;
 	bool ack = FALSE;
 
+	if (response)
+	{
+		ack = response->get_code(response) == RMC_ACCOUNTING_RESPONSE;
+		response->destroy(response);
+	}
+	if (!ack)
+	{
+		eap_radius_handle_timeout(id);
+	}
+	DESTROY_IF(id);
+}
+
+/**
+ * Handle a RADIUS message that could not be sent
+ */
+static job_requeue_t send_failed(ike_sa_id_t *id)
+{
+	eap_radius_handle_timeout(id);
+	return JOB_REQUEUE_NONE;
+}
+
+/**
+ * Destroy the IKE_SA identifier of a send_failed() job
+ */
+static void send_failed_destroy(ike_sa_id_t *id)
+{
+	DESTROY_IF(id);
+}
+
+/**
+ * Send a RADIUS message without waiting for the response, the IKE_SA with
+ * the given identifier (if any) gets deleted if the request fails. Failures
+ * are always handled asynchronously, as the caller might hold the IKE_SA.
+ */
+static void send_message(private_eap_radius_accounting_t *this,
+						 radius_message_t *request, ike_sa_id_t *id)
+{
+	radius_client_t *client;
+	bool queued = FALSE;
+
+	id = id ? id->clone(id) : NULL;
 	client = eap_radius_create_client();
 	if (client)
 	{
-		response = client->request(client, request);
-		if (response)
-		{
-			ack = response->get_code(response) == RMC_ACCOUNTING_RESPONSE;
-			response->destroy(response);
-		}
+		queued = client->request_async(client, request,
+									   (radius_socket_cb_t)message_cb, id);
 		client->destroy(client);
 	}
-	return ack;
+	else
+	{
+		request->destroy(request);
+	}
+	if (!queued)
+	{
+		lib->processor->queue_job(lib->processor, (job_t*)
+				callback_job_create_with_prio((callback_job_cb_t)send_failed,
+					id, (callback_job_cleanup_t)send_failed_destroy,
+					(callback_job_cancel_t)return_false, JOB_PRIO_HIGH));
+	}
 }
 
 /**
@@ -408,11 +453,7 @@ static job_requeue_t send_interim(interim_data_t *data)
 
 	if (message)
 	{
-		if (!send_message(this, message))
-		{
-			eap_radius_handle_timeout(data->id);
-		}
-		message->destroy(message);
+		send_message(this, message, data->id);
 	}
 	return JOB_REQUEUE_NONE;
 }
@@ -487,11 +528,7 @@ static void send_start(private_eap_radius_accounting_t *this, ike_sa_t *ike_sa)
 	this->mutex->unlock(this->mutex);
 
 	add_ike_sa_parameters(this, message, ike_sa);
-	if (!send_message(this, message))
-	{
-		eap_radius_handle_timeout(ike_sa->get_id(ike_sa));
-	}
-	message->destroy(message);
+	send_message(this, message, ike_sa->get_id(ike_sa));
 }
 
 /**
@@ -549,11 +586,7 @@ static void send_stop(private_eap_radius_accounting_t *this, ike_sa_t *ike_sa)
 		value = htonl(entry->cause);
 		message->add(message, RAT_ACCT_TERMINATE_CAUSE, chunk_from_thing(value));
 
-		if (!send_message(this, message))
-		{
-			eap_radius_handle_timeout(NULL);
-		}
-		message->destroy(message);
+		send_message(this, message, NULL);
 		destroy_entry(entry);
 	}
 }
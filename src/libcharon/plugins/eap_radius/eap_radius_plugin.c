@@ -21,11 +21,13 @@
 #include "eap_radius_forward.h"
 #include "eap_radius_provider.h"
 
+#include <inttypes.h>
+
 #include <radius_client.h>
 #include <radius_config.h>
+#include <radius_pool.h>
 
 #include <hydra.h>
-#include <threading/rwlock.h>
 #include <processing/jobs/callback_job.h>
 #include <processing/jobs/delete_ike_sa_job.h>
 
@@ -52,14 +54,9 @@ struct private_eap_radius_plugin_t {
 	eap_radius_plugin_t public;
 
 	/**
-	 * List of RADIUS server configurations
+	 * Pool of RADIUS server configurations
 	 */
-	linked_list_t *configs;
-
-	/**
-	 * Lock for configs list
-	 */
-	rwlock_t *lock;
+	radius_pool_t *pool;
 
 	/**
 	 * RADIUS sessions for accounting
@@ -87,6 +84,30 @@ struct private_eap_radius_plugin_t {
  */
 static private_eap_radius_plugin_t *instance = NULL;
 
+/**
+ * Report a RADIUS server not responding to a Status-Server probe
+ */
+static void probe_failed(void *data, radius_config_t *config)
+{
+	eap_radius_handle_timeout(NULL);
+}
+
+/**
+ * Configure the circuit breaker of a RADIUS server
+ */
+static void set_backoff(radius_config_t *config)
+{
+	config->set_backoff(config,
+				lib->settings->get_int(lib->settings,
+					"%s.plugins.eap-radius.backoff", 5, charon->name),
+				lib->settings->get_int(lib->settings,
+					"%s.plugins.eap-radius.backoff_max", 300, charon->name),
+				lib->settings->get_bool(lib->settings,
+					"%s.plugins.eap-radius.status_server", FALSE,
+					charon->name));
+	config->set_probe_cb(config, probe_failed, NULL);
+}
+
 /**
  * Load RADIUS servers from configuration
  */
@@ -94,9 +115,12 @@ static void load_configs(private_eap_radius_plugin_t *this)
 {
 	enumerator_t *enumerator;
 	radius_config_t *config;
+	linked_list_t *configs;
 	char *nas_identifier, *secret, *address, *section;
 	int auth_port, acct_port, sockets, preference;
 
+	configs = linked_list_create();
+
 	address = lib->settings->get_str(lib->settings,
 					"%s.plugins.eap-radius.server", NULL, charon->name);
 	if (address)
@@ -106,6 +130,7 @@ static void load_configs(private_eap_radius_plugin_t *this)
 		if (!secret)
 		{
 			DBG1(DBG_CFG, "no RADIUS secret defined");
+			this->pool->replace(this->pool, configs);
 			return;
 		}
 		nas_identifier = lib->settings->get_str(lib->settings,
@@ -117,12 +142,16 @@ static void load_configs(private_eap_radius_plugin_t *this)
 					"%s.plugins.eap-radius.sockets", 1, charon->name);
 		config = radius_config_create(address, address, auth_port, ACCT_PORT,
 									  nas_identifier, secret, sockets, 0);
-		if (!config)
+		if (config)
+		{
+			set_backoff(config);
+			configs->insert_last(configs, config);
+		}
+		else
 		{
 			DBG1(DBG_CFG, "no RADUIS server defined");
-			return;
 		}
-		this->configs->insert_last(this->configs, config);
+		this->pool->replace(this->pool, configs);
 		return;
 	}
 
@@ -171,13 +200,15 @@ static void load_configs(private_eap_radius_plugin_t *this)
 			DBG1(DBG_CFG, "loading RADIUS server '%s' failed, skipped", section);
 			continue;
 		}
-		this->configs->insert_last(this->configs, config);
+		set_backoff(config);
+		configs->insert_last(configs, config);
 	}
 	enumerator->destroy(enumerator);
 
 	DBG1(DBG_CFG, "loaded %d RADIUS server configuration%s",
-		 this->configs->get_count(this->configs),
-		 this->configs->get_count(this->configs) == 1 ? "" : "s");
+		 configs->get_count(configs),
+		 configs->get_count(configs) == 1 ? "" : "s");
+	this->pool->replace(this->pool, configs);
 }
 
 METHOD(plugin_t, get_name, char*,
@@ -203,12 +234,7 @@ METHOD(plugin_t, get_features, int,
 METHOD(plugin_t, reload, bool,
 	private_eap_radius_plugin_t *this)
 {
-	this->lock->write_lock(this->lock);
-	this->configs->destroy_offset(this->configs,
-								  offsetof(radius_config_t, destroy));
-	this->configs = linked_list_create();
 	load_configs(this);
-	this->lock->unlock(this->lock);
 	return TRUE;
 }
 
@@ -224,9 +250,8 @@ METHOD(plugin_t, destroy, void,
 		this->forward->destroy(this->forward);
 	}
 	DESTROY_IF(this->dae);
-	this->configs->destroy_offset(this->configs,
-								  offsetof(radius_config_t, destroy));
-	this->lock->destroy(this->lock);
+	lib->set(lib, "radius-status", NULL);
+	this->pool->destroy(this->pool);
 	this->accounting->destroy(this->accounting);
 	free(this);
 	instance = NULL;
@@ -248,14 +273,14 @@ plugin_t *eap_radius_plugin_create()
 				.destroy = _destroy,
 			},
 		},
-		.configs = linked_list_create(),
-		.lock = rwlock_create(RWLOCK_TYPE_DEFAULT),
+		.pool = radius_pool_create(),
 		.accounting = eap_radius_accounting_create(),
 		.forward = eap_radius_forward_create(),
 		.provider = eap_radius_provider_create(),
 	);
 
 	load_configs(this);
+	lib->set(lib, "radius-status", eap_radius_list_servers);
 	instance = this;
 
 	if (lib->settings->get_bool(lib->settings,
@@ -278,36 +303,11 @@ plugin_t *eap_radius_plugin_create()
  */
 radius_client_t *eap_radius_create_client()
 {
+	radius_config_t *selected;
+
 	if (instance)
 	{
-		enumerator_t *enumerator;
-		radius_config_t *config, *selected = NULL;
-		int current, best = -1;
-
-		instance->lock->read_lock(instance->lock);
-		enumerator = instance->configs->create_enumerator(instance->configs);
-		while (enumerator->enumerate(enumerator, &config))
-		{
-			current = config->get_preference(config);
-			if (current > best ||
-				/* for two with equal preference, 50-50 chance */
-				(current == best && random() % 2 == 0))
-			{
-				DBG2(DBG_CFG, "RADIUS server '%s' is candidate: %d",
-					 config->get_name(config), current);
-				best = current;
-				DESTROY_IF(selected);
-				selected = config->get_ref(config);
-			}
-			else
-			{
-				DBG2(DBG_CFG, "RADIUS server '%s' skipped: %d",
-					 config->get_name(config), current);
-			}
-		}
-		enumerator->destroy(enumerator);
-		instance->lock->unlock(instance->lock);
-
+		selected = instance->pool->select_config(instance->pool);
 		if (selected)
 		{
 			return radius_client_create(selected);
@@ -316,6 +316,57 @@ radius_client_t *eap_radius_create_client()
 	return NULL;
 }
 
+/**
+ * See header
+ */
+void eap_radius_list_servers(FILE *out)
+{
+	enumerator_t *enumerator;
+	radius_config_t *config;
+	radius_stats_t stats;
+
+	if (!instance)
+	{
+		return;
+	}
+
+	fprintf(out, "\n");
+	fprintf(out, "List of RADIUS servers:\n");
+
+	enumerator = instance->pool->create_enumerator(instance->pool);
+	while (enumerator->enumerate(enumerator, &config))
+	{
+		config->get_stats(config, &stats);
+		fprintf(out, "\n  %s: ", config->get_name(config));
+		switch (stats.state)
+		{
+			case RADIUS_SERVER_UP:
+				fprintf(out, "up");
+				break;
+			case RADIUS_SERVER_DOWN:
+				fprintf(out, "down, %u failures, retry in %us (backoff %us)",
+						stats.failures, stats.retry, stats.backoff);
+				break;
+			case RADIUS_SERVER_PROBING:
+				fprintf(out, "probing, %u failures", stats.failures);
+				break;
+		}
+		fprintf(out, "\n    rtt: ");
+		if (stats.rtt)
+		{
+			fprintf(out, "%ums\n", stats.rtt);
+		}
+		else
+		{
+			fprintf(out, "unknown\n");
+		}
+		fprintf(out, "    requests: %" PRIu64 ", responses: %" PRIu64
+				", timeouts: %" PRIu64 ", outstanding: %u\n", stats.requests,
+				stats.responses, stats.timeouts, stats.outstanding);
+	}
+	enumerator->destroy(enumerator);
+}
+
 /**
  * Job to delete all active IKE_SAs
  */
@@ -52,6 +52,16 @@ struct eap_radius_plugin_t {
  */
 radius_client_t *eap_radius_create_client();
 
+/**
+ * Print the health state and statistics of all RADIUS servers.
+ *
+ * The function is registered as "radius-status" using lib->set(), which
+ * allows other plugins to list the servers without using libradius.
+ *
+ * @param out		stream to print to
+ */
+void eap_radius_list_servers(FILE *out);
+
 /**
  * Handle a RADIUS request timeout.
  *
@@ -361,6 +361,30 @@ METHOD(stroke_attribute_t, create_pool_enumerator, enumerator_t*,
 									this->lock, (void*)this->lock->unlock);
 }
 
+/**
+ * Filter function to skip pools without addresses
+ */
+static bool mem_pool_filter(void *lock, mem_pool_t **in, mem_pool_t **out)
+{
+	mem_pool_t *pool = *in;
+
+	if (pool->get_size(pool) == 0)
+	{
+		return FALSE;
+	}
+	*out = pool;
+	return TRUE;
+}
+
+METHOD(stroke_attribute_t, create_mem_pool_enumerator, enumerator_t*,
+	private_stroke_attribute_t *this)
+{
+	this->lock->read_lock(this->lock);
+	return enumerator_create_filter(this->pools->create_enumerator(this->pools),
+									(void*)mem_pool_filter,
+									this->lock, (void*)this->lock->unlock);
+}
+
 METHOD(stroke_attribute_t, create_lease_enumerator, enumerator_t*,
 	private_stroke_attribute_t *this, char *name)
 {
@@ -404,6 +428,7 @@ stroke_attribute_t *stroke_attribute_create()
 			.del_dns = _del_dns,
 			.create_pool_enumerator = _create_pool_enumerator,
 			.create_lease_enumerator = _create_lease_enumerator,
+			.create_mem_pool_enumerator = _create_mem_pool_enumerator,
 			.destroy = _destroy,
 		},
 		.pools = linked_list_create(),
@@ -83,6 +83,13 @@ struct stroke_attribute_t {
 	enumerator_t* (*create_lease_enumerator)(stroke_attribute_t *this,
 											 char *pool);
 
+	/**
+	 * Create an enumerator over the non-empty in-memory pools.
+	 *
+	 * @return			enumerator over mem_pool_t
+	 */
+	enumerator_t* (*create_mem_pool_enumerator)(stroke_attribute_t *this);
+
 	/**
 	 * Destroy a stroke_attribute instance.
 	 */
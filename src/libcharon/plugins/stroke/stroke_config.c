@@ -20,6 +20,7 @@
 #include <daemon.h>
 #include <threading/mutex.h>
 #include <utils/lexparser.h>
+#include <config/peer_cfg_index.h>
 
 typedef struct private_stroke_config_t private_stroke_config_t;
 
@@ -38,6 +39,11 @@ struct private_stroke_config_t {
 	 */
 	linked_list_t *list;
 
+	/**
+	 * index over the configs in list, by remote identity
+	 */
+	peer_cfg_index_t *index;
+
 	/**
 	 * mutex to lock config list
 	 */
@@ -63,8 +69,9 @@ METHOD(backend_t, create_peer_cfg_enumerator, enumerator_t*,
 	private_stroke_config_t *this, identification_t *me, identification_t *other)
 {
 	this->mutex->lock(this->mutex);
-	return enumerator_create_cleaner(this->list->create_enumerator(this->list),
-									 (void*)this->mutex->unlock, this->mutex);
+	return enumerator_create_cleaner(
+							this->index->create_enumerator(this->index, other),
+							(void*)this->mutex->unlock, this->mutex);
 }
 
 /**
@@ -1057,6 +1064,7 @@ METHOD(stroke_config_t, add, void,
 		DBG1(DBG_CFG, "added configuration '%s'", msg->add_conn.name);
 		this->mutex->lock(this->mutex);
 		this->list->insert_last(this->list, peer_cfg);
+		this->index->add(this->index, peer_cfg);
 		this->mutex->unlock(this->mutex);
 	}
 }
@@ -1096,6 +1104,7 @@ METHOD(stroke_config_t, del, void,
 		if (!keep || streq(peer->get_name(peer), msg->del_conn.name))
 		{
 			this->list->remove_at(this->list, enumerator);
+			this->index->remove(this->index, peer);
 			peer->destroy(peer);
 			deleted = TRUE;
 		}
@@ -1294,6 +1303,7 @@ METHOD(stroke_config_t, set_user_credentials, void,
 METHOD(stroke_config_t, destroy, void,
 	private_stroke_config_t *this)
 {
+	this->index->destroy(this->index);
 	this->list->destroy_offset(this->list, offsetof(peer_cfg_t, destroy));
 	this->mutex->destroy(this->mutex);
 	free(this);
@@ -1320,6 +1330,7 @@ stroke_config_t *stroke_config_create(stroke_ca_t *ca, stroke_cred_t *cred,
 			.destroy = _destroy,
 		},
 		.list = linked_list_create(),
+		.index = peer_cfg_index_create(),
 		.mutex = mutex_create(MUTEX_TYPE_RECURSIVE),
 		.ca = ca,
 		.cred = cred,
@@ -466,6 +466,7 @@ METHOD(stroke_list_t, status, void,
 		time_t since, now;
 		u_int size, online, offline, i;
 		struct utsname utsname;
+		cert_cache_stats_t cache;
 
 		now = time_monotonic(NULL);
 		since = time(NULL) - (now - this->uptime);
@@ -502,6 +503,12 @@ METHOD(stroke_list_t, status, void,
 		}
 		fprintf(out, ", scheduled: %d\n",
 				lib->scheduler->get_job_load(lib->scheduler));
+		if (lib->credmgr->get_cache_stats(lib->credmgr, &cache))
+		{
+			fprintf(out, "  certificate cache: %u/%u relations, %u hits, "
+					"%u misses, %u evictions\n", cache.count, cache.capacity,
+					cache.hits, cache.misses, cache.evictions);
+		}
 		fprintf(out, "  loaded plugins: %s\n",
 				lib->plugins->loaded_plugins(lib->plugins));
 
@@ -1368,6 +1375,52 @@ static void list_plugins(FILE *out)
 	enumerator->destroy(enumerator);
 }
 
+/**
+ * List utilization and fragmentation of in-memory pools
+ */
+static void list_pools(private_stroke_list_t *this, FILE *out)
+{
+	enumerator_t *enumerator;
+	mem_pool_stats_t stats;
+	mem_pool_t *pool;
+	bool first = TRUE;
+
+	enumerator = this->attribute->create_mem_pool_enumerator(this->attribute);
+	while (enumerator->enumerate(enumerator, &pool))
+	{
+		if (first)
+		{
+			fprintf(out, "\n");
+			fprintf(out, "List of IP Address Pools:\n");
+			first = FALSE;
+		}
+		pool->get_stats(pool, &stats);
+		fprintf(out, "\n  %s:\n", pool->get_name(pool));
+		fprintf(out, "    usage: %u/%u, %u online (%u%%), %u offline, "
+				"%u unused\n", stats.online + stats.offline, stats.size,
+				stats.online, (u_int)((u_int64_t)stats.online * 100 / stats.size),
+				stats.offline, stats.unused);
+		fprintf(out, "    fragmentation: %u offline ranges, largest %u\n",
+				stats.ranges, stats.largest_range);
+	}
+	enumerator->destroy(enumerator);
+}
+
+/**
+ * List health and statistics of RADIUS servers
+ */
+static void list_radius(FILE *out)
+{
+	void (*list_servers)(FILE *out);
+
+	/* registered by the eap-radius plugin, if loaded */
+	list_servers = lib->get(lib, "radius-status");
+	if (list_servers)
+	{
+		list_servers(out);
+	}
+}
+
 METHOD(stroke_list_t, list, void,
 	private_stroke_list_t *this, stroke_msg_t *msg, FILE *out)
 {
@@ -1443,6 +1496,14 @@ METHOD(stroke_list_t, list, void,
 	{
 		list_plugins(out);
 	}
+	if (msg->list.flags & LIST_RADIUS)
+	{
+		list_radius(out);
+	}
+	if (msg->list.flags & LIST_POOLS)
+	{
+		list_pools(this, out);
+	}
 }
 
 /**
@@ -28,17 +28,27 @@ DEFINE_TEST("auth cfg", test_auth_cfg, FALSE)
 DEFINE_TEST("CURL get", test_curl_get, FALSE)
 DEFINE_TEST("MySQL operations", test_mysql, FALSE)
 DEFINE_TEST("SQLite operations", test_sqlite, FALSE)
+DEFINE_TEST("SQLite statement cache", test_sqlite_cache, FALSE)
 DEFINE_TEST("mutex primitive", test_mutex, FALSE)
+DEFINE_TEST("processor scheduling", test_processor, FALSE)
 DEFINE_TEST("RSA key generation", test_rsa_gen, FALSE)
 DEFINE_TEST("RSA subjectPublicKeyInfo loading", test_rsa_load_any, FALSE)
 DEFINE_TEST("X509 certificate", test_cert_x509, FALSE)
 DEFINE_TEST("Mediation database key fetch", test_med_db, FALSE)
 DEFINE_TEST("Base64 converter", test_chunk_base64, FALSE)
+DEFINE_TEST("SipHash keyed hash", test_chunk_mac, FALSE)
 DEFINE_TEST("IP pool", test_pool, FALSE)
+DEFINE_TEST("In-memory IP pool", test_mem_pool, FALSE)
 DEFINE_TEST("SSH agent", test_agent, FALSE)
 DEFINE_TEST("ID parts", test_id_parts, FALSE)
 DEFINE_TEST("ID wildcards", test_id_wildcards, FALSE)
 DEFINE_TEST("ID equals", test_id_equals, FALSE)
+DEFINE_TEST("ID hash", test_id_hash, FALSE)
 DEFINE_TEST("ID matches", test_id_matches, FALSE)
+DEFINE_TEST("IKEv2 response window", test_response_window, FALSE)
+DEFINE_TEST("IKEv2 response cache", test_response_cache, FALSE)
+DEFINE_TEST("OCSP response cache", test_revocation_cache, FALSE)
+DEFINE_TEST("OCSP response cache purge", test_revocation_purge, FALSE)
+DEFINE_TEST("Revocation fetch coalescing", test_revocation_fetch, FALSE)
 
 /** @}*/
@@ -80,3 +80,56 @@ bool test_chunk_base64()
 	return TRUE;
 }
 
+
+/*******************************************************************************
+ * SipHash-2-4 keyed hash test
+ ******************************************************************************/
+bool test_chunk_mac()
+{
+	/* test vectors from the SipHash reference implementation, with key
+	 * 00 01 .. 0f and messages 00 01 .. of increasing length */
+	typedef struct {
+		size_t len;
+		u_int64_t mac;
+	} testdata_t;
+
+	testdata_t test[] = {
+		{ 0, 0x726fdb47dd0e0e31ULL},
+		{ 1, 0x74f839c593dc67fdULL},
+		{ 8, 0x93f5f5799a932462ULL},
+		{15, 0xa129ca6149be45e5ULL},
+	};
+	u_char key[CHUNK_MAC_KEY_LEN], msg[16];
+	u_int64_t mac;
+	int i;
+
+	for (i = 0; i < sizeof(key); i++)
+	{
+		key[i] = i;
+	}
+	for (i = 0; i < sizeof(msg); i++)
+	{
+		msg[i] = i;
+	}
+	for (i = 0; i < countof(test); i++)
+	{
+		mac = chunk_mac(chunk_create(msg, test[i].len), key);
+		if (mac != test[i].mac)
+		{
+			DBG1(DBG_CFG, "SipHash error for %zu bytes - should %llx, is %llx",
+				 test[i].len, (unsigned long long)test[i].mac,
+				 (unsigned long long)mac);
+			return FALSE;
+		}
+	}
+
+	/* the incremental version hashes the previous value, little endian */
+	mac = chunk_mac_inc(chunk_create(msg + 8, 7), key, 0x0706050403020100ULL);
+	if (mac != test[3].mac)
+	{
+		DBG1(DBG_CFG, "incremental SipHash error - should %llx, is %llx",
+			 (unsigned long long)test[3].mac, (unsigned long long)mac);
+		return FALSE;
+	}
+	return TRUE;
+}
@@ -193,6 +193,63 @@ bool test_id_equals()
 	return TRUE;
 }
 
+/*******************************************************************************
+ * identification hash test
+ ******************************************************************************/
+
+static bool test_id_hash_one(char *a_str, char *b_str)
+{
+	identification_t *a, *b;
+	bool equals;
+
+	a = identification_create_from_string(a_str);
+	b = identification_create_from_string(b_str);
+	/* equal IDs must hash equally, unequal IDs may collide */
+	equals = a->equals(a, b) && b->equals(b, a) &&
+			 a->hash(a, 0) == b->hash(b, 0);
+	b->destroy(b);
+	a->destroy(a);
+	return equals;
+}
+
+bool test_id_hash()
+{
+	identification_t *a, *b;
+	bool equals;
+
+	if (!test_id_hash_one("C=CH, E=martin@strongswan.org, CN=martin",
+						  "C=ch, E=martin@STRONGSWAN.ORG, CN=Martin"))
+	{
+		return FALSE;
+	}
+	if (!test_id_hash_one("moon.strongswan.org", "MOON.strongSwan.org"))
+	{
+		return FALSE;
+	}
+	if (!test_id_hash_one("martin@strongswan.org", "Martin@StrongSwan.org"))
+	{
+		return FALSE;
+	}
+	if (!test_id_hash_one("192.168.0.1", "192.168.0.1"))
+	{
+		return FALSE;
+	}
+	if (!test_id_hash_one("%any", "%any"))
+	{
+		return FALSE;
+	}
+
+	/* equals() compares types, as hash() includes them */
+	a = identification_create_from_encoding(ID_FQDN,
+										chunk_from_str("strongswan.org"));
+	b = identification_create_from_encoding(ID_RFC822_ADDR,
+										chunk_from_str("strongswan.org"));
+	equals = a->equals(a, b) || b->equals(b, a);
+	b->destroy(b);
+	a->destroy(a);
+	return !equals;
+}
+
 /*******************************************************************************
  * identification matches test
  ******************************************************************************/
@@ -18,6 +18,7 @@
 #include <library.h>
 #include <threading/thread.h>
 #include <hydra.h>
+#include <attributes/mem_pool.h>
 
 #define ALLOCS 1000
 #define THREADS 20
@@ -98,3 +99,113 @@ bool test_pool()
 	return TRUE;
 }
 
+
+/**
+ * Acquire an address for an identity from a pool
+ */
+static host_t *acquire(mem_pool_t *pool, identification_t *id, host_t *any)
+{
+	host_t *addr;
+
+	addr = pool->acquire_address(pool, id, any, MEM_POOL_EXISTING);
+	if (!addr)
+	{
+		addr = pool->acquire_address(pool, id, any, MEM_POOL_NEW);
+		if (!addr)
+		{
+			addr = pool->acquire_address(pool, id, any, MEM_POOL_REASSIGN);
+		}
+	}
+	return addr;
+}
+
+/*******************************************************************************
+ * In-memory pool lease assignment test
+ ******************************************************************************/
+bool test_mem_pool()
+{
+	identification_t *id[ALLOCS] = {};
+	host_t *addr[ALLOCS] = {}, *base, *any, *addr2;
+	mem_pool_stats_t stats;
+	mem_pool_t *pool;
+	bool good = FALSE;
+	char buf[64];
+	int i;
+
+	base = host_create_from_string("10.1.0.0", 0);
+	any = host_create_from_string("0.0.0.0", 0);
+	/* a /22 has 1022 usable addresses, less than ALLOCS identities */
+	pool = mem_pool_create("test", base, 22);
+
+	for (i = 0; i < ALLOCS; i++)
+	{
+		snprintf(buf, sizeof(buf), "%d@strongswan.org", i);
+		id[i] = identification_create_from_string(buf);
+		addr[i] = acquire(pool, id[i], any);
+		if (!addr[i])
+		{
+			goto out;
+		}
+	}
+	if (pool->get_online(pool) != ALLOCS || pool->get_offline(pool) != 0)
+	{
+		goto out;
+	}
+	/* release every other lease, which fragments the pool */
+	for (i = 0; i < ALLOCS; i += 2)
+	{
+		if (!pool->release_address(pool, addr[i], id[i]) ||
+			pool->release_address(pool, addr[i], id[i]))
+		{
+			goto out;
+		}
+	}
+	pool->get_stats(pool, &stats);
+	if (stats.online != ALLOCS / 2 || stats.offline != ALLOCS / 2 ||
+		stats.ranges != ALLOCS / 2 || stats.largest_range != 1)
+	{
+		goto out;
+	}
+	/* an identity gets its offline lease back */
+	addr2 = acquire(pool, id[0], any);
+	if (!addr2 || !addr2->ip_equals(addr2, addr[0]))
+	{
+		DESTROY_IF(addr2);
+		goto out;
+	}
+	addr2->destroy(addr2);
+	/* its online lease, if requested */
+	addr2 = pool->acquire_address(pool, id[1], addr[1], MEM_POOL_EXISTING);
+	if (!addr2 || !addr2->ip_equals(addr2, addr[1]))
+	{
+		DESTROY_IF(addr2);
+		goto out;
+	}
+	addr2->destroy(addr2);
+	/* the least recently released lease gets reassigned once exhausted */
+	for (i = 0; i < stats.unused; i++)
+	{
+		addr2 = acquire(pool, id[1], any);
+		DESTROY_IF(addr2);
+	}
+	addr2 = acquire(pool, id[3], any);
+	if (!addr2 || !addr2->ip_equals(addr2, addr[2]) ||
+		pool->release_address(pool, addr[2], id[2]))
+	{
+		DESTROY_IF(addr2);
+		goto out;
+	}
+	addr2->destroy(addr2);
+	good = TRUE;
+
+out:
+	for (i = 0; i < ALLOCS; i++)
+	{
+		DESTROY_IF(addr[i]);
+		DESTROY_IF(id[i]);
+	}
+	pool->destroy(pool);
+	base->destroy(base);
+	any->destroy(any);
+	return good;
+}
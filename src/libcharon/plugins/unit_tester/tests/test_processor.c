@@ -0,0 +1,514 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <library.h>
+#include <daemon.h>
+#include <processing/processor.h>
+#include <processing/jobs/callback_job.h>
+#include <threading/thread.h>
+#include <threading/mutex.h>
+#include <threading/condvar.h>
+
+#include <unistd.h>
+
+#define JOBS 200000
+#define PRODUCERS 4
+
+/**
+ * Time to wait for expected events, in ms
+ */
+#define TIMEOUT 5000
+
+static processor_t *processor;
+
+static mutex_t *mutex;
+
+static condvar_t *condvar;
+
+/**
+ * Number of jobs that started executing
+ */
+static int started;
+
+/**
+ * Executed record jobs, by index
+ */
+static int order[16];
+
+/**
+ * Number of executed record jobs
+ */
+static int recorded;
+
+/**
+ * Whether gate jobs may return
+ */
+static bool gate_open;
+
+/**
+ * Number of canceled blocking jobs
+ */
+static int canceled;
+
+/**
+ * Wait until value reaches count, mutex must be held
+ */
+static bool wait_count(int *value, int count, u_int timeout)
+{
+	timeval_t deadline;
+
+	time_monotonic(&deadline);
+	timeval_add_ms(&deadline, timeout);
+	while (*value < count)
+	{
+		if (condvar->timed_wait_abs(condvar, mutex, deadline))
+		{
+			return *value >= count;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Job blocking until the gate opens
+ */
+static job_requeue_t gate(void *data)
+{
+	mutex->lock(mutex);
+	started++;
+	condvar->broadcast(condvar);
+	while (!gate_open)
+	{
+		condvar->wait(condvar, mutex);
+	}
+	mutex->unlock(mutex);
+	return JOB_REQUEUE_NONE;
+}
+
+/**
+ * Job recording its index when executed
+ */
+static job_requeue_t record(void *data)
+{
+	mutex->lock(mutex);
+	order[recorded++] = (uintptr_t)data;
+	condvar->broadcast(condvar);
+	mutex->unlock(mutex);
+	return JOB_REQUEUE_NONE;
+}
+
+/**
+ * Job blocking until it gets canceled
+ */
+static job_requeue_t block(bool *done)
+{
+	mutex->lock(mutex);
+	started++;
+	condvar->broadcast(condvar);
+	while (!*done)
+	{
+		condvar->wait(condvar, mutex);
+	}
+	mutex->unlock(mutex);
+	return JOB_REQUEUE_NONE;
+}
+
+/**
+ * Cancel a blocking job
+ */
+static bool cancel_block(bool *done)
+{
+	mutex->lock(mutex);
+	*done = TRUE;
+	canceled++;
+	condvar->broadcast(condvar);
+	mutex->unlock(mutex);
+	return TRUE;
+}
+
+/**
+ * Queue a job blocking until it gets canceled
+ */
+static void queue_block()
+{
+	bool *done;
+
+	done = malloc_thing(bool);
+	*done = FALSE;
+	processor->queue_job(processor,
+			(job_t*)callback_job_create((callback_job_cb_t)block, done, free,
+						(callback_job_cancel_t)cancel_block));
+}
+
+/**
+ * Create a processor with the given number of reserved threads per priority
+ */
+static processor_t *create_processor(int reserved[], u_int threads)
+{
+	processor_t *created;
+	int i;
+
+	for (i = 0; i < JOB_PRIO_MAX; i++)
+	{
+		lib->settings->set_int(lib->settings,
+						"libstrongswan.processor.priority_threads.%N",
+						reserved[i], job_priority_names, i);
+	}
+	created = processor_create();
+	created->set_threads(created, threads);
+	return created;
+}
+
+/**
+ * Reset state shared with the jobs
+ */
+static void reset()
+{
+	started = recorded = canceled = 0;
+	gate_open = FALSE;
+}
+
+/**
+ * Jobs of higher priority are executed first, jobs of the same priority in
+ * the order they were queued
+ */
+static bool test_order()
+{
+	job_priority_t prios[] = {
+		JOB_PRIO_LOW, JOB_PRIO_MEDIUM, JOB_PRIO_CRITICAL, JOB_PRIO_LOW,
+		JOB_PRIO_HIGH, JOB_PRIO_CRITICAL, JOB_PRIO_MEDIUM, JOB_PRIO_HIGH,
+	};
+	int reserved[JOB_PRIO_MAX] = {}, i;
+	bool success;
+
+	reset();
+	processor = create_processor(reserved, 1);
+
+	/* block the only worker, so all jobs get queued */
+	processor->queue_job(processor,
+			(job_t*)callback_job_create(gate, NULL, NULL, NULL));
+	mutex->lock(mutex);
+	success = wait_count(&started, 1, TIMEOUT);
+	mutex->unlock(mutex);
+	for (i = 0; i < countof(prios); i++)
+	{
+		processor->queue_job(processor,
+				(job_t*)callback_job_create_with_prio(record,
+									(void*)(uintptr_t)i, NULL, NULL, prios[i]));
+	}
+	mutex->lock(mutex);
+	gate_open = TRUE;
+	condvar->broadcast(condvar);
+	success = success && wait_count(&recorded, countof(prios), TIMEOUT);
+	mutex->unlock(mutex);
+	processor->destroy(processor);
+
+	if (!success)
+	{
+		DBG1(DBG_CFG, "processor did not execute queued jobs");
+		return FALSE;
+	}
+	for (i = 1; i < countof(prios); i++)
+	{
+		if (prios[order[i - 1]] > prios[order[i]] ||
+			(prios[order[i - 1]] == prios[order[i]] && order[i - 1] > order[i]))
+		{
+			DBG1(DBG_CFG, "job %d executed before job %d", order[i - 1],
+				 order[i]);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Threads reserved for critical jobs don't execute other jobs
+ */
+static bool test_reserved()
+{
+	int reserved[JOB_PRIO_MAX] = { [JOB_PRIO_CRITICAL] = 1 };
+	bool success = TRUE;
+
+	reset();
+	processor = create_processor(reserved, 2);
+
+	/* one thread executes a low priority job ... */
+	processor->queue_job(processor,
+			(job_t*)callback_job_create_with_prio(gate, NULL, NULL, NULL,
+												  JOB_PRIO_LOW));
+	mutex->lock(mutex);
+	if (!wait_count(&started, 1, TIMEOUT))
+	{
+		DBG1(DBG_CFG, "processor did not execute low priority job");
+		success = FALSE;
+	}
+	mutex->unlock(mutex);
+	if (processor->get_working_threads(processor, JOB_PRIO_LOW) != 1)
+	{
+		DBG1(DBG_CFG, "processor does not count working threads");
+		success = FALSE;
+	}
+
+	/* ... the other is reserved for critical jobs */
+	processor->queue_job(processor,
+			(job_t*)callback_job_create_with_prio(record, (void*)0, NULL, NULL,
+												  JOB_PRIO_LOW));
+	mutex->lock(mutex);
+	if (wait_count(&recorded, 1, 200))
+	{
+		DBG1(DBG_CFG, "low priority job executed by reserved thread");
+		success = FALSE;
+	}
+	mutex->unlock(mutex);
+	processor->queue_job(processor,
+			(job_t*)callback_job_create_with_prio(record, (void*)1, NULL, NULL,
+												  JOB_PRIO_CRITICAL));
+	mutex->lock(mutex);
+	if (!wait_count(&recorded, 1, TIMEOUT) || order[0] != 1)
+	{
+		DBG1(DBG_CFG, "critical job not executed by reserved thread");
+		success = FALSE;
+	}
+
+	/* the delayed job gets executed once the low priority job completes */
+	gate_open = TRUE;
+	condvar->broadcast(condvar);
+	if (!wait_count(&recorded, 2, TIMEOUT) || order[1] != 0)
+	{
+		DBG1(DBG_CFG, "delayed low priority job not executed");
+		success = FALSE;
+	}
+	mutex->unlock(mutex);
+	processor->destroy(processor);
+	return success;
+}
+
+/**
+ * Whether the producer should stop
+ */
+static bool stop;
+
+/**
+ * Job doing nothing
+ */
+static job_requeue_t execute_nop(void *data)
+{
+	return JOB_REQUEUE_NONE;
+}
+
+/**
+ * Queue short and blocking jobs until stopped, so workers pick up blocking
+ * jobs while the processor gets canceled
+ */
+static void* produce_blocking(void *null)
+{
+	int i;
+
+	while (TRUE)
+	{
+		mutex->lock(mutex);
+		if (stop)
+		{
+			mutex->unlock(mutex);
+			return NULL;
+		}
+		mutex->unlock(mutex);
+		for (i = 0; i < 16; i++)
+		{
+			processor->queue_job(processor,
+					(job_t*)callback_job_create(execute_nop, NULL, NULL, NULL));
+		}
+		queue_block();
+		usleep(10);
+	}
+}
+
+/**
+ * Whether cancel() returned
+ */
+static int cancel_done;
+
+/**
+ * Cancel the processor
+ */
+static void* cancel_processor(void *null)
+{
+	processor->cancel(processor);
+	mutex->lock(mutex);
+	cancel_done = 1;
+	condvar->broadcast(condvar);
+	mutex->unlock(mutex);
+	return NULL;
+}
+
+/**
+ * cancel() cancels all executing jobs and terminates the threads, even if
+ * jobs get queued concurrently
+ */
+static bool test_cancel()
+{
+	int reserved[JOB_PRIO_MAX] = {}, i;
+	thread_t *producer, *canceler;
+	bool success = TRUE;
+
+	reset();
+	stop = FALSE;
+	cancel_done = 0;
+	processor = create_processor(reserved, 8);
+
+	for (i = 0; i < 4; i++)
+	{
+		queue_block();
+	}
+	mutex->lock(mutex);
+	if (!wait_count(&started, 4, TIMEOUT))
+	{
+		DBG1(DBG_CFG, "processor did not execute blocking jobs");
+		success = FALSE;
+	}
+	mutex->unlock(mutex);
+
+	producer = thread_create(produce_blocking, NULL);
+	usleep(1000);
+	canceler = thread_create(cancel_processor, NULL);
+	mutex->lock(mutex);
+	if (!wait_count(&cancel_done, 1, TIMEOUT))
+	{
+		DBG1(DBG_CFG, "processor cancel() did not return");
+		stop = TRUE;
+		mutex->unlock(mutex);
+		/* we can't clean up the blocked threads */
+		return FALSE;
+	}
+	if (canceled < 4)
+	{
+		DBG1(DBG_CFG, "processor canceled %d of 4 blocking jobs", canceled);
+		success = FALSE;
+	}
+	stop = TRUE;
+	mutex->unlock(mutex);
+	canceler->join(canceler);
+	producer->join(producer);
+
+	if (processor->get_total_threads(processor) != 0)
+	{
+		DBG1(DBG_CFG, "processor has threads left after cancel()");
+		success = FALSE;
+	}
+	processor->destroy(processor);
+	return success;
+}
+
+/**
+ * Number of jobs left to execute in the benchmark
+ */
+static refcount_t executed;
+
+static job_requeue_t execute(void *data)
+{
+	if (ref_put(&executed))
+	{
+		mutex->lock(mutex);
+		condvar->signal(condvar);
+		mutex->unlock(mutex);
+	}
+	return JOB_REQUEUE_NONE;
+}
+
+static void* produce(void *null)
+{
+	int i;
+
+	for (i = 0; i < JOBS / PRODUCERS; i++)
+	{
+		processor->queue_job(processor,
+				(job_t*)callback_job_create(execute, NULL, NULL, NULL));
+	}
+	return NULL;
+}
+
+/**
+ * Run JOBS jobs with the given number of worker threads, returns jobs/s
+ */
+static u_int run(u_int threads)
+{
+	thread_t *producers[PRODUCERS];
+	int reserved[JOB_PRIO_MAX] = {};
+	struct timeval start, end;
+	u_int64_t usec;
+	int i;
+
+	processor = create_processor(reserved, threads);
+	executed = JOBS;
+
+	time_monotonic(&start);
+	for (i = 0; i < PRODUCERS; i++)
+	{
+		producers[i] = thread_create(produce, NULL);
+	}
+	for (i = 0; i < PRODUCERS; i++)
+	{
+		producers[i]->join(producers[i]);
+	}
+	mutex->lock(mutex);
+	while (executed)
+	{
+		condvar->wait(condvar, mutex);
+	}
+	mutex->unlock(mutex);
+	time_monotonic(&end);
+
+	processor->destroy(processor);
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+	return JOBS * 1000000ULL / max(usec, 1);
+}
+
+/*******************************************************************************
+ * processor scheduling test and throughput benchmark
+ ******************************************************************************/
+bool test_processor()
+{
+	int reserved[JOB_PRIO_MAX], i;
+	u_int threads;
+	bool success;
+
+	mutex = mutex_create(MUTEX_TYPE_DEFAULT);
+	condvar = condvar_create(CONDVAR_TYPE_DEFAULT);
+	for (i = 0; i < JOB_PRIO_MAX; i++)
+	{
+		reserved[i] = lib->settings->get_int(lib->settings,
+						"libstrongswan.processor.priority_threads.%N", 0,
+						job_priority_names, i);
+	}
+
+	success = test_order() && test_reserved() && test_cancel();
+	if (success)
+	{
+		for (threads = 1; threads <= 64; threads *= 2)
+		{
+			DBG1(DBG_CFG, "%2u threads: %u jobs/s", threads, run(threads));
+		}
+	}
+
+	for (i = 0; i < JOB_PRIO_MAX; i++)
+	{
+		lib->settings->set_int(lib->settings,
+						"libstrongswan.processor.priority_threads.%N",
+						reserved[i], job_priority_names, i);
+	}
+	condvar->destroy(condvar);
+	mutex->destroy(mutex);
+	return success;
+}
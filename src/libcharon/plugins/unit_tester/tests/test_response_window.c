@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <library.h>
+
+#ifdef USE_IKEV2
+
+#include <sa/ikev2/response_window.h>
+
+/**
+ * Answer a request with a dummy response
+ */
+static void answer(response_window_t *window, u_int32_t mid)
+{
+	window->answer(window, mid, packet_create());
+}
+
+/**
+ * Check if a response to a request is cached
+ */
+static bool is_cached(response_window_t *window, u_int32_t mid)
+{
+	packet_t *packet = NULL;
+
+	return window->get_response(window, mid, &packet) && packet;
+}
+
+/**
+ * Test acceptance of requests within the window, answered out of order
+ */
+bool test_response_window()
+{
+	response_window_t *window;
+	bool good = FALSE;
+
+	/* with a window size of one, only the next request is accepted */
+	window = response_window_create(1);
+	if (!window->is_new(window, 0) || window->is_new(window, 1))
+	{
+		goto out;
+	}
+	answer(window, 0);
+	if (window->get_lowest(window) != 1 ||
+		window->is_new(window, 0) || !window->is_new(window, 1))
+	{
+		goto out;
+	}
+	window->destroy(window);
+
+	window = response_window_create(3);
+	if (!window->is_new(window, 2) || window->is_new(window, 3))
+	{
+		goto out;
+	}
+	/* answering 2 and 1 first does not move the window */
+	answer(window, 2);
+	answer(window, 1);
+	if (window->get_lowest(window) != 0 || window->is_new(window, 2) ||
+		window->is_new(window, 1) || window->is_new(window, 3))
+	{
+		goto out;
+	}
+	/* answering 0 moves the window past all answered requests */
+	answer(window, 0);
+	if (window->get_lowest(window) != 3 || !window->is_new(window, 3) ||
+		!window->is_new(window, 5) || window->is_new(window, 6))
+	{
+		goto out;
+	}
+	/* answers without response, e.g. to invalid requests, count too */
+	window->answer(window, 3, NULL);
+	if (window->get_lowest(window) != 4 || window->is_new(window, 3))
+	{
+		goto out;
+	}
+	window->reset(window, 10);
+	if (window->get_lowest(window) != 10 || !window->is_new(window, 10) ||
+		window->is_new(window, 4))
+	{
+		goto out;
+	}
+	good = TRUE;
+
+out:
+	window->destroy(window);
+	return good;
+}
+
+/**
+ * Test caching of multiple responses for retransmission
+ */
+bool test_response_cache()
+{
+	response_window_t *window;
+	packet_t *packet;
+	bool good = FALSE;
+	int i;
+
+	window = response_window_create(3);
+	answer(window, 1);
+	answer(window, 0);
+	answer(window, 2);
+	for (i = 0; i < 3; i++)
+	{
+		if (!is_cached(window, i))
+		{
+			goto out;
+		}
+	}
+	if (window->get_response(window, 3, &packet))
+	{
+		goto out;
+	}
+	/* once the peer sent 3, it got the response to 0 due to its window */
+	answer(window, 3);
+	if (is_cached(window, 0) || !is_cached(window, 1) || !is_cached(window, 3))
+	{
+		goto out;
+	}
+	/* answers beyond the lowest unanswered request don't drop anything */
+	answer(window, 5);
+	if (window->get_lowest(window) != 4 ||
+		!is_cached(window, 1) || !is_cached(window, 5))
+	{
+		goto out;
+	}
+	answer(window, 4);
+	if (window->get_lowest(window) != 6 || is_cached(window, 1) ||
+		is_cached(window, 2) || !is_cached(window, 3) ||
+		!is_cached(window, 4) || !is_cached(window, 5))
+	{
+		goto out;
+	}
+	window->reset(window, 6);
+	if (is_cached(window, 5))
+	{
+		goto out;
+	}
+	good = TRUE;
+
+out:
+	window->destroy(window);
+	return good;
+}
+
+#else /* USE_IKEV2 */
+
+bool test_response_window()
+{
+	return TRUE;
+}
+
+bool test_response_cache()
+{
+	return TRUE;
+}
+
+#endif /* USE_IKEV2 */
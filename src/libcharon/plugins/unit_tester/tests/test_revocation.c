@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <unistd.h>
+#include <time.h>
+
+#include <library.h>
+#include <threading/thread.h>
+#include <threading/mutex.h>
+#include <threading/condvar.h>
+#include <fetcher/revocation_cache.h>
+#include <fetcher/revocation_fetcher.h>
+
+/**
+ * Certificate providing nothing but a validity, used as cached response
+ */
+typedef struct {
+	certificate_t public;
+	time_t until;
+	refcount_t ref;
+} fake_cert_t;
+
+METHOD(certificate_t, fake_get_validity, bool,
+	fake_cert_t *this, time_t *when, time_t *not_before, time_t *not_after)
+{
+	if (not_after)
+	{
+		*not_after = this->until;
+	}
+	return time(NULL) <= this->until;
+}
+
+METHOD(certificate_t, fake_get_ref, certificate_t*,
+	fake_cert_t *this)
+{
+	ref_get(&this->ref);
+	return &this->public;
+}
+
+METHOD(certificate_t, fake_destroy, void,
+	fake_cert_t *this)
+{
+	if (ref_put(&this->ref))
+	{
+		free(this);
+	}
+}
+
+/**
+ * Create a fake response valid until now + lifetime
+ */
+static certificate_t *fake_cert_create(int lifetime)
+{
+	fake_cert_t *this;
+
+	INIT(this,
+		.public = {
+			.get_validity = _fake_get_validity,
+			.get_ref = _fake_get_ref,
+			.destroy = _fake_destroy,
+		},
+		.until = time(NULL) + lifetime,
+		.ref = 1,
+	);
+	return &this->public;
+}
+
+/*******************************************************************************
+ * OCSP response cache lookup and prefetch test
+ ******************************************************************************/
+bool test_revocation_cache()
+{
+	revocation_cache_t *cache;
+	certificate_t *cert, *found;
+	chunk_t a = chunk_from_str("a"), b = chunk_from_str("b");
+	char *uri;
+	bool success = FALSE;
+
+	cache = revocation_cache_create(60);
+
+	cert = fake_cert_create(3600);
+	cache->add(cache, a, cert, "http://a");
+	cert->destroy(cert);
+	cert = fake_cert_create(30);
+	cache->add(cache, b, cert, "http://b");
+	cert->destroy(cert);
+
+	/* valid for long, no prefetch */
+	found = cache->get(cache, a, &uri);
+	if (!found || uri)
+	{
+		goto out;
+	}
+	found->destroy(found);
+
+	/* expires within prefetch time, refetch exactly once */
+	found = cache->get(cache, b, &uri);
+	if (!found || !uri || !streq(uri, "http://b"))
+	{
+		goto out;
+	}
+	found->destroy(found);
+	free(uri);
+	found = cache->get(cache, b, &uri);
+	if (!found || uri)
+	{
+		goto out;
+	}
+	found->destroy(found);
+	cache->refreshed(cache, b);
+	found = cache->get(cache, b, &uri);
+	if (!found || !uri)
+	{
+		goto out;
+	}
+	found->destroy(found);
+	free(uri);
+
+	/* replacing a response resets the prefetch state */
+	cert = fake_cert_create(3600);
+	cache->add(cache, b, cert, "http://b");
+	found = cache->get(cache, b, &uri);
+	if (found != cert || uri || cache->get_count(cache) != 2)
+	{
+		DESTROY_IF(found);
+		cert->destroy(cert);
+		goto out;
+	}
+	found->destroy(found);
+	cert->destroy(cert);
+
+	found = cache->get(cache, chunk_from_str("c"), &uri);
+	success = !found && !uri;
+
+out:
+	cache->destroy(cache);
+	return success;
+}
+
+/*******************************************************************************
+ * OCSP response cache expiry and purge test
+ ******************************************************************************/
+bool test_revocation_purge()
+{
+	revocation_cache_t *cache;
+	certificate_t *cert, *found;
+	char key[16], *uri;
+	bool success = FALSE;
+	int i;
+
+	cache = revocation_cache_create(0);
+
+	/* expired responses get removed when looked up */
+	cert = fake_cert_create(-1);
+	cache->add(cache, chunk_from_str("expired"), cert, "http://x");
+	cert->destroy(cert);
+	found = cache->get(cache, chunk_from_str("expired"), &uri);
+	if (found || uri || cache->get_count(cache) != 0)
+	{
+		DESTROY_IF(found);
+		goto out;
+	}
+
+	/* and purged once the cache reaches its limit */
+	for (i = 0; i < 63; i++)
+	{
+		snprintf(key, sizeof(key), "expired-%d", i);
+		cert = fake_cert_create(-1);
+		cache->add(cache, chunk_from_str(key), cert, "http://x");
+		cert->destroy(cert);
+	}
+	if (cache->get_count(cache) != 63)
+	{
+		goto out;
+	}
+	cert = fake_cert_create(3600);
+	cache->add(cache, chunk_from_str("valid"), cert, "http://x");
+	cert->destroy(cert);
+	if (cache->get_count(cache) != 1)
+	{
+		goto out;
+	}
+	found = cache->get(cache, chunk_from_str("valid"), &uri);
+	success = found && !uri;
+	DESTROY_IF(found);
+
+out:
+	cache->destroy(cache);
+	return success;
+}
+
+/**
+ * State shared with the fake fetcher
+ */
+static mutex_t *mutex;
+static condvar_t *condvar;
+static u_int fetches;
+static bool released;
+
+/**
+ * Response returned by the fake fetcher
+ */
+static chunk_t fake_response = chunk_from_chars(0x01,0x02,0x03,0x04);
+
+METHOD(fetcher_t, fake_fetch, status_t,
+	fetcher_t *this, char *uri, void *userdata)
+{
+	chunk_t *result = userdata;
+
+	mutex->lock(mutex);
+	fetches++;
+	condvar->broadcast(condvar);
+	while (!released)
+	{
+		condvar->wait(condvar, mutex);
+	}
+	mutex->unlock(mutex);
+	*result = chunk_clone(fake_response);
+	return SUCCESS;
+}
+
+METHOD(fetcher_t, fake_set_option, bool,
+	fetcher_t *this, fetcher_option_t option, ...)
+{
+	return TRUE;
+}
+
+METHOD(fetcher_t, fake_fetcher_destroy, void,
+	fetcher_t *this)
+{
+	free(this);
+}
+
+/**
+ * Create a fetcher blocking until released
+ */
+static fetcher_t *fake_fetcher_create()
+{
+	fetcher_t *this;
+
+	INIT(this,
+		.fetch = _fake_fetch,
+		.set_option = _fake_set_option,
+		.destroy = _fake_fetcher_destroy,
+	);
+	return this;
+}
+
+/**
+ * Fetch synchronously in a thread
+ */
+static void *do_fetch(revocation_fetcher_t *fetcher)
+{
+	chunk_t response;
+	bool success;
+
+	if (fetcher->fetch(fetcher, "revtest://a", chunk_from_str("key"),
+					   chunk_empty, NULL, &response) != SUCCESS)
+	{
+		return (void*)FALSE;
+	}
+	success = chunk_equals(response, fake_response);
+	free(response.ptr);
+	return (void*)(uintptr_t)success;
+}
+
+/**
+ * Result callback for asynchronous fetches
+ */
+static void fetched(int *result, chunk_t response)
+{
+	mutex->lock(mutex);
+	*result = chunk_equals(response, fake_response) ? 1 : -1;
+	mutex->unlock(mutex);
+}
+
+/*******************************************************************************
+ * Coalescing of concurrent revocation fetches
+ ******************************************************************************/
+bool test_revocation_fetch()
+{
+	revocation_fetcher_t *fetcher;
+	thread_t *first, *second;
+	bool success = TRUE;
+	int result = 0;
+
+	mutex = mutex_create(MUTEX_TYPE_DEFAULT);
+	condvar = condvar_create(CONDVAR_TYPE_DEFAULT);
+	fetches = 0;
+	released = FALSE;
+	lib->fetcher->add_fetcher(lib->fetcher,
+							  (fetcher_constructor_t)fake_fetcher_create,
+							  "revtest://");
+	fetcher = revocation_fetcher_create();
+
+	first = thread_create((thread_main_t)do_fetch, fetcher);
+	mutex->lock(mutex);
+	while (!fetches)
+	{
+		condvar->wait(condvar, mutex);
+	}
+	mutex->unlock(mutex);
+
+	/* join the running fetch, both synchronously and in the background */
+	second = thread_create((thread_main_t)do_fetch, fetcher);
+	fetcher->fetch_async(fetcher, "revtest://a", chunk_from_str("key"),
+						 chunk_empty, NULL, (revocation_fetcher_cb_t)fetched,
+						 &result);
+	usleep(100000);
+
+	mutex->lock(mutex);
+	released = TRUE;
+	condvar->broadcast(condvar);
+	mutex->unlock(mutex);
+
+	success = first->join(first) && success;
+	success = second->join(second) && success;
+	success = success && fetches == 1 && result == 1;
+
+	fetcher->destroy(fetcher);
+	lib->fetcher->remove_fetcher(lib->fetcher,
+								 (fetcher_constructor_t)fake_fetcher_create);
+	condvar->destroy(condvar);
+	mutex->destroy(mutex);
+	return success;
+}
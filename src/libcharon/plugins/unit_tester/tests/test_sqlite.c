@@ -1,4 +1,5 @@
 /*
+ * Copyright (C) 2013 revosec AG
  * Copyright (C) 2008 Martin Willi
  * Hochschule fuer Technik Rapperswil
  *
@@ -18,6 +19,7 @@
 #include <collections/enumerator.h>
 
 #include <unistd.h>
+#include <sys/time.h>
 
 
 #define DBFILE "/tmp/strongswan-test.db"
@@ -91,3 +93,138 @@ bool test_sqlite()
 	return TRUE;
 }
 
+
+#define ROWS 100
+#define QUERIES 50000
+
+/**
+ * Run a query returning rows start, start + 1 and start + 2, but only
+ * enumerate the first one, leaving the statement partially consumed
+ */
+static bool query_partial(database_t *db, u_int start)
+{
+	enumerator_t *e;
+	u_int id;
+	bool good;
+
+	e = db->query(db, "SELECT id FROM test WHERE id >= ? ORDER BY id LIMIT 3",
+				  DB_UINT, start, DB_UINT);
+	if (!e)
+	{
+		return FALSE;
+	}
+	good = e->enumerate(e, &id) && id == start;
+	e->destroy(e);
+	return good;
+}
+
+/**
+ * Run QUERIES queries with the given statement cache size, verifying that
+ * reused statements return the results of their new bindings only.
+ * Returns queries/s, 0 on failure.
+ */
+static u_int run_queries(int cache_size)
+{
+	database_t *db;
+	enumerator_t *outer, *inner;
+	struct timeval start, end;
+	u_int64_t usec;
+	u_int id, value, qps = 0;
+	bool good;
+	int i;
+
+	lib->settings->set_int(lib->settings,
+				"libstrongswan.plugins.sqlite.statement_cache", cache_size);
+	db = lib->db->create(lib->db, "sqlite://" DBFILE);
+	if (!db)
+	{
+		return 0;
+	}
+	if (db->execute(db, NULL, "CREATE TABLE test (id INTEGER PRIMARY KEY, "
+					"value INTEGER)") < 0)
+	{
+		goto out;
+	}
+	for (i = 0; i < ROWS; i++)
+	{
+		if (db->execute(db, NULL, "INSERT INTO test (id, value) VALUES (?, ?)",
+						DB_UINT, i, DB_UINT, i * 2) != 1)
+		{
+			goto out;
+		}
+	}
+
+	time_monotonic(&start);
+	for (i = 0; i < QUERIES; i++)
+	{
+		outer = db->query(db, "SELECT value FROM test WHERE id = ?",
+						  DB_UINT, i % ROWS, DB_UINT);
+		if (!outer)
+		{
+			goto out;
+		}
+		/* exactly one row, with the value of the current binding */
+		good = outer->enumerate(outer, &value) && value == i % ROWS * 2 &&
+			   !outer->enumerate(outer, &value);
+		if (!good)
+		{
+			DBG1(DBG_CFG, "query %d returned wrong result", i);
+			outer->destroy(outer);
+			goto out;
+		}
+		if (i % 100 == 0)
+		{	/* the same statement while the cached one is in use */
+			inner = db->query(db, "SELECT value FROM test WHERE id = ?",
+							  DB_UINT, (i + 1) % ROWS, DB_UINT);
+			if (!inner || !inner->enumerate(inner, &id) ||
+				id != (i + 1) % ROWS * 2 || inner->enumerate(inner, &id))
+			{
+				DBG1(DBG_CFG, "nested query %d returned wrong result", i);
+				DESTROY_IF(inner);
+				outer->destroy(outer);
+				goto out;
+			}
+			inner->destroy(inner);
+		}
+		outer->destroy(outer);
+		if (i % 10 == 0 && !query_partial(db, i % (ROWS - 3)))
+		{	/* a cached statement must not continue where it stopped */
+			DBG1(DBG_CFG, "partial query %d returned wrong result", i);
+			goto out;
+		}
+	}
+	time_monotonic(&end);
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+	qps = QUERIES * 1000000ULL / max(usec, 1);
+
+out:
+	db->execute(db, NULL, "DROP TABLE test");
+	db->destroy(db);
+	unlink(DBFILE);
+	return qps;
+}
+
+/*******************************************************************************
+ * sqlite statement cache benchmark
+ ******************************************************************************/
+bool test_sqlite_cache()
+{
+	u_int uncached, single, cached;
+	int old;
+
+	/* restore the configured value, or the plugin default, when done */
+	old = lib->settings->get_int(lib->settings,
+				"libstrongswan.plugins.sqlite.statement_cache", 32);
+	uncached = run_queries(0);
+	single = run_queries(1);
+	cached = run_queries(32);
+	lib->settings->set_int(lib->settings,
+				"libstrongswan.plugins.sqlite.statement_cache", old);
+
+	DBG1(DBG_CFG, "without statement cache: %u queries/s", uncached);
+	DBG1(DBG_CFG, "with single statement cache: %u queries/s", single);
+	DBG1(DBG_CFG, "with statement cache: %u queries/s", cached);
+
+	return uncached && single && cached;
+}
@@ -128,6 +128,11 @@ struct private_child_sa_t {
 	 */
 	bool trap;
 
+	/**
+	 * TRUE if policies have been installed and have to be removed on destroy
+	 */
+	bool policies_installed;
+
 	/**
 	 * Specifies if UDP encapsulation is enabled (NAT traversal)
 	 */
@@ -738,6 +743,26 @@ static status_t install_policies_internal(private_child_sa_t *this,
 	return status;
 }
 
+/**
+ * Queue 3 policies in a batch: out, in and forward
+ */
+static void queue_policies(private_child_sa_t *this,
+	kernel_ipsec_batch_t *batch, traffic_selector_t *my_ts,
+	traffic_selector_t *other_ts, ipsec_sa_cfg_t *my_sa,
+	ipsec_sa_cfg_t *other_sa, policy_type_t type, policy_priority_t priority)
+{
+	batch->add_policy(batch, this->my_addr, this->other_addr, my_ts, other_ts,
+					  POLICY_OUT, type, other_sa, this->mark_out, priority);
+	batch->add_policy(batch, this->other_addr, this->my_addr, other_ts, my_ts,
+					  POLICY_IN, type, my_sa, this->mark_in, priority);
+	if (this->mode != MODE_TRANSPORT)
+	{
+		batch->add_policy(batch, this->other_addr, this->my_addr, other_ts,
+						  my_ts, POLICY_FWD, type, my_sa, this->mark_in,
+						  priority);
+	}
+}
+
 /**
  * Delete 3 policies: out, in and forward
  */
@@ -783,6 +808,7 @@ METHOD(child_sa_t, add_policies, status_t,
 
 	if (this->config->install_policy(this->config))
 	{
+		kernel_ipsec_batch_t *batch;
 		policy_priority_t priority;
 		ipsec_sa_cfg_t my_sa = {
 			.mode = this->mode,
@@ -816,7 +842,9 @@ METHOD(child_sa_t, add_policies, status_t,
 		priority = this->trap ? POLICY_PRIORITY_ROUTED
 							  : POLICY_PRIORITY_DEFAULT;
 
-		/* enumerate pairs of traffic selectors */
+		/* install the policies of all pairs of traffic selectors at once,
+		 * they get removed again if any of them fails */
+		batch = hydra->kernel_interface->create_batch(hydra->kernel_interface);
 		enumerator = create_policy_enumerator(this);
 		while (enumerator->enumerate(enumerator, &my_ts, &other_ts))
 		{
@@ -824,23 +852,19 @@ METHOD(child_sa_t, add_policies, status_t,
 			 * when updating policies */
 			if (priority == POLICY_PRIORITY_DEFAULT)
 			{
-				status |= install_policies_internal(this, this->my_addr,
-									this->other_addr, my_ts, other_ts,
-									&my_sa, &other_sa, POLICY_DROP,
-									POLICY_PRIORITY_FALLBACK);
+				queue_policies(this, batch, my_ts, other_ts, &my_sa, &other_sa,
+							   POLICY_DROP, POLICY_PRIORITY_FALLBACK);
 			}
 
 			/* install policies */
-			status |= install_policies_internal(this, this->my_addr,
-									this->other_addr, my_ts, other_ts,
-									&my_sa, &other_sa, POLICY_IPSEC, priority);
-
-			if (status != SUCCESS)
-			{
-				break;
-			}
+			queue_policies(this, batch, my_ts, other_ts, &my_sa, &other_sa,
+						   POLICY_IPSEC, priority);
 		}
 		enumerator->destroy(enumerator);
+
+		status = batch->commit(batch);
+		batch->destroy(batch);
+		this->policies_installed = status == SUCCESS;
 	}
 
 	if (status == SUCCESS && this->trap)
@@ -914,7 +938,7 @@ METHOD(child_sa_t, update, status_t,
 		}
 	}
 
-	if (this->config->install_policy(this->config))
+	if (this->policies_installed)
 	{
 		ipsec_sa_cfg_t my_sa = {
 			.mode = this->mode,
@@ -1052,7 +1076,7 @@ METHOD(child_sa_t, destroy, void,
 					this->mark_out);
 	}
 
-	if (this->config->install_policy(this->config))
+	if (this->policies_installed)
 	{
 		/* delete all policies in the kernel */
 		enumerator = create_policy_enumerator(this);
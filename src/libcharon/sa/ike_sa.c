@@ -232,6 +232,11 @@ struct private_ike_sa_t {
 	 */
 	u_int32_t stats[STAT_MAX];
 
+	/**
+	 * Identifiers of scheduled rekeying, reauthentication and delete jobs
+	 */
+	u_int jobs[STAT_MAX];
+
 	/**
 	 * how many times we have retried so far (keyingtries)
 	 */
@@ -622,6 +627,21 @@ METHOD(ike_sa_t, get_state, ike_sa_state_t,
 	return this->state;
 }
 
+/**
+ * Schedule a rekeying, reauthentication or delete job, replacing the job
+ * previously scheduled for the same statistic
+ */
+static void schedule_timeout(private_ike_sa_t *this, statistic_t stat,
+							 job_t *job, u_int32_t t)
+{
+	if (this->jobs[stat])
+	{
+		lib->scheduler->cancel_job(lib->scheduler, this->jobs[stat]);
+	}
+	this->jobs[stat] = lib->scheduler->schedule_job_cancelable(lib->scheduler,
+															   job, t);
+}
+
 METHOD(ike_sa_t, set_state, void,
 	private_ike_sa_t *this, ike_sa_state_t state)
 {
@@ -653,7 +673,7 @@ METHOD(ike_sa_t, set_state, void,
 				{
 					this->stats[STAT_REKEY] = t + this->stats[STAT_ESTABLISHED];
 					job = (job_t*)rekey_ike_sa_job_create(this->ike_sa_id, FALSE);
-					lib->scheduler->schedule_job(lib->scheduler, job, t);
+					schedule_timeout(this, STAT_REKEY, job, t);
 					DBG1(DBG_IKE, "scheduling rekeying in %ds", t);
 				}
 				t = this->peer_cfg->get_reauth_time(this->peer_cfg, TRUE);
@@ -662,7 +682,7 @@ METHOD(ike_sa_t, set_state, void,
 				{
 					this->stats[STAT_REAUTH] = t + this->stats[STAT_ESTABLISHED];
 					job = (job_t*)rekey_ike_sa_job_create(this->ike_sa_id, TRUE);
-					lib->scheduler->schedule_job(lib->scheduler, job, t);
+					schedule_timeout(this, STAT_REAUTH, job, t);
 					DBG1(DBG_IKE, "scheduling reauthentication in %ds", t);
 				}
 				t = this->peer_cfg->get_over_time(this->peer_cfg);
@@ -684,7 +704,7 @@ METHOD(ike_sa_t, set_state, void,
 					this->stats[STAT_DELETE] += t;
 					t = this->stats[STAT_DELETE] - this->stats[STAT_ESTABLISHED];
 					job = (job_t*)delete_ike_sa_job_create(this->ike_sa_id, TRUE);
-					lib->scheduler->schedule_job(lib->scheduler, job, t);
+					schedule_timeout(this, STAT_DELETE, job, t);
 					DBG1(DBG_IKE, "maximum IKE_SA lifetime %ds", t);
 				}
 				trigger_dpd = this->peer_cfg->get_dpd(this->peer_cfg);
@@ -1797,7 +1817,7 @@ METHOD(ike_sa_t, set_auth_lifetime, status_t,
 		{
 			DBG1(DBG_IKE, "received AUTH_LIFETIME of %ds, scheduling "
 				 "reauthentication in %ds", lifetime, lifetime - diff);
-			lib->scheduler->schedule_job(lib->scheduler,
+			schedule_timeout(this, STAT_REAUTH,
 						(job_t*)rekey_ike_sa_job_create(this->ike_sa_id, TRUE),
 						lifetime - diff);
 		}
@@ -2067,9 +2087,9 @@ METHOD(ike_sa_t, inherit, void,
 		this->stats[STAT_DELETE] = this->stats[STAT_REAUTH] + delete;
 		DBG1(DBG_IKE, "rescheduling reauthentication in %ds after rekeying, "
 			 "lifetime reduced to %ds", reauth, delete);
-		lib->scheduler->schedule_job(lib->scheduler,
+		schedule_timeout(this, STAT_REAUTH,
 				(job_t*)rekey_ike_sa_job_create(this->ike_sa_id, TRUE), reauth);
-		lib->scheduler->schedule_job(lib->scheduler,
+		schedule_timeout(this, STAT_DELETE,
 				(job_t*)delete_ike_sa_job_create(this->ike_sa_id, TRUE), delete);
 	}
 }
@@ -2079,12 +2099,22 @@ METHOD(ike_sa_t, destroy, void,
 {
 	attribute_entry_t *entry;
 	host_t *vip;
+	int i;
 
 	charon->bus->set_sa(charon->bus, &this->public);
 
 	set_state(this, IKE_DESTROYING);
 	DESTROY_IF(this->task_manager);
 
+	/* scheduled jobs for this IKE_SA are obsolete */
+	for (i = 0; i < STAT_MAX; i++)
+	{
+		if (this->jobs[i])
+		{
+			lib->scheduler->cancel_job(lib->scheduler, this->jobs[i]);
+		}
+	}
+
 	/* remove attributes first, as we pass the IKE_SA to the handler */
 	while (this->attributes->remove_last(this->attributes,
 										 (void**)&entry) == SUCCESS)
@@ -27,7 +27,6 @@
 #include <threading/mutex.h>
 #include <threading/rwlock.h>
 #include <collections/linked_list.h>
-#include <crypto/hashers/hasher.h>
 
 /* the default size of the hash table (MUST be a power of 2) */
 #define DEFAULT_HASHTABLE_SIZE 1
@@ -83,7 +82,12 @@ struct entry_t {
 	/**
 	 * hash of the IKE_SA_INIT message, used to detect retransmissions
 	 */
-	chunk_t init_hash;
+	u_int64_t init_hash;
+
+	/**
+	 * TRUE if init_hash is set
+	 */
+	bool has_init_hash;
 
 	/**
 	 * remote host address, required for DoS detection and duplicate
@@ -111,8 +115,73 @@ struct entry_t {
 	 * message ID or hash of currently processing message, -1 if none
 	 */
 	u_int32_t processing;
+
+	/**
+	 * keys this entry is registered with in the secondary index, index_key_t
+	 */
+	linked_list_t *index_keys;
+};
+
+typedef struct index_key_t index_key_t;
+
+/**
+ * Type of a key in the secondary index
+ */
+typedef enum {
+	/** unique ID of an IKE_SA */
+	INDEX_UNIQUE_ID,
+	/** reqid of a CHILD_SA */
+	INDEX_REQID,
+	/** name of an IKE_SA, i.e. of its peer config */
+	INDEX_IKE_NAME,
+	/** name of a CHILD_SA */
+	INDEX_CHILD_NAME,
+	/** remote address, port and IKE version of the config of an IKE_SA */
+	INDEX_IKE_CFG,
+} index_type_t;
+
+/**
+ * Key in the secondary index
+ */
+struct index_key_t {
+	/** type of this key */
+	index_type_t type;
+
+	/** key data */
+	chunk_t key;
 };
 
+/**
+ * Create an index key, data gets cloned
+ */
+static index_key_t *index_key_create(index_type_t type, chunk_t key)
+{
+	index_key_t *this;
+
+	INIT(this,
+		.type = type,
+		.key = chunk_clone(key),
+	);
+	return this;
+}
+
+/**
+ * Destroy an index key
+ */
+static void index_key_destroy(index_key_t *this)
+{
+	free(this->key.ptr);
+	free(this);
+}
+
+/**
+ * Compare two index keys
+ */
+static bool index_key_equals(index_key_t *this, index_key_t *other)
+{
+	return this->type == other->type && chunk_equals(this->key, other->key);
+}
+
 /**
  * Implementation of entry_t.destroy.
  */
@@ -121,10 +190,11 @@ static status_t entry_destroy(entry_t *this)
 	/* also destroy IKE SA */
 	this->ike_sa->destroy(this->ike_sa);
 	this->ike_sa_id->destroy(this->ike_sa_id);
-	chunk_free(&this->init_hash);
 	DESTROY_IF(this->other);
 	DESTROY_IF(this->my_id);
 	DESTROY_IF(this->other_id);
+	this->index_keys->destroy_function(this->index_keys,
+									   (void*)index_key_destroy);
 	this->condvar->destroy(this->condvar);
 	free(this);
 	return SUCCESS;
@@ -140,6 +210,7 @@ static entry_t *entry_create()
 	INIT(this,
 		.condvar = condvar_create(CONDVAR_TYPE_DEFAULT),
 		.processing = -1,
+		.index_keys = linked_list_create(),
 	);
 
 	return this;
@@ -250,11 +321,31 @@ static inline bool connected_peers_match(connected_peers_t *connected_peers,
 		   (!family || family == connected_peers->family);
 }
 
+typedef struct index_item_t index_item_t;
+
+/**
+ * IKE_SAs registered with a key in the secondary index
+ */
+struct index_item_t {
+	/** the key */
+	index_key_t *key;
+
+	/** list of ike_sa_id_t objects of IKE_SAs registered with that key */
+	linked_list_t *sas;
+};
+
+static void index_item_destroy(index_item_t *this)
+{
+	index_key_destroy(this->key);
+	this->sas->destroy_offset(this->sas, offsetof(ike_sa_id_t, destroy));
+	free(this);
+}
+
 typedef struct init_hash_t init_hash_t;
 
 struct init_hash_t {
-	/** hash of IKE_SA_INIT or initial phase1 message (data is not cloned) */
-	chunk_t hash;
+	/** keyed hash of IKE_SA_INIT or initial phase1 message */
+	u_int64_t hash;
 
 	/** our SPI allocated for the IKE_SA based on this message */
 	u_int64_t our_spi;
@@ -362,6 +453,17 @@ struct private_ike_sa_manager_t {
 	 */
 	shareable_segment_t *connected_peers_segments;
 
+	/**
+	 * Hash table with index_item_t objects, to look up IKE_SAs by unique ID,
+	 * name, or reqid/name of their CHILD_SAs.
+	 */
+	table_item_t **index_table;
+
+	/**
+	 * Segments of the secondary index hash table.
+	 */
+	shareable_segment_t *index_segments;
+
 	/**
 	 * Hash table with init_hash_t objects.
 	 */
@@ -378,9 +480,9 @@ struct private_ike_sa_manager_t {
 	rng_t *rng;
 
 	/**
-	 * SHA1 hasher for IKE_SA_INIT retransmit detection
+	 * Random key for the keyed hash used for IKE_SA_INIT retransmit detection
 	 */
-	hasher_t *hasher;
+	u_char init_key[CHUNK_MAC_KEY_LEN];
 
 	/**
 	 * reuse existing IKE_SAs in checkout_by_config
@@ -933,6 +1035,266 @@ static void remove_connected_peers(private_ike_sa_manager_t *this, entry_t *entr
 	lock->unlock(lock);
 }
 
+/**
+ * Get the row of a key in the secondary index
+ */
+static inline u_int index_row(private_ike_sa_manager_t *this, index_key_t *key)
+{
+	return chunk_hash_inc(key->key, key->type) & this->table_mask;
+}
+
+/**
+ * Register an IKE_SA with a key in the secondary index.
+ */
+static void put_index(private_ike_sa_manager_t *this, entry_t *entry,
+					  index_key_t *key)
+{
+	table_item_t *item;
+	index_item_t *index = NULL;
+	u_int row, segment;
+	rwlock_t *lock;
+
+	row = index_row(this, key);
+	segment = row & this->segment_mask;
+	lock = this->index_segments[segment].lock;
+	lock->write_lock(lock);
+	item = this->index_table[row];
+	while (item)
+	{
+		index = item->value;
+		if (index_key_equals(index->key, key))
+		{
+			break;
+		}
+		item = item->next;
+	}
+	if (!item)
+	{
+		INIT(index,
+			.key = index_key_create(key->type, key->key),
+			.sas = linked_list_create(),
+		);
+		INIT(item,
+			.value = index,
+			.next = this->index_table[row],
+		);
+		this->index_table[row] = item;
+	}
+	index->sas->insert_last(index->sas,
+							entry->ike_sa_id->clone(entry->ike_sa_id));
+	this->index_segments[segment].count++;
+	lock->unlock(lock);
+}
+
+/**
+ * Unregister an IKE_SA from a key in the secondary index.
+ */
+static void remove_index(private_ike_sa_manager_t *this, entry_t *entry,
+						 index_key_t *key)
+{
+	table_item_t *item, *prev = NULL;
+	u_int row, segment;
+	rwlock_t *lock;
+
+	row = index_row(this, key);
+	segment = row & this->segment_mask;
+	lock = this->index_segments[segment].lock;
+	lock->write_lock(lock);
+	item = this->index_table[row];
+	while (item)
+	{
+		index_item_t *current = item->value;
+
+		if (index_key_equals(current->key, key))
+		{
+			enumerator_t *enumerator;
+			ike_sa_id_t *ike_sa_id;
+
+			enumerator = current->sas->create_enumerator(current->sas);
+			while (enumerator->enumerate(enumerator, &ike_sa_id))
+			{
+				if (entry_match_by_id(entry, ike_sa_id))
+				{
+					current->sas->remove_at(current->sas, enumerator);
+					ike_sa_id->destroy(ike_sa_id);
+					this->index_segments[segment].count--;
+					break;
+				}
+			}
+			enumerator->destroy(enumerator);
+			if (current->sas->get_count(current->sas) == 0)
+			{
+				if (prev)
+				{
+					prev->next = item->next;
+				}
+				else
+				{
+					this->index_table[row] = item->next;
+				}
+				index_item_destroy(current);
+				free(item);
+			}
+			break;
+		}
+		prev = item;
+		item = item->next;
+	}
+	lock->unlock(lock);
+}
+
+/**
+ * Get the IDs of the IKE_SAs registered with a key in the secondary index.
+ *
+ * @return				list of ike_sa_id_t, NULL if none found
+ */
+static linked_list_t *get_index(private_ike_sa_manager_t *this,
+								index_type_t type, chunk_t data)
+{
+	index_key_t key = {
+		.type = type,
+		.key = data,
+	};
+	table_item_t *item;
+	linked_list_t *ids = NULL;
+	u_int row, segment;
+	rwlock_t *lock;
+
+	row = index_row(this, &key);
+	segment = row & this->segment_mask;
+	lock = this->index_segments[segment].lock;
+	lock->read_lock(lock);
+	item = this->index_table[row];
+	while (item)
+	{
+		index_item_t *current = item->value;
+
+		if (index_key_equals(current->key, &key))
+		{
+			ids = current->sas->clone_offset(current->sas,
+											 offsetof(ike_sa_id_t, clone));
+			break;
+		}
+		item = item->next;
+	}
+	lock->unlock(lock);
+	return ids;
+}
+
+/**
+ * Add a key to a list, if it is not already contained
+ */
+static void add_index_key(linked_list_t *keys, index_type_t type, chunk_t data)
+{
+	index_key_t key = {
+		.type = type,
+		.key = data,
+	};
+
+	if (keys->find_first(keys, (linked_list_match_t)index_key_equals,
+						 NULL, &key) != SUCCESS)
+	{
+		keys->insert_last(keys, index_key_create(type, data));
+	}
+}
+
+/**
+ * Build the INDEX_IKE_CFG key of a peer config. It covers only properties
+ * compared by peer_cfg_t.equals()/ike_cfg_t.equals(), equal configs (even
+ * with different names) get the same key.
+ */
+static chunk_t build_cfg_key(peer_cfg_t *peer_cfg, char *buf, size_t len)
+{
+	ike_cfg_t *ike_cfg;
+	bool any;
+
+	ike_cfg = peer_cfg->get_ike_cfg(peer_cfg);
+	snprintf(buf, len, "%d:%s[%u]", peer_cfg->get_ike_version(peer_cfg),
+			 ike_cfg->get_other_addr(ike_cfg, &any),
+			 ike_cfg->get_other_port(ike_cfg));
+	return chunk_from_str(buf);
+}
+
+/**
+ * Update the secondary index with the current unique ID, name and config of
+ * an IKE_SA and the reqids and names of its CHILD_SAs.
+ */
+static void update_index(private_ike_sa_manager_t *this, entry_t *entry)
+{
+	enumerator_t *enumerator;
+	linked_list_t *keys;
+	child_sa_t *child_sa;
+	peer_cfg_t *peer_cfg;
+	index_key_t *key;
+	u_int32_t value;
+	char buf[BUF_LEN];
+
+	keys = linked_list_create();
+	value = entry->ike_sa->get_unique_id(entry->ike_sa);
+	add_index_key(keys, INDEX_UNIQUE_ID, chunk_from_thing(value));
+	add_index_key(keys, INDEX_IKE_NAME,
+				  chunk_from_str(entry->ike_sa->get_name(entry->ike_sa)));
+	peer_cfg = entry->ike_sa->get_peer_cfg(entry->ike_sa);
+	if (peer_cfg)
+	{
+		add_index_key(keys, INDEX_IKE_CFG,
+					  build_cfg_key(peer_cfg, buf, sizeof(buf)));
+	}
+	enumerator = entry->ike_sa->create_child_sa_enumerator(entry->ike_sa);
+	while (enumerator->enumerate(enumerator, &child_sa))
+	{
+		value = child_sa->get_reqid(child_sa);
+		add_index_key(keys, INDEX_REQID, chunk_from_thing(value));
+		add_index_key(keys, INDEX_CHILD_NAME,
+					  chunk_from_str(child_sa->get_name(child_sa)));
+	}
+	enumerator->destroy(enumerator);
+
+	/* remove stale keys, and those that don't have to be added again */
+	enumerator = entry->index_keys->create_enumerator(entry->index_keys);
+	while (enumerator->enumerate(enumerator, &key))
+	{
+		index_key_t *current;
+
+		if (keys->find_first(keys, (linked_list_match_t)index_key_equals,
+							 (void**)&current, key) == SUCCESS)
+		{
+			keys->remove(keys, current, NULL);
+			index_key_destroy(current);
+		}
+		else
+		{
+			remove_index(this, entry, key);
+			entry->index_keys->remove_at(entry->index_keys, enumerator);
+			index_key_destroy(key);
+		}
+	}
+	enumerator->destroy(enumerator);
+
+	/* register new keys */
+	while (keys->remove_first(keys, (void**)&key) == SUCCESS)
+	{
+		put_index(this, entry, key);
+		entry->index_keys->insert_last(entry->index_keys, key);
+	}
+	keys->destroy(keys);
+}
+
+/**
+ * Remove an IKE_SA from the secondary index.
+ */
+static void remove_all_index(private_ike_sa_manager_t *this, entry_t *entry)
+{
+	index_key_t *key;
+
+	while (entry->index_keys->remove_first(entry->index_keys,
+										   (void**)&key) == SUCCESS)
+	{
+		remove_index(this, entry, key);
+		index_key_destroy(key);
+	}
+}
+
 /**
  * Get a random SPI for new IKE_SAs
  */
@@ -949,60 +1311,47 @@ static u_int64_t get_spi(private_ike_sa_manager_t *this)
 }
 
 /**
- * Calculate the hash of the initial IKE message.  Memory for the hash is
- * allocated on success.
+ * Calculate the keyed hash of the initial IKE message.
  *
  * @returns TRUE on success
  */
 static bool get_init_hash(private_ike_sa_manager_t *this, message_t *message,
-						  chunk_t *hash)
+						  u_int64_t *hash)
 {
 	host_t *src;
+	u_int16_t port;
+	u_int64_t spi;
 
-	if (!this->hasher)
+	if (!this->rng)
 	{	/* this might be the case when flush() has been called */
 		return FALSE;
 	}
+	src = message->get_source(message);
 	if (message->get_first_payload_type(message) == FRAGMENT_V1)
 	{	/* only hash the source IP, port and SPI for fragmented init messages */
-		u_int16_t port;
-		u_int64_t spi;
-
-		src = message->get_source(message);
-		if (!this->hasher->allocate_hash(this->hasher,
-										 src->get_address(src), NULL))
-		{
-			return FALSE;
-		}
 		port = src->get_port(src);
-		if (!this->hasher->allocate_hash(this->hasher,
-										 chunk_from_thing(port), NULL))
-		{
-			return FALSE;
-		}
 		spi = message->get_initiator_spi(message);
-		return this->hasher->allocate_hash(this->hasher,
-										   chunk_from_thing(spi), hash);
+		*hash = chunk_mac(src->get_address(src), this->init_key);
+		*hash = chunk_mac_inc(chunk_from_thing(port), this->init_key, *hash);
+		*hash = chunk_mac_inc(chunk_from_thing(spi), this->init_key, *hash);
+		return TRUE;
 	}
 	if (message->get_exchange_type(message) == ID_PROT)
 	{	/* include the source for Main Mode as the hash will be the same if
 		 * SPIs are reused by two initiators that use the same proposal */
-		src = message->get_source(message);
-
-		if (!this->hasher->allocate_hash(this->hasher,
-										 src->get_address(src), NULL))
-		{
-			return FALSE;
-		}
+		*hash = chunk_mac(src->get_address(src), this->init_key);
+		*hash = chunk_mac_inc(message->get_packet_data(message),
+							  this->init_key, *hash);
+		return TRUE;
 	}
-	return this->hasher->allocate_hash(this->hasher,
-									   message->get_packet_data(message), hash);
+	*hash = chunk_mac(message->get_packet_data(message), this->init_key);
+	return TRUE;
 }
 
 /**
  * Check if we already have created an IKE_SA based on the initial IKE message
  * with the given hash.
- * If not the hash is stored, the hash data is not(!) cloned.
+ * If not the hash is stored.
  *
  * Also, the local SPI is returned.  In case of a retransmit this is already
  * stored together with the hash, otherwise it is newly allocated and should
@@ -1013,7 +1362,7 @@ static bool get_init_hash(private_ike_sa_manager_t *this, message_t *message,
  *			FAILED if the SPI allocation failed
  */
 static status_t check_and_put_init_hash(private_ike_sa_manager_t *this,
-										chunk_t init_hash, u_int64_t *our_spi)
+										u_int64_t init_hash, u_int64_t *our_spi)
 {
 	table_item_t *item;
 	u_int row, segment;
@@ -1021,7 +1370,8 @@ static status_t check_and_put_init_hash(private_ike_sa_manager_t *this,
 	init_hash_t *init;
 	u_int64_t spi;
 
-	row = chunk_hash(init_hash) & this->table_mask;
+	/* the keyed hash is uniformly distributed, use it directly */
+	row = init_hash & this->table_mask;
 	segment = row & this->segment_mask;
 	mutex = this->init_hashes_segments[segment].mutex;
 	mutex->lock(mutex);
@@ -1030,7 +1380,7 @@ static status_t check_and_put_init_hash(private_ike_sa_manager_t *this,
 	{
 		init_hash_t *current = item->value;
 
-		if (chunk_equals(init_hash, current->hash))
+		if (init_hash == current->hash)
 		{
 			*our_spi = current->our_spi;
 			mutex->unlock(mutex);
@@ -1042,14 +1392,12 @@ static status_t check_and_put_init_hash(private_ike_sa_manager_t *this,
 	spi = get_spi(this);
 	if (!spi)
 	{
+		mutex->unlock(mutex);
 		return FAILED;
 	}
 
 	INIT(init,
-		.hash = {
-			.len = init_hash.len,
-			.ptr = init_hash.ptr,
-		},
+		.hash = init_hash,
 		.our_spi = spi,
 	);
 	INIT(item,
@@ -1065,13 +1413,13 @@ static status_t check_and_put_init_hash(private_ike_sa_manager_t *this,
 /**
  * Remove the hash of an initial IKE message from the cache.
  */
-static void remove_init_hash(private_ike_sa_manager_t *this, chunk_t init_hash)
+static void remove_init_hash(private_ike_sa_manager_t *this, u_int64_t init_hash)
 {
 	table_item_t *item, *prev = NULL;
 	u_int row, segment;
 	mutex_t *mutex;
 
-	row = chunk_hash(init_hash) & this->table_mask;
+	row = init_hash & this->table_mask;
 	segment = row & this->segment_mask;
 	mutex = this->init_hashes_segments[segment].mutex;
 	mutex->lock(mutex);
@@ -1080,7 +1428,7 @@ static void remove_init_hash(private_ike_sa_manager_t *this, chunk_t init_hash)
 	{
 		init_hash_t *current = item->value;
 
-		if (chunk_equals(init_hash, current->hash))
+		if (init_hash == current->hash)
 		{
 			if (prev)
 			{
@@ -1219,8 +1567,7 @@ METHOD(ike_sa_manager_t, checkout_by_message, ike_sa_t*,
 
 	if (is_init)
 	{
-		u_int64_t our_spi;
-		chunk_t hash;
+		u_int64_t our_spi, hash;
 
 		if (!get_init_hash(this, message, &hash))
 		{
@@ -1251,6 +1598,7 @@ METHOD(ike_sa_manager_t, checkout_by_message, ike_sa_t*,
 
 						entry->processing = get_message_id_or_hash(message);
 						entry->init_hash = hash;
+						entry->has_init_hash = TRUE;
 
 						DBG2(DBG_MGR, "created IKE_SA %s[%u]",
 							 ike_sa->get_name(ike_sa),
@@ -1271,13 +1619,11 @@ METHOD(ike_sa_manager_t, checkout_by_message, ike_sa_t*,
 						 this->ikesa_limit);
 				}
 				remove_init_hash(this, hash);
-				chunk_free(&hash);
 				id->destroy(id);
 				return NULL;
 			}
 			case FAILED:
 			{	/* we failed to allocate an SPI */
-				chunk_free(&hash);
 				id->destroy(id);
 				DBG1(DBG_MGR, "ignoring message, failed to allocate SPI");
 				return NULL;
@@ -1288,7 +1634,6 @@ METHOD(ike_sa_manager_t, checkout_by_message, ike_sa_t*,
 		}
 		/* it looks like we already handled this init message to some degree */
 		id->set_responder_spi(id, our_spi);
-		chunk_free(&hash);
 	}
 
 	if (get_entry_by_id(this, id, &entry, &segment) == SUCCESS)
@@ -1328,15 +1673,71 @@ METHOD(ike_sa_manager_t, checkout_by_message, ike_sa_t*,
 	return ike_sa;
 }
 
-METHOD(ike_sa_manager_t, checkout_by_config, ike_sa_t*,
-	private_ike_sa_manager_t *this, peer_cfg_t *peer_cfg)
+/**
+ * Check out the first IKE_SA registered with a key in the secondary index
+ * that satisfies the given match function. Only the entries of registered
+ * IKE_SAs are waited for.
+ */
+static ike_sa_t *checkout_by_index(private_ike_sa_manager_t *this,
+								   index_type_t type, chunk_t key,
+								   bool (*match)(ike_sa_t*, void*), void *data)
 {
-	enumerator_t *enumerator;
-	entry_t *entry;
+	linked_list_t *ids;
+	ike_sa_id_t *id;
 	ike_sa_t *ike_sa = NULL;
+	entry_t *entry;
+	u_int segment;
+
+	ids = get_index(this, type, key);
+	if (!ids)
+	{
+		return NULL;
+	}
+	while (!ike_sa && ids->remove_first(ids, (void**)&id) == SUCCESS)
+	{
+		if (get_entry_by_id(this, id, &entry, &segment) == SUCCESS)
+		{
+			if (wait_for_entry(this, entry, segment) &&
+				match(entry->ike_sa, data))
+			{
+				entry->checked_out = TRUE;
+				ike_sa = entry->ike_sa;
+			}
+			unlock_single_segment(this, segment);
+		}
+		id->destroy(id);
+	}
+	ids->destroy_offset(ids, offsetof(ike_sa_id_t, destroy));
+	return ike_sa;
+}
+
+/**
+ * Check if an IKE_SA uses the given peer config and is usable
+ */
+static bool match_config(ike_sa_t *ike_sa, peer_cfg_t *peer_cfg)
+{
 	peer_cfg_t *current_peer;
 	ike_cfg_t *current_ike;
-	u_int segment;
+
+	if (ike_sa->get_state(ike_sa) == IKE_DELETING)
+	{	/* skip IKE_SAs which are not usable */
+		return FALSE;
+	}
+	current_peer = ike_sa->get_peer_cfg(ike_sa);
+	if (current_peer && current_peer->equals(current_peer, peer_cfg))
+	{
+		current_ike = current_peer->get_ike_cfg(current_peer);
+		return current_ike->equals(current_ike,
+								   peer_cfg->get_ike_cfg(peer_cfg));
+	}
+	return FALSE;
+}
+
+METHOD(ike_sa_manager_t, checkout_by_config, ike_sa_t*,
+	private_ike_sa_manager_t *this, peer_cfg_t *peer_cfg)
+{
+	ike_sa_t *ike_sa = NULL;
+	char buf[BUF_LEN];
 
 	DBG2(DBG_MGR, "checkout IKE_SA by config");
 
@@ -1347,36 +1748,17 @@ METHOD(ike_sa_manager_t, checkout_by_config, ike_sa_t*,
 		return ike_sa;
 	}
 
-	enumerator = create_table_enumerator(this);
-	while (enumerator->enumerate(enumerator, &entry, &segment))
+	/* IKE_SAs are registered with a key built from properties of their
+	 * config, which also matches equal configs with a different name */
+	ike_sa = checkout_by_index(this, INDEX_IKE_CFG,
+							   build_cfg_key(peer_cfg, buf, sizeof(buf)),
+							   (void*)match_config, peer_cfg);
+	if (ike_sa)
 	{
-		if (!wait_for_entry(this, entry, segment))
-		{
-			continue;
-		}
-		if (entry->ike_sa->get_state(entry->ike_sa) == IKE_DELETING)
-		{	/* skip IKE_SAs which are not usable */
-			continue;
-		}
-
-		current_peer = entry->ike_sa->get_peer_cfg(entry->ike_sa);
-		if (current_peer && current_peer->equals(current_peer, peer_cfg))
-		{
-			current_ike = current_peer->get_ike_cfg(current_peer);
-			if (current_ike->equals(current_ike, peer_cfg->get_ike_cfg(peer_cfg)))
-			{
-				entry->checked_out = TRUE;
-				ike_sa = entry->ike_sa;
-				DBG2(DBG_MGR, "found existing IKE_SA %u with a '%s' config",
-						ike_sa->get_unique_id(ike_sa),
-						current_peer->get_name(current_peer));
-				break;
-			}
-		}
+		DBG2(DBG_MGR, "found existing IKE_SA %u with a '%s' config",
+			 ike_sa->get_unique_id(ike_sa), ike_sa->get_name(ike_sa));
 	}
-	enumerator->destroy(enumerator);
-
-	if (!ike_sa)
+	else
 	{	/* no IKE_SA using such a config, hand out a new */
 		ike_sa = checkout_new(this, peer_cfg->get_ike_version(peer_cfg), TRUE);
 	}
@@ -1384,106 +1766,102 @@ METHOD(ike_sa_manager_t, checkout_by_config, ike_sa_t*,
 	return ike_sa;
 }
 
-METHOD(ike_sa_manager_t, checkout_by_id, ike_sa_t*,
-	private_ike_sa_manager_t *this, u_int32_t id, bool child)
+/**
+ * Check if an IKE_SA has the given unique ID
+ */
+static bool match_unique_id(ike_sa_t *ike_sa, u_int32_t *id)
 {
-	enumerator_t *enumerator, *children;
-	entry_t *entry;
-	ike_sa_t *ike_sa = NULL;
-	child_sa_t *child_sa;
-	u_int segment;
+	return ike_sa->get_unique_id(ike_sa) == *id;
+}
 
-	DBG2(DBG_MGR, "checkout IKE_SA by ID");
+/**
+ * Check if an IKE_SA has a CHILD_SA with the given reqid
+ */
+static bool match_reqid(ike_sa_t *ike_sa, u_int32_t *reqid)
+{
+	enumerator_t *enumerator;
+	child_sa_t *child_sa;
+	bool found = FALSE;
 
-	enumerator = create_table_enumerator(this);
-	while (enumerator->enumerate(enumerator, &entry, &segment))
+	enumerator = ike_sa->create_child_sa_enumerator(ike_sa);
+	while (enumerator->enumerate(enumerator, (void**)&child_sa))
 	{
-		if (wait_for_entry(this, entry, segment))
+		if (child_sa->get_reqid(child_sa) == *reqid)
 		{
-			/* look for a child with such a reqid ... */
-			if (child)
-			{
-				children = entry->ike_sa->create_child_sa_enumerator(entry->ike_sa);
-				while (children->enumerate(children, (void**)&child_sa))
-				{
-					if (child_sa->get_reqid(child_sa) == id)
-					{
-						ike_sa = entry->ike_sa;
-						break;
-					}
-				}
-				children->destroy(children);
-			}
-			else /* ... or for a IKE_SA with such a unique id */
-			{
-				if (entry->ike_sa->get_unique_id(entry->ike_sa) == id)
-				{
-					ike_sa = entry->ike_sa;
-				}
-			}
-			/* got one, return */
-			if (ike_sa)
-			{
-				entry->checked_out = TRUE;
-				DBG2(DBG_MGR, "IKE_SA %s[%u] successfully checked out",
-						ike_sa->get_name(ike_sa), ike_sa->get_unique_id(ike_sa));
-				break;
-			}
+			found = TRUE;
+			break;
 		}
 	}
 	enumerator->destroy(enumerator);
+	return found;
+}
+
+METHOD(ike_sa_manager_t, checkout_by_id, ike_sa_t*,
+	private_ike_sa_manager_t *this, u_int32_t id, bool child)
+{
+	ike_sa_t *ike_sa;
+
+	DBG2(DBG_MGR, "checkout IKE_SA by ID");
 
+	/* look for a child with such a reqid, or for an IKE_SA with such a
+	 * unique id */
+	ike_sa = checkout_by_index(this, child ? INDEX_REQID : INDEX_UNIQUE_ID,
+					chunk_from_thing(id),
+					child ? (void*)match_reqid : (void*)match_unique_id, &id);
+	if (ike_sa)
+	{
+		DBG2(DBG_MGR, "IKE_SA %s[%u] successfully checked out",
+			 ike_sa->get_name(ike_sa), ike_sa->get_unique_id(ike_sa));
+	}
 	charon->bus->set_sa(charon->bus, ike_sa);
 	return ike_sa;
 }
 
-METHOD(ike_sa_manager_t, checkout_by_name, ike_sa_t*,
-	private_ike_sa_manager_t *this, char *name, bool child)
+/**
+ * Check if an IKE_SA has the given name
+ */
+static bool match_name(ike_sa_t *ike_sa, char *name)
 {
-	enumerator_t *enumerator, *children;
-	entry_t *entry;
-	ike_sa_t *ike_sa = NULL;
+	return streq(ike_sa->get_name(ike_sa), name);
+}
+
+/**
+ * Check if an IKE_SA has a CHILD_SA with the given name
+ */
+static bool match_child_name(ike_sa_t *ike_sa, char *name)
+{
+	enumerator_t *enumerator;
 	child_sa_t *child_sa;
-	u_int segment;
+	bool found = FALSE;
 
-	enumerator = create_table_enumerator(this);
-	while (enumerator->enumerate(enumerator, &entry, &segment))
+	enumerator = ike_sa->create_child_sa_enumerator(ike_sa);
+	while (enumerator->enumerate(enumerator, (void**)&child_sa))
 	{
-		if (wait_for_entry(this, entry, segment))
+		if (streq(child_sa->get_name(child_sa), name))
 		{
-			/* look for a child with such a policy name ... */
-			if (child)
-			{
-				children = entry->ike_sa->create_child_sa_enumerator(entry->ike_sa);
-				while (children->enumerate(children, (void**)&child_sa))
-				{
-					if (streq(child_sa->get_name(child_sa), name))
-					{
-						ike_sa = entry->ike_sa;
-						break;
-					}
-				}
-				children->destroy(children);
-			}
-			else /* ... or for a IKE_SA with such a connection name */
-			{
-				if (streq(entry->ike_sa->get_name(entry->ike_sa), name))
-				{
-					ike_sa = entry->ike_sa;
-				}
-			}
-			/* got one, return */
-			if (ike_sa)
-			{
-				entry->checked_out = TRUE;
-				DBG2(DBG_MGR, "IKE_SA %s[%u] successfully checked out",
-						ike_sa->get_name(ike_sa), ike_sa->get_unique_id(ike_sa));
-				break;
-			}
+			found = TRUE;
+			break;
 		}
 	}
 	enumerator->destroy(enumerator);
+	return found;
+}
+
+METHOD(ike_sa_manager_t, checkout_by_name, ike_sa_t*,
+	private_ike_sa_manager_t *this, char *name, bool child)
+{
+	ike_sa_t *ike_sa;
 
+	/* look for a child with such a policy name, or for an IKE_SA with such a
+	 * connection name */
+	ike_sa = checkout_by_index(this, child ? INDEX_CHILD_NAME : INDEX_IKE_NAME,
+					chunk_from_str(name),
+					child ? (void*)match_child_name : (void*)match_name, name);
+	if (ike_sa)
+	{
+		DBG2(DBG_MGR, "IKE_SA %s[%u] successfully checked out",
+			 ike_sa->get_name(ike_sa), ike_sa->get_unique_id(ike_sa));
+	}
 	charon->bus->set_sa(charon->bus, ike_sa);
 	return ike_sa;
 }
@@ -1627,6 +2005,8 @@ METHOD(ike_sa_manager_t, checkin, void,
 		put_connected_peers(this, entry);
 	}
 
+	update_index(this, entry);
+
 	unlock_single_segment(this, segment);
 
 	charon->bus->set_sa(charon->bus, NULL);
@@ -1684,10 +2064,11 @@ METHOD(ike_sa_manager_t, checkin_and_destroy, void,
 		{
 			remove_connected_peers(this, entry);
 		}
-		if (entry->init_hash.ptr)
+		if (entry->has_init_hash)
 		{
 			remove_init_hash(this, entry->init_hash);
 		}
+		remove_all_index(this, entry);
 
 		entry_destroy(entry);
 
@@ -2012,10 +2393,11 @@ METHOD(ike_sa_manager_t, flush, void,
 		{
 			remove_connected_peers(this, entry);
 		}
-		if (entry->init_hash.ptr)
+		if (entry->has_init_hash)
 		{
 			remove_init_hash(this, entry->init_hash);
 		}
+		remove_all_index(this, entry);
 		remove_entry_at((private_enumerator_t*)enumerator);
 		entry_destroy(entry);
 	}
@@ -2025,8 +2407,6 @@ METHOD(ike_sa_manager_t, flush, void,
 
 	this->rng->destroy(this->rng);
 	this->rng = NULL;
-	this->hasher->destroy(this->hasher);
-	this->hasher = NULL;
 }
 
 METHOD(ike_sa_manager_t, destroy, void,
@@ -2039,17 +2419,20 @@ METHOD(ike_sa_manager_t, destroy, void,
 	free(this->half_open_table);
 	free(this->connected_peers_table);
 	free(this->init_hashes_table);
+	free(this->index_table);
 	for (i = 0; i < this->segment_count; i++)
 	{
 		this->segments[i].mutex->destroy(this->segments[i].mutex);
 		this->half_open_segments[i].lock->destroy(this->half_open_segments[i].lock);
 		this->connected_peers_segments[i].lock->destroy(this->connected_peers_segments[i].lock);
 		this->init_hashes_segments[i].mutex->destroy(this->init_hashes_segments[i].mutex);
+		this->index_segments[i].lock->destroy(this->index_segments[i].lock);
 	}
 	free(this->segments);
 	free(this->half_open_segments);
 	free(this->connected_peers_segments);
 	free(this->init_hashes_segments);
+	free(this->index_segments);
 
 	free(this);
 }
@@ -2101,18 +2484,18 @@ ike_sa_manager_t *ike_sa_manager_create()
 		},
 	);
 
-	this->hasher = lib->crypto->create_hasher(lib->crypto, HASH_PREFERRED);
-	if (this->hasher == NULL)
+	this->rng = lib->crypto->create_rng(lib->crypto, RNG_WEAK);
+	if (this->rng == NULL)
 	{
-		DBG1(DBG_MGR, "manager initialization failed, no hasher supported");
+		DBG1(DBG_MGR, "manager initialization failed, no RNG supported");
 		free(this);
 		return NULL;
 	}
-	this->rng = lib->crypto->create_rng(lib->crypto, RNG_WEAK);
-	if (this->rng == NULL)
+	if (!this->rng->get_bytes(this->rng, sizeof(this->init_key),
+							  this->init_key))
 	{
-		DBG1(DBG_MGR, "manager initialization failed, no RNG supported");
-		this->hasher->destroy(this->hasher);
+		DBG1(DBG_MGR, "manager initialization failed, no hash key available");
+		this->rng->destroy(this->rng);
 		free(this);
 		return NULL;
 	}
@@ -2167,6 +2550,15 @@ ike_sa_manager_t *ike_sa_manager_create()
 		this->init_hashes_segments[i].count = 0;
 	}
 
+	/* and for the secondary index */
+	this->index_table = calloc(this->table_size, sizeof(table_item_t*));
+	this->index_segments = calloc(this->segment_count, sizeof(shareable_segment_t));
+	for (i = 0; i < this->segment_count; i++)
+	{
+		this->index_segments[i].lock = rwlock_create(RWLOCK_TYPE_DEFAULT);
+		this->index_segments[i].count = 0;
+	}
+
 	this->reuse_ikesa = lib->settings->get_bool(lib->settings,
 										"%s.reuse_ikesa", TRUE, charon->name);
 	return &this->public;
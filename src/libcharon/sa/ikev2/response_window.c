@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "response_window.h"
+
+#include <collections/linked_list.h>
+
+typedef struct private_response_window_t private_response_window_t;
+
+/**
+ * A request we answered
+ */
+typedef struct {
+
+	/**
+	 * Message ID of the request
+	 */
+	u_int32_t mid;
+
+	/**
+	 * Sent response, if any
+	 */
+	packet_t *packet;
+} response_t;
+
+/**
+ * Private data of an response_window_t object.
+ */
+struct private_response_window_t {
+
+	/**
+	 * Public response_window_t interface.
+	 */
+	response_window_t public;
+
+	/**
+	 * Number of concurrent requests we accept
+	 */
+	u_int32_t size;
+
+	/**
+	 * Lowest message ID of a request we have not answered yet
+	 */
+	u_int32_t lowest;
+
+	/**
+	 * Answered requests, response_t
+	 */
+	linked_list_t *responses;
+};
+
+/**
+ * Destroy a response entry
+ */
+static void response_destroy(response_t *response)
+{
+	DESTROY_IF(response->packet);
+	free(response);
+}
+
+/**
+ * Find an answered request by message ID
+ */
+static response_t *find_response(private_response_window_t *this,
+								 u_int32_t mid)
+{
+	enumerator_t *enumerator;
+	response_t *current, *found = NULL;
+
+	enumerator = this->responses->create_enumerator(this->responses);
+	while (enumerator->enumerate(enumerator, &current))
+	{
+		if (current->mid == mid)
+		{
+			found = current;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+	return found;
+}
+
+METHOD(response_window_t, get_lowest, u_int32_t,
+	private_response_window_t *this)
+{
+	return this->lowest;
+}
+
+METHOD(response_window_t, is_new, bool,
+	private_response_window_t *this, u_int32_t mid)
+{
+	if (mid < this->lowest || mid - this->lowest >= this->size)
+	{
+		return FALSE;
+	}
+	return find_response(this, mid) == NULL;
+}
+
+METHOD(response_window_t, answer, void,
+	private_response_window_t *this, u_int32_t mid, packet_t *packet)
+{
+	enumerator_t *enumerator;
+	response_t *response;
+
+	response = find_response(this, mid);
+	if (response)
+	{	/* answered again, e.g. with an error notify, keep the latest */
+		DESTROY_IF(response->packet);
+		response->packet = packet;
+	}
+	else
+	{
+		INIT(response,
+			.mid = mid,
+			.packet = packet,
+		);
+		this->responses->insert_last(this->responses, response);
+	}
+
+	/* requests might have been answered out of order */
+	while (find_response(this, this->lowest))
+	{
+		this->lowest++;
+	}
+	/* the peer only retransmits requests within its window, it has received
+	 * the responses to anything older */
+	enumerator = this->responses->create_enumerator(this->responses);
+	while (enumerator->enumerate(enumerator, &response))
+	{
+		if (response->mid < this->lowest &&
+			this->lowest - response->mid > this->size)
+		{
+			this->responses->remove_at(this->responses, enumerator);
+			response_destroy(response);
+		}
+	}
+	enumerator->destroy(enumerator);
+}
+
+METHOD(response_window_t, get_response, bool,
+	private_response_window_t *this, u_int32_t mid, packet_t **packet)
+{
+	response_t *response;
+
+	response = find_response(this, mid);
+	if (response)
+	{
+		*packet = response->packet;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+METHOD(response_window_t, reset, void,
+	private_response_window_t *this, u_int32_t mid)
+{
+	response_t *response;
+
+	while (this->responses->remove_last(this->responses,
+										(void**)&response) == SUCCESS)
+	{
+		response_destroy(response);
+	}
+	this->lowest = mid;
+}
+
+METHOD(response_window_t, destroy, void,
+	private_response_window_t *this)
+{
+	this->responses->destroy_function(this->responses,
+									  (void*)response_destroy);
+	free(this);
+}
+
+/**
+ * See header
+ */
+response_window_t *response_window_create(u_int32_t size)
+{
+	private_response_window_t *this;
+
+	INIT(this,
+		.public = {
+			.get_lowest = _get_lowest,
+			.is_new = _is_new,
+			.answer = _answer,
+			.get_response = _get_response,
+			.reset = _reset,
+			.destroy = _destroy,
+		},
+		.size = max(size, 1),
+		.responses = linked_list_create(),
+	);
+
+	return &this->public;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup response_window response_window
+ * @{ @ingroup ikev2
+ */
+
+#ifndef RESPONSE_WINDOW_H_
+#define RESPONSE_WINDOW_H_
+
+typedef struct response_window_t response_window_t;
+
+#include <library.h>
+#include <networking/packet.h>
+
+/**
+ * Tracks the requests we answer as responder within our window.
+ *
+ * With a window size greater than one, the peer may send requests before
+ * it received the responses to previous ones, and we might answer them
+ * out of order. The window keeps the lowest message ID not answered yet and
+ * caches sent responses until the peer can't retransmit the requests anymore.
+ */
+struct response_window_t {
+
+	/**
+	 * Get the lowest message ID of a request we have not answered yet.
+	 *
+	 * @return				lowest unanswered message ID
+	 */
+	u_int32_t (*get_lowest)(response_window_t *this);
+
+	/**
+	 * Check if a request is not yet answered and within the window.
+	 *
+	 * @param mid			message ID of the request
+	 * @return				TRUE if the request may be processed
+	 */
+	bool (*is_new)(response_window_t *this, u_int32_t mid);
+
+	/**
+	 * Register a request as answered and cache the response.
+	 *
+	 * @param mid			message ID of the request
+	 * @param packet		response to cache, NULL for none, gets owned
+	 */
+	void (*answer)(response_window_t *this, u_int32_t mid, packet_t *packet);
+
+	/**
+	 * Get the cached response to a request.
+	 *
+	 * @param mid			message ID of the request
+	 * @param packet		cached response, internal data, may be NULL
+	 * @return				TRUE if the request has been answered and the
+	 *						response is still known
+	 */
+	bool (*get_response)(response_window_t *this, u_int32_t mid,
+						 packet_t **packet);
+
+	/**
+	 * Drop all cached responses and restart at a message ID.
+	 *
+	 * @param mid			message ID of the next request to expect
+	 */
+	void (*reset)(response_window_t *this, u_int32_t mid);
+
+	/**
+	 * Destroy a response_window_t.
+	 */
+	void (*destroy)(response_window_t *this);
+};
+
+/**
+ * Create a response_window_t instance.
+ *
+ * @param size			number of concurrent requests we accept
+ * @return				response window, expecting message ID 0
+ */
+response_window_t *response_window_create(u_int32_t size);
+
+#endif /** RESPONSE_WINDOW_H_ @}*/
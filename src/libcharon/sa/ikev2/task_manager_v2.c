@@ -15,6 +15,7 @@
  */
 
 #include "task_manager_v2.h"
+#include "response_window.h"
 
 #include <math.h>
 
@@ -44,6 +45,11 @@
 #include <sa/ikev2/tasks/ike_me.h>
 #endif
 
+/**
+ * Default number of concurrent requests we process as responder
+ */
+#define WINDOW_SIZE 1
+
 typedef struct exchange_t exchange_t;
 
 /**
@@ -56,10 +62,30 @@ struct exchange_t {
 	 */
 	u_int32_t mid;
 
+	/**
+	 * type of the exchange
+	 */
+	exchange_type_t type;
+
+	/**
+	 * how many times we have retransmitted so far (initiator only)
+	 */
+	u_int retransmitted;
+
 	/**
 	 * generated packet for retransmission
 	 */
 	packet_t *packet;
+
+	/**
+	 * active tasks handled in this exchange, task_t (initiator only)
+	 */
+	linked_list_t *tasks;
+
+	/**
+	 * TRUE if other exchanges may be initiated while this one is in the air
+	 */
+	bool concurrent;
 };
 
 typedef struct private_task_manager_t private_task_manager_t;
@@ -80,44 +106,28 @@ struct private_task_manager_t {
 	ike_sa_t *ike_sa;
 
 	/**
-	 * Exchange we are currently handling as responder
+	 * Requests we answer as responder, with responses for retransmission
 	 */
-	struct {
-		/**
-		 * Message ID of the exchange
-		 */
-		u_int32_t mid;
-
-		/**
-		 * packet for retransmission
-		 */
-		packet_t *packet;
-
-	} responding;
+	response_window_t *responding;
 
 	/**
-	 * Exchange we are currently handling as initiator
+	 * Exchanges we are currently handling as initiator
 	 */
 	struct {
 		/**
-		 * Message ID of the exchange
+		 * Message ID of the next exchange we initiate
 		 */
 		u_int32_t mid;
 
 		/**
-		 * how many times we have retransmitted so far
-		 */
-		u_int retransmitted;
-
-		/**
-		 * packet for retransmission
+		 * exchanges in the air, ordered by message ID, exchange_t
 		 */
-		packet_t *packet;
+		linked_list_t *exchanges;
 
 		/**
-		 * type of the initated exchange
+		 * number of concurrent requests the peer accepts (SET_WINDOW_SIZE)
 		 */
-		exchange_type_t type;
+		u_int32_t window;
 
 	} initiating;
 
@@ -141,6 +151,11 @@ struct private_task_manager_t {
 	 */
 	bool reset;
 
+	/**
+	 * Number of concurrent requests we accept as responder
+	 */
+	u_int32_t window;
+
 	/**
 	 * Number of times we retransmit messages before giving up
 	 */
@@ -157,6 +172,51 @@ struct private_task_manager_t {
 	double retransmit_base;
 };
 
+/**
+ * Destroy an exchange, but not the tasks it references
+ */
+static void exchange_destroy(exchange_t *exchange)
+{
+	DESTROY_IF(exchange->packet);
+	DESTROY_IF(exchange->tasks);
+	free(exchange);
+}
+
+/**
+ * Find an exchange by message ID in the given list
+ */
+static exchange_t *find_exchange(linked_list_t *list, u_int32_t mid)
+{
+	enumerator_t *enumerator;
+	exchange_t *current, *found = NULL;
+
+	enumerator = list->create_enumerator(list);
+	while (enumerator->enumerate(enumerator, &current))
+	{
+		if (current->mid == mid)
+		{
+			found = current;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+	return found;
+}
+
+/**
+ * Destroy all exchanges we initiated
+ */
+static void flush_exchanges(private_task_manager_t *this)
+{
+	exchange_t *exchange;
+
+	while (this->initiating.exchanges->remove_last(this->initiating.exchanges,
+											(void**)&exchange) == SUCCESS)
+	{
+		exchange_destroy(exchange);
+	}
+}
+
 METHOD(task_manager_t, flush_queue, void,
 	private_task_manager_t *this, task_queue_t queue)
 {
@@ -166,6 +226,8 @@ METHOD(task_manager_t, flush_queue, void,
 	switch (queue)
 	{
 		case TASK_QUEUE_ACTIVE:
+			/* exchanges in the air reference active tasks */
+			flush_exchanges(this);
 			list = this->active_tasks;
 			break;
 		case TASK_QUEUE_PASSIVE:
@@ -194,9 +256,62 @@ static void flush(private_task_manager_t *this)
 }
 
 /**
- * move a task of a specific type from the queue to the active list
+ * Get the CHILD_SA a rekey or delete task operates on, if any
+ */
+static child_sa_t *get_task_child(task_t *task)
+{
+	switch (task->get_type(task))
+	{
+		case TASK_CHILD_REKEY:
+		{
+			child_rekey_t *rekey = (child_rekey_t*)task;
+			return rekey->get_child(rekey);
+		}
+		case TASK_CHILD_DELETE:
+		{
+			child_delete_t *del = (child_delete_t*)task;
+			return del->get_child(del);
+		}
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * Check if an active task operates on the same CHILD_SA as the given task.
+ * Such tasks are serialized, e.g. a delete waits until a rekeying completed.
+ */
+static bool is_child_busy(private_task_manager_t *this, task_t *task)
+{
+	enumerator_t *enumerator;
+	child_sa_t *child_sa;
+	task_t *active;
+	bool busy = FALSE;
+
+	child_sa = get_task_child(task);
+	if (!child_sa)
+	{
+		return FALSE;
+	}
+	enumerator = this->active_tasks->create_enumerator(this->active_tasks);
+	while (enumerator->enumerate(enumerator, (void**)&active))
+	{
+		if (get_task_child(active) == child_sa)
+		{
+			busy = TRUE;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+	return busy;
+}
+
+/**
+ * move a task of a specific type from the queue to the active list, and add
+ * it to the given list of tasks of an exchange
  */
-static bool activate_task(private_task_manager_t *this, task_type_t type)
+static bool activate_task(private_task_manager_t *this, task_type_t type,
+						  linked_list_t *tasks)
 {
 	enumerator_t *enumerator;
 	task_t *task;
@@ -205,11 +320,12 @@ static bool activate_task(private_task_manager_t *this, task_type_t type)
 	enumerator = this->queued_tasks->create_enumerator(this->queued_tasks);
 	while (enumerator->enumerate(enumerator, (void**)&task))
 	{
-		if (task->get_type(task) == type)
+		if (task->get_type(task) == type && !is_child_busy(this, task))
 		{
 			DBG2(DBG_IKE, "  activating %N task", task_type_names, type);
 			this->queued_tasks->remove_at(this->queued_tasks, enumerator);
 			this->active_tasks->insert_last(this->active_tasks, task);
+			tasks->insert_last(tasks, task);
 			found = TRUE;
 			break;
 		}
@@ -218,10 +334,94 @@ static bool activate_task(private_task_manager_t *this, task_type_t type)
 	return found;
 }
 
+/**
+ * Check if a task may run while other exchanges are in the air. Only tasks
+ * operating on a single CHILD_SA may, everything affecting the IKE_SA itself
+ * is serialized. Tasks operating on the same CHILD_SA are serialized when
+ * activating them, see is_child_busy().
+ */
+static bool is_concurrent(task_t *task)
+{
+	switch (task->get_type(task))
+	{
+		case TASK_CHILD_CREATE:
+		case TASK_CHILD_REKEY:
+		case TASK_CHILD_DELETE:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/**
+ * Check if an active task is handled in an exchange currently in the air
+ */
+static bool is_in_the_air(private_task_manager_t *this, task_t *task)
+{
+	enumerator_t *enumerator;
+	exchange_t *exchange;
+	bool found = FALSE;
+
+	enumerator = this->initiating.exchanges->create_enumerator(
+													this->initiating.exchanges);
+	while (enumerator->enumerate(enumerator, &exchange))
+	{
+		if (exchange->tasks->find_first(exchange->tasks, NULL,
+										(void**)&task) == SUCCESS)
+		{
+			found = TRUE;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+	return found;
+}
+
+/**
+ * Check if we may initiate another exchange. If other exchanges are in the
+ * air, concurrent is set to TRUE and only concurrent tasks may be initiated.
+ */
+static bool window_open(private_task_manager_t *this, bool *concurrent)
+{
+	enumerator_t *enumerator;
+	exchange_t *exchange;
+	bool open = TRUE;
+
+	*concurrent = FALSE;
+	if (this->initiating.exchanges->get_first(this->initiating.exchanges,
+											  (void**)&exchange) != SUCCESS)
+	{
+		return TRUE;
+	}
+	/* the window is always one until the IKE_SA is established, and the
+	 * peer accepts requests up to the lowest unanswered ID plus its window */
+	if (this->ike_sa->get_state(this->ike_sa) != IKE_ESTABLISHED ||
+		this->initiating.mid - exchange->mid >= this->initiating.window)
+	{
+		return FALSE;
+	}
+	enumerator = this->initiating.exchanges->create_enumerator(
+													this->initiating.exchanges);
+	while (enumerator->enumerate(enumerator, &exchange))
+	{
+		if (!exchange->concurrent)
+		{
+			open = FALSE;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+	*concurrent = open;
+	return open;
+}
+
 METHOD(task_manager_t, retransmit, status_t,
 	private_task_manager_t *this, u_int32_t message_id)
 {
-	if (this->initiating.packet && message_id == this->initiating.mid)
+	exchange_t *exchange;
+
+	exchange = find_exchange(this->initiating.exchanges, message_id);
+	if (exchange && exchange->packet)
 	{
 		u_int32_t timeout;
 		job_t *job;
@@ -231,7 +431,7 @@ METHOD(task_manager_t, retransmit, status_t,
 		ike_mobike_t *mobike = NULL;
 
 		/* check if we are retransmitting a MOBIKE routability check */
-		enumerator = this->active_tasks->create_enumerator(this->active_tasks);
+		enumerator = exchange->tasks->create_enumerator(exchange->tasks);
 		while (enumerator->enumerate(enumerator, (void*)&task))
 		{
 			if (task->get_type(task) == TASK_IKE_MOBIKE)
@@ -248,226 +448,303 @@ METHOD(task_manager_t, retransmit, status_t,
 
 		if (mobike == NULL)
 		{
-			if (this->initiating.retransmitted <= this->retransmit_tries)
+			if (exchange->retransmitted <= this->retransmit_tries)
 			{
 				timeout = (u_int32_t)(this->retransmit_timeout * 1000.0 *
-					pow(this->retransmit_base, this->initiating.retransmitted));
+					pow(this->retransmit_base, exchange->retransmitted));
 			}
 			else
 			{
 				DBG1(DBG_IKE, "giving up after %d retransmits",
-					 this->initiating.retransmitted - 1);
+					 exchange->retransmitted - 1);
 				charon->bus->alert(charon->bus, ALERT_RETRANSMIT_SEND_TIMEOUT,
-								   this->initiating.packet);
+								   exchange->packet);
 				return DESTROY_ME;
 			}
 
-			if (this->initiating.retransmitted)
+			if (exchange->retransmitted)
 			{
 				DBG1(DBG_IKE, "retransmit %d of request with message ID %d",
-					 this->initiating.retransmitted, message_id);
+					 exchange->retransmitted, message_id);
 				charon->bus->alert(charon->bus, ALERT_RETRANSMIT_SEND,
-								   this->initiating.packet);
+								   exchange->packet);
 			}
-			packet = this->initiating.packet->clone(this->initiating.packet);
+			packet = exchange->packet->clone(exchange->packet);
 			charon->sender->send(charon->sender, packet);
 		}
 		else
 		{	/* for routeability checks, we use a more aggressive behavior */
-			if (this->initiating.retransmitted <= ROUTEABILITY_CHECK_TRIES)
+			if (exchange->retransmitted <= ROUTEABILITY_CHECK_TRIES)
 			{
 				timeout = ROUTEABILITY_CHECK_INTERVAL;
 			}
 			else
 			{
 				DBG1(DBG_IKE, "giving up after %d path probings",
-					 this->initiating.retransmitted - 1);
+					 exchange->retransmitted - 1);
 				return DESTROY_ME;
 			}
 
-			if (this->initiating.retransmitted)
+			if (exchange->retransmitted)
 			{
 				DBG1(DBG_IKE, "path probing attempt %d",
-					 this->initiating.retransmitted);
+					 exchange->retransmitted);
 			}
-			mobike->transmit(mobike, this->initiating.packet);
+			mobike->transmit(mobike, exchange->packet);
 		}
 
-		this->initiating.retransmitted++;
-		job = (job_t*)retransmit_job_create(this->initiating.mid,
+		exchange->retransmitted++;
+		job = (job_t*)retransmit_job_create(exchange->mid,
 											this->ike_sa->get_id(this->ike_sa));
 		lib->scheduler->schedule_job_ms(lib->scheduler, job, timeout);
 	}
 	return SUCCESS;
 }
 
-METHOD(task_manager_t, initiate, status_t,
-	private_task_manager_t *this)
+/**
+ * Collect active tasks that need another exchange. While established, each
+ * concurrent task gets an exchange of its own.
+ */
+static exchange_type_t reinitiate_tasks(private_task_manager_t *this,
+										linked_list_t *tasks, bool concurrent)
 {
 	enumerator_t *enumerator;
 	task_t *task;
-	message_t *message;
-	host_t *me, *other;
-	status_t status;
 	exchange_type_t exchange = 0;
+	bool established;
+
+	established = this->ike_sa->get_state(this->ike_sa) == IKE_ESTABLISHED;
 
-	if (this->initiating.type != EXCHANGE_TYPE_UNDEFINED)
+	enumerator = this->active_tasks->create_enumerator(this->active_tasks);
+	while (enumerator->enumerate(enumerator, (void**)&task))
 	{
-		DBG2(DBG_IKE, "delaying task initiation, %N exchange in progress",
-				exchange_type_names, this->initiating.type);
-		/* do not initiate if we already have a message in the air */
-		return SUCCESS;
+		if (is_in_the_air(this, task))
+		{
+			continue;
+		}
+		if (established && is_concurrent(task))
+		{
+			if (tasks->get_count(tasks) == 0)
+			{
+				tasks->insert_last(tasks, task);
+				break;
+			}
+		}
+		else if (!concurrent)
+		{
+			tasks->insert_last(tasks, task);
+		}
 	}
+	enumerator->destroy(enumerator);
 
-	if (this->active_tasks->get_count(this->active_tasks) == 0)
+	if (tasks->get_count(tasks))
+	{
+		DBG2(DBG_IKE, "reinitiating already active tasks");
+	}
+	enumerator = tasks->create_enumerator(tasks);
+	while (enumerator->enumerate(enumerator, (void**)&task))
 	{
-		DBG2(DBG_IKE, "activating new tasks");
-		switch (this->ike_sa->get_state(this->ike_sa))
+		DBG2(DBG_IKE, "  %N task", task_type_names, task->get_type(task));
+		switch (task->get_type(task))
 		{
-			case IKE_CREATED:
-				activate_task(this, TASK_IKE_VENDOR);
-				if (activate_task(this, TASK_IKE_INIT))
-				{
-					this->initiating.mid = 0;
-					exchange = IKE_SA_INIT;
-					activate_task(this, TASK_IKE_NATD);
-					activate_task(this, TASK_IKE_CERT_PRE);
-#ifdef ME
-					/* this task has to be activated before the TASK_IKE_AUTH
-					 * task, because that task pregenerates the packet after
-					 * which no payloads can be added to the message anymore.
-					 */
-					activate_task(this, TASK_IKE_ME);
-#endif /* ME */
-					activate_task(this, TASK_IKE_AUTH);
-					activate_task(this, TASK_IKE_CERT_POST);
-					activate_task(this, TASK_IKE_CONFIG);
-					activate_task(this, TASK_CHILD_CREATE);
-					activate_task(this, TASK_IKE_AUTH_LIFETIME);
-					activate_task(this, TASK_IKE_MOBIKE);
-				}
+			case TASK_IKE_INIT:
+				exchange = IKE_SA_INIT;
 				break;
-			case IKE_ESTABLISHED:
-				if (activate_task(this, TASK_CHILD_CREATE))
-				{
-					exchange = CREATE_CHILD_SA;
-					break;
-				}
-				if (activate_task(this, TASK_CHILD_DELETE))
-				{
-					exchange = INFORMATIONAL;
-					break;
-				}
-				if (activate_task(this, TASK_CHILD_REKEY))
-				{
-					exchange = CREATE_CHILD_SA;
-					break;
-				}
-				if (activate_task(this, TASK_IKE_DELETE))
-				{
-					exchange = INFORMATIONAL;
-					break;
-				}
-				if (activate_task(this, TASK_IKE_REKEY))
-				{
-					exchange = CREATE_CHILD_SA;
-					break;
-				}
-				if (activate_task(this, TASK_IKE_REAUTH))
-				{
-					exchange = INFORMATIONAL;
-					break;
-				}
-				if (activate_task(this, TASK_IKE_MOBIKE))
-				{
-					exchange = INFORMATIONAL;
-					break;
-				}
-				if (activate_task(this, TASK_IKE_DPD))
-				{
-					exchange = INFORMATIONAL;
-					break;
-				}
-				if (activate_task(this, TASK_IKE_AUTH_LIFETIME))
-				{
-					exchange = INFORMATIONAL;
-					break;
-				}
-#ifdef ME
-				if (activate_task(this, TASK_IKE_ME))
-				{
-					exchange = ME_CONNECT;
-					break;
-				}
-#endif /* ME */
-			case IKE_REKEYING:
-				if (activate_task(this, TASK_IKE_DELETE))
-				{
-					exchange = INFORMATIONAL;
-					break;
-				}
-			case IKE_DELETING:
-			default:
+			case TASK_IKE_AUTH:
+				exchange = IKE_AUTH;
+				break;
+			case TASK_CHILD_CREATE:
+			case TASK_CHILD_REKEY:
+			case TASK_IKE_REKEY:
+				exchange = CREATE_CHILD_SA;
+				break;
+			case TASK_IKE_MOBIKE:
+				exchange = INFORMATIONAL;
 				break;
+			default:
+				continue;
 		}
+		break;
 	}
-	else
+	enumerator->destroy(enumerator);
+	return exchange;
+}
+
+/**
+ * Activate queued tasks for a new exchange, depending on the IKE_SA state
+ */
+static exchange_type_t activate_tasks(private_task_manager_t *this,
+									  linked_list_t *tasks, bool concurrent)
+{
+	exchange_type_t exchange = 0;
+
+	DBG2(DBG_IKE, "activating new tasks");
+	switch (this->ike_sa->get_state(this->ike_sa))
 	{
-		DBG2(DBG_IKE, "reinitiating already active tasks");
-		enumerator = this->active_tasks->create_enumerator(this->active_tasks);
-		while (enumerator->enumerate(enumerator, (void**)&task))
-		{
-			DBG2(DBG_IKE, "  %N task", task_type_names, task->get_type(task));
-			switch (task->get_type(task))
+		case IKE_CREATED:
+			activate_task(this, TASK_IKE_VENDOR, tasks);
+			if (activate_task(this, TASK_IKE_INIT, tasks))
 			{
-				case TASK_IKE_INIT:
-					exchange = IKE_SA_INIT;
-					break;
-				case TASK_IKE_AUTH:
-					exchange = IKE_AUTH;
-					break;
-				case TASK_CHILD_CREATE:
-				case TASK_CHILD_REKEY:
-				case TASK_IKE_REKEY:
-					exchange = CREATE_CHILD_SA;
-					break;
-				case TASK_IKE_MOBIKE:
-					exchange = INFORMATIONAL;
-					break;
-				default:
-					continue;
+				this->initiating.mid = 0;
+				exchange = IKE_SA_INIT;
+				activate_task(this, TASK_IKE_NATD, tasks);
+				activate_task(this, TASK_IKE_CERT_PRE, tasks);
+#ifdef ME
+				/* this task has to be activated before the TASK_IKE_AUTH
+				 * task, because that task pregenerates the packet after
+				 * which no payloads can be added to the message anymore.
+				 */
+				activate_task(this, TASK_IKE_ME, tasks);
+#endif /* ME */
+				activate_task(this, TASK_IKE_AUTH, tasks);
+				activate_task(this, TASK_IKE_CERT_POST, tasks);
+				activate_task(this, TASK_IKE_CONFIG, tasks);
+				activate_task(this, TASK_CHILD_CREATE, tasks);
+				activate_task(this, TASK_IKE_AUTH_LIFETIME, tasks);
+				activate_task(this, TASK_IKE_MOBIKE, tasks);
 			}
 			break;
-		}
-		enumerator->destroy(enumerator);
+		case IKE_ESTABLISHED:
+			if (activate_task(this, TASK_CHILD_CREATE, tasks))
+			{
+				exchange = CREATE_CHILD_SA;
+				break;
+			}
+			if (activate_task(this, TASK_CHILD_DELETE, tasks))
+			{
+				exchange = INFORMATIONAL;
+				break;
+			}
+			if (activate_task(this, TASK_CHILD_REKEY, tasks))
+			{
+				exchange = CREATE_CHILD_SA;
+				break;
+			}
+			if (concurrent)
+			{	/* other tasks wait until all exchanges completed */
+				break;
+			}
+			if (activate_task(this, TASK_IKE_DELETE, tasks))
+			{
+				exchange = INFORMATIONAL;
+				break;
+			}
+			if (activate_task(this, TASK_IKE_REKEY, tasks))
+			{
+				exchange = CREATE_CHILD_SA;
+				break;
+			}
+			if (activate_task(this, TASK_IKE_REAUTH, tasks))
+			{
+				exchange = INFORMATIONAL;
+				break;
+			}
+			if (activate_task(this, TASK_IKE_MOBIKE, tasks))
+			{
+				exchange = INFORMATIONAL;
+				break;
+			}
+			if (activate_task(this, TASK_IKE_DPD, tasks))
+			{
+				exchange = INFORMATIONAL;
+				break;
+			}
+			if (activate_task(this, TASK_IKE_AUTH_LIFETIME, tasks))
+			{
+				exchange = INFORMATIONAL;
+				break;
+			}
+#ifdef ME
+			if (activate_task(this, TASK_IKE_ME, tasks))
+			{
+				exchange = ME_CONNECT;
+				break;
+			}
+#endif /* ME */
+		case IKE_REKEYING:
+			if (activate_task(this, TASK_IKE_DELETE, tasks))
+			{
+				exchange = INFORMATIONAL;
+				break;
+			}
+		case IKE_DELETING:
+		default:
+			break;
+	}
+	return exchange;
+}
+
+/**
+ * Add a SET_WINDOW_SIZE notify to a message, if we accept multiple requests
+ */
+static void add_window_size(private_task_manager_t *this, message_t *message)
+{
+	u_int32_t window;
+
+	if (this->window > 1)
+	{
+		window = htonl(this->window);
+		message->add_notify(message, FALSE, SET_WINDOW_SIZE,
+							chunk_from_thing(window));
 	}
+}
 
-	if (exchange == 0)
+/**
+ * Adopt the window size the peer announced in a SET_WINDOW_SIZE notify
+ */
+static void process_window_size(private_task_manager_t *this,
+								message_t *message)
+{
+	notify_payload_t *notify;
+	chunk_t data;
+
+	notify = message->get_notify(message, SET_WINDOW_SIZE);
+	if (notify)
 	{
-		DBG2(DBG_IKE, "nothing to initiate");
-		/* nothing to do yet... */
-		return SUCCESS;
+		data = notify->get_notification_data(notify);
+		if (data.len == sizeof(u_int32_t))
+		{
+			this->initiating.window = max(untoh32(data.ptr), 1);
+			DBG2(DBG_IKE, "peer accepts %u concurrent requests",
+				 this->initiating.window);
+		}
 	}
+}
+
+/**
+ * Build, send and schedule retransmission of an initiated exchange
+ */
+static status_t send_exchange(private_task_manager_t *this,
+							  exchange_t *exchange)
+{
+	enumerator_t *enumerator;
+	task_t *task;
+	message_t *message;
+	host_t *me, *other;
+	status_t status;
 
 	me = this->ike_sa->get_my_host(this->ike_sa);
 	other = this->ike_sa->get_other_host(this->ike_sa);
 
 	message = message_create(IKEV2_MAJOR_VERSION, IKEV2_MINOR_VERSION);
-	message->set_message_id(message, this->initiating.mid);
+	message->set_message_id(message, exchange->mid);
 	message->set_source(message, me->clone(me));
 	message->set_destination(message, other->clone(other));
-	message->set_exchange_type(message, exchange);
-	this->initiating.type = exchange;
-	this->initiating.retransmitted = 0;
+	message->set_exchange_type(message, exchange->type);
+	if (exchange->type == IKE_AUTH && exchange->mid == 1)
+	{
+		add_window_size(this, message);
+	}
 
-	enumerator = this->active_tasks->create_enumerator(this->active_tasks);
+	enumerator = exchange->tasks->create_enumerator(exchange->tasks);
 	while (enumerator->enumerate(enumerator, (void*)&task))
 	{
 		switch (task->build(task, message))
 		{
 			case SUCCESS:
 				/* task completed, remove it */
-				this->active_tasks->remove_at(this->active_tasks, enumerator);
+				exchange->tasks->remove_at(exchange->tasks, enumerator);
+				this->active_tasks->remove(this->active_tasks, task, NULL);
 				task->destroy(task);
 				break;
 			case NEED_MORE:
@@ -475,7 +752,6 @@ METHOD(task_manager_t, initiate, status_t,
 				break;
 			case FAILED:
 			default:
-				this->initiating.type = EXCHANGE_TYPE_UNDEFINED;
 				if (this->ike_sa->get_state(this->ike_sa) != IKE_CONNECTING)
 				{
 					charon->bus->ike_updown(charon->bus, this->ike_sa, FALSE);
@@ -492,10 +768,10 @@ METHOD(task_manager_t, initiate, status_t,
 	enumerator->destroy(enumerator);
 
 	/* update exchange type if a task changed it */
-	this->initiating.type = message->get_exchange_type(message);
+	exchange->type = message->get_exchange_type(message);
 
 	status = this->ike_sa->generate_message(this->ike_sa, message,
-											&this->initiating.packet);
+											&exchange->packet);
 	if (status != SUCCESS)
 	{
 		/* message generation failed. There is nothing more to do than to
@@ -507,37 +783,102 @@ METHOD(task_manager_t, initiate, status_t,
 	}
 	message->destroy(message);
 
-	return retransmit(this, this->initiating.mid);
+	return retransmit(this, exchange->mid);
+}
+
+METHOD(task_manager_t, initiate, status_t,
+	private_task_manager_t *this)
+{
+	exchange_t *exchange;
+	exchange_type_t type;
+	linked_list_t *tasks;
+	enumerator_t *enumerator;
+	task_t *task;
+	status_t status;
+	bool concurrent;
+
+	while (TRUE)
+	{
+		if (!window_open(this, &concurrent))
+		{
+			DBG2(DBG_IKE, "delaying task initiation, %d exchanges in progress",
+				 this->initiating.exchanges->get_count(
+											this->initiating.exchanges));
+			/* do not initiate if the peer does not accept more requests */
+			return SUCCESS;
+		}
+
+		tasks = linked_list_create();
+		type = reinitiate_tasks(this, tasks, concurrent);
+		if (tasks->get_count(tasks) == 0)
+		{
+			type = activate_tasks(this, tasks, concurrent);
+		}
+		if (type == 0)
+		{
+			DBG2(DBG_IKE, "nothing to initiate");
+			/* nothing to do yet... */
+			tasks->destroy(tasks);
+			return SUCCESS;
+		}
+
+		INIT(exchange,
+			.mid = this->initiating.mid++,
+			.type = type,
+			.tasks = tasks,
+			.concurrent = this->ike_sa->get_state(this->ike_sa) ==
+															IKE_ESTABLISHED,
+		);
+		enumerator = tasks->create_enumerator(tasks);
+		while (enumerator->enumerate(enumerator, (void**)&task))
+		{
+			exchange->concurrent = exchange->concurrent && is_concurrent(task);
+		}
+		enumerator->destroy(enumerator);
+		this->initiating.exchanges->insert_last(this->initiating.exchanges,
+												exchange);
+
+		status = send_exchange(this, exchange);
+		if (status != SUCCESS)
+		{
+			return status;
+		}
+	}
 }
 
 /**
  * handle an incoming response message
  */
 static status_t process_response(private_task_manager_t *this,
-								 message_t *message)
+								 exchange_t *exchange, message_t *message)
 {
 	enumerator_t *enumerator;
 	task_t *task;
 
-	if (message->get_exchange_type(message) != this->initiating.type)
+	if (message->get_exchange_type(message) != exchange->type)
 	{
 		DBG1(DBG_IKE, "received %N response, but expected %N",
 			 exchange_type_names, message->get_exchange_type(message),
-			 exchange_type_names, this->initiating.type);
+			 exchange_type_names, exchange->type);
 		charon->bus->ike_updown(charon->bus, this->ike_sa, FALSE);
 		return DESTROY_ME;
 	}
 
+	/* the exchange is complete, remaining tasks need another one */
+	this->initiating.exchanges->remove(this->initiating.exchanges,
+									   exchange, NULL);
+
 	/* catch if we get resetted while processing */
 	this->reset = FALSE;
-	enumerator = this->active_tasks->create_enumerator(this->active_tasks);
+	enumerator = exchange->tasks->create_enumerator(exchange->tasks);
 	while (enumerator->enumerate(enumerator, (void*)&task))
 	{
 		switch (task->process(task, message))
 		{
 			case SUCCESS:
 				/* task completed, remove it */
-				this->active_tasks->remove_at(this->active_tasks, enumerator);
+				exchange->tasks->remove_at(exchange->tasks, enumerator);
+				this->active_tasks->remove(this->active_tasks, task, NULL);
 				task->destroy(task);
 				break;
 			case NEED_MORE:
@@ -549,24 +890,20 @@ static status_t process_response(private_task_manager_t *this,
 				/* FALL */
 			case DESTROY_ME:
 				/* critical failure, destroy IKE_SA */
-				this->active_tasks->remove_at(this->active_tasks, enumerator);
+				this->active_tasks->remove(this->active_tasks, task, NULL);
 				enumerator->destroy(enumerator);
+				exchange_destroy(exchange);
 				task->destroy(task);
 				return DESTROY_ME;
 		}
 		if (this->reset)
 		{	/* start all over again if we were reset */
 			this->reset = FALSE;
-			enumerator->destroy(enumerator);
-			return initiate(this);
+			break;
 		}
 	}
 	enumerator->destroy(enumerator);
-
-	this->initiating.mid++;
-	this->initiating.type = EXCHANGE_TYPE_UNDEFINED;
-	this->initiating.packet->destroy(this->initiating.packet);
-	this->initiating.packet = NULL;
+	exchange_destroy(exchange);
 
 	return initiate(this);
 }
@@ -606,8 +943,14 @@ static bool handle_collisions(private_task_manager_t *this, task_t *task)
 					if (type == TASK_CHILD_REKEY || type == TASK_CHILD_DELETE)
 					{
 						child_rekey_t *rekey = (child_rekey_t*)active;
-						rekey->collide(rekey, task);
-						break;
+
+						/* several rekeyings might be in progress, pass the
+						 * task to the one handling the same CHILD_SA */
+						if (rekey->is_collision(rekey, task))
+						{
+							rekey->collide(rekey, task);
+							break;
+						}
 					}
 					continue;
 				default:
@@ -629,6 +972,7 @@ static status_t build_response(private_task_manager_t *this, message_t *request)
 	enumerator_t *enumerator;
 	task_t *task;
 	message_t *message;
+	packet_t *packet;
 	host_t *me, *other;
 	bool delete = FALSE, hook = FALSE;
 	ike_sa_id_t *id = NULL;
@@ -643,8 +987,13 @@ static status_t build_response(private_task_manager_t *this, message_t *request)
 	/* send response along the path the request came in */
 	message->set_source(message, me->clone(me));
 	message->set_destination(message, other->clone(other));
-	message->set_message_id(message, this->responding.mid);
+	message->set_message_id(message, request->get_message_id(request));
 	message->set_request(message, FALSE);
+	if (request->get_exchange_type(request) == IKE_AUTH &&
+		request->get_message_id(request) == 1)
+	{
+		add_window_size(this, message);
+	}
 
 	enumerator = this->passive_tasks->create_enumerator(this->passive_tasks);
 	while (enumerator->enumerate(enumerator, (void*)&task))
@@ -696,10 +1045,7 @@ static status_t build_response(private_task_manager_t *this, message_t *request)
 	}
 
 	/* message complete, send it */
-	DESTROY_IF(this->responding.packet);
-	this->responding.packet = NULL;
-	status = this->ike_sa->generate_message(this->ike_sa, message,
-											&this->responding.packet);
+	status = this->ike_sa->generate_message(this->ike_sa, message, &packet);
 	message->destroy(message);
 	if (id)
 	{
@@ -711,8 +1057,9 @@ static status_t build_response(private_task_manager_t *this, message_t *request)
 		return DESTROY_ME;
 	}
 
-	charon->sender->send(charon->sender,
-						 this->responding.packet->clone(this->responding.packet));
+	charon->sender->send(charon->sender, packet->clone(packet));
+	this->responding->answer(this->responding,
+							 request->get_message_id(request), packet);
 	if (delete)
 	{
 		if (hook)
@@ -938,8 +1285,50 @@ METHOD(task_manager_t, incr_mid, void,
 	}
 	else
 	{
-		this->responding.mid++;
+		this->responding->answer(this->responding,
+					this->responding->get_lowest(this->responding), NULL);
+	}
+}
+
+/**
+ * Check if we accept a request that arrived before requests with lower
+ * message IDs. We do so only for standalone CHILD_SA and INFORMATIONAL
+ * exchanges within our window.
+ */
+static bool accept_out_of_order(private_task_manager_t *this, message_t *msg)
+{
+	if (!this->responding->is_new(this->responding, msg->get_message_id(msg)))
+	{
+		return FALSE;
+	}
+	if (this->ike_sa->get_state(this->ike_sa) != IKE_ESTABLISHED ||
+		this->passive_tasks->get_count(this->passive_tasks))
+	{
+		return FALSE;
 	}
+	switch (msg->get_exchange_type(msg))
+	{
+		case CREATE_CHILD_SA:
+		case INFORMATIONAL:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/**
+ * Check if a request is the one we expect next, or one we accept out of order
+ */
+static bool is_expected(private_task_manager_t *this, message_t *msg)
+{
+	u_int32_t mid;
+
+	mid = msg->get_message_id(msg);
+	if (mid == this->responding->get_lowest(this->responding))
+	{
+		return TRUE;
+	}
+	return accept_out_of_order(this, msg);
 }
 
 /**
@@ -975,7 +1364,16 @@ static void send_notify_response(private_task_manager_t *this,
 	if (this->ike_sa->generate_message(this->ike_sa, response,
 									   &packet) == SUCCESS)
 	{
-		charon->sender->send(charon->sender, packet);
+		if (request->get_request(request) && is_expected(this, request))
+		{	/* answer retransmits of the request with the same notify */
+			charon->sender->send(charon->sender, packet->clone(packet));
+			this->responding->answer(this->responding,
+									 request->get_message_id(request), packet);
+		}
+		else
+		{
+			charon->sender->send(charon->sender, packet);
+		}
 	}
 	response->destroy(response);
 }
@@ -1026,7 +1424,6 @@ static status_t parse_message(private_task_manager_t *this, message_t *msg)
 					send_notify_response(this, msg,
 										 UNSUPPORTED_CRITICAL_PAYLOAD,
 										 chunk_from_thing(type));
-					incr_mid(this, FALSE);
 				}
 				break;
 			case PARSE_ERROR:
@@ -1035,7 +1432,6 @@ static status_t parse_message(private_task_manager_t *this, message_t *msg)
 				{
 					send_notify_response(this, msg,
 										 INVALID_SYNTAX, chunk_empty);
-					incr_mid(this, FALSE);
 				}
 				break;
 			case VERIFY_ERROR:
@@ -1044,7 +1440,6 @@ static status_t parse_message(private_task_manager_t *this, message_t *msg)
 				{
 					send_notify_response(this, msg,
 										 INVALID_SYNTAX, chunk_empty);
-					incr_mid(this, FALSE);
 				}
 				break;
 			case FAILED:
@@ -1076,6 +1471,8 @@ METHOD(task_manager_t, process_message, status_t,
 	private_task_manager_t *this, message_t *msg)
 {
 	host_t *me, *other;
+	exchange_t *exchange;
+	packet_t *packet;
 	status_t status;
 	u_int32_t mid;
 
@@ -1122,7 +1519,9 @@ METHOD(task_manager_t, process_message, status_t,
 	mid = msg->get_message_id(msg);
 	if (msg->get_request(msg))
 	{
-		if (mid == this->responding.mid)
+		packet = NULL;
+		if (!this->responding->get_response(this->responding, mid, &packet) &&
+			is_expected(this, msg))
 		{
 			/* reject initial messages once established */
 			if (msg->get_exchange_type(msg) == IKE_SA_INIT ||
@@ -1150,14 +1549,14 @@ METHOD(task_manager_t, process_message, status_t,
 			{	/* ignore messages altered to EXCHANGE_TYPE_UNDEFINED */
 				return SUCCESS;
 			}
+			process_window_size(this, msg);
 			if (process_request(this, msg) != SUCCESS)
 			{
 				flush(this);
 				return DESTROY_ME;
 			}
-			this->responding.mid++;
 		}
-		else if ((mid == this->responding.mid - 1) && this->responding.packet)
+		else if (packet)
 		{
 			packet_t *clone;
 			host_t *host;
@@ -1165,7 +1564,7 @@ METHOD(task_manager_t, process_message, status_t,
 			DBG1(DBG_IKE, "received retransmit of request with ID %d, "
 				 "retransmitting response", mid);
 			charon->bus->alert(charon->bus, ALERT_RETRANSMIT_RECEIVE, msg);
-			clone = this->responding.packet->clone(this->responding.packet);
+			clone = packet->clone(packet);
 			host = msg->get_destination(msg);
 			clone->set_source(clone, host->clone(host));
 			host = msg->get_source(msg);
@@ -1175,7 +1574,7 @@ METHOD(task_manager_t, process_message, status_t,
 		else
 		{
 			DBG1(DBG_IKE, "received message ID %d, expected %d. Ignored",
-				 mid, this->responding.mid);
+				 mid, this->responding->get_lowest(this->responding));
 			if (msg->get_exchange_type(msg) == IKE_SA_INIT)
 			{	/* clean up IKE_SA state if IKE_SA_INIT has invalid msg ID */
 				return DESTROY_ME;
@@ -1184,7 +1583,8 @@ METHOD(task_manager_t, process_message, status_t,
 	}
 	else
 	{
-		if (mid == this->initiating.mid)
+		exchange = find_exchange(this->initiating.exchanges, mid);
+		if (exchange && exchange->packet)
 		{
 			if (this->ike_sa->get_state(this->ike_sa) == IKE_CREATED ||
 				this->ike_sa->get_state(this->ike_sa) == IKE_CONNECTING ||
@@ -1200,7 +1600,8 @@ METHOD(task_manager_t, process_message, status_t,
 			{	/* ignore messages altered to EXCHANGE_TYPE_UNDEFINED */
 				return SUCCESS;
 			}
-			if (process_response(this, msg) != SUCCESS)
+			process_window_size(this, msg);
+			if (process_response(this, exchange, msg) != SUCCESS)
 			{
 				flush(this);
 				return DESTROY_ME;
@@ -1208,8 +1609,8 @@ METHOD(task_manager_t, process_message, status_t,
 		}
 		else
 		{
-			DBG1(DBG_IKE, "received message ID %d, expected %d. Ignored",
-				 mid, this->initiating.mid);
+			DBG1(DBG_IKE, "received message ID %d, but no such request "
+				 "outstanding. Ignored", mid);
 			return SUCCESS;
 		}
 	}
@@ -1426,19 +1827,17 @@ METHOD(task_manager_t, reset, void,
 	task_t *task;
 
 	/* reset message counters and retransmit packets */
-	DESTROY_IF(this->responding.packet);
-	DESTROY_IF(this->initiating.packet);
-	this->responding.packet = NULL;
-	this->initiating.packet = NULL;
+	flush_exchanges(this);
 	if (initiate != UINT_MAX)
 	{
 		this->initiating.mid = initiate;
 	}
-	if (respond != UINT_MAX)
+	if (respond == UINT_MAX)
 	{
-		this->responding.mid = respond;
+		respond = this->responding->get_lowest(this->responding);
 	}
-	this->initiating.type = EXCHANGE_TYPE_UNDEFINED;
+	this->responding->reset(this->responding, respond);
+	this->initiating.window = 1;
 
 	/* reset queued tasks */
 	enumerator = this->queued_tasks->create_enumerator(this->queued_tasks);
@@ -1484,8 +1883,8 @@ METHOD(task_manager_t, destroy, void,
 	this->queued_tasks->destroy(this->queued_tasks);
 	this->passive_tasks->destroy(this->passive_tasks);
 
-	DESTROY_IF(this->responding.packet);
-	DESTROY_IF(this->initiating.packet);
+	this->responding->destroy(this->responding);
+	this->initiating.exchanges->destroy(this->initiating.exchanges);
 	free(this);
 }
 
@@ -1522,7 +1921,10 @@ task_manager_v2_t *task_manager_v2_create(ike_sa_t *ike_sa)
 			},
 		},
 		.ike_sa = ike_sa,
-		.initiating.type = EXCHANGE_TYPE_UNDEFINED,
+		.initiating = {
+			.exchanges = linked_list_create(),
+			.window = 1,
+		},
 		.queued_tasks = linked_list_create(),
 		.active_tasks = linked_list_create(),
 		.passive_tasks = linked_list_create(),
@@ -1532,7 +1934,10 @@ task_manager_v2_t *task_manager_v2_create(ike_sa_t *ike_sa)
 					"%s.retransmit_timeout", RETRANSMIT_TIMEOUT, charon->name),
 		.retransmit_base = lib->settings->get_double(lib->settings,
 					"%s.retransmit_base", RETRANSMIT_BASE, charon->name),
+		.window = max(lib->settings->get_int(lib->settings,
+					"%s.window_size", WINDOW_SIZE, charon->name), 1),
 	);
+	this->responding = response_window_create(this->window);
 
 	return &this->public;
 }
@@ -349,7 +349,19 @@ METHOD(child_delete_t , get_child, child_sa_t*,
 	private_child_delete_t *this)
 {
 	child_sa_t *child_sa = NULL;
-	this->child_sas->get_first(this->child_sas, (void**)&child_sa);
+
+	if (this->child_sas->get_first(this->child_sas,
+								   (void**)&child_sa) != SUCCESS &&
+		this->initiator)
+	{	/* not initiated yet, look it up the same way as build_i() does */
+		child_sa = this->ike_sa->get_child_sa(this->ike_sa, this->protocol,
+											  this->spi, TRUE);
+		if (!child_sa)
+		{
+			child_sa = this->ike_sa->get_child_sa(this->ike_sa, this->protocol,
+												  this->spi, FALSE);
+		}
+	}
 	return child_sa;
 }
 
@@ -381,43 +381,78 @@ METHOD(task_t, get_type, task_type_t,
 	return TASK_CHILD_REKEY;
 }
 
-METHOD(child_rekey_t, collide, void,
+METHOD(child_rekey_t, get_child, child_sa_t*,
+	private_child_rekey_t *this)
+{
+	child_sa_t *child_sa;
+
+	if (this->child_sa || !this->initiator)
+	{
+		return this->child_sa;
+	}
+	/* not yet initiated, look it up the same way as build_i() does */
+	child_sa = this->ike_sa->get_child_sa(this->ike_sa, this->protocol,
+										  this->spi, TRUE);
+	if (!child_sa)
+	{
+		child_sa = this->ike_sa->get_child_sa(this->ike_sa, this->protocol,
+											  this->spi, FALSE);
+	}
+	return child_sa;
+}
+
+METHOD(child_rekey_t, is_collision, bool,
 	private_child_rekey_t *this, task_t *other)
 {
-	/* the task manager only detects exchange collision, but not if
-	 * the collision is for the same child. we check it here. */
+	child_sa_t *child_sa;
+
+	if (!this->child_sa)
+	{	/* not initiated yet, or the CHILD_SA is already gone */
+		return FALSE;
+	}
 	if (other->get_type(other) == TASK_CHILD_REKEY)
 	{
-		private_child_rekey_t *rekey = (private_child_rekey_t*)other;
-		if (rekey->child_sa != this->child_sa)
+		child_rekey_t *rekey = (child_rekey_t*)other;
+
+		return rekey->get_child(rekey) == this->child_sa;
+	}
+	if (other->get_type(other) == TASK_CHILD_DELETE)
+	{
+		child_delete_t *del = (child_delete_t*)other;
+
+		child_sa = del->get_child(del);
+		if (this->child_create &&
+			child_sa == this->child_create->get_child(this->child_create))
 		{
-			/* not the same child => no collision */
-			other->destroy(other);
-			return;
+			return TRUE;
 		}
+		return child_sa == this->child_sa;
+	}
+	return FALSE;
+}
+
+METHOD(child_rekey_t, collide, void,
+	private_child_rekey_t *this, task_t *other)
+{
+	/* the task manager only detects exchange collision, but not if
+	 * the collision is for the same child. we check it here. */
+	if (!is_collision(this, other))
+	{
+		/* not the same child => no collision */
+		other->destroy(other);
+		return;
 	}
-	else if (other->get_type(other) == TASK_CHILD_DELETE)
+	if (other->get_type(other) == TASK_CHILD_DELETE)
 	{
 		child_delete_t *del = (child_delete_t*)other;
-		if (del->get_child(del) == this->child_create->get_child(this->child_create))
+		if (this->child_create &&
+			del->get_child(del) == this->child_create->get_child(this->child_create))
 		{
 			/* peer deletes redundant child created in collision */
 			this->other_child_destroyed = TRUE;
 			other->destroy(other);
 			return;
 		}
-		if (del->get_child(del) != this->child_sa)
-		{
-			/* not the same child => no collision */
-			other->destroy(other);
-			return;
-		}
-	}
-	else
-	{
-		/* any other task is not critical for collisisions, ignore */
-		other->destroy(other);
-		return;
 	}
 	DBG1(DBG_IKE, "detected %N collision with %N", task_type_names,
 		 TASK_CHILD_REKEY, task_type_names, other->get_type(other));
@@ -472,6 +507,8 @@ child_rekey_t *child_rekey_create(ike_sa_t *ike_sa, protocol_id_t protocol,
 				.migrate = _migrate,
 				.destroy = _destroy,
 			},
+			.get_child = _get_child,
+			.is_collision = _is_collision,
 			.collide = _collide,
 		},
 		.ike_sa = ike_sa,
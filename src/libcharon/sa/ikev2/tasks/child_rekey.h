@@ -38,6 +38,24 @@ struct child_rekey_t {
 	 */
 	task_t task;
 
+	/**
+	 * Get the CHILD_SA rekeyed by this task.
+	 *
+	 * @return			CHILD_SA, NULL if not known (anymore)
+	 */
+	child_sa_t* (*get_child)(child_rekey_t *this);
+
+	/**
+	 * Check if an incoming task affects a CHILD_SA handled by this task.
+	 *
+	 * This includes rekeying or deleting the CHILD_SA we rekey, and deleting
+	 * the CHILD_SA we created in a collision.
+	 *
+	 * @param other		incoming rekey or delete task
+	 * @return			TRUE if the task collides with this one
+	 */
+	bool (*is_collision)(child_rekey_t *this, task_t *other);
+
 	/**
 	 * Register a rekeying task which collides with this one
 	 *
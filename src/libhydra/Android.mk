@@ -10,6 +10,7 @@ attributes/attribute_manager.c attributes/attribute_manager.h \
 attributes/mem_pool.c attributes/mem_pool.h \
 kernel/kernel_interface.c kernel/kernel_interface.h \
 kernel/kernel_ipsec.c kernel/kernel_ipsec.h \
+kernel/kernel_ipsec_batch.c kernel/kernel_ipsec_batch.h \
 kernel/kernel_net.c kernel/kernel_net.h \
 kernel/kernel_listener.h
 
@@ -1,4 +1,5 @@
 /*
+ * Copyright (C) 2013 revosec AG
  * Copyright (C) 2010 Tobias Brunner
  * Copyright (C) 2008-2010 Martin Willi
  * Hochschule fuer Technik Rapperswil
@@ -23,7 +24,12 @@
 
 #define POOL_LIMIT (sizeof(u_int)*8 - 1)
 
+/** number of bits in a word of the online bitmap */
+#define MAP_BITS (sizeof(u_int32_t) * 8)
+
 typedef struct private_mem_pool_t private_mem_pool_t;
+typedef struct entry_t entry_t;
+typedef struct lease_t lease_t;
 
 /**
  * private data of mem_pool_t
@@ -54,11 +60,51 @@ struct private_mem_pool_t {
 	 */
 	u_int unused;
 
+	/**
+	 * initial value of unused, i.e. offsets not used at the start of the pool
+	 */
+	u_int unused_base;
+
 	/**
 	 * lease hashtable [identity => entry]
 	 */
 	hashtable_t *leases;
 
+	/**
+	 * Leases by offset, allocated for offsets up to "unused"
+	 */
+	lease_t *offsets;
+
+	/**
+	 * Bitmap of online leases, by offset
+	 */
+	u_int32_t *online_map;
+
+	/**
+	 * Number of allocated lease_t in offsets
+	 */
+	u_int allocated;
+
+	/**
+	 * Number of online leases
+	 */
+	u_int online;
+
+	/**
+	 * Number of offline leases
+	 */
+	u_int offline;
+
+	/**
+	 * Least recently released offline lease, 0 if none
+	 */
+	u_int lru_first;
+
+	/**
+	 * Most recently released offline lease, 0 if none
+	 */
+	u_int lru_last;
+
 	/**
 	 * lock to safely access the pool
 	 */
@@ -68,14 +114,26 @@ struct private_mem_pool_t {
 /**
  * Lease entry.
  */
-typedef struct {
+struct entry_t {
 	/* identitiy reference */
 	identification_t *id;
 	/* list of online leases, as offset */
 	linked_list_t *online;
 	/* list of offline leases, as offset */
 	linked_list_t *offline;
-} entry_t;
+};
+
+/**
+ * State of an assigned address, by offset
+ */
+struct lease_t {
+	/* entry the address is assigned to, NULL if never assigned */
+	entry_t *entry;
+	/* previous offline lease in LRU order, 0 if none */
+	u_int prev;
+	/* next offline lease in LRU order, 0 if none */
+	u_int next;
+};
 
 /**
  * hashtable hash function for identities
@@ -156,6 +214,117 @@ static int host2offset(private_mem_pool_t *pool, host_t *addr)
 	return hosti - basei + 1;
 }
 
+/**
+ * Check if the lease at the given offset is online
+ */
+static inline bool is_online(private_mem_pool_t *this, u_int offset)
+{
+	return (this->online_map[offset / MAP_BITS] &
+			(1U << (offset % MAP_BITS))) != 0;
+}
+
+/**
+ * Mark the lease at the given offset online or offline
+ */
+static inline void set_online(private_mem_pool_t *this, u_int offset,
+							  bool online)
+{
+	if (online)
+	{
+		this->online_map[offset / MAP_BITS] |= (1U << (offset % MAP_BITS));
+		this->online++;
+	}
+	else
+	{
+		this->online_map[offset / MAP_BITS] &= ~(1U << (offset % MAP_BITS));
+		this->online--;
+	}
+}
+
+/**
+ * Append an offline lease to the LRU list
+ */
+static void lru_append(private_mem_pool_t *this, u_int offset)
+{
+	lease_t *lease = &this->offsets[offset];
+
+	lease->prev = this->lru_last;
+	lease->next = 0;
+	if (this->lru_last)
+	{
+		this->offsets[this->lru_last].next = offset;
+	}
+	else
+	{
+		this->lru_first = offset;
+	}
+	this->lru_last = offset;
+	this->offline++;
+}
+
+/**
+ * Remove an offline lease from the LRU list
+ */
+static void lru_remove(private_mem_pool_t *this, u_int offset)
+{
+	lease_t *lease = &this->offsets[offset];
+
+	if (lease->prev)
+	{
+		this->offsets[lease->prev].next = lease->next;
+	}
+	else
+	{
+		this->lru_first = lease->next;
+	}
+	if (lease->next)
+	{
+		this->offsets[lease->next].prev = lease->prev;
+	}
+	else
+	{
+		this->lru_last = lease->prev;
+	}
+	lease->prev = lease->next = 0;
+	this->offline--;
+}
+
+/**
+ * Get the offset of an address, if it is assigned to the given entry
+ */
+static u_int get_owned(private_mem_pool_t *this, entry_t *entry, host_t *addr)
+{
+	int offset;
+
+	offset = host2offset(this, addr);
+	if (offset <= 0 || offset > this->unused ||
+		this->offsets[offset].entry != entry)
+	{
+		return 0;
+	}
+	return offset;
+}
+
+/**
+ * Get or create the entry for id
+ */
+static entry_t *get_entry(private_mem_pool_t *this, identification_t *id)
+{
+	entry_t *entry;
+
+	entry = this->leases->get(this->leases, id);
+	if (!entry)
+	{
+		INIT(entry,
+			.id = id->clone(id),
+			.online = linked_list_create(),
+			.offline = linked_list_create(),
+		);
+		this->leases->put(this->leases, entry->id, entry);
+	}
+	return entry;
+}
+
 METHOD(mem_pool_t, get_name, const char*,
 	private_mem_pool_t *this)
 {
@@ -177,17 +346,10 @@ METHOD(mem_pool_t, get_size, u_int,
 METHOD(mem_pool_t, get_online, u_int,
 	private_mem_pool_t *this)
 {
-	enumerator_t *enumerator;
-	entry_t *entry;
-	u_int count = 0;
+	u_int count;
 
 	this->mutex->lock(this->mutex);
-	enumerator = this->leases->create_enumerator(this->leases);
-	while (enumerator->enumerate(enumerator, NULL, &entry))
-	{
-		count += entry->online->get_count(entry->online);
-	}
-	enumerator->destroy(enumerator);
+	count = this->online;
 	this->mutex->unlock(this->mutex);
 
 	return count;
@@ -196,32 +358,53 @@ METHOD(mem_pool_t, get_online, u_int,
 METHOD(mem_pool_t, get_offline, u_int,
 	private_mem_pool_t *this)
 {
-	enumerator_t *enumerator;
-	entry_t *entry;
-	u_int count = 0;
+	u_int count;
 
 	this->mutex->lock(this->mutex);
-	enumerator = this->leases->create_enumerator(this->leases);
-	while (enumerator->enumerate(enumerator, NULL, &entry))
-	{
-		count += entry->offline->get_count(entry->offline);
-	}
-	enumerator->destroy(enumerator);
+	count = this->offline;
 	this->mutex->unlock(this->mutex);
 
 	return count;
 }
 
+METHOD(mem_pool_t, get_stats, void,
+	private_mem_pool_t *this, mem_pool_stats_t *stats)
+{
+	u_int offset, run = 0;
+
+	this->mutex->lock(this->mutex);
+	*stats = (mem_pool_stats_t){
+		.size = this->size,
+		.online = this->online,
+		.offline = this->offline,
+	};
+	/* offline leases interrupted by online leases fragment the pool */
+	for (offset = this->unused_base + 1; offset <= this->unused + 1; offset++)
+	{
+		if (offset <= this->unused && !is_online(this, offset))
+		{
+			run++;
+		}
+		else if (run)
+		{
+			stats->ranges++;
+			stats->largest_range = max(stats->largest_range, run);
+			run = 0;
+		}
+	}
+	stats->unused = this->size - this->unused;
+	this->mutex->unlock(this->mutex);
+}
+
 /**
  * Get an existing lease for id
  */
 static int get_existing(private_mem_pool_t *this, identification_t *id,
 						host_t *requested)
 {
-	enumerator_t *enumerator;
 	uintptr_t current;
 	entry_t *entry;
-	int offset = 0;
+	u_int offset;
 
 	entry = this->leases->get(this->leases, id);
 	if (!entry)
@@ -230,36 +413,50 @@ static int get_existing(private_mem_pool_t *this, identification_t *id,
 	}
 
 	/* check for a valid offline lease, refresh */
-	enumerator = entry->offline->create_enumerator(entry->offline);
-	if (enumerator->enumerate(enumerator, &current))
+	if (entry->offline->remove_first(entry->offline,
+									 (void**)&current) == SUCCESS)
 	{
-		entry->offline->remove_at(entry->offline, enumerator);
+		lru_remove(this, current);
+		set_online(this, current, TRUE);
 		entry->online->insert_last(entry->online, (void*)current);
-		offset = current;
-	}
-	enumerator->destroy(enumerator);
-	if (offset)
-	{
 		DBG1(DBG_CFG, "reassigning offline lease to '%Y'", id);
-		return offset;
+		return current;
 	}
 
 	/* check for a valid online lease to reassign */
-	enumerator = entry->online->create_enumerator(entry->online);
-	while (enumerator->enumerate(enumerator, &current))
+	offset = get_owned(this, entry, requested);
+	if (offset && is_online(this, offset))
 	{
-		if (current == host2offset(this, requested))
-		{
-			offset = current;
-			break;
-		}
+		DBG1(DBG_CFG, "reassigning online lease to '%Y'", id);
+		return offset;
 	}
-	enumerator->destroy(enumerator);
-	if (offset)
+	return 0;
+}
+
+/**
+ * Allocate lease state for offsets up to "unused"
+ */
+static void grow(private_mem_pool_t *this)
+{
+	u_int allocated, words;
+
+	if (this->unused < this->allocated)
 	{
-		DBG1(DBG_CFG, "reassigning online lease to '%Y'", id);
+		return;
 	}
-	return offset;
+	allocated = max(64, this->allocated * 2);
+	allocated = min(allocated, this->size + 1);
+	allocated = max(allocated, this->unused + 1);
+	words = (allocated + MAP_BITS - 1) / MAP_BITS;
+
+	this->offsets = realloc(this->offsets, allocated * sizeof(lease_t));
+	memset(this->offsets + this->allocated, 0,
+		   (allocated - this->allocated) * sizeof(lease_t));
+	this->online_map = realloc(this->online_map, words * sizeof(u_int32_t));
+	memset(this->online_map + (this->allocated + MAP_BITS - 1) / MAP_BITS, 0,
+		   (words - (this->allocated + MAP_BITS - 1) / MAP_BITS) *
+		   sizeof(u_int32_t));
+	this->allocated = allocated;
 }
 
 /**
@@ -272,18 +469,12 @@ static int get_new(private_mem_pool_t *this, identification_t *id)
 
 	if (this->unused < this->size)
 	{
-		entry = this->leases->get(this->leases, id);
-		if (!entry)
-		{
-			INIT(entry,
-				.id = id->clone(id),
-				.online = linked_list_create(),
-				.offline = linked_list_create(),
-			);
-			this->leases->put(this->leases, entry->id, entry);
-		}
+		entry = get_entry(this, id);
 		/* assigning offset, starting by 1 */
 		offset = ++this->unused;
+		grow(this);
+		this->offsets[offset].entry = entry;
+		set_online(this, offset, TRUE);
 		entry->online->insert_last(entry->online, (void*)offset);
 		DBG1(DBG_CFG, "assigning new lease to '%Y'", id);
 	}
@@ -295,34 +486,25 @@ static int get_new(private_mem_pool_t *this, identification_t *id)
  */
 static int get_reassigned(private_mem_pool_t *this, identification_t *id)
 {
-	enumerator_t *enumerator;
 	entry_t *entry;
-	uintptr_t current, offset = 0;
-
-	enumerator = this->leases->create_enumerator(this->leases);
-	while (enumerator->enumerate(enumerator, NULL, &entry))
-	{
-		if (entry->offline->remove_first(entry->offline,
-										 (void**)&current) == SUCCESS)
-		{
-			offset = current;
-			DBG1(DBG_CFG, "reassigning existing offline lease by '%Y'"
-				 " to '%Y'", entry->id, id);
-			break;
-		}
-	}
-	enumerator->destroy(enumerator);
+	uintptr_t offset;
 
-	if (offset)
+	/* reassign the least recently released offline lease */
+	offset = this->lru_first;
+	if (!offset)
 	{
-		INIT(entry,
-			.id = id->clone(id),
-			.online = linked_list_create(),
-			.offline = linked_list_create(),
-		);
-		entry->online->insert_last(entry->online, (void*)offset);
-		this->leases->put(this->leases, entry->id, entry);
+		return 0;
 	}
+	entry = this->offsets[offset].entry;
+	entry->offline->remove(entry->offline, (void*)offset, NULL);
+	lru_remove(this, offset);
+	DBG1(DBG_CFG, "reassigning existing offline lease by '%Y'"
+		 " to '%Y'", entry->id, id);
+
+	entry = get_entry(this, id);
+	this->offsets[offset].entry = entry;
+	set_online(this, offset, TRUE);
+	entry->online->insert_last(entry->online, (void*)offset);
 	return offset;
 }
 
@@ -387,11 +569,14 @@ METHOD(mem_pool_t, release_address, bool,
 		entry = this->leases->get(this->leases, id);
 		if (entry)
 		{
-			offset = host2offset(this, address);
-			if (entry->online->remove(entry->online, (void*)offset, NULL) > 0)
+			offset = get_owned(this, entry, address);
+			if (offset && is_online(this, offset) &&
+				entry->online->remove(entry->online, (void*)offset, NULL) > 0)
 			{
 				DBG1(DBG_CFG, "lease %H by '%Y' went offline", address, id);
 				entry->offline->insert_last(entry->offline, (void*)offset);
+				set_online(this, offset, FALSE);
+				lru_append(this, offset);
 				found = TRUE;
 			}
 		}
@@ -506,6 +691,8 @@ METHOD(mem_pool_t, destroy, void,
 	enumerator->destroy(enumerator);
 
 	this->leases->destroy(this->leases);
+	free(this->offsets);
+	free(this->online_map);
 	this->mutex->destroy(this->mutex);
 	DESTROY_IF(this->base);
 	free(this->name);
@@ -526,6 +713,7 @@ static private_mem_pool_t *create_generic(char *name)
 			.get_size = _get_size,
 			.get_online = _get_online,
 			.get_offline = _get_offline,
+			.get_stats = _get_stats,
 			.acquire_address = _acquire_address,
 			.release_address = _release_address,
 			.create_lease_enumerator = _create_lease_enumerator,
@@ -566,6 +754,7 @@ mem_pool_t *mem_pool_create(char *name, host_t *base, int bits)
 		if (this->size > 2)
 		{	/* do not use first and last addresses of a block */
 			this->unused++;
+			this->unused_base++;
 			this->size -= 2;
 		}
 		this->base = base->clone(base);
@@ -22,6 +22,7 @@
 #define MEM_POOL_H
 
 typedef struct mem_pool_t mem_pool_t;
+typedef struct mem_pool_stats_t mem_pool_stats_t;
 typedef enum mem_pool_op_t mem_pool_op_t;
 
 #include <networking/host.h>
@@ -39,6 +40,24 @@ enum mem_pool_op_t {
 	MEM_POOL_REASSIGN,
 };
 
+/**
+ * Utilization statistics of a mem_pool_t.
+ */
+struct mem_pool_stats_t {
+	/** number of addresses in the pool */
+	u_int size;
+	/** number of online leases */
+	u_int online;
+	/** number of offline leases */
+	u_int offline;
+	/** number of addresses never assigned */
+	u_int unused;
+	/** number of address ranges consisting of offline leases only */
+	u_int ranges;
+	/** number of addresses in the largest range of offline leases */
+	u_int largest_range;
+};
+
 /**
  * An in-memory IP address pool.
  */
@@ -79,6 +98,13 @@ struct mem_pool_t {
 	 */
 	u_int (*get_offline)(mem_pool_t *this);
 
+	/**
+	 * Get utilization statistics of this pool.
+	 *
+	 * @param stats		receives pool statistics
+	 */
+	void (*get_stats)(mem_pool_t *this, mem_pool_stats_t *stats);
+
 	/**
 	 * Acquire an address for the given id from this pool.
 	 *
@@ -289,6 +289,12 @@ METHOD(kernel_interface_t, flush_policies, status_t,
 	return this->ipsec->flush_policies(this->ipsec);
 }
 
+METHOD(kernel_interface_t, create_batch, kernel_ipsec_batch_t*,
+	private_kernel_interface_t *this)
+{
+	return kernel_ipsec_batch_create(this->ipsec);
+}
+
 METHOD(kernel_interface_t, get_source_addr, host_t*,
 	private_kernel_interface_t *this, host_t *dest, host_t *src)
 {
@@ -736,6 +742,7 @@ kernel_interface_t *kernel_interface_create()
 			.query_policy = _query_policy,
 			.del_policy = _del_policy,
 			.flush_policies = _flush_policies,
+			.create_batch = _create_batch,
 			.get_source_addr = _get_source_addr,
 			.get_nexthop = _get_nexthop,
 			.get_interface = _get_interface,
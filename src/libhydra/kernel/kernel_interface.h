@@ -54,6 +54,7 @@ typedef enum kernel_feature_t kernel_feature_t;
 
 #include <kernel/kernel_listener.h>
 #include <kernel/kernel_ipsec.h>
+#include <kernel/kernel_ipsec_batch.h>
 #include <kernel/kernel_net.h>
 
 /**
@@ -299,6 +300,13 @@ struct kernel_interface_t {
 	 */
 	status_t (*flush_policies) (kernel_interface_t *this);
 
+	/**
+	 * Create a batch to install multiple SAs and policies at once.
+	 *
+	 * @return				batch, install it with commit()
+	 */
+	kernel_ipsec_batch_t* (*create_batch)(kernel_interface_t *this);
+
 	/**
 	 * Get our outgoing source address for a destination.
 	 *
@@ -25,6 +25,8 @@
 #define KERNEL_IPSEC_H_
 
 typedef struct kernel_ipsec_t kernel_ipsec_t;
+typedef struct kernel_ipsec_op_t kernel_ipsec_op_t;
+typedef enum kernel_ipsec_op_type_t kernel_ipsec_op_type_t;
 
 #include <networking/host.h>
 #include <ipsec/ipsec_types.h>
@@ -32,6 +34,83 @@ typedef struct kernel_ipsec_t kernel_ipsec_t;
 #include <plugins/plugin.h>
 #include <kernel/kernel_interface.h>
 
+/**
+ * Type of an operation in a batch passed to kernel_ipsec_t.commit_batch().
+ */
+enum kernel_ipsec_op_type_t {
+	/** install an SA, see kernel_ipsec_t.add_sa() */
+	KERNEL_IPSEC_OP_ADD_SA,
+	/** install a policy, see kernel_ipsec_t.add_policy() */
+	KERNEL_IPSEC_OP_ADD_POLICY,
+};
+
+/**
+ * An add_sa() or add_policy() operation queued in a kernel_ipsec_batch_t.
+ *
+ * Depending on the type either the sa or the policy member is used, the fields
+ * correspond to the arguments of the respective kernel_ipsec_t method.
+ */
+struct kernel_ipsec_op_t {
+
+	/**
+	 * Type of this operation
+	 */
+	kernel_ipsec_op_type_t type;
+
+	/**
+	 * Result of this operation, set by commit_batch()
+	 */
+	status_t status;
+
+	/**
+	 * Set by commit_batch() if the operation left state in the kernel or in
+	 * the backend which has to be removed with del_sa()/del_policy() if the
+	 * batch is rolled back
+	 */
+	bool applied;
+
+	/**
+	 * Arguments for KERNEL_IPSEC_OP_ADD_SA
+	 */
+	struct {
+		host_t *src;
+		host_t *dst;
+		u_int32_t spi;
+		u_int8_t protocol;
+		u_int32_t reqid;
+		mark_t mark;
+		u_int32_t tfc;
+		lifetime_cfg_t lifetime;
+		u_int16_t enc_alg;
+		chunk_t enc_key;
+		u_int16_t int_alg;
+		chunk_t int_key;
+		ipsec_mode_t mode;
+		u_int16_t ipcomp;
+		u_int16_t cpi;
+		bool encap;
+		bool esn;
+		bool inbound;
+		traffic_selector_t *src_ts;
+		traffic_selector_t *dst_ts;
+	} sa;
+
+	/**
+	 * Arguments for KERNEL_IPSEC_OP_ADD_POLICY
+	 */
+	struct {
+		host_t *src;
+		host_t *dst;
+		traffic_selector_t *src_ts;
+		traffic_selector_t *dst_ts;
+		policy_dir_t direction;
+		policy_type_t type;
+		ipsec_sa_cfg_t sa;
+		mark_t mark;
+		policy_priority_t priority;
+	} policy;
+};
+
 /**
  * Interface to the ipsec subsystem of the kernel.
  *
@@ -258,6 +337,22 @@ struct kernel_ipsec_t {
 	 */
 	status_t (*flush_policies) (kernel_ipsec_t *this);
 
+	/**
+	 * Install a batch of SAs and policies.
+	 *
+	 * This method is optional and may be NULL. Backends implement it if they
+	 * are able to pass multiple operations to the kernel at once, otherwise
+	 * the operations are executed one by one using add_sa()/add_policy().
+	 * The status and applied fields of all operations get updated, rolling
+	 * back the batch on failure is done by the caller.
+	 *
+	 * @param ops			operations to execute, in order
+	 * @param count			number of operations
+	 * @return				SUCCESS if all operations completed
+	 */
+	status_t (*commit_batch) (kernel_ipsec_t *this, kernel_ipsec_op_t *ops,
+							  int count);
+
 	/**
 	 * Install a bypass policy for the given socket.
 	 *
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "kernel_ipsec_batch.h"
+
+#include <utils/debug.h>
+
+typedef struct private_kernel_ipsec_batch_t private_kernel_ipsec_batch_t;
+
+/**
+ * Private data of a kernel_ipsec_batch_t object.
+ */
+struct private_kernel_ipsec_batch_t {
+
+	/**
+	 * Public kernel_ipsec_batch_t interface.
+	 */
+	kernel_ipsec_batch_t public;
+
+	/**
+	 * IPsec backend to install operations with
+	 */
+	kernel_ipsec_t *ipsec;
+
+	/**
+	 * Queued operations
+	 */
+	kernel_ipsec_op_t *ops;
+
+	/**
+	 * Number of queued operations
+	 */
+	int count;
+
+	/**
+	 * TRUE if the batch has been committed
+	 */
+	bool committed;
+};
+
+/**
+ * Append a new, zeroed operation of the given type
+ */
+static kernel_ipsec_op_t *append_op(private_kernel_ipsec_batch_t *this,
+									kernel_ipsec_op_type_t type)
+{
+	kernel_ipsec_op_t *op;
+
+	this->ops = realloc(this->ops, sizeof(kernel_ipsec_op_t) * (this->count + 1));
+	op = &this->ops[this->count++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->status = FAILED;
+	return op;
+}
+
+METHOD(kernel_ipsec_batch_t, add_sa, void,
+	private_kernel_ipsec_batch_t *this, host_t *src, host_t *dst,
+	u_int32_t spi, u_int8_t protocol, u_int32_t reqid, mark_t mark,
+	u_int32_t tfc, lifetime_cfg_t *lifetime, u_int16_t enc_alg, chunk_t enc_key,
+	u_int16_t int_alg, chunk_t int_key, ipsec_mode_t mode, u_int16_t ipcomp,
+	u_int16_t cpi, bool encap, bool esn, bool inbound,
+	traffic_selector_t *src_ts, traffic_selector_t *dst_ts)
+{
+	kernel_ipsec_op_t *op;
+
+	op = append_op(this, KERNEL_IPSEC_OP_ADD_SA);
+	op->sa.src = src->clone(src);
+	op->sa.dst = dst->clone(dst);
+	op->sa.spi = spi;
+	op->sa.protocol = protocol;
+	op->sa.reqid = reqid;
+	op->sa.mark = mark;
+	op->sa.tfc = tfc;
+	op->sa.lifetime = *lifetime;
+	op->sa.enc_alg = enc_alg;
+	op->sa.enc_key = chunk_clone(enc_key);
+	op->sa.int_alg = int_alg;
+	op->sa.int_key = chunk_clone(int_key);
+	op->sa.mode = mode;
+	op->sa.ipcomp = ipcomp;
+	op->sa.cpi = cpi;
+	op->sa.encap = encap;
+	op->sa.esn = esn;
+	op->sa.inbound = inbound;
+	op->sa.src_ts = src_ts ? src_ts->clone(src_ts) : NULL;
+	op->sa.dst_ts = dst_ts ? dst_ts->clone(dst_ts) : NULL;
+}
+
+METHOD(kernel_ipsec_batch_t, add_policy, void,
+	private_kernel_ipsec_batch_t *this, host_t *src, host_t *dst,
+	traffic_selector_t *src_ts, traffic_selector_t *dst_ts,
+	policy_dir_t direction, policy_type_t type, ipsec_sa_cfg_t *sa,
+	mark_t mark, policy_priority_t priority)
+{
+	kernel_ipsec_op_t *op;
+
+	op = append_op(this, KERNEL_IPSEC_OP_ADD_POLICY);
+	op->policy.src = src->clone(src);
+	op->policy.dst = dst->clone(dst);
+	op->policy.src_ts = src_ts->clone(src_ts);
+	op->policy.dst_ts = dst_ts->clone(dst_ts);
+	op->policy.direction = direction;
+	op->policy.type = type;
+	op->policy.sa = *sa;
+	op->policy.mark = mark;
+	op->policy.priority = priority;
+}
+
+METHOD(kernel_ipsec_batch_t, get_count, int,
+	private_kernel_ipsec_batch_t *this)
+{
+	return this->count;
+}
+
+/**
+ * Execute a single operation
+ */
+static void execute_op(private_kernel_ipsec_batch_t *this,
+					   kernel_ipsec_op_t *op)
+{
+	switch (op->type)
+	{
+		case KERNEL_IPSEC_OP_ADD_SA:
+			op->status = this->ipsec->add_sa(this->ipsec, op->sa.src,
+						op->sa.dst, op->sa.spi, op->sa.protocol, op->sa.reqid,
+						op->sa.mark, op->sa.tfc, &op->sa.lifetime,
+						op->sa.enc_alg, op->sa.enc_key, op->sa.int_alg,
+						op->sa.int_key, op->sa.mode, op->sa.ipcomp, op->sa.cpi,
+						op->sa.encap, op->sa.esn, op->sa.inbound,
+						op->sa.src_ts, op->sa.dst_ts);
+			op->applied = op->status == SUCCESS;
+			break;
+		case KERNEL_IPSEC_OP_ADD_POLICY:
+			op->status = this->ipsec->add_policy(this->ipsec, op->policy.src,
+						op->policy.dst, op->policy.src_ts, op->policy.dst_ts,
+						op->policy.direction, op->policy.type, &op->policy.sa,
+						op->policy.mark, op->policy.priority);
+			/* backends keep track of policies even if installing them fails,
+			 * so they always have to be removed again */
+			op->applied = TRUE;
+			break;
+	}
+}
+
+/**
+ * Revert a previously executed operation
+ */
+static void revert_op(private_kernel_ipsec_batch_t *this,
+					  kernel_ipsec_op_t *op)
+{
+	switch (op->type)
+	{
+		case KERNEL_IPSEC_OP_ADD_SA:
+			this->ipsec->del_sa(this->ipsec, op->sa.src, op->sa.dst,
+						op->sa.spi, op->sa.protocol, op->sa.cpi, op->sa.mark);
+			break;
+		case KERNEL_IPSEC_OP_ADD_POLICY:
+			this->ipsec->del_policy(this->ipsec, op->policy.src_ts,
+						op->policy.dst_ts, op->policy.direction,
+						op->policy.sa.reqid, op->policy.mark,
+						op->policy.priority);
+			break;
+	}
+	op->applied = FALSE;
+}
+
+METHOD(kernel_ipsec_batch_t, commit, status_t,
+	private_kernel_ipsec_batch_t *this)
+{
+	status_t status = SUCCESS;
+	int i;
+
+	if (!this->ipsec)
+	{
+		return NOT_SUPPORTED;
+	}
+	if (this->committed)
+	{
+		return INVALID_STATE;
+	}
+	this->committed = TRUE;
+	if (!this->count)
+	{
+		return SUCCESS;
+	}
+
+	if (this->ipsec->commit_batch)
+	{
+		status = this->ipsec->commit_batch(this->ipsec, this->ops, this->count);
+	}
+	else
+	{	/* stop at the first failure, we roll back anyway */
+		for (i = 0; i < this->count && status == SUCCESS; i++)
+		{
+			execute_op(this, &this->ops[i]);
+			status = this->ops[i].status;
+		}
+	}
+	if (status != SUCCESS)
+	{
+		DBG1(DBG_KNL, "installing batch of %d SAs/policies failed, rolling "
+			 "back", this->count);
+		for (i = this->count - 1; i >= 0; i--)
+		{
+			if (this->ops[i].applied)
+			{
+				revert_op(this, &this->ops[i]);
+			}
+		}
+	}
+	return status;
+}
+
+METHOD(kernel_ipsec_batch_t, destroy, void,
+	private_kernel_ipsec_batch_t *this)
+{
+	kernel_ipsec_op_t *op;
+	int i;
+
+	for (i = 0; i < this->count; i++)
+	{
+		op = &this->ops[i];
+		switch (op->type)
+		{
+			case KERNEL_IPSEC_OP_ADD_SA:
+				op->sa.src->destroy(op->sa.src);
+				op->sa.dst->destroy(op->sa.dst);
+				chunk_clear(&op->sa.enc_key);
+				chunk_clear(&op->sa.int_key);
+				DESTROY_IF(op->sa.src_ts);
+				DESTROY_IF(op->sa.dst_ts);
+				break;
+			case KERNEL_IPSEC_OP_ADD_POLICY:
+				op->policy.src->destroy(op->policy.src);
+				op->policy.dst->destroy(op->policy.dst);
+				op->policy.src_ts->destroy(op->policy.src_ts);
+				op->policy.dst_ts->destroy(op->policy.dst_ts);
+				break;
+		}
+	}
+	free(this->ops);
+	free(this);
+}
+
+/**
+ * See header
+ */
+kernel_ipsec_batch_t *kernel_ipsec_batch_create(kernel_ipsec_t *ipsec)
+{
+	private_kernel_ipsec_batch_t *this;
+
+	INIT(this,
+		.public = {
+			.add_sa = _add_sa,
+			.add_policy = _add_policy,
+			.get_count = _get_count,
+			.commit = _commit,
+			.destroy = _destroy,
+		},
+		.ipsec = ipsec,
+	);
+
+	return &this->public;
+}
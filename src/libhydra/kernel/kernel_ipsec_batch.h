@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup kernel_ipsec_batch kernel_ipsec_batch
+ * @{ @ingroup hkernel
+ */
+
+#ifndef KERNEL_IPSEC_BATCH_H_
+#define KERNEL_IPSEC_BATCH_H_
+
+typedef struct kernel_ipsec_batch_t kernel_ipsec_batch_t;
+
+#include <kernel/kernel_ipsec.h>
+
+/**
+ * Transactional batch of SA and policy installations.
+ *
+ * Operations are queued with add_sa()/add_policy(), which take the same
+ * arguments as the kernel_interface_t methods, and are installed together
+ * with commit(). Backends supporting it pass the whole batch to the kernel at
+ * once, otherwise the operations are executed one after the other. If any
+ * operation fails, all installed SAs and policies of the batch are removed
+ * again.
+ */
+struct kernel_ipsec_batch_t {
+
+	/**
+	 * Queue an SA installation, see kernel_interface_t.add_sa().
+	 *
+	 * All arguments are copied.
+	 */
+	void (*add_sa)(kernel_ipsec_batch_t *this,
+				   host_t *src, host_t *dst, u_int32_t spi,
+				   u_int8_t protocol, u_int32_t reqid,
+				   mark_t mark, u_int32_t tfc, lifetime_cfg_t *lifetime,
+				   u_int16_t enc_alg, chunk_t enc_key,
+				   u_int16_t int_alg, chunk_t int_key,
+				   ipsec_mode_t mode, u_int16_t ipcomp, u_int16_t cpi,
+				   bool encap, bool esn, bool inbound,
+				   traffic_selector_t *src_ts, traffic_selector_t *dst_ts);
+
+	/**
+	 * Queue a policy installation, see kernel_interface_t.add_policy().
+	 *
+	 * All arguments are copied.
+	 */
+	void (*add_policy)(kernel_ipsec_batch_t *this,
+					   host_t *src, host_t *dst,
+					   traffic_selector_t *src_ts,
+					   traffic_selector_t *dst_ts,
+					   policy_dir_t direction, policy_type_t type,
+					   ipsec_sa_cfg_t *sa, mark_t mark,
+					   policy_priority_t priority);
+
+	/**
+	 * Get the number of queued operations.
+	 *
+	 * @return				number of operations
+	 */
+	int (*get_count)(kernel_ipsec_batch_t *this);
+
+	/**
+	 * Install all queued operations.
+	 *
+	 * On failure, everything installed by this batch is removed again. A
+	 * batch can be committed only once.
+	 *
+	 * @return				SUCCESS if all operations completed
+	 */
+	status_t (*commit)(kernel_ipsec_batch_t *this);
+
+	/**
+	 * Destroy a kernel_ipsec_batch_t.
+	 */
+	void (*destroy)(kernel_ipsec_batch_t *this);
+};
+
+/**
+ * Create a kernel_ipsec_batch_t instance.
+ *
+ * @param ipsec			IPsec backend to install the batch with, NULL if none
+ * @return				batch instance
+ */
+kernel_ipsec_batch_t *kernel_ipsec_batch_create(kernel_ipsec_t *ipsec);
+
+#endif /** KERNEL_IPSEC_BATCH_H_ @}*/
@@ -1,4 +1,5 @@
 /*
+ * Copyright (C) 2013 revosec AG
  * Copyright (C) 2008 Martin Willi
  * Hochschule fuer Technik Rapperswil
  *
@@ -17,9 +18,28 @@
 
 #include <utils/debug.h>
 #include <library.h>
+#include <collections/hashtable.h>
+#include <collections/linked_list.h>
+#include <threading/mutex.h>
+#include <processing/jobs/callback_job.h>
 
 #include "sql_attribute.h"
 
+/**
+ * Default number of free addresses fetched at once
+ */
+#define PREFETCH_DEFAULT 16
+
+/**
+ * Default lifetime of cached pool lookups, in seconds
+ */
+#define CACHE_LIFETIME_DEFAULT 60
+
+/**
+ * Default delay before released leases get written, in ms
+ */
+#define RELEASE_DELAY_DEFAULT 1000
+
 typedef struct private_sql_attribute_t private_sql_attribute_t;
 
 /**
@@ -41,15 +61,215 @@ struct private_sql_attribute_t {
 	 * whether to record lease history in lease table
 	 */
 	bool history;
+
+	/**
+	 * Cached pool lookups, name => pool_entry_t
+	 */
+	hashtable_t *pools;
+
+	/**
+	 * Cached identity rows, identification_t => identity_entry_t
+	 */
+	hashtable_t *identities;
+
+	/**
+	 * Leases released but not yet written, as release_t
+	 */
+	linked_list_t *releases;
+
+	/**
+	 * Latest not yet written release per pool and identity, release_t
+	 */
+	hashtable_t *pending;
+
+	/**
+	 * TRUE if a job to write released leases is scheduled
+	 */
+	bool flush_scheduled;
+
+	/**
+	 * Number of free addresses fetched at once
+	 */
+	u_int prefetch;
+
+	/**
+	 * Lifetime of cached pool lookups, in seconds
+	 */
+	u_int cache_lifetime;
+
+	/**
+	 * Delay before released leases get written, in ms, 0 to write instantly
+	 */
+	u_int release_delay;
+
+	/**
+	 * Mutex protecting caches and pending releases, not held during database
+	 * queries
+	 */
+	mutex_t *mutex;
+
+	/**
+	 * Mutex held while writing released leases
+	 */
+	mutex_t *flush_mutex;
 };
 
+/**
+ * Cached lookup of a pool
+ */
+typedef struct {
+	/** name of the pool */
+	char *name;
+	/** row of the pool */
+	u_int id;
+	/** lease timeout of the pool */
+	u_int timeout;
+	/** first address of the pool */
+	chunk_t start;
+	/** last address of the pool */
+	chunk_t end;
+	/** monotonic time the lookup has to be refreshed */
+	time_t expires;
+	/** prefetched free addresses, as candidate_t */
+	linked_list_t *candidates;
+} pool_entry_t;
+
+/**
+ * Free address fetched from a pool, not yet claimed
+ */
+typedef struct {
+	/** row of the address */
+	u_int id;
+	/** the address */
+	chunk_t address;
+} candidate_t;
+
+/**
+ * Cached row of an identity
+ */
+typedef struct {
+	/** the identity */
+	identification_t *id;
+	/** row of the identity */
+	u_int row;
+} identity_entry_t;
+
+/**
+ * Released lease, not yet written
+ */
+typedef struct {
+	/** row of the pool */
+	u_int pool;
+	/** row of the identity */
+	u_int identity;
+	/** released address */
+	host_t *address;
+	/** time of release */
+	time_t released;
+	/** TRUE if the lease has been acquired again before being written */
+	bool reacquired;
+} release_t;
+
+/**
+ * Destroy a candidate_t
+ */
+static void candidate_destroy(candidate_t *this)
+{
+	free(this->address.ptr);
+	free(this);
+}
+
+/**
+ * Destroy a pool_entry_t
+ */
+static void pool_entry_destroy(pool_entry_t *this)
+{
+	this->candidates->destroy_function(this->candidates,
+									   (void*)candidate_destroy);
+	free(this->start.ptr);
+	free(this->end.ptr);
+	free(this->name);
+	free(this);
+}
+
+/**
+ * Destroy a release_t
+ */
+static void release_destroy(release_t *this)
+{
+	this->address->destroy(this->address);
+	free(this);
+}
+
+/**
+ * Hash function for pool names
+ */
+static u_int name_hash(char *name)
+{
+	return chunk_hash(chunk_from_str(name));
+}
+
+/**
+ * Equals function for pool names
+ */
+static bool name_equals(char *a, char *b)
+{
+	return streq(a, b);
+}
+
+/**
+ * Hash function for identities
+ */
+static u_int id_hash(identification_t *id)
+{
+	return id->hash(id, 0);
+}
+
+/**
+ * Equals function for identities
+ */
+static bool id_equals(identification_t *a, identification_t *b)
+{
+	return a->equals(a, b);
+}
+
+/**
+ * Hash function for pending releases, by pool and identity
+ */
+static u_int release_hash(release_t *this)
+{
+	return chunk_hash_inc(chunk_from_thing(this->pool),
+						  chunk_hash(chunk_from_thing(this->identity)));
+}
+
+/**
+ * Equals function for pending releases, by pool and identity
+ */
+static bool release_equals(release_t *a, release_t *b)
+{
+	return a->pool == b->pool && a->identity == b->identity;
+}
+
 /**
  * lookup/insert an identity
  */
 static u_int get_identity(private_sql_attribute_t *this, identification_t *id)
 {
+	identity_entry_t *entry;
 	enumerator_t *e;
-	u_int row;
+	u_int row = 0;
+
+	this->mutex->lock(this->mutex);
+	entry = this->identities->get(this->identities, id);
+	if (entry)
+	{
+		row = entry->row;
+	}
+	this->mutex->unlock(this->mutex);
+	if (row)
+	{
+		return row;
+	}
 
 	/* look for peer identity in the identities table */
 	e = this->db->query(this->db,
@@ -57,20 +277,30 @@ static u_int get_identity(private_sql_attribute_t *this, identification_t *id)
 						DB_INT, id->get_type(id), DB_BLOB, id->get_encoding(id),
 						DB_UINT);
 
-	if (e && e->enumerate(e, &row))
+	if (!e || !e->enumerate(e, &row))
 	{
-		e->destroy(e);
-		return row;
+		row = 0;
 	}
 	DESTROY_IF(e);
 	/* not found, insert new one */
-	if (this->db->execute(this->db, &row,
+	if (!row && this->db->execute(this->db, &row,
 				  "INSERT INTO identities (type, data) VALUES (?, ?)",
-				  DB_INT, id->get_type(id), DB_BLOB, id->get_encoding(id)) == 1)
+				  DB_INT, id->get_type(id), DB_BLOB, id->get_encoding(id)) != 1)
 	{
-		return row;
+		return 0;
+	}
+	/* identities never get deleted, so we cache them indefinitely */
+	this->mutex->lock(this->mutex);
+	if (!this->identities->get(this->identities, id))
+	{
+		INIT(entry,
+			.id = id->clone(id),
+			.row = row,
+		);
+		this->identities->put(this->identities, entry->id, entry);
 	}
-	return 0;
+	this->mutex->unlock(this->mutex);
+	return row;
 }
 
 /**
@@ -93,30 +323,155 @@ static u_int get_attr_pool(private_sql_attribute_t *this, char *name)
 	return row;
 }
 
+/**
+ * Look up a pool in the database, returns a new pool_entry_t or NULL if the
+ * pool does not exist
+ */
+static pool_entry_t *query_pool(private_sql_attribute_t *this, char *name,
+								time_t now)
+{
+	pool_entry_t *entry = NULL;
+	enumerator_t *e;
+	chunk_t start, end;
+	u_int id, timeout;
+
+	e = this->db->query(this->db,
+				"SELECT id, start, end, timeout FROM pools WHERE name = ?",
+				DB_TEXT, name, DB_UINT, DB_BLOB, DB_BLOB, DB_UINT);
+	if (e && e->enumerate(e, &id, &start, &end, &timeout))
+	{
+		INIT(entry,
+			.name = strdup(name),
+			.id = id,
+			.timeout = timeout,
+			.start = chunk_clone(start),
+			.end = chunk_clone(end),
+			.expires = now + this->cache_lifetime,
+			.candidates = linked_list_create(),
+		);
+	}
+	DESTROY_IF(e);
+	return entry;
+}
+
+/**
+ * Get a cached pool lookup by name, refreshing it if required. The database
+ * is queried without holding the mutex. Returns the entry with the mutex
+ * held, or NULL without holding the mutex if the pool does not exist.
+ */
+static pool_entry_t *get_pool_entry(private_sql_attribute_t *this, char *name)
+{
+	pool_entry_t *entry, *found;
+	time_t now;
+
+	now = time_monotonic(NULL);
+	this->mutex->lock(this->mutex);
+	entry = this->pools->get(this->pools, name);
+	if (entry && entry->expires > now)
+	{
+		return entry;
+	}
+	this->mutex->unlock(this->mutex);
+
+	found = query_pool(this, name, now);
+
+	this->mutex->lock(this->mutex);
+	/* the cache might have been updated in the meantime */
+	entry = this->pools->get(this->pools, name);
+	if (!found)
+	{	/* don't cache failed lookups, the pool might get created later */
+		if (entry)
+		{
+			this->pools->remove(this->pools, name);
+			pool_entry_destroy(entry);
+		}
+		this->mutex->unlock(this->mutex);
+		return NULL;
+	}
+	if (entry && entry->id == found->id &&
+		chunk_equals(entry->start, found->start) &&
+		chunk_equals(entry->end, found->end))
+	{	/* pool unchanged, keep the prefetched addresses */
+		entry->timeout = found->timeout;
+		entry->expires = found->expires;
+		pool_entry_destroy(found);
+		return entry;
+	}
+	if (entry)
+	{	/* pool got replaced, prefetched addresses are invalid */
+		this->pools->remove(this->pools, name);
+		pool_entry_destroy(entry);
+	}
+	this->pools->put(this->pools, found->name, found);
+	return found;
+}
+
 /**
  * Lookup pool by name and address family
  */
 static u_int get_pool(private_sql_attribute_t *this, char *name, int family,
 					  u_int *timeout)
 {
-	enumerator_t *e;
-	chunk_t start;
-	u_int pool;
+	pool_entry_t *entry;
+	u_int pool = 0;
 
-	e = this->db->query(this->db,
-						"SELECT id, start, timeout FROM pools WHERE name = ?",
-						DB_TEXT, name, DB_UINT, DB_BLOB, DB_UINT);
-	if (e && e->enumerate(e, &pool, &start, timeout))
+	entry = get_pool_entry(this, name);
+	if (entry)
 	{
-		if ((family == AF_INET  && start.len == 4) ||
-			(family == AF_INET6 && start.len == 16))
+		if ((family == AF_INET  && entry->start.len == 4) ||
+			(family == AF_INET6 && entry->start.len == 16))
 		{
-			e->destroy(e);
-			return pool;
+			pool = entry->id;
+			*timeout = entry->timeout;
 		}
+		this->mutex->unlock(this->mutex);
 	}
-	DESTROY_IF(e);
-	return 0;
+	return pool;
+}
+
+/**
+ * Check if an address is in the range of a pool
+ */
+static bool in_pool(private_sql_attribute_t *this, char *name, host_t *host)
+{
+	pool_entry_t *entry;
+	chunk_t address;
+	bool found = FALSE;
+
+	address = host->get_address(host);
+	this->mutex->lock(this->mutex);
+	entry = this->pools->get(this->pools, name);
+	if (entry && address.len == entry->start.len &&
+		address.len == entry->end.len)
+	{
+		found = memcmp(address.ptr, entry->start.ptr, address.len) >= 0 &&
+				memcmp(address.ptr, entry->end.ptr, address.len) <= 0;
+	}
+	this->mutex->unlock(this->mutex);
+	return found;
+}
+
+/**
+ * Get a not yet written release of a lease in a pool, marking it reacquired
+ */
+static host_t* reacquire_release(private_sql_attribute_t *this, u_int pool,
+								 u_int identity)
+{
+	release_t *release, key = {
+		.pool = pool,
+		.identity = identity,
+	};
+	host_t *host = NULL;
+
+	this->mutex->lock(this->mutex);
+	release = this->pending->remove(this->pending, &key);
+	if (release)
+	{
+		release->reacquired = TRUE;
+		host = release->address->clone(release->address);
+	}
+	this->mutex->unlock(this->mutex);
+	return host;
 }
 
 /**
@@ -125,6 +480,20 @@ static u_int get_pool(private_sql_attribute_t *this, char *name, int family,
 static host_t* check_lease(private_sql_attribute_t *this, char *name,
 						   u_int pool, u_int identity)
 {
+	host_t *host;
+
+	/* the lease is still active in the database if its release is pending */
+	host = reacquire_release(this, pool, identity);
+	if (host)
+	{
+		DBG1(DBG_CFG, "acquired existing lease for address %H in"
+			 " pool '%s'", host, name);
+		return host;
+	}
+	/* wait for releases currently being written */
+	this->flush_mutex->lock(this->flush_mutex);
+	this->flush_mutex->unlock(this->flush_mutex);
+
 	while (TRUE)
 	{
 		u_int id;
@@ -149,8 +518,6 @@ static host_t* check_lease(private_sql_attribute_t *this, char *name,
 				"WHERE id = ? AND identity = ? AND released != 0",
 				DB_UINT, now, DB_UINT, id, DB_UINT, identity) > 0)
 		{
-			host_t *host;
-
 			host = host_create_from_chunk(AF_UNSPEC, address, 0);
 			if (host)
 			{
@@ -164,46 +531,115 @@ static host_t* check_lease(private_sql_attribute_t *this, char *name,
 }
 
 /**
- * We check for unallocated addresses or expired leases. First we select an
- * address as a candidate, but double check later on if it is still available
- * during the update operation. This allows us to work without locking.
+ * Fetch a batch of unallocated addresses or expired leases, as candidate_t
  */
-static host_t* get_lease(private_sql_attribute_t *this, char *name,
-						 u_int pool, u_int timeout, u_int identity)
+static linked_list_t *prefetch(private_sql_attribute_t *this, u_int pool,
+							   u_int timeout)
 {
-	while (TRUE)
-	{
-		u_int id;
-		chunk_t address;
-		enumerator_t *e;
-		time_t now = time(NULL);
-		int hits;
+	linked_list_t *candidates;
+	candidate_t *candidate;
+	enumerator_t *e;
+	chunk_t address;
+	u_int id;
 
-		if (timeout)
-		{
-			/* check for an expired lease */
-			e = this->db->query(this->db,
+	if (timeout)
+	{
+		/* check for expired leases */
+		e = this->db->query(this->db,
 				"SELECT id, address FROM addresses "
-				"WHERE pool = ? AND released != 0 AND released < ? LIMIT 1",
-				DB_UINT, pool, DB_UINT, now - timeout, DB_UINT, DB_BLOB);
-		}
-		else
-		{
-			/* with static leases, check for an unallocated address */
-			e = this->db->query(this->db,
+				"WHERE pool = ? AND released != 0 AND released < ? LIMIT ?",
+				DB_UINT, pool, DB_UINT, time(NULL) - timeout,
+				DB_UINT, this->prefetch, DB_UINT, DB_BLOB);
+	}
+	else
+	{
+		/* with static leases, check for unallocated addresses */
+		e = this->db->query(this->db,
 				"SELECT id, address FROM addresses "
-				"WHERE pool = ? AND identity = 0 LIMIT 1",
-				DB_UINT, pool, DB_UINT, DB_BLOB);
+				"WHERE pool = ? AND identity = 0 LIMIT ?",
+				DB_UINT, pool, DB_UINT, this->prefetch, DB_UINT, DB_BLOB);
+	}
+	candidates = linked_list_create();
+	while (e && e->enumerate(e, &id, &address))
+	{
+		INIT(candidate,
+			.id = id,
+			.address = chunk_clone(address),
+		);
+		candidates->insert_last(candidates, candidate);
+	}
+	DESTROY_IF(e);
+	return candidates;
+}
 
-		}
+/**
+ * Get the next prefetched free address of a pool
+ */
+static candidate_t *get_candidate(private_sql_attribute_t *this, char *name)
+{
+	candidate_t *candidate = NULL;
+	linked_list_t *candidates;
+	pool_entry_t *entry;
+	u_int pool, timeout;
 
-		if (!e || !e->enumerate(e, &id, &address))
+	entry = get_pool_entry(this, name);
+	if (!entry)
+	{
+		return NULL;
+	}
+	if (entry->candidates->get_count(entry->candidates) == 0)
+	{
+		pool = entry->id;
+		timeout = entry->timeout;
+		this->mutex->unlock(this->mutex);
+
+		/* concurrent fetches might return the same addresses, which is fine
+		 * as we double check them when updating the lease */
+		candidates = prefetch(this, pool, timeout);
+
+		this->mutex->lock(this->mutex);
+		entry = this->pools->get(this->pools, name);
+		if (entry && entry->id == pool)
 		{
-			DESTROY_IF(e);
-			break;
+			while (candidates->remove_first(candidates,
+											(void**)&candidate) == SUCCESS)
+			{
+				entry->candidates->insert_last(entry->candidates, candidate);
+			}
+			candidate = NULL;
 		}
-		address = chunk_clonea(address);
-		e->destroy(e);
+		candidates->destroy_function(candidates, (void*)candidate_destroy);
+		if (!entry)
+		{	/* removed in the meantime */
+			this->mutex->unlock(this->mutex);
+			return NULL;
+		}
+	}
+	if (entry->candidates->remove_first(entry->candidates,
+										(void**)&candidate) != SUCCESS)
+	{	/* pool is exhausted, or might have been replaced */
+		entry->expires = 0;
+	}
+	this->mutex->unlock(this->mutex);
+	return candidate;
+}
+
+/**
+ * We check for unallocated addresses or expired leases. Candidates get
+ * fetched in batches and are shared by all threads, but we double check if
+ * they are still available during the update operation. This allows us to work
+ * without locking the database.
+ */
+static host_t* get_lease(private_sql_attribute_t *this, char *name,
+						 u_int pool, u_int timeout, u_int identity)
+{
+	candidate_t *candidate;
+	host_t *host;
+	int hits;
+
+	while ((candidate = get_candidate(this, name)))
+	{
+		time_t now = time(NULL);
 
 		if (timeout)
 		{
@@ -212,7 +648,7 @@ static host_t* get_lease(private_sql_attribute_t *this, char *name,
 						"acquired = ?, released = 0, identity = ? "
 						"WHERE id = ? AND released != 0 AND released < ?",
 						DB_UINT, now, DB_UINT, identity,
-						DB_UINT, id, DB_UINT, now - timeout);
+						DB_UINT, candidate->id, DB_UINT, now - timeout);
 		}
 		else
 		{
@@ -220,19 +656,25 @@ static host_t* get_lease(private_sql_attribute_t *this, char *name,
 						"UPDATE addresses SET "
 						"acquired = ?, released = 0, identity = ? "
 						"WHERE id = ? AND identity = 0",
-						DB_UINT, now, DB_UINT, identity, DB_UINT, id);
+						DB_UINT, now, DB_UINT, identity,
+						DB_UINT, candidate->id);
 		}
 		if (hits > 0)
 		{
-			host_t *host;
-
-			host = host_create_from_chunk(AF_UNSPEC, address, 0);
+			host = host_create_from_chunk(AF_UNSPEC, candidate->address, 0);
+			candidate_destroy(candidate);
 			if (host)
 			{
 				DBG1(DBG_CFG, "acquired new lease for address %H in pool '%s'",
 					 host, name);
 				return host;
 			}
+			continue;
+		}
+		candidate_destroy(candidate);
+		if (hits < 0)
+		{	/* database failure, don't refetch the same candidates */
+			break;
 		}
 	}
 	DBG1(DBG_CFG, "no available address found in pool '%s'", name);
@@ -291,13 +733,155 @@ METHOD(attribute_provider_t, acquire_address, host_t*,
 	return address;
 }
 
+/**
+ * Write the release of a lease in a pool
+ */
+static bool release_lease(private_sql_attribute_t *this, u_int pool,
+						  host_t *address, time_t released)
+{
+	if (this->db->execute(this->db, NULL,
+			"UPDATE addresses SET released = ? WHERE "
+			"pool = ? AND address = ?", DB_UINT, released,
+			DB_UINT, pool, DB_BLOB, address->get_address(address)) > 0)
+	{
+		if (this->history)
+		{
+			this->db->execute(this->db, NULL,
+				"INSERT INTO leases (address, identity, acquired, released)"
+				" SELECT id, identity, acquired, ? FROM addresses "
+				" WHERE pool = ? AND address = ?",
+				DB_UINT, released, DB_UINT, pool,
+				DB_BLOB, address->get_address(address));
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * Write not yet written releases within a single transaction
+ */
+static job_requeue_t flush_releases(private_sql_attribute_t *this)
+{
+	release_t *release;
+	linked_list_t *releases;
+	hashtable_t *pending;
+	bool transaction;
+
+	this->flush_mutex->lock(this->flush_mutex);
+	this->mutex->lock(this->mutex);
+	releases = this->releases;
+	pending = this->pending;
+	this->releases = linked_list_create();
+	this->pending = hashtable_create((hashtable_hash_t)release_hash,
+									 (hashtable_equals_t)release_equals, 32);
+	this->flush_scheduled = FALSE;
+	this->mutex->unlock(this->mutex);
+	pending->destroy(pending);
+
+	transaction = this->db->transaction(this->db);
+	while (releases->remove_first(releases, (void**)&release) == SUCCESS)
+	{
+		if (!release->reacquired)
+		{
+			release_lease(this, release->pool, release->address,
+						  release->released);
+		}
+		release_destroy(release);
+	}
+	if (transaction)
+	{
+		this->db->commit(this->db);
+	}
+	releases->destroy(releases);
+	this->flush_mutex->unlock(this->flush_mutex);
+	return JOB_REQUEUE_NONE;
+}
+
+/**
+ * Queue a released lease to write it delayed
+ */
+static void queue_release(private_sql_attribute_t *this, u_int pool,
+						  u_int identity, host_t *address)
+{
+	release_t *release;
+	callback_job_t *job;
+	bool schedule = FALSE;
+
+	INIT(release,
+		.pool = pool,
+		.identity = identity,
+		.address = address->clone(address),
+		.released = time(NULL),
+	);
+
+	this->mutex->lock(this->mutex);
+	this->releases->insert_last(this->releases, release);
+	/* replaces a release of another lease of the same identity, if any, which
+	 * is still written */
+	this->pending->put(this->pending, release, release);
+	if (!this->flush_scheduled)
+	{
+		this->flush_scheduled = schedule = TRUE;
+	}
+	this->mutex->unlock(this->mutex);
+
+	if (schedule)
+	{
+		job = callback_job_create((callback_job_cb_t)flush_releases,
+								  this, NULL, NULL);
+		lib->scheduler->schedule_job_ms(lib->scheduler, (job_t*)job,
+										this->release_delay);
+	}
+}
+
+/**
+ * Check if a not yet written release of an address is pending
+ */
+static bool release_pending(private_sql_attribute_t *this, u_int pool,
+							u_int identity, host_t *address)
+{
+	release_t *release, key = {
+		.pool = pool,
+		.identity = identity,
+	};
+	bool pending;
+
+	this->mutex->lock(this->mutex);
+	release = this->pending->get(this->pending, &key);
+	pending = release && address->ip_equals(address, release->address);
+	this->mutex->unlock(this->mutex);
+	return pending;
+}
+
+/**
+ * Check if an address has a row in a pool
+ */
+static bool lease_exists(private_sql_attribute_t *this, u_int pool,
+						 host_t *address)
+{
+	enumerator_t *e;
+	u_int id;
+	bool found = FALSE;
+
+	e = this->db->query(this->db,
+				"SELECT id FROM addresses WHERE pool = ? AND address = ?",
+				DB_UINT, pool, DB_BLOB, address->get_address(address),
+				DB_UINT);
+	if (e && e->enumerate(e, &id))
+	{
+		found = TRUE;
+	}
+	DESTROY_IF(e);
+	return found;
+}
+
 METHOD(attribute_provider_t, release_address, bool,
 	private_sql_attribute_t *this, linked_list_t *pools, host_t *address,
 	identification_t *id)
 {
 	enumerator_t *enumerator;
-	u_int pool, timeout;
-	time_t now = time(NULL);
+	u_int pool, timeout, identity;
 	bool found = FALSE;
 	char *name;
 	int family;
@@ -311,20 +895,33 @@ METHOD(attribute_provider_t, release_address, bool,
 		{
 			continue;
 		}
-		if (this->db->execute(this->db, NULL,
-				"UPDATE addresses SET released = ? WHERE "
-				"pool = ? AND address = ?", DB_UINT, time(NULL),
-				DB_UINT, pool, DB_BLOB, address->get_address(address)) > 0)
+		if (this->release_delay)
 		{
-			if (this->history)
+			if (!in_pool(this, name, address))
 			{
-				this->db->execute(this->db, NULL,
-					"INSERT INTO leases (address, identity, acquired, released)"
-					" SELECT id, identity, acquired, ? FROM addresses "
-					" WHERE pool = ? AND address = ?",
-					DB_UINT, now, DB_UINT, pool,
-					DB_BLOB, address->get_address(address));
+				continue;
+			}
+			identity = get_identity(this, id);
+			if (!identity)
+			{
+				found = release_lease(this, pool, address, time(NULL));
+			}
+			else if (release_pending(this, pool, identity, address))
+			{	/* already released */
+				found = FALSE;
+			}
+			else if (lease_exists(this, pool, address))
+			{
+				queue_release(this, pool, identity, address);
+				found = TRUE;
+			}
+			if (found)
+			{
+				break;
 			}
+		}
+		else if (release_lease(this, pool, address, time(NULL)))
+		{
 			found = TRUE;
 			break;
 		}
@@ -436,6 +1033,34 @@ METHOD(attribute_provider_t, create_attribute_enumerator, enumerator_t*,
 METHOD(sql_attribute_t, destroy, void,
 	private_sql_attribute_t *this)
 {
+	enumerator_t *enumerator;
+	identity_entry_t *identity;
+	pool_entry_t *pool;
+	void *key;
+
+	flush_releases(this);
+	this->releases->destroy(this->releases);
+	this->pending->destroy(this->pending);
+
+	enumerator = this->pools->create_enumerator(this->pools);
+	while (enumerator->enumerate(enumerator, &key, &pool))
+	{
+		pool_entry_destroy(pool);
+	}
+	enumerator->destroy(enumerator);
+	this->pools->destroy(this->pools);
+
+	enumerator = this->identities->create_enumerator(this->identities);
+	while (enumerator->enumerate(enumerator, &key, &identity))
+	{
+		identity->id->destroy(identity->id);
+		free(identity);
+	}
+	enumerator->destroy(enumerator);
+	this->identities->destroy(this->identities);
+
+	this->flush_mutex->destroy(this->flush_mutex);
+	this->mutex->destroy(this->mutex);
 	free(this);
 }
 
@@ -459,6 +1084,24 @@ sql_attribute_t *sql_attribute_create(database_t *db)
 		.db = db,
 		.history = lib->settings->get_bool(lib->settings,
 							"libhydra.plugins.attr-sql.lease_history", TRUE),
+		.prefetch = max(1, lib->settings->get_int(lib->settings,
+							"libhydra.plugins.attr-sql.prefetch",
+							PREFETCH_DEFAULT)),
+		.cache_lifetime = lib->settings->get_time(lib->settings,
+							"libhydra.plugins.attr-sql.cache_lifetime",
+							CACHE_LIFETIME_DEFAULT),
+		.release_delay = lib->settings->get_int(lib->settings,
+							"libhydra.plugins.attr-sql.release_delay",
+							RELEASE_DELAY_DEFAULT),
+		.pools = hashtable_create((hashtable_hash_t)name_hash,
+								  (hashtable_equals_t)name_equals, 8),
+		.identities = hashtable_create((hashtable_hash_t)id_hash,
+									   (hashtable_equals_t)id_equals, 128),
+		.releases = linked_list_create(),
+		.pending = hashtable_create((hashtable_hash_t)release_hash,
+									(hashtable_equals_t)release_equals, 32),
+		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
+		.flush_mutex = mutex_create(MUTEX_TYPE_DEFAULT),
 	);
 
 	/* close any "online" leases in the case we crashed */
@@ -1968,25 +1968,20 @@ METHOD(kernel_ipsec_t, flush_sas, status_t,
 }
 
 /**
- * Add or update a policy in the kernel.
+ * Build the netlink message to add or update a policy in the kernel.
  *
- * Note: The mutex has to be locked when entering this function
- * and is unlocked here in any case.
+ * Note: The mutex has to be locked when calling this function.
  */
-static status_t add_policy_internal(private_kernel_netlink_ipsec_t *this,
-	policy_entry_t *policy, policy_sa_t *mapping, bool update)
+static bool build_policy(private_kernel_netlink_ipsec_t *this,
+	policy_entry_t *policy, policy_sa_t *mapping, bool update,
+	netlink_buf_t request)
 {
-	netlink_buf_t request;
-	policy_entry_t clone;
 	ipsec_sa_t *ipsec = mapping->sa;
 	struct xfrm_userpolicy_info *policy_info;
 	struct nlmsghdr *hdr;
 	int i;
 
-	/* clone the policy so we are able to check it out again later */
-	memcpy(&clone, policy, sizeof(policy_entry_t));
-
-	memset(&request, 0, sizeof(request));
+	memset(request, 0, sizeof(netlink_buf_t));
 	hdr = (struct nlmsghdr*)request;
 	hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
 	hdr->nlmsg_type = update ? XFRM_MSG_UPDPOLICY : XFRM_MSG_NEWPOLICY;
@@ -2033,12 +2028,11 @@ static status_t add_policy_internal(private_kernel_netlink_ipsec_t *this,
 				count++;
 			}
 		}
-		tmpl = netlink_reserve(hdr, sizeof(request), XFRMA_TMPL,
+		tmpl = netlink_reserve(hdr, sizeof(netlink_buf_t), XFRMA_TMPL,
 							   count * sizeof(*tmpl));
 		if (!tmpl)
 		{
-			this->mutex->unlock(this->mutex);
-			return FAILED;
+			return FALSE;
 		}
 
 		for (i = 0; i < countof(protos); i++)
@@ -2068,28 +2062,31 @@ static status_t add_policy_internal(private_kernel_netlink_ipsec_t *this,
 		}
 	}
 
-	if (!add_mark(hdr, sizeof(request), ipsec->mark))
-	{
-		this->mutex->unlock(this->mutex);
-		return FAILED;
-	}
-	this->mutex->unlock(this->mutex);
+	return add_mark(hdr, sizeof(netlink_buf_t), ipsec->mark);
+}
 
-	if (this->socket_xfrm->send_ack(this->socket_xfrm, hdr) != SUCCESS)
-	{
-		return FAILED;
-	}
+/**
+ * Install a route for a policy that has been installed in the kernel, if
+ * required.
+ */
+static void install_route(private_kernel_netlink_ipsec_t *this,
+						  policy_entry_t *clone)
+{
+	policy_entry_t *policy;
+	policy_sa_t *mapping;
+	ipsec_sa_t *ipsec;
 
 	/* find the policy again */
 	this->mutex->lock(this->mutex);
-	policy = this->policies->get(this->policies, &clone);
+	policy = this->policies->get(this->policies, clone);
 	if (!policy ||
 		 policy->used_by->find_first(policy->used_by,
 									 NULL, (void**)&mapping) != SUCCESS)
 	{	/* policy or mapping is already gone, ignore */
 		this->mutex->unlock(this->mutex);
-		return SUCCESS;
+		return;
 	}
+	ipsec = mapping->sa;
 
 	/* install a route, if:
 	 * - this is a forward policy (to just get one for each child)
@@ -2131,7 +2128,7 @@ static status_t add_policy_internal(private_kernel_netlink_ipsec_t *this,
 			{
 				this->mutex->unlock(this->mutex);
 				route_entry_destroy(route);
-				return SUCCESS;
+				return;
 			}
 
 			if (policy->route)
@@ -2141,7 +2138,7 @@ static status_t add_policy_internal(private_kernel_netlink_ipsec_t *this,
 				{
 					this->mutex->unlock(this->mutex);
 					route_entry_destroy(route);
-					return SUCCESS;
+					return;
 				}
 				/* uninstall previously installed route */
 				if (hydra->kernel_interface->del_route(hydra->kernel_interface,
@@ -2184,14 +2181,50 @@ static status_t add_policy_internal(private_kernel_netlink_ipsec_t *this,
 		}
 	}
 	this->mutex->unlock(this->mutex);
+}
+
+/**
+ * Add or update a policy in the kernel.
+ *
+ * Note: The mutex has to be locked when entering this function
+ * and is unlocked here in any case.
+ */
+static status_t add_policy_internal(private_kernel_netlink_ipsec_t *this,
+	policy_entry_t *policy, policy_sa_t *mapping, bool update)
+{
+	netlink_buf_t request;
+	policy_entry_t clone;
+
+	/* clone the policy so we are able to check it out again later */
+	memcpy(&clone, policy, sizeof(policy_entry_t));
+
+	if (!build_policy(this, policy, mapping, update, request))
+	{
+		this->mutex->unlock(this->mutex);
+		return FAILED;
+	}
+	this->mutex->unlock(this->mutex);
+
+	if (this->socket_xfrm->send_ack(this->socket_xfrm,
+									(struct nlmsghdr*)request) != SUCCESS)
+	{
+		return FAILED;
+	}
+	install_route(this, &clone);
 	return SUCCESS;
 }
 
-METHOD(kernel_ipsec_t, add_policy, status_t,
-	private_kernel_netlink_ipsec_t *this, host_t *src, host_t *dst,
-	traffic_selector_t *src_ts, traffic_selector_t *dst_ts,
-	policy_dir_t direction, policy_type_t type, ipsec_sa_cfg_t *sa,
-	mark_t mark, policy_priority_t priority)
+/**
+ * Add a policy to the cache and assign the SA to it.
+ *
+ * Returns TRUE if the policy has to be added to or updated in the kernel, in
+ * which case the mutex is kept locked.
+ */
+static bool cache_policy(private_kernel_netlink_ipsec_t *this,
+	host_t *src, host_t *dst, traffic_selector_t *src_ts,
+	traffic_selector_t *dst_ts, policy_dir_t direction, policy_type_t type,
+	ipsec_sa_cfg_t *sa, mark_t mark, policy_priority_t priority,
+	policy_entry_t **out_policy, policy_sa_t **out_sa, bool *out_found)
 {
 	policy_entry_t *policy, *current;
 	policy_sa_t *assigned_sa, *current_sa;
@@ -2255,13 +2288,34 @@ METHOD(kernel_ipsec_t, add_policy, status_t,
 	{	/* we don't update the policy if the priority is lower than that of
 		 * the currently installed one */
 		this->mutex->unlock(this->mutex);
-		return SUCCESS;
+		return FALSE;
 	}
 
 	DBG2(DBG_KNL, "%s policy %R === %R %N  (mark %u/0x%08x)",
 				   found ? "updating" : "adding", src_ts, dst_ts,
 				   policy_dir_names, direction, mark.value, mark.mask);
 
+	*out_policy = policy;
+	*out_sa = assigned_sa;
+	*out_found = found;
+	return TRUE;
+}
+
+METHOD(kernel_ipsec_t, add_policy, status_t,
+	private_kernel_netlink_ipsec_t *this, host_t *src, host_t *dst,
+	traffic_selector_t *src_ts, traffic_selector_t *dst_ts,
+	policy_dir_t direction, policy_type_t type, ipsec_sa_cfg_t *sa,
+	mark_t mark, policy_priority_t priority)
+{
+	policy_entry_t *policy;
+	policy_sa_t *assigned_sa;
+	bool found;
+
+	if (!cache_policy(this, src, dst, src_ts, dst_ts, direction, type, sa,
+					  mark, priority, &policy, &assigned_sa, &found))
+	{
+		return SUCCESS;
+	}
 	if (add_policy_internal(this, policy, assigned_sa, found) != SUCCESS)
 	{
 		DBG1(DBG_KNL, "unable to %s policy %R === %R %N",
@@ -2272,6 +2326,128 @@ METHOD(kernel_ipsec_t, add_policy, status_t,
 	return SUCCESS;
 }
 
+/**
+ * A policy message queued in a batch
+ */
+typedef struct {
+	/** netlink message to add or update the policy */
+	netlink_buf_t request;
+	/** copy of the policy to look it up again */
+	policy_entry_t clone;
+	/** batch operation the policy belongs to */
+	kernel_ipsec_op_t *op;
+} pending_policy_t;
+
+/**
+ * Send queued policy messages at once and install routes for them
+ */
+static status_t send_policies(private_kernel_netlink_ipsec_t *this,
+							  pending_policy_t *pending, int count)
+{
+	struct nlmsghdr **msgs;
+	status_t *results, status = SUCCESS;
+	kernel_ipsec_op_t *op;
+	int i;
+
+	msgs = malloc(sizeof(struct nlmsghdr*) * count);
+	results = malloc(sizeof(status_t) * count);
+	for (i = 0; i < count; i++)
+	{
+		msgs[i] = (struct nlmsghdr*)pending[i].request;
+	}
+	this->socket_xfrm->send_ack_batch(this->socket_xfrm, msgs, count, results);
+	for (i = 0; i < count; i++)
+	{
+		op = pending[i].op;
+		op->status = results[i];
+		if (op->status == SUCCESS)
+		{
+			install_route(this, &pending[i].clone);
+		}
+		else
+		{
+			DBG1(DBG_KNL, "unable to add policy %R === %R %N",
+						   op->policy.src_ts, op->policy.dst_ts,
+						   policy_dir_names, op->policy.direction);
+			status = FAILED;
+		}
+	}
+	free(results);
+	free(msgs);
+	return status;
+}
+
+METHOD(kernel_ipsec_t, commit_batch, status_t,
+	private_kernel_netlink_ipsec_t *this, kernel_ipsec_op_t *ops, int count)
+{
+	pending_policy_t *pending;
+	policy_entry_t *policy;
+	policy_sa_t *assigned_sa;
+	kernel_ipsec_op_t *op;
+	status_t status = SUCCESS;
+	int i, queued = 0;
+	bool found;
+
+	pending = malloc(sizeof(pending_policy_t) * count);
+	for (i = 0; i < count && status == SUCCESS; i++)
+	{
+		op = &ops[i];
+		switch (op->type)
+		{
+			case KERNEL_IPSEC_OP_ADD_SA:
+				if (queued)
+				{	/* send queued policies first to retain the order */
+					status = send_policies(this, pending, queued);
+					queued = 0;
+					if (status != SUCCESS)
+					{
+						break;
+					}
+				}
+				op->status = add_sa(this, op->sa.src, op->sa.dst, op->sa.spi,
+						op->sa.protocol, op->sa.reqid, op->sa.mark, op->sa.tfc,
+						&op->sa.lifetime, op->sa.enc_alg, op->sa.enc_key,
+						op->sa.int_alg, op->sa.int_key, op->sa.mode,
+						op->sa.ipcomp, op->sa.cpi, op->sa.encap, op->sa.esn,
+						op->sa.inbound, op->sa.src_ts, op->sa.dst_ts);
+				op->applied = op->status == SUCCESS;
+				status = op->status;
+				break;
+			case KERNEL_IPSEC_OP_ADD_POLICY:
+				/* the policy is cached even if installing it fails */
+				op->applied = TRUE;
+				op->status = SUCCESS;
+				if (!cache_policy(this, op->policy.src, op->policy.dst,
+						op->policy.src_ts, op->policy.dst_ts,
+						op->policy.direction, op->policy.type, &op->policy.sa,
+						op->policy.mark, op->policy.priority, &policy,
+						&assigned_sa, &found))
+				{
+					break;
+				}
+				memcpy(&pending[queued].clone, policy, sizeof(policy_entry_t));
+				if (!build_policy(this, policy, assigned_sa, found,
+								  pending[queued].request))
+				{
+					this->mutex->unlock(this->mutex);
+					op->status = status = FAILED;
+					break;
+				}
+				this->mutex->unlock(this->mutex);
+				pending[queued++].op = op;
+				break;
+		}
+	}
+	/* policies already cached are sent even after a failure, so the caller
+	 * can roll them back consistently */
+	if (queued && send_policies(this, pending, queued) != SUCCESS)
+	{
+		status = FAILED;
+	}
+	free(pending);
+	return status;
+}
+
 METHOD(kernel_ipsec_t, query_policy, status_t,
 	private_kernel_netlink_ipsec_t *this, traffic_selector_t *src_ts,
 	traffic_selector_t *dst_ts, policy_dir_t direction, mark_t mark,
@@ -2624,6 +2800,7 @@ kernel_netlink_ipsec_t *kernel_netlink_ipsec_create()
 				.query_policy = _query_policy,
 				.del_policy = _del_policy,
 				.flush_policies = _flush_policies,
+				.commit_batch = _commit_batch,
 				.bypass_socket = _bypass_socket,
 				.enable_udp_decap = _enable_udp_decap,
 				.destroy = _destroy,
@@ -2657,7 +2834,10 @@ kernel_netlink_ipsec_t *kernel_netlink_ipsec_create()
 		close(fd);
 	}
 
-	this->socket_xfrm = netlink_socket_create(NETLINK_XFRM);
+	this->socket_xfrm = netlink_socket_create(NETLINK_XFRM,
+					lib->settings->get_int(lib->settings,
+						"%s.plugins.kernel-netlink.timeout",
+						NETLINK_DEFAULT_TIMEOUT, hydra->daemon));
 	if (!this->socket_xfrm)
 	{
 		destroy(this);
@@ -14,15 +14,26 @@
  */
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include "kernel_netlink_shared.h"
 
 #include <utils/debug.h>
 #include <threading/mutex.h>
+#include <threading/condvar.h>
+#include <collections/hashtable.h>
+
+/**
+ * Maximum number of outstanding requests per socket, also the maximum number
+ * of messages sent in a single sendmsg() call. Acknowledges contain a copy of
+ * the request, so we limit it to avoid overflowing the socket receive buffer.
+ */
+#define MAX_OUTSTANDING 64
 
 typedef struct private_netlink_socket_t private_netlink_socket_t;
 
@@ -36,14 +47,34 @@ struct private_netlink_socket_t {
 	netlink_socket_t public;
 
 	/**
-	 * mutex to lock access to netlink socket
+	 * mutex to lock sequence numbers and outstanding requests
 	 */
 	mutex_t *mutex;
 
+	/**
+	 * condvar to signal received replies and reader changes
+	 */
+	condvar_t *condvar;
+
+	/**
+	 * outstanding requests, entry_t indexed by sequence number
+	 */
+	hashtable_t *entries;
+
+	/**
+	 * is a thread currently reading from the socket
+	 */
+	bool reading;
+
 	/**
 	 * current sequence number for netlink request
 	 */
-	int seq;
+	u_int32_t seq;
+
+	/**
+	 * time to wait for (a part of) a reply, in ms, 0 to wait forever
+	 */
+	u_int timeout;
 
 	/**
 	 * netlink socket protocol
@@ -56,29 +87,80 @@ struct private_netlink_socket_t {
 	int socket;
 };
 
+/**
+ * Request waiting for its reply
+ */
+typedef struct {
+
+	/**
+	 * sequence number of the request
+	 */
+	u_int32_t seq;
+
+	/**
+	 * received reply messages
+	 */
+	chunk_t result;
+
+	/**
+	 * is the request a dump, which completes with NLMSG_DONE
+	 */
+	bool dump;
+
+	/**
+	 * has the complete reply been received
+	 */
+	bool complete;
+
+	/**
+	 * did receiving the reply fail
+	 */
+	bool failed;
+} entry_t;
+
 /**
  * Imported from kernel_netlink_ipsec.c
  */
 extern enum_name_t *xfrm_msg_names;
 
-METHOD(netlink_socket_t, netlink_send, status_t,
-	private_netlink_socket_t *this, struct nlmsghdr *in, struct nlmsghdr **out,
-	size_t *out_len)
+/**
+ * Hash function for sequence numbers
+ */
+static u_int hash_seq(uintptr_t seq)
 {
-	int len, addr_len;
-	struct sockaddr_nl addr;
-	chunk_t result = chunk_empty, tmp;
-	struct nlmsghdr *msg, peek;
+	return seq;
+}
 
-	this->mutex->lock(this->mutex);
+/**
+ * Equality function for sequence numbers
+ */
+static bool equals_seq(uintptr_t a, uintptr_t b)
+{
+	return a == b;
+}
 
-	in->nlmsg_seq = ++this->seq;
+/**
+ * Assign a sequence number to a message and register an entry for its reply,
+ * mutex must be held
+ */
+static void register_entry(private_netlink_socket_t *this, struct nlmsghdr *in,
+						   entry_t *entry)
+{
+	if (++this->seq == 0)
+	{	/* zero can't be used as hashtable key */
+		this->seq++;
+	}
+	in->nlmsg_seq = this->seq;
 	in->nlmsg_pid = getpid();
+	/* the kernel does not acknowledge dumps, but completes them with
+	 * NLMSG_DONE, all other requests complete with their acknowledge */
+	in->nlmsg_flags |= NLM_F_ACK;
 
-	memset(&addr, 0, sizeof(addr));
-	addr.nl_family = AF_NETLINK;
-	addr.nl_pid = 0;
-	addr.nl_groups = 0;
+	*entry = (entry_t){
+		.seq = this->seq,
+		.dump = (in->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP,
+	};
+	this->entries->put(this->entries, (void*)(uintptr_t)entry->seq, entry);
 
 	if (this->protocol == NETLINK_XFRM)
 	{
@@ -86,111 +168,337 @@ METHOD(netlink_socket_t, netlink_send, status_t,
 
 		DBG3(DBG_KNL, "sending %N: %B", xfrm_msg_names, in->nlmsg_type, &in_chunk);
 	}
+}
 
+/**
+ * Send messages in a single sendmsg() call
+ */
+static bool write_msgs(private_netlink_socket_t *this, struct nlmsghdr *in[],
+					   int count)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+	};
+	struct iovec iov[count];
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = iov,
+		.msg_iovlen = count,
+	};
+	size_t total = 0;
+	int i, len;
+
+	for (i = 0; i < count; i++)
+	{
+		iov[i].iov_base = in[i];
+		iov[i].iov_len = NLMSG_ALIGN(in[i]->nlmsg_len);
+		total += iov[i].iov_len;
+	}
 	while (TRUE)
 	{
-		len = sendto(this->socket, in, in->nlmsg_len, 0,
-					 (struct sockaddr*)&addr, sizeof(addr));
-
-		if (len != in->nlmsg_len)
+		len = sendmsg(this->socket, &msg, 0);
+		if (len != total)
 		{
-			if (errno == EINTR)
+			if (len < 0 && errno == EINTR)
 			{
 				/* interrupted, try again */
 				continue;
 			}
-			this->mutex->unlock(this->mutex);
 			DBG1(DBG_KNL, "error sending to netlink socket: %s", strerror(errno));
-			return FAILED;
+			return FALSE;
 		}
-		break;
+		return TRUE;
 	}
+}
 
+/**
+ * Fail all outstanding requests, mutex must be held
+ */
+static void fail_entries(private_netlink_socket_t *this)
+{
+	enumerator_t *enumerator;
+	entry_t *entry;
+	void *seq;
+
+	enumerator = this->entries->create_enumerator(this->entries);
+	while (enumerator->enumerate(enumerator, &seq, &entry))
+	{
+		entry->complete = entry->failed = TRUE;
+	}
+	enumerator->destroy(enumerator);
+}
+
+/**
+ * Wait until the socket is readable or the deadline is reached, if any.
+ * Returns FALSE on timeout.
+ */
+static bool wait_readable(private_netlink_socket_t *this, timeval_t *deadline)
+{
+	struct pollfd pfd = {
+		.fd = this->socket,
+		.events = POLLIN,
+	};
+	timeval_t now, remaining;
+	int ms;
+
+	if (!deadline)
+	{
+		return TRUE;
+	}
 	while (TRUE)
 	{
-		char buf[4096];
-		tmp.len = sizeof(buf);
-		tmp.ptr = buf;
-		msg = (struct nlmsghdr*)tmp.ptr;
+		time_monotonic(&now);
+		if (!timercmp(&now, deadline, <))
+		{
+			return FALSE;
+		}
+		timersub(deadline, &now, &remaining);
+		ms = remaining.tv_sec * 1000 + (remaining.tv_usec + 999) / 1000;
+		switch (poll(&pfd, 1, ms))
+		{
+			case 0:
+				return FALSE;
+			case -1:
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				/* let recvfrom() report the error */
+			default:
+				return TRUE;
+		}
+	}
+}
 
+/**
+ * Read a datagram from the socket and dispatch the contained messages to the
+ * waiting entries. Mutex must be held, but gets released while reading.
+ * If nothing is received until the deadline, if any, it returns without
+ * dispatching.
+ */
+static void read_and_dispatch(private_netlink_socket_t *this,
+							  timeval_t *deadline)
+{
+	struct sockaddr_nl addr;
+	socklen_t addr_len;
+	struct nlmsghdr *msg;
+	entry_t *entry;
+	char buf[4096];
+	int len;
+
+	this->reading = TRUE;
+	this->mutex->unlock(this->mutex);
+
+	if (!wait_readable(this, deadline))
+	{
+		this->mutex->lock(this->mutex);
+		this->reading = FALSE;
+		this->condvar->broadcast(this->condvar);
+		return;
+	}
+	while (TRUE)
+	{
 		memset(&addr, 0, sizeof(addr));
-		addr.nl_family = AF_NETLINK;
-		addr.nl_pid = getpid();
-		addr.nl_groups = 0;
 		addr_len = sizeof(addr);
-
-		len = recvfrom(this->socket, tmp.ptr, tmp.len, 0,
+		len = recvfrom(this->socket, buf, sizeof(buf), 0,
 					   (struct sockaddr*)&addr, &addr_len);
+		if (len < 0 && errno == EINTR)
+		{
+			DBG1(DBG_KNL, "got interrupted");
+			/* interrupted, try again */
+			continue;
+		}
+		break;
+	}
 
-		if (len < 0)
+	this->mutex->lock(this->mutex);
+	this->reading = FALSE;
+	/* let another thread take over reading, or check its reply */
+	this->condvar->broadcast(this->condvar);
+
+	if (len < 0)
+	{
+		DBG1(DBG_KNL, "error reading from netlink socket: %s", strerror(errno));
+		/* replies might have been lost, e.g. with ENOBUFS */
+		fail_entries(this);
+		return;
+	}
+	msg = (struct nlmsghdr*)buf;
+	if (!NLMSG_OK(msg, len))
+	{
+		DBG1(DBG_KNL, "received corrupted netlink message");
+		fail_entries(this);
+		return;
+	}
+	while (NLMSG_OK(msg, len))
+	{
+		entry = this->entries->get(this->entries,
+								   (void*)(uintptr_t)msg->nlmsg_seq);
+		if (entry && !entry->complete)
 		{
-			if (errno == EINTR)
+			entry->result.ptr = realloc(entry->result.ptr,
+										entry->result.len + msg->nlmsg_len);
+			memcpy(entry->result.ptr + entry->result.len, msg, msg->nlmsg_len);
+			entry->result.len += msg->nlmsg_len;
+			if (msg->nlmsg_type == NLMSG_ERROR ||
+				(entry->dump && msg->nlmsg_type == NLMSG_DONE))
 			{
-				DBG1(DBG_KNL, "got interrupted");
-				/* interrupted, try again */
-				continue;
+				entry->complete = TRUE;
 			}
-			DBG1(DBG_KNL, "error reading from netlink socket: %s", strerror(errno));
-			this->mutex->unlock(this->mutex);
-			free(result.ptr);
-			return FAILED;
 		}
-		if (!NLMSG_OK(msg, len))
+		else
+		{
+			DBG1(DBG_KNL, "received unexpected netlink sequence number %u",
+				 msg->nlmsg_seq);
+		}
+		msg = NLMSG_NEXT(msg, len);
+	}
+}
+
+/**
+ * Wait until all entries are complete, reading from the socket if no other
+ * thread does. Entries fail if no (further) reply is received within the
+ * timeout. Mutex must be held.
+ */
+static bool wait_entries(private_netlink_socket_t *this, entry_t *entries,
+						 int count)
+{
+	timeval_t now, deadline, *timeout = NULL;
+	bool success = TRUE;
+	size_t received = 0;
+	int i = 0, last = 0;
+
+	if (this->timeout)
+	{
+		time_monotonic(&deadline);
+		timeval_add_ms(&deadline, this->timeout);
+		timeout = &deadline;
+	}
+	while (i < count)
+	{
+		if (entries[i].complete)
 		{
-			DBG1(DBG_KNL, "received corrupted netlink message");
-			this->mutex->unlock(this->mutex);
-			free(result.ptr);
-			return FAILED;
+			success = success && !entries[i].failed;
+			i++;
+			continue;
 		}
-		if (msg->nlmsg_seq != this->seq)
+		if (timeout)
 		{
-			DBG1(DBG_KNL, "received invalid netlink sequence number");
-			if (msg->nlmsg_seq < this->seq)
+			time_monotonic(&now);
+			if (i != last || entries[i].result.len != received)
+			{	/* restart timeout if the kernel makes progress */
+				last = i;
+				received = entries[i].result.len;
+				deadline = now;
+				timeval_add_ms(&deadline, this->timeout);
+			}
+			if (!timercmp(&now, &deadline, <))
 			{
-				continue;
+				DBG1(DBG_KNL, "netlink request timed out after %ums",
+					 this->timeout);
+				for (; i < count; i++)
+				{
+					entries[i].complete = entries[i].failed = TRUE;
+				}
+				return FALSE;
 			}
-			this->mutex->unlock(this->mutex);
-			free(result.ptr);
-			return FAILED;
 		}
+		if (this->reading)
+		{
+			if (timeout)
+			{
+				this->condvar->timed_wait_abs(this->condvar, this->mutex,
+											  deadline);
+			}
+			else
+			{
+				this->condvar->wait(this->condvar, this->mutex);
+			}
+		}
+		else
+		{
+			read_and_dispatch(this, timeout);
+		}
+	}
+	return success;
+}
 
-		tmp.len = len;
-		result.ptr = realloc(result.ptr, result.len + tmp.len);
-		memcpy(result.ptr + result.len, tmp.ptr, tmp.len);
-		result.len += tmp.len;
-
-		/* NLM_F_MULTI flag does not seem to be set correctly, we use sequence
-		 * numbers to detect multi header messages */
-		len = recvfrom(this->socket, &peek, sizeof(peek), MSG_PEEK | MSG_DONTWAIT,
-					   (struct sockaddr*)&addr, &addr_len);
+/**
+ * Unregister entries, free replies unless all requests succeeded. Mutex must
+ * be held.
+ */
+static void unregister_entries(private_netlink_socket_t *this,
+							   entry_t *entries, int count, bool success)
+{
+	int i;
 
-		if (len == sizeof(peek) && peek.nlmsg_seq == this->seq)
+	for (i = 0; i < count; i++)
+	{
+		this->entries->remove(this->entries, (void*)(uintptr_t)entries[i].seq);
+		if (!success)
 		{
-			/* seems to be multipart */
-			continue;
+			chunk_free(&entries[i].result);
 		}
-		break;
 	}
+	/* wake up threads waiting for a free slot */
+	this->condvar->broadcast(this->condvar);
+}
 
-	*out_len = result.len;
-	*out = (struct nlmsghdr*)result.ptr;
+/**
+ * Send messages, and wait for all replies
+ */
+static bool send_and_wait(private_netlink_socket_t *this, struct nlmsghdr *in[],
+						  entry_t *entries, int count)
+{
+	bool success;
+	int i;
 
+	this->mutex->lock(this->mutex);
+	while (this->entries->get_count(this->entries) &&
+		   this->entries->get_count(this->entries) + count > MAX_OUTSTANDING)
+	{
+		this->condvar->wait(this->condvar, this->mutex);
+	}
+	for (i = 0; i < count; i++)
+	{
+		register_entry(this, in[i], &entries[i]);
+	}
 	this->mutex->unlock(this->mutex);
 
-	return SUCCESS;
+	/* only the kernel is involved in sending, no need to lock the socket */
+	success = write_msgs(this, in, count);
+
+	this->mutex->lock(this->mutex);
+	if (success)
+	{
+		success = wait_entries(this, entries, count);
+	}
+	unregister_entries(this, entries, count, success);
+	this->mutex->unlock(this->mutex);
+	return success;
 }
 
-METHOD(netlink_socket_t, netlink_send_ack, status_t,
-	private_netlink_socket_t *this, struct nlmsghdr *in)
+METHOD(netlink_socket_t, netlink_send, status_t,
+	private_netlink_socket_t *this, struct nlmsghdr *in, struct nlmsghdr **out,
+	size_t *out_len)
 {
-	struct nlmsghdr *out, *hdr;
-	size_t len;
+	entry_t entry;
 
-	if (netlink_send(this, in, &out, &len) != SUCCESS)
+	if (!send_and_wait(this, &in, &entry, 1))
 	{
 		return FAILED;
 	}
-	hdr = out;
+	*out_len = entry.result.len;
+	*out = (struct nlmsghdr*)entry.result.ptr;
+	return SUCCESS;
+}
+
+/**
+ * Parse the acknowledgement in a reply
+ */
+static status_t parse_ack(struct nlmsghdr *hdr, size_t len)
+{
 	while (NLMSG_OK(hdr, len))
 	{
 		switch (hdr->nlmsg_type)
@@ -203,20 +511,16 @@ METHOD(netlink_socket_t, netlink_send_ack, status_t,
 				{
 					if (-err->error == EEXIST)
 					{	/* do not report existing routes */
-						free(out);
 						return ALREADY_DONE;
 					}
 					if (-err->error == ESRCH)
 					{	/* do not report missing entries */
-						free(out);
 						return NOT_FOUND;
 					}
 					DBG1(DBG_KNL, "received netlink error: %s (%d)",
 						 strerror(-err->error), -err->error);
-					free(out);
 					return FAILED;
 				}
-				free(out);
 				return SUCCESS;
 			}
 			default:
@@ -228,10 +532,61 @@ METHOD(netlink_socket_t, netlink_send_ack, status_t,
 		break;
 	}
 	DBG1(DBG_KNL, "netlink request not acknowledged");
-	free(out);
 	return FAILED;
 }
 
+METHOD(netlink_socket_t, netlink_send_ack, status_t,
+	private_netlink_socket_t *this, struct nlmsghdr *in)
+{
+	struct nlmsghdr *out;
+	status_t status;
+	size_t len;
+
+	if (netlink_send(this, in, &out, &len) != SUCCESS)
+	{
+		return FAILED;
+	}
+	status = parse_ack(out, len);
+	free(out);
+	return status;
+}
+
+METHOD(netlink_socket_t, netlink_send_ack_batch, status_t,
+	private_netlink_socket_t *this, struct nlmsghdr *in[], int count,
+	status_t results[])
+{
+	status_t status = SUCCESS;
+	entry_t *entries;
+	int i, done, batch;
+
+	entries = malloc(sizeof(entry_t) * min(count, MAX_OUTSTANDING));
+	for (done = 0; done < count; done += batch)
+	{
+		batch = min(count - done, MAX_OUTSTANDING);
+		if (!send_and_wait(this, in + done, entries, batch))
+		{
+			for (i = done; i < count; i++)
+			{
+				results[i] = FAILED;
+			}
+			status = FAILED;
+			break;
+		}
+		for (i = 0; i < batch; i++)
+		{
+			results[done + i] = parse_ack((struct nlmsghdr*)entries[i].result.ptr,
+										  entries[i].result.len);
+			if (results[done + i] == FAILED)
+			{
+				status = FAILED;
+			}
+			free(entries[i].result.ptr);
+		}
+	}
+	free(entries);
+	return status;
+}
+
 METHOD(netlink_socket_t, destroy, void,
 	private_netlink_socket_t *this)
 {
@@ -239,6 +594,8 @@ METHOD(netlink_socket_t, destroy, void,
 	{
 		close(this->socket);
 	}
+	this->entries->destroy(this->entries);
+	this->condvar->destroy(this->condvar);
 	this->mutex->destroy(this->mutex);
 	free(this);
 }
@@ -246,7 +603,7 @@ METHOD(netlink_socket_t, destroy, void,
 /**
  * Described in header.
  */
-netlink_socket_t *netlink_socket_create(int protocol)
+netlink_socket_t *netlink_socket_create(int protocol, u_int timeout)
 {
 	private_netlink_socket_t *this;
 	struct sockaddr_nl addr;
@@ -255,10 +612,15 @@ netlink_socket_t *netlink_socket_create(int protocol)
 		.public = {
 			.send = _netlink_send,
 			.send_ack = _netlink_send_ack,
+			.send_ack_batch = _netlink_send_ack_batch,
 			.destroy = _destroy,
 		},
 		.seq = 200,
+		.timeout = timeout,
 		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
+		.condvar = condvar_create(CONDVAR_TYPE_DEFAULT),
+		.entries = hashtable_create((hashtable_hash_t)hash_seq,
+									(hashtable_equals_t)equals_seq, 32),
 		.protocol = protocol,
 	);
 
@@ -20,6 +20,11 @@
 
 #include <linux/rtnetlink.h>
 
+/**
+ * Default time to wait for a reply, in ms
+ */
+#define NETLINK_DEFAULT_TIMEOUT 10000
+
 /**
  * General purpose netlink buffer.
  *
@@ -32,6 +37,13 @@ typedef struct netlink_socket_t netlink_socket_t;
 
 /**
  * Wrapper around a netlink socket.
+ *
+ * Multiple threads may send requests concurrently over the same socket. The
+ * replies are matched to the requests using the netlink sequence numbers,
+ * each thread waits for its own reply only. Whichever thread is waiting reads
+ * from the socket and dispatches the replies to the other waiting threads.
+ * Each request gets acknowledged, a request completes with its acknowledge
+ * or, for dumps, with NLMSG_DONE.
  */
 struct netlink_socket_t {
 
@@ -52,6 +64,20 @@ struct netlink_socket_t {
 	 */
 	status_t (*send_ack)(netlink_socket_t *this, struct nlmsghdr *in);
 
+	/**
+	 * Send multiple netlink messages and wait for their acknowledges.
+	 *
+	 * The messages are sent in as few sendmsg() calls as possible, the
+	 * kernel processes them in order.
+	 *
+	 * @param	in		array of netlink messages to send
+	 * @param	count	number of messages in array
+	 * @param	results	array receiving the send_ack() status of each message
+	 * @return			SUCCESS, or FAILED if any of the messages failed
+	 */
+	status_t (*send_ack_batch)(netlink_socket_t *this, struct nlmsghdr *in[],
+							   int count, status_t results[]);
+
 	/**
 	 * Destroy the socket.
 	 */
@@ -62,8 +88,9 @@ struct netlink_socket_t {
  * Create a netlink_socket_t object.
  *
  * @param	protocol	protocol type (e.g. NETLINK_XFRM or NETLINK_ROUTE)
+ * @param	timeout		time to wait for a reply in ms, 0 to wait forever
  */
-netlink_socket_t *netlink_socket_create(int protocol);
+netlink_socket_t *netlink_socket_create(int protocol, u_int timeout);
 
 /**
  * Creates an rtattr and adds it to the given netlink message.
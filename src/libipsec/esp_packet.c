@@ -17,13 +17,13 @@
 
 
 #include "esp_packet.h"
+#include "ipsec.h"
 
 #include <library.h>
 #include <utils/debug.h>
 #include <crypto/crypters/crypter.h>
 #include <crypto/signers/signer.h>
 #include <bio/bio_reader.h>
-#include <bio/bio_writer.h>
 
 #include <netinet/in.h>
 
@@ -44,6 +44,16 @@ struct private_esp_packet_t {
 	 */
 	packet_t *packet;
 
+	/**
+	 * Buffer containing the encrypted packet, if built by encrypt()
+	 */
+	chunk_t buffer;
+
+	/**
+	 * Encrypted packet, located within buffer
+	 */
+	chunk_t data;
+
 	/**
 	 * Payload of this packet
 	 */
@@ -85,18 +95,46 @@ METHOD2(esp_packet_t, packet_t, get_destination, host_t*,
 	return this->packet->get_destination(this->packet);
 }
 
+/**
+ * Release the buffer of a packet built by encrypt()
+ */
+static void release_buffer(private_esp_packet_t *this)
+{
+	ipsec->buffers->put(ipsec->buffers, this->buffer);
+	this->buffer = this->data = chunk_empty;
+}
+
 METHOD(packet_t, get_data, chunk_t,
 	private_esp_packet_t *this)
 {
+	if (this->buffer.ptr)
+	{
+		return this->data;
+	}
 	return this->packet->get_data(this->packet);
 }
 
 METHOD(packet_t, set_data, void,
 	private_esp_packet_t *this, chunk_t data)
 {
+	release_buffer(this);
 	return this->packet->set_data(this->packet, data);
 }
 
+METHOD(packet_t, extract_data, chunk_t,
+	private_esp_packet_t *this)
+{
+	chunk_t data;
+
+	if (this->buffer.ptr)
+	{
+		data = chunk_clone(this->data);
+		release_buffer(this);
+		return data;
+	}
+	return this->packet->extract_data(this->packet);
+}
+
 METHOD(packet_t, get_dscp, u_int8_t,
 	private_esp_packet_t *this)
 {
@@ -112,6 +150,11 @@ METHOD(packet_t, set_dscp, void,
 METHOD(packet_t, skip_bytes, void,
 	private_esp_packet_t *this, size_t bytes)
 {
+	if (this->buffer.ptr)
+	{
+		this->data = chunk_skip(this->data, bytes);
+		return;
+	}
 	return this->packet->skip_bytes(this->packet, bytes);
 }
 
@@ -119,8 +162,14 @@ METHOD(packet_t, clone, packet_t*,
 	private_esp_packet_t *this)
 {
 	private_esp_packet_t *pkt;
+	packet_t *packet;
 
-	pkt = esp_packet_create_internal(this->packet->clone(this->packet));
+	packet = this->packet->clone(this->packet);
+	if (this->buffer.ptr)
+	{
+		packet->set_data(packet, chunk_clone(this->data));
+	}
+	pkt = esp_packet_create_internal(packet);
 	pkt->payload = this->payload ? this->payload->clone(this->payload) : NULL;
 	pkt->next_header = this->next_header;
 	return &pkt->public.packet;
@@ -170,41 +219,44 @@ static bool check_padding(chunk_t padding)
 static bool remove_padding(private_esp_packet_t *this, chunk_t plaintext)
 {
 	u_int8_t next_header, pad_length;
-	chunk_t padding, payload;
+	chunk_t padding, payload, data;
 	bio_reader_t *reader;
+	size_t offset;
 
 	reader = bio_reader_create(plaintext);
 	if (!reader->read_uint8_end(reader, &next_header) ||
 		!reader->read_uint8_end(reader, &pad_length))
 	{
 		DBG1(DBG_ESP, "parsing ESP payload failed: invalid length");
-		goto failed;
+		reader->destroy(reader);
+		return FALSE;
 	}
 	if (!reader->read_data_end(reader, pad_length, &padding) ||
 		!check_padding(padding))
 	{
 		DBG1(DBG_ESP, "parsing ESP payload failed: invalid padding");
-		goto failed;
+		reader->destroy(reader);
+		return FALSE;
 	}
-	this->payload = ip_packet_create(reader->peek(reader));
+	payload = reader->peek(reader);
 	reader->destroy(reader);
+
+	DBG3(DBG_ESP, "ESP payload:\n  payload %B\n  padding %B\n  "
+		 "padding length = %hhu, next header = %hhu", &payload, &padding,
+		 pad_length, next_header);
+
+	/* the payload is decrypted in place, pass the packet data to it */
+	offset = payload.ptr - this->packet->get_data(this->packet).ptr;
+	data = this->packet->extract_data(this->packet);
+	this->payload = ip_packet_create_from_buffer(data,
+								chunk_create(data.ptr + offset, payload.len));
 	if (!this->payload)
 	{
 		DBG1(DBG_ESP, "parsing ESP payload failed: unsupported payload");
 		return FALSE;
 	}
 	this->next_header = next_header;
-	payload = this->payload->get_encoding(this->payload);
-
-	DBG3(DBG_ESP, "ESP payload:\n  payload %B\n  padding %B\n  "
-		 "padding length = %hhu, next header = %hhu", &payload, &padding,
-		 pad_length, this->next_header);
 	return TRUE;
-
-failed:
-	reader->destroy(reader);
-	chunk_free(&plaintext);
-	return FALSE;
 }
 
 METHOD(esp_packet_t, decrypt, status_t,
@@ -248,13 +300,16 @@ METHOD(esp_packet_t, decrypt, status_t,
 	/* aad = spi + seq */
 	aad = chunk_create(data.ptr, 8);
 
-	if (!aead->decrypt(aead, ciphertext, aad, iv, &plaintext))
+	/* decrypt/verify the content inline */
+	if (!aead->decrypt(aead, ciphertext, aad, iv, NULL))
 	{
 		DBG1(DBG_ESP, "ESP decryption or ICV verification failed");
 		return FAILED;
 	}
 	esp_context->set_authenticated_seqno(esp_context, seq);
 
+	plaintext = chunk_create(ciphertext.ptr, ciphertext.len - icv.len);
+
 	if (!remove_padding(this, plaintext))
 	{
 		return PARSE_ERROR;
@@ -278,13 +333,13 @@ static void generate_padding(chunk_t padding)
 METHOD(esp_packet_t, encrypt, status_t,
 	private_esp_packet_t *this, esp_context_t *esp_context, u_int32_t spi)
 {
-	chunk_t iv, icv, aad, padding, payload, ciphertext;
-	bio_writer_t *writer;
+	chunk_t iv, icv, aad, padding, payload, ciphertext, buffer;
 	u_int32_t next_seqno;
-	size_t blocksize, plainlen;
+	size_t blocksize, plainlen, headlen, taillen;
 	aead_t *aead;
 	rng_t *rng;
 
+	release_buffer(this);
 	this->packet->set_data(this->packet, chunk_empty);
 
 	if (!esp_context->next_seqno(esp_context, &next_seqno))
@@ -313,38 +368,66 @@ METHOD(esp_packet_t, encrypt, status_t,
 	plainlen += padding.len;
 
 	/* len = spi, seq, IV, plaintext, ICV */
-	writer = bio_writer_create(2 * sizeof(u_int32_t) + iv.len + plainlen +
-							   icv.len);
-	writer->write_uint32(writer, ntohl(spi));
-	writer->write_uint32(writer, next_seqno);
+	headlen = 2 * sizeof(u_int32_t) + iv.len;
+	taillen = padding.len + 2 + icv.len;
+
+	/* build the packet around the payload, if its buffer has enough room */
+	buffer = this->payload ? this->payload->extract_buffer(this->payload)
+						   : chunk_empty;
+	if (!buffer.ptr || payload.ptr < buffer.ptr + headlen ||
+		payload.ptr + payload.len + taillen > buffer.ptr + buffer.len)
+	{
+		chunk_t moved;
 
-	iv = writer->skip(writer, iv.len);
+		moved = ipsec->buffers->get(ipsec->buffers, payload.len);
+		if (headlen > IPSEC_BUFFER_HEADROOM || taillen > IPSEC_BUFFER_TAILROOM)
+		{
+			ipsec->buffers->put(ipsec->buffers, moved);
+			moved = chunk_alloc(headlen + payload.len + taillen);
+			memcpy(moved.ptr + headlen, payload.ptr, payload.len);
+			payload.ptr = moved.ptr + headlen;
+		}
+		else
+		{
+			memcpy(moved.ptr + IPSEC_BUFFER_HEADROOM, payload.ptr, payload.len);
+			payload.ptr = moved.ptr + IPSEC_BUFFER_HEADROOM;
+		}
+		ipsec->buffers->put(ipsec->buffers, buffer);
+		buffer = moved;
+	}
+	/* the payload got consumed */
+	DESTROY_IF(this->payload);
+	this->payload = NULL;
+
+	this->buffer = buffer;
+	this->data = chunk_create(payload.ptr - headlen,
+							  headlen + plainlen + icv.len);
+
+	htoun32(this->data.ptr, ntohl(spi));
+	htoun32(this->data.ptr + sizeof(u_int32_t), next_seqno);
+
+	iv.ptr = this->data.ptr + 2 * sizeof(u_int32_t);
 	if (!rng->get_bytes(rng, iv.len, iv.ptr))
 	{
 		DBG1(DBG_ESP, "ESP encryption failed: could not generate IV");
-		writer->destroy(writer);
+		release_buffer(this);
 		rng->destroy(rng);
 		return FAILED;
 	}
 	rng->destroy(rng);
 
-	/* plain-/ciphertext will start here */
-	ciphertext = writer->get_buf(writer);
-	ciphertext.ptr += ciphertext.len;
-	ciphertext.len = plainlen;
-
-	writer->write_data(writer, payload);
+	/* plain-/ciphertext starts with the payload */
+	ciphertext = chunk_create(payload.ptr, plainlen);
 
-	padding = writer->skip(writer, padding.len);
+	padding.ptr = payload.ptr + payload.len;
 	generate_padding(padding);
 
-	writer->write_uint8(writer, padding.len);
-	writer->write_uint8(writer, this->next_header);
+	padding.ptr[padding.len] = padding.len;
+	padding.ptr[padding.len + 1] = this->next_header;
 
 	/* aad = spi + seq */
-	aad = writer->get_buf(writer);
-	aad.len = 8;
-	icv = writer->skip(writer, icv.len);
+	aad = chunk_create(this->data.ptr, 8);
+	icv.ptr = ciphertext.ptr + ciphertext.len;
 
 	DBG3(DBG_ESP, "ESP before encryption:\n  payload = %B\n  padding = %B\n  "
 		 "padding length = %hhu, next header = %hhu", &payload, &padding,
@@ -354,16 +437,13 @@ METHOD(esp_packet_t, encrypt, status_t,
 	if (!aead->encrypt(aead, ciphertext, aad, iv, NULL))
 	{
 		DBG1(DBG_ESP, "ESP encryption or ICV generation failed");
-		writer->destroy(writer);
+		release_buffer(this);
 		return FAILED;
 	}
 
 	DBG3(DBG_ESP, "ESP packet:\n  SPI %.8x [seq %u]\n  IV %B\n  "
 		 "encrypted %B\n  ICV %B", ntohl(spi), next_seqno, &iv,
 		 &ciphertext, &icv);
-
-	this->packet->set_data(this->packet, writer->extract_buf(writer));
-	writer->destroy(writer);
 	return SUCCESS;
 }
 
@@ -393,6 +473,7 @@ METHOD2(esp_packet_t, packet_t, destroy, void,
 	private_esp_packet_t *this)
 {
 	DESTROY_IF(this->payload);
+	release_buffer(this);
 	this->packet->destroy(this->packet);
 	free(this);
 }
@@ -410,6 +491,7 @@ static private_esp_packet_t *esp_packet_create_internal(packet_t *packet)
 				.get_destination = _get_destination,
 				.get_data = _get_data,
 				.set_data = _set_data,
+				.extract_data = _extract_data,
 				.get_dscp = _get_dscp,
 				.set_dscp = _set_dscp,
 				.skip_bytes = _skip_bytes,
@@ -15,6 +15,7 @@
 
 
 #include "ip_packet.h"
+#include "ipsec.h"
 
 #include <library.h>
 #include <utils/debug.h>
@@ -49,10 +50,15 @@ struct private_ip_packet_t {
 	host_t *dst;
 
 	/**
-	 * IP packet
+	 * IP packet, located within buffer
 	 */
 	chunk_t packet;
 
+	/**
+	 * Buffer containing the IP packet
+	 */
+	chunk_t buffer;
+
 	/**
 	 * IP version
 	 */
@@ -95,10 +101,34 @@ METHOD(ip_packet_t, get_next_header, u_int8_t,
 	return this->next_header;
 }
 
+METHOD(ip_packet_t, extract_buffer, chunk_t,
+	private_ip_packet_t *this)
+{
+	chunk_t buffer = this->buffer;
+
+	this->buffer = chunk_empty;
+	return buffer;
+}
+
 METHOD(ip_packet_t, clone, ip_packet_t*,
 	private_ip_packet_t *this)
 {
-	return ip_packet_create(this->packet);
+	return ip_packet_create(chunk_clone(this->packet));
+}
+
+/**
+ * Release a packet buffer, to the pool only if libipsec is initialized
+ */
+static void put_buffer(chunk_t buffer)
+{
+	if (ipsec && ipsec->buffers)
+	{
+		ipsec->buffers->put(ipsec->buffers, buffer);
+	}
+	else
+	{
+		free(buffer.ptr);
+	}
 }
 
 METHOD(ip_packet_t, destroy, void,
@@ -106,7 +136,7 @@ METHOD(ip_packet_t, destroy, void,
 {
 	this->src->destroy(this->src);
 	this->dst->destroy(this->dst);
-	chunk_free(&this->packet);
+	put_buffer(this->buffer);
 	free(this);
 }
 
@@ -114,6 +144,14 @@ METHOD(ip_packet_t, destroy, void,
  * Described in header.
  */
 ip_packet_t *ip_packet_create(chunk_t packet)
+{
+	return ip_packet_create_from_buffer(packet, packet);
+}
+
+/**
+ * Described in header.
+ */
+ip_packet_t *ip_packet_create_from_buffer(chunk_t buffer, chunk_t packet)
 {
 	private_ip_packet_t *this;
 	u_int8_t version, next_header;
@@ -177,18 +215,20 @@ ip_packet_t *ip_packet_create(chunk_t packet)
 			.get_destination = _get_destination,
 			.get_next_header = _get_next_header,
 			.get_encoding = _get_encoding,
+			.extract_buffer = _extract_buffer,
 			.clone = _clone,
 			.destroy = _destroy,
 		},
 		.src = src,
 		.dst = dst,
 		.packet = packet,
+		.buffer = buffer,
 		.version = version,
 		.next_header = next_header,
 	);
 	return &this->public;
 
 failed:
-	chunk_free(&packet);
+	put_buffer(buffer);
 	return NULL;
 }
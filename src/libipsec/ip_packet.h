@@ -67,6 +67,17 @@ struct ip_packet_t {
 	 */
 	chunk_t (*get_encoding)(ip_packet_t *this);
 
+	/**
+	 * Extract the buffer containing the IP packet.
+	 *
+	 * The encoding returned by get_encoding() is located within the buffer
+	 * and may be modified in place afterwards, the IP packet must not be
+	 * used anymore except for destroy().
+	 *
+	 * @return				buffer, release via ipsec->buffers
+	 */
+	chunk_t (*extract_buffer)(ip_packet_t *this);
+
 	/**
 	 * Clone the IP packet
 	 *
@@ -93,4 +104,19 @@ struct ip_packet_t {
  */
 ip_packet_t *ip_packet_create(chunk_t packet);
 
+/**
+ * Create an IP packet stored within a larger buffer.
+ *
+ * The buffer provides room around the packet, so it can be encapsulated in
+ * place.
+ *
+ * @note The buffer gets either owned by the new object, or released,
+ * if the data is invalid.
+ *
+ * @param buffer		buffer containing the packet, gets owned
+ * @param packet		the IP packet (including header), within buffer
+ * @return				ip_packet_t instance, or NULL if invalid
+ */
+ip_packet_t *ip_packet_create_from_buffer(chunk_t buffer, chunk_t packet);
+
 #endif /** IP_PACKET_H_ @}*/
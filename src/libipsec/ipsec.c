@@ -47,6 +47,7 @@ void libipsec_deinit()
 	DESTROY_IF(this->public.events);
 	DESTROY_IF(this->public.policies);
 	DESTROY_IF(this->public.sas);
+	DESTROY_IF(this->public.buffers);
 	free(this);
 	ipsec = NULL;
 }
@@ -68,6 +69,7 @@ bool libipsec_init()
 		return FALSE;
 	}
 
+	this->public.buffers = ipsec_buffer_pool_create();
 	this->public.sas = ipsec_sa_mgr_create();
 	this->public.policies = ipsec_policy_mgr_create();
 	this->public.events = ipsec_event_relay_create();
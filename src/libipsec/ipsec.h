@@ -29,6 +29,7 @@
 #include "ipsec_policy_mgr.h"
 #include "ipsec_event_relay.h"
 #include "ipsec_processor.h"
+#include "ipsec_buffer_pool.h"
 
 #include <library.h>
 
@@ -59,6 +60,11 @@ struct ipsec_t {
 	 */
 	ipsec_processor_t *processor;
 
+	/**
+	 * Packet buffer pool instance
+	 */
+	ipsec_buffer_pool_t *buffers;
+
 };
 
 /**
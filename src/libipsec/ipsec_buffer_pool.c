@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "ipsec_buffer_pool.h"
+
+#include <threading/thread.h>
+#include <threading/mutex.h>
+
+/**
+ * Size of pooled buffers, fits common MTUs plus headroom and tailroom
+ */
+#define BUFFER_SIZE 2048
+
+/**
+ * Number of separately locked caches (MUST be a power of 2)
+ */
+#define CACHE_COUNT 8
+
+/**
+ * Maximum number of buffers kept per cache
+ */
+#define CACHE_SIZE 64
+
+typedef struct private_ipsec_buffer_pool_t private_ipsec_buffer_pool_t;
+
+/**
+ * Cache of released buffers
+ */
+typedef struct {
+
+	/**
+	 * Cached buffers, BUFFER_SIZE bytes each
+	 */
+	u_char *buffers[CACHE_SIZE];
+
+	/**
+	 * Number of cached buffers
+	 */
+	u_int count;
+
+	/**
+	 * Mutex to lock this cache
+	 */
+	mutex_t *mutex;
+
+} cache_t;
+
+/**
+ * Private data of an ipsec_buffer_pool_t object.
+ */
+struct private_ipsec_buffer_pool_t {
+
+	/**
+	 * Public ipsec_buffer_pool_t interface.
+	 */
+	ipsec_buffer_pool_t public;
+
+	/**
+	 * Caches, the one of the current thread is tried first
+	 */
+	cache_t caches[CACHE_COUNT];
+};
+
+/**
+ * Get the cache to try first for the current thread
+ */
+static inline u_int first_cache(private_ipsec_buffer_pool_t *this)
+{
+	return thread_current_id() & (CACHE_COUNT - 1);
+}
+
+METHOD(ipsec_buffer_pool_t, get, chunk_t,
+	private_ipsec_buffer_pool_t *this, size_t len)
+{
+	cache_t *cache;
+	chunk_t buffer;
+	u_int first, i;
+
+	len += IPSEC_BUFFER_HEADROOM + IPSEC_BUFFER_TAILROOM;
+	if (len > BUFFER_SIZE)
+	{
+		return chunk_alloc(len);
+	}
+	/* buffers are often released by other threads, e.g. after decryption,
+	 * so take them from other caches if ours is empty */
+	first = first_cache(this);
+	for (i = 0; i < CACHE_COUNT; i++)
+	{
+		cache = &this->caches[(first + i) & (CACHE_COUNT - 1)];
+		cache->mutex->lock(cache->mutex);
+		if (cache->count)
+		{
+			buffer = chunk_create(cache->buffers[--cache->count], BUFFER_SIZE);
+			cache->mutex->unlock(cache->mutex);
+			return buffer;
+		}
+		cache->mutex->unlock(cache->mutex);
+	}
+	return chunk_alloc(BUFFER_SIZE);
+}
+
+METHOD(ipsec_buffer_pool_t, put, void,
+	private_ipsec_buffer_pool_t *this, chunk_t buffer)
+{
+	cache_t *cache;
+	u_int first, i;
+
+	if (buffer.len == BUFFER_SIZE)
+	{
+		first = first_cache(this);
+		for (i = 0; i < CACHE_COUNT; i++)
+		{
+			cache = &this->caches[(first + i) & (CACHE_COUNT - 1)];
+			cache->mutex->lock(cache->mutex);
+			if (cache->count < CACHE_SIZE)
+			{
+				cache->buffers[cache->count++] = buffer.ptr;
+				cache->mutex->unlock(cache->mutex);
+				return;
+			}
+			cache->mutex->unlock(cache->mutex);
+		}
+	}
+	free(buffer.ptr);
+}
+
+METHOD(ipsec_buffer_pool_t, destroy, void,
+	private_ipsec_buffer_pool_t *this)
+{
+	cache_t *cache;
+	int i;
+
+	for (i = 0; i < CACHE_COUNT; i++)
+	{
+		cache = &this->caches[i];
+		while (cache->count)
+		{
+			free(cache->buffers[--cache->count]);
+		}
+		cache->mutex->destroy(cache->mutex);
+	}
+	free(this);
+}
+
+/**
+ * Described in header.
+ */
+ipsec_buffer_pool_t *ipsec_buffer_pool_create()
+{
+	private_ipsec_buffer_pool_t *this;
+	int i;
+
+	INIT(this,
+		.public = {
+			.get = _get,
+			.put = _put,
+			.destroy = _destroy,
+		},
+	);
+
+	for (i = 0; i < CACHE_COUNT; i++)
+	{
+		this->caches[i].mutex = mutex_create(MUTEX_TYPE_DEFAULT);
+	}
+	return &this->public;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup ipsec_buffer_pool ipsec_buffer_pool
+ * @{ @ingroup libipsec
+ */
+
+#ifndef IPSEC_BUFFER_POOL_H_
+#define IPSEC_BUFFER_POOL_H_
+
+#include <library.h>
+
+/**
+ * Space reserved in front of IP packets for the ESP header and IV
+ */
+#define IPSEC_BUFFER_HEADROOM 64
+
+/**
+ * Space reserved after IP packets for the ESP trailer and ICV
+ */
+#define IPSEC_BUFFER_TAILROOM 64
+
+typedef struct ipsec_buffer_pool_t ipsec_buffer_pool_t;
+
+/**
+ * Pool of packet buffers.
+ *
+ * Buffers provide room around the packet so ESP headers and trailers can be
+ * added and removed in place. Buffers of the default size are cached when
+ * released, others are allocated and freed directly.
+ */
+struct ipsec_buffer_pool_t {
+
+	/**
+	 * Get a buffer for a packet of the given length.
+	 *
+	 * The packet is expected to be stored at offset IPSEC_BUFFER_HEADROOM,
+	 * at least IPSEC_BUFFER_TAILROOM bytes are available after it.
+	 *
+	 * @param len			length of the packet
+	 * @return				allocated buffer
+	 */
+	chunk_t (*get)(ipsec_buffer_pool_t *this, size_t len);
+
+	/**
+	 * Release a buffer.
+	 *
+	 * Any buffer allocated with malloc() may be released using this method.
+	 *
+	 * @param buffer		buffer to release, may be chunk_empty
+	 */
+	void (*put)(ipsec_buffer_pool_t *this, chunk_t buffer);
+
+	/**
+	 * Destroy an ipsec_buffer_pool_t and all cached buffers.
+	 */
+	void (*destroy)(ipsec_buffer_pool_t *this);
+};
+
+/**
+ * Create an ipsec_buffer_pool_t instance.
+ *
+ * @return					buffer pool
+ */
+ipsec_buffer_pool_t *ipsec_buffer_pool_create();
+
+#endif /** IPSEC_BUFFER_POOL_H_ @}*/
@@ -20,11 +20,73 @@
 #include <utils/debug.h>
 #include <threading/rwlock.h>
 #include <collections/linked_list.h>
+#include <collections/hashtable.h>
 
 /** Base priority for installed policies */
 #define PRIO_BASE 512
 
 typedef struct private_ipsec_policy_mgr_t private_ipsec_policy_mgr_t;
+typedef struct policy_index_t policy_index_t;
+typedef struct trie_node_t trie_node_t;
+
+/**
+ * Node in a binary prefix trie.
+ *
+ * Nodes of the destination trie link to a source trie for the policies with
+ * that destination prefix, nodes of the source trie store the policies.
+ */
+struct trie_node_t {
+
+	/**
+	 * Child nodes for the next bit being 0 or 1
+	 */
+	trie_node_t *child[2];
+
+	/**
+	 * Policies with a prefix ending at this node, sorted by priority
+	 * (ipsec_policy_entry_t*), NULL if none. In the destination trie these
+	 * are policies with a source range that is not a subnet.
+	 */
+	linked_list_t *entries;
+
+	/**
+	 * Source trie of a destination trie node, NULL if none
+	 */
+	trie_node_t *src;
+};
+
+/**
+ * Lookup index for the policies of one direction.
+ *
+ * Host policies (/32 or /128) are found by hashing the destination, or if that
+ * is a subnet, the source address. Other policies are stored in a trie on the
+ * destination prefix, followed by a trie on the source prefix. Policies with a
+ * destination range that can't be expressed as subnet are kept in a separate
+ * list that is searched linearly.
+ */
+struct policy_index_t {
+
+	/**
+	 * Policies with a host destination, host_bucket_t* by address
+	 */
+	hashtable_t *dst_hosts;
+
+	/**
+	 * Policies with a host source, host_bucket_t* by address
+	 */
+	hashtable_t *src_hosts;
+
+	/**
+	 * Destination prefix tries for IPv4 and IPv6
+	 */
+	trie_node_t *trie[2];
+
+	/**
+	 * Policies that can't be indexed (ipsec_policy_entry_t*), sorted by
+	 * priority
+	 */
+	linked_list_t *other;
+};
 
 /**
  * Private additions to ipsec_policy_mgr_t.
@@ -41,6 +103,16 @@ struct private_ipsec_policy_mgr_t {
 	 */
 	linked_list_t *policies;
 
+	/**
+	 * Lookup indices for outbound [0] and inbound [1] policies
+	 */
+	policy_index_t index[2];
+
+	/**
+	 * Sequence number assigned to the next installed policy
+	 */
+	u_int32_t seq;
+
 	/**
 	 * Lock to safely access the list of policies
 	 */
@@ -59,6 +131,12 @@ typedef struct {
 	 */
 	u_int32_t priority;
 
+	/**
+	 * Installation order, of policies with equal priority the most recently
+	 * installed one is used
+	 */
+	u_int32_t seq;
+
 	/**
 	 * The policy
 	 */
@@ -66,6 +144,82 @@ typedef struct {
 
 } ipsec_policy_entry_t;
 
+/**
+ * Policies indexed by a host address
+ */
+typedef struct {
+
+	/**
+	 * Host address
+	 */
+	chunk_t addr;
+
+	/**
+	 * Policies for this address (ipsec_policy_entry_t*), sorted by priority
+	 */
+	linked_list_t *entries;
+
+} host_bucket_t;
+
+/**
+ * Hash function for host buckets
+ */
+static u_int host_bucket_hash(host_bucket_t *key)
+{
+	return chunk_hash(key->addr);
+}
+
+/**
+ * Equals function for host buckets
+ */
+static bool host_bucket_equals(host_bucket_t *key, host_bucket_t *other_key)
+{
+	return chunk_equals(key->addr, other_key->addr);
+}
+
+/**
+ * Destroy a host bucket
+ */
+static void host_bucket_destroy(host_bucket_t *this)
+{
+	this->entries->destroy(this->entries);
+	free(this->addr.ptr);
+	free(this);
+}
+
+/**
+ * Destroy a trie node and all its children
+ */
+static void trie_node_destroy(trie_node_t *this)
+{
+	if (this)
+	{
+		trie_node_destroy(this->child[0]);
+		trie_node_destroy(this->child[1]);
+		trie_node_destroy(this->src);
+		DESTROY_IF(this->entries);
+		free(this);
+	}
+}
+
+/**
+ * Get bit i of an address, counted from the most significant bit
+ */
+static inline int get_bit(chunk_t addr, int i)
+{
+	return (addr.ptr[i / 8] >> (7 - i % 8)) & 0x01;
+}
+
+/**
+ * Type of index a policy is stored in
+ */
+typedef enum {
+	INDEX_DST_HOST,
+	INDEX_SRC_HOST,
+	INDEX_DST_PREFIX,
+	INDEX_OTHER,
+} index_type_t;
+
 /**
  * Calculate the pseudo-priority to sort policies.  This is the same algorithm
  * used by the NETLINK kernel interface (i.e. high priority -> low value).
@@ -134,14 +288,343 @@ static void policy_entry_destroy(ipsec_policy_entry_t *this)
 	free(this);
 }
 
+/**
+ * Check if a policy entry is preferred over another
+ */
+static inline bool is_better(ipsec_policy_entry_t *a, ipsec_policy_entry_t *b)
+{
+	return a->priority < b->priority ||
+		  (a->priority == b->priority && a->seq > b->seq);
+}
+
+/**
+ * Insert an entry into a list sorted by priority
+ */
+static void insert_sorted(linked_list_t *list, ipsec_policy_entry_t *entry)
+{
+	enumerator_t *enumerator;
+	ipsec_policy_entry_t *current;
+
+	enumerator = list->create_enumerator(list);
+	while (enumerator->enumerate(enumerator, (void**)&current))
+	{
+		if (current->priority >= entry->priority)
+		{
+			break;
+		}
+	}
+	list->insert_before(list, enumerator, entry);
+	enumerator->destroy(enumerator);
+}
+
+/**
+ * Determine the index to store a policy in. Depending on the type, dst and src
+ * are set to the subnets the policy gets indexed by, NULL otherwise (have to be
+ * destroyed).
+ */
+static index_type_t get_index_type(ipsec_policy_t *policy,
+								   host_t **dst, u_int8_t *dst_mask,
+								   host_t **src, u_int8_t *src_mask)
+{
+	traffic_selector_t *src_ts, *dst_ts;
+	bool dst_subnet, src_subnet;
+	int bits;
+
+	src_ts = policy->get_source_ts(policy);
+	dst_ts = policy->get_destination_ts(policy);
+	bits = dst_ts->get_type(dst_ts) == TS_IPV4_ADDR_RANGE ? 32 : 128;
+
+	*dst = *src = NULL;
+	dst_subnet = dst_ts->to_subnet(dst_ts, dst, dst_mask);
+	src_subnet = src_ts->to_subnet(src_ts, src, src_mask);
+	if (!src_subnet)
+	{
+		DESTROY_IF(*src);
+		*src = NULL;
+	}
+	if (!dst_subnet)
+	{
+		DESTROY_IF(*dst);
+		*dst = NULL;
+	}
+	if (dst_subnet && *dst_mask == bits)
+	{
+		DESTROY_IF(*src);
+		*src = NULL;
+		return INDEX_DST_HOST;
+	}
+	if (src_subnet && *src_mask == bits)
+	{
+		DESTROY_IF(*dst);
+		*dst = NULL;
+		return INDEX_SRC_HOST;
+	}
+	if (dst_subnet)
+	{
+		return INDEX_DST_PREFIX;
+	}
+	DESTROY_IF(*src);
+	*src = NULL;
+	return INDEX_OTHER;
+}
+
+/**
+ * Get the lookup index for policies of the given direction
+ */
+static inline policy_index_t *get_index(private_ipsec_policy_mgr_t *this,
+										ipsec_policy_t *policy)
+{
+	return &this->index[policy->get_direction(policy) == POLICY_IN];
+}
+
+/**
+ * Find or create the trie node for the given prefix
+ */
+static trie_node_t *trie_get(trie_node_t **node, host_t *net, u_int8_t mask)
+{
+	chunk_t addr;
+	int i;
+
+	addr = net->get_address(net);
+	for (i = 0; ; i++)
+	{
+		if (!*node)
+		{
+			INIT(*node);
+		}
+		if (i == mask)
+		{
+			return *node;
+		}
+		node = &(*node)->child[get_bit(addr, i)];
+	}
+}
+
+/**
+ * Remove an entry from a trie, pruning nodes that get empty. If src is given,
+ * the entry is removed from the source trie of the destination prefix.
+ */
+static void trie_remove(trie_node_t **node, chunk_t addr, u_int8_t mask,
+						int depth, host_t *src, u_int8_t src_mask,
+						ipsec_policy_entry_t *entry)
+{
+	trie_node_t *this = *node;
+
+	if (!this)
+	{
+		return;
+	}
+	if (depth < mask)
+	{
+		trie_remove(&this->child[get_bit(addr, depth)], addr, mask,
+					depth + 1, src, src_mask, entry);
+	}
+	else if (src)
+	{
+		trie_remove(&this->src, src->get_address(src), src_mask, 0,
+					NULL, 0, entry);
+	}
+	else if (this->entries)
+	{
+		this->entries->remove(this->entries, entry, NULL);
+		if (this->entries->get_count(this->entries) == 0)
+		{
+			this->entries->destroy(this->entries);
+			this->entries = NULL;
+		}
+	}
+	if (!this->entries && !this->src && !this->child[0] && !this->child[1])
+	{
+		free(this);
+		*node = NULL;
+	}
+}
+
+/**
+ * Add a policy entry to the lookup index of its direction
+ */
+static void index_entry(private_ipsec_policy_mgr_t *this,
+						ipsec_policy_entry_t *entry)
+{
+	policy_index_t *index;
+	host_bucket_t *bucket, key;
+	hashtable_t *hosts;
+	trie_node_t *node;
+	index_type_t type;
+	host_t *dst, *src;
+	u_int8_t dst_mask, src_mask;
+
+	index = get_index(this, entry->policy);
+	type = get_index_type(entry->policy, &dst, &dst_mask, &src, &src_mask);
+	switch (type)
+	{
+		case INDEX_DST_HOST:
+		case INDEX_SRC_HOST:
+			hosts = type == INDEX_DST_HOST ? index->dst_hosts
+										   : index->src_hosts;
+			key.addr = type == INDEX_DST_HOST ? dst->get_address(dst)
+											  : src->get_address(src);
+			bucket = hosts->get(hosts, &key);
+			if (!bucket)
+			{
+				INIT(bucket,
+					.addr = chunk_clone(key.addr),
+					.entries = linked_list_create(),
+				);
+				hosts->put(hosts, bucket, bucket);
+			}
+			insert_sorted(bucket->entries, entry);
+			break;
+		case INDEX_DST_PREFIX:
+			node = trie_get(&index->trie[dst->get_family(dst) == AF_INET6],
+							dst, dst_mask);
+			if (src)
+			{
+				node = trie_get(&node->src, src, src_mask);
+			}
+			if (!node->entries)
+			{
+				node->entries = linked_list_create();
+			}
+			insert_sorted(node->entries, entry);
+			break;
+		case INDEX_OTHER:
+			insert_sorted(index->other, entry);
+			break;
+	}
+	DESTROY_IF(dst);
+	DESTROY_IF(src);
+}
+
+/**
+ * Remove a policy entry from the lookup index of its direction
+ */
+static void unindex_entry(private_ipsec_policy_mgr_t *this,
+						  ipsec_policy_entry_t *entry)
+{
+	policy_index_t *index;
+	host_bucket_t *bucket, key;
+	hashtable_t *hosts;
+	index_type_t type;
+	host_t *dst, *src;
+	u_int8_t dst_mask, src_mask;
+
+	index = get_index(this, entry->policy);
+	type = get_index_type(entry->policy, &dst, &dst_mask, &src, &src_mask);
+	switch (type)
+	{
+		case INDEX_DST_HOST:
+		case INDEX_SRC_HOST:
+			hosts = type == INDEX_DST_HOST ? index->dst_hosts
+										   : index->src_hosts;
+			key.addr = type == INDEX_DST_HOST ? dst->get_address(dst)
+											  : src->get_address(src);
+			bucket = hosts->get(hosts, &key);
+			if (bucket)
+			{
+				bucket->entries->remove(bucket->entries, entry, NULL);
+				if (bucket->entries->get_count(bucket->entries) == 0)
+				{
+					hosts->remove(hosts, bucket);
+					host_bucket_destroy(bucket);
+				}
+			}
+			break;
+		case INDEX_DST_PREFIX:
+			trie_remove(&index->trie[dst->get_family(dst) == AF_INET6],
+						dst->get_address(dst), dst_mask, 0, src, src_mask,
+						entry);
+			break;
+		case INDEX_OTHER:
+			index->other->remove(index->other, entry, NULL);
+			break;
+	}
+	DESTROY_IF(dst);
+	DESTROY_IF(src);
+}
+
+/**
+ * Find the best matching policy in a list sorted by priority, if it is better
+ * than the currently found one
+ */
+static void find_in_list(linked_list_t *list, ip_packet_t *packet,
+						 ipsec_policy_entry_t **best)
+{
+	enumerator_t *enumerator;
+	ipsec_policy_entry_t *current;
+
+	enumerator = list->create_enumerator(list);
+	while (enumerator->enumerate(enumerator, (void**)&current))
+	{
+		if (*best && !is_better(current, *best))
+		{	/* the remaining entries have a lower priority */
+			break;
+		}
+		if (current->policy->match_packet(current->policy, packet))
+		{
+			*best = current;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+}
+
+/**
+ * Find the best matching policy in a host hashtable
+ */
+static void find_in_hosts(hashtable_t *hosts, host_t *host,
+						  ip_packet_t *packet, ipsec_policy_entry_t **best)
+{
+	host_bucket_t *bucket, key = {
+		.addr = host->get_address(host),
+	};
+
+	if (hosts->get_count(hosts))
+	{
+		bucket = hosts->get(hosts, &key);
+		if (bucket)
+		{
+			find_in_list(bucket->entries, packet, best);
+		}
+	}
+}
+
+/**
+ * Find the best matching policy along the path of the destination address in
+ * a trie, and the source address in the source tries of visited nodes
+ */
+static void find_in_trie(trie_node_t *node, host_t *dst, host_t *src,
+						 ip_packet_t *packet, ipsec_policy_entry_t **best)
+{
+	chunk_t addr;
+	int i;
+
+	addr = dst->get_address(dst);
+	for (i = 0; node; i++)
+	{
+		if (node->entries)
+		{
+			find_in_list(node->entries, packet, best);
+		}
+		if (node->src)
+		{
+			find_in_trie(node->src, src, NULL, packet, best);
+		}
+		if (i == addr.len * 8)
+		{
+			break;
+		}
+		node = node->child[get_bit(addr, i)];
+	}
+}
+
 METHOD(ipsec_policy_mgr_t, add_policy, status_t,
 	private_ipsec_policy_mgr_t *this, host_t *src, host_t *dst,
 	traffic_selector_t *src_ts, traffic_selector_t *dst_ts,
 	policy_dir_t direction, policy_type_t type, ipsec_sa_cfg_t *sa, mark_t mark,
 	policy_priority_t priority)
 {
-	enumerator_t *enumerator;
-	ipsec_policy_entry_t *entry, *current;
+	ipsec_policy_entry_t *entry;
 	ipsec_policy_t *policy;
 
 	if (type != POLICY_IPSEC || direction == POLICY_FWD)
@@ -157,16 +640,9 @@ METHOD(ipsec_policy_mgr_t, add_policy, status_t,
 	entry = policy_entry_create(policy);
 
 	this->lock->write_lock(this->lock);
-	enumerator = this->policies->create_enumerator(this->policies);
-	while (enumerator->enumerate(enumerator, (void**)&current))
-	{
-		if (current->priority >= entry->priority)
-		{
-			break;
-		}
-	}
-	this->policies->insert_before(this->policies, enumerator, entry);
-	enumerator->destroy(enumerator);
+	entry->seq = this->seq++;
+	insert_sorted(this->policies, entry);
+	index_entry(this, entry);
 	this->lock->unlock(this->lock);
 	return SUCCESS;
 }
@@ -198,6 +674,7 @@ METHOD(ipsec_policy_mgr_t, del_policy, status_t,
 								   reqid, mark, policy_priority))
 		{
 			this->policies->remove_at(this->policies, enumerator);
+			unindex_entry(this, current);
 			found = current;
 			break;
 		}
@@ -223,6 +700,7 @@ METHOD(ipsec_policy_mgr_t, flush_policies, status_t,
 	while (this->policies->remove_last(this->policies,
 									  (void**)&entry) == SUCCESS)
 	{
+		unindex_entry(this, entry);
 		policy_entry_destroy(entry);
 	}
 	this->lock->unlock(this->lock);
@@ -232,24 +710,25 @@ METHOD(ipsec_policy_mgr_t, flush_policies, status_t,
 METHOD(ipsec_policy_mgr_t, find_by_packet, ipsec_policy_t*,
 	private_ipsec_policy_mgr_t *this, ip_packet_t *packet, bool inbound)
 {
-	enumerator_t *enumerator;
-	ipsec_policy_entry_t *current;
+	ipsec_policy_entry_t *best = NULL;
 	ipsec_policy_t *found = NULL;
+	policy_index_t *index;
+	host_t *src, *dst;
+
+	src = packet->get_source(packet);
+	dst = packet->get_destination(packet);
 
 	this->lock->read_lock(this->lock);
-	enumerator = this->policies->create_enumerator(this->policies);
-	while (enumerator->enumerate(enumerator, (void**)&current))
+	index = &this->index[inbound];
+	find_in_hosts(index->dst_hosts, dst, packet, &best);
+	find_in_hosts(index->src_hosts, src, packet, &best);
+	find_in_trie(index->trie[dst->get_family(dst) == AF_INET6], dst, src,
+				 packet, &best);
+	find_in_list(index->other, packet, &best);
+	if (best)
 	{
-		ipsec_policy_t *policy = current->policy;
-
-		if ((inbound == (policy->get_direction(policy) == POLICY_IN)) &&
-			 policy->match_packet(policy, packet))
-		{
-			found = policy->get_ref(policy);
-			break;
-		}
+		found = best->policy->get_ref(best->policy);
 	}
-	enumerator->destroy(enumerator);
 	this->lock->unlock(this->lock);
 	return found;
 }
@@ -257,7 +736,17 @@ METHOD(ipsec_policy_mgr_t, find_by_packet, ipsec_policy_t*,
 METHOD(ipsec_policy_mgr_t, destroy, void,
 	private_ipsec_policy_mgr_t *this)
 {
+	int i;
+
 	flush_policies(this);
+	for (i = 0; i < countof(this->index); i++)
+	{
+		this->index[i].dst_hosts->destroy(this->index[i].dst_hosts);
+		this->index[i].src_hosts->destroy(this->index[i].src_hosts);
+		trie_node_destroy(this->index[i].trie[0]);
+		trie_node_destroy(this->index[i].trie[1]);
+		this->index[i].other->destroy(this->index[i].other);
+	}
 	this->policies->destroy(this->policies);
 	this->lock->destroy(this->lock);
 	free(this);
@@ -269,6 +758,7 @@ METHOD(ipsec_policy_mgr_t, destroy, void,
 ipsec_policy_mgr_t *ipsec_policy_mgr_create()
 {
 	private_ipsec_policy_mgr_t *this;
+	int i;
 
 	INIT(this,
 		.public = {
@@ -282,5 +772,15 @@ ipsec_policy_mgr_t *ipsec_policy_mgr_create()
 		.lock = rwlock_create(RWLOCK_TYPE_DEFAULT),
 	);
 
+	for (i = 0; i < countof(this->index); i++)
+	{
+		this->index[i].dst_hosts = hashtable_create(
+								(hashtable_hash_t)host_bucket_hash,
+								(hashtable_equals_t)host_bucket_equals, 32);
+		this->index[i].src_hosts = hashtable_create(
+								(hashtable_hash_t)host_bucket_hash,
+								(hashtable_equals_t)host_bucket_equals, 32);
+		this->index[i].other = linked_list_create();
+	}
 	return &this->public;
 }
@@ -18,11 +18,103 @@
 
 #include <utils/debug.h>
 #include <library.h>
+#include <threading/thread.h>
+#include <threading/mutex.h>
+#include <threading/condvar.h>
 #include <threading/rwlock.h>
-#include <collections/blocking_queue.h>
 #include <processing/jobs/callback_job.h>
 
+/** default number of worker lanes */
+#define DEFAULT_LANES 2
+
+/** default number of packets queued per lane and direction */
+#define DEFAULT_QUEUE_SIZE 1024
+
+/** default number of packets dequeued at once */
+#define DEFAULT_BATCH_SIZE 32
+
 typedef struct private_ipsec_processor_t private_ipsec_processor_t;
+typedef struct lane_t lane_t;
+
+/**
+ * A queued packet
+ */
+typedef struct {
+
+	/**
+	 * ESP packet (inbound) or IP packet (outbound)
+	 */
+	void *packet;
+
+	/**
+	 * Policy matching an outbound packet
+	 */
+	ipsec_policy_t *policy;
+
+} queue_entry_t;
+
+/**
+ * Bounded FIFO queue of packets
+ */
+typedef struct {
+
+	/**
+	 * Ring buffer of queued packets
+	 */
+	queue_entry_t *entries;
+
+	/**
+	 * Index of the first queued packet
+	 */
+	u_int head;
+
+	/**
+	 * Number of queued packets
+	 */
+	u_int count;
+
+	/**
+	 * Number of packets dropped because the queue was full
+	 */
+	u_int dropped;
+
+} queue_t;
+
+/**
+ * A worker lane, all packets of an SA are processed by the same lane
+ */
+struct lane_t {
+
+	/**
+	 * Processor this lane belongs to
+	 */
+	private_ipsec_processor_t *processor;
+
+	/**
+	 * Queued inbound packets
+	 */
+	queue_t inbound;
+
+	/**
+	 * Queued outbound packets
+	 */
+	queue_t outbound;
+
+	/**
+	 * Packets dequeued by the worker of this lane
+	 */
+	queue_entry_t *batch;
+
+	/**
+	 * Mutex to lock the queues
+	 */
+	mutex_t *mutex;
+
+	/**
+	 * Condvar to signal queued packets
+	 */
+	condvar_t *condvar;
+};
 
 /**
  * Private additions to ipsec_processor_t.
@@ -35,14 +127,24 @@ struct private_ipsec_processor_t {
 	ipsec_processor_t public;
 
 	/**
-	 * Queue for inbound packets (esp_packet_t*)
+	 * Worker lanes
 	 */
-	blocking_queue_t *inbound_queue;
+	lane_t *lanes;
 
 	/**
-	 * Queue for outbound packets (ip_packet_t*)
+	 * Number of worker lanes
 	 */
-	blocking_queue_t *outbound_queue;
+	u_int lane_count;
+
+	/**
+	 * Maximum number of packets per queue
+	 */
+	u_int queue_size;
+
+	/**
+	 * Maximum number of packets processed per batch and direction
+	 */
+	u_int batch_size;
 
 	/**
 	 * Registered inbound callback
@@ -86,21 +188,19 @@ static void deliver_inbound(private_ipsec_processor_t *this,
 }
 
 /**
- * Processes inbound packets
+ * Processes an inbound packet
  */
-static job_requeue_t process_inbound(private_ipsec_processor_t *this)
+static void process_inbound(private_ipsec_processor_t *this,
+							esp_packet_t *packet)
 {
-	esp_packet_t *packet;
 	ipsec_sa_t *sa;
 	u_int8_t next_header;
 	u_int32_t spi;
 
-	packet = (esp_packet_t*)this->inbound_queue->dequeue(this->inbound_queue);
-
 	if (!packet->parse_header(packet, &spi))
 	{
 		packet->destroy(packet);
-		return JOB_REQUEUE_DIRECT;
+		return;
 	}
 
 	sa = ipsec->sas->checkout_by_spi(ipsec->sas, spi,
@@ -109,7 +209,7 @@ static job_requeue_t process_inbound(private_ipsec_processor_t *this)
 	{
 		DBG2(DBG_ESP, "inbound ESP packet does not belong to an installed SA");
 		packet->destroy(packet);
-		return JOB_REQUEUE_DIRECT;
+		return;
 	}
 
 	if (!sa->is_inbound(sa))
@@ -117,14 +217,14 @@ static job_requeue_t process_inbound(private_ipsec_processor_t *this)
 		DBG1(DBG_ESP, "error: IPsec SA is not inbound");
 		packet->destroy(packet);
 		ipsec->sas->checkin(ipsec->sas, sa);
-		return JOB_REQUEUE_DIRECT;
+		return;
 	}
 
 	if (packet->decrypt(packet, sa->get_esp_context(sa)) != SUCCESS)
 	{
 		ipsec->sas->checkin(ipsec->sas, sa);
 		packet->destroy(packet);
-		return JOB_REQUEUE_DIRECT;
+		return;
 	}
 	ipsec->sas->checkin(ipsec->sas, sa);
 
@@ -158,7 +258,6 @@ static job_requeue_t process_inbound(private_ipsec_processor_t *this)
 			packet->destroy(packet);
 			break;
 	}
-	return JOB_REQUEUE_DIRECT;
 }
 
 /**
@@ -181,27 +280,15 @@ static void send_outbound(private_ipsec_processor_t *this,
 }
 
 /**
- * Processes outbound packets
+ * Processes an outbound packet
  */
-static job_requeue_t process_outbound(private_ipsec_processor_t *this)
+static void process_outbound(private_ipsec_processor_t *this,
+							 ip_packet_t *packet, ipsec_policy_t *policy)
 {
-	ipsec_policy_t *policy;
 	esp_packet_t *esp_packet;
-	ip_packet_t *packet;
 	ipsec_sa_t *sa;
 	host_t *src, *dst;
 
-	packet = (ip_packet_t*)this->outbound_queue->dequeue(this->outbound_queue);
-
-	policy = ipsec->policies->find_by_packet(ipsec->policies, packet, FALSE);
-	if (!policy)
-	{
-		DBG2(DBG_ESP, "no matching outbound IPsec policy for %H == %H",
-			 packet->get_source(packet), packet->get_destination(packet));
-		packet->destroy(packet);
-		return JOB_REQUEUE_DIRECT;
-	}
-
 	sa = ipsec->sas->checkout_by_reqid(ipsec->sas, policy->get_reqid(policy),
 									   FALSE);
 	if (!sa)
@@ -210,7 +297,7 @@ static job_requeue_t process_outbound(private_ipsec_processor_t *this)
 			 "dropping packet", policy->get_reqid(policy));
 		packet->destroy(packet);
 		policy->destroy(policy);
-		return JOB_REQUEUE_DIRECT;
+		return;
 	}
 	src = sa->get_source(sa);
 	dst = sa->get_destination(sa);
@@ -222,25 +309,144 @@ static job_requeue_t process_outbound(private_ipsec_processor_t *this)
 		ipsec->sas->checkin(ipsec->sas, sa);
 		esp_packet->destroy(esp_packet);
 		policy->destroy(policy);
-		return JOB_REQUEUE_DIRECT;
+		return;
 	}
 	/* TODO-IPSEC: update policy/sa counters? */
 	ipsec->sas->checkin(ipsec->sas, sa);
 	policy->destroy(policy);
 	send_outbound(this, esp_packet);
+}
+
+/**
+ * Move up to batch_size packets from a queue to the given batch
+ */
+static u_int dequeue_batch(queue_t *queue, u_int batch_size, u_int queue_size,
+						   queue_entry_t *batch)
+{
+	u_int i;
+
+	for (i = 0; i < batch_size && queue->count; i++)
+	{
+		batch[i] = queue->entries[queue->head];
+		queue->head = (queue->head + 1) % queue_size;
+		queue->count--;
+	}
+	return i;
+}
+
+/**
+ * Processes batches of inbound and outbound packets of a lane
+ */
+static job_requeue_t process_lane(lane_t *lane)
+{
+	private_ipsec_processor_t *this = lane->processor;
+	u_int i, inbound, outbound;
+	bool oldstate;
+
+	lane->mutex->lock(lane->mutex);
+	thread_cleanup_push((thread_cleanup_t)lane->mutex->unlock, lane->mutex);
+	while (!lane->inbound.count && !lane->outbound.count)
+	{
+		oldstate = thread_cancelability(TRUE);
+		lane->condvar->wait(lane->condvar, lane->mutex);
+		thread_cancelability(oldstate);
+	}
+	inbound = dequeue_batch(&lane->inbound, this->batch_size,
+							this->queue_size, lane->batch);
+	outbound = dequeue_batch(&lane->outbound, this->batch_size,
+							 this->queue_size, lane->batch + inbound);
+	thread_cleanup_pop(TRUE);
+
+	for (i = 0; i < inbound; i++)
+	{
+		process_inbound(this, lane->batch[i].packet);
+	}
+	for (; i < inbound + outbound; i++)
+	{
+		process_outbound(this, lane->batch[i].packet, lane->batch[i].policy);
+	}
 	return JOB_REQUEUE_DIRECT;
 }
 
+/**
+ * Queue a packet to a lane, returns FALSE if the queue is full
+ */
+static bool enqueue(private_ipsec_processor_t *this, lane_t *lane,
+					queue_t *queue, void *packet, ipsec_policy_t *policy)
+{
+	bool queued = FALSE;
+
+	lane->mutex->lock(lane->mutex);
+	if (queue->count < this->queue_size)
+	{
+		queue->entries[(queue->head + queue->count) % this->queue_size] =
+			(queue_entry_t){
+				.packet = packet,
+				.policy = policy,
+			};
+		queue->count++;
+		lane->condvar->signal(lane->condvar);
+		queued = TRUE;
+	}
+	else
+	{
+		queue->dropped++;
+	}
+	lane->mutex->unlock(lane->mutex);
+	return queued;
+}
+
+/**
+ * Select the lane for a hash value
+ */
+static inline lane_t *get_lane(private_ipsec_processor_t *this, u_int hash)
+{
+	return &this->lanes[hash % this->lane_count];
+}
+
 METHOD(ipsec_processor_t, queue_inbound, void,
 	private_ipsec_processor_t *this, esp_packet_t *packet)
 {
-	this->inbound_queue->enqueue(this->inbound_queue, packet);
+	chunk_t data;
+	lane_t *lane;
+
+	/* packets with the same SPI are processed by the same lane, which
+	 * preserves their order for the replay check */
+	data = packet->packet.get_data(&packet->packet);
+	lane = get_lane(this, chunk_hash(chunk_create(data.ptr,
+											min(data.len, sizeof(u_int32_t)))));
+	if (!enqueue(this, lane, &lane->inbound, packet, NULL))
+	{
+		DBG2(DBG_ESP, "inbound queue full, dropping ESP packet");
+		packet->destroy(packet);
+	}
 }
 
 METHOD(ipsec_processor_t, queue_outbound, void,
 	private_ipsec_processor_t *this, ip_packet_t *packet)
 {
-	this->outbound_queue->enqueue(this->outbound_queue, packet);
+	ipsec_policy_t *policy;
+	u_int32_t reqid;
+	lane_t *lane;
+
+	policy = ipsec->policies->find_by_packet(ipsec->policies, packet, FALSE);
+	if (!policy)
+	{
+		DBG2(DBG_ESP, "no matching outbound IPsec policy for %H == %H",
+			 packet->get_source(packet), packet->get_destination(packet));
+		packet->destroy(packet);
+		return;
+	}
+	/* packets using the same SA are processed by the same lane, so sequence
+	 * numbers are assigned in the order the packets are sent */
+	reqid = policy->get_reqid(policy);
+	lane = get_lane(this, chunk_hash(chunk_from_thing(reqid)));
+	if (!enqueue(this, lane, &lane->outbound, packet, policy))
+	{
+		DBG2(DBG_ESP, "outbound queue full, dropping IP packet");
+		policy->destroy(policy);
+		packet->destroy(packet);
+	}
 }
 
 METHOD(ipsec_processor_t, register_inbound, void,
@@ -286,10 +492,42 @@ METHOD(ipsec_processor_t, unregister_outbound, void,
 METHOD(ipsec_processor_t, destroy, void,
 	private_ipsec_processor_t *this)
 {
-	this->inbound_queue->destroy_offset(this->inbound_queue,
-										offsetof(esp_packet_t, destroy));
-	this->outbound_queue->destroy_offset(this->outbound_queue,
-										 offsetof(ip_packet_t, destroy));
+	queue_entry_t *entry;
+	lane_t *lane;
+	u_int i, dropped_in = 0, dropped_out = 0;
+
+	for (i = 0; i < this->lane_count; i++)
+	{
+		lane = &this->lanes[i];
+		dropped_in += lane->inbound.dropped;
+		dropped_out += lane->outbound.dropped;
+		while (lane->inbound.count)
+		{
+			entry = &lane->inbound.entries[lane->inbound.head];
+			((esp_packet_t*)entry->packet)->destroy(entry->packet);
+			lane->inbound.head = (lane->inbound.head + 1) % this->queue_size;
+			lane->inbound.count--;
+		}
+		while (lane->outbound.count)
+		{
+			entry = &lane->outbound.entries[lane->outbound.head];
+			((ip_packet_t*)entry->packet)->destroy(entry->packet);
+			entry->policy->destroy(entry->policy);
+			lane->outbound.head = (lane->outbound.head + 1) % this->queue_size;
+			lane->outbound.count--;
+		}
+		free(lane->inbound.entries);
+		free(lane->outbound.entries);
+		free(lane->batch);
+		lane->condvar->destroy(lane->condvar);
+		lane->mutex->destroy(lane->mutex);
+	}
+	if (dropped_in || dropped_out)
+	{
+		DBG1(DBG_ESP, "dropped %u inbound and %u outbound packets due to full "
+			 "processing queues", dropped_in, dropped_out);
+	}
+	free(this->lanes);
 	this->lock->destroy(this->lock);
 	free(this);
 }
@@ -300,6 +538,8 @@ METHOD(ipsec_processor_t, destroy, void,
 ipsec_processor_t *ipsec_processor_create()
 {
 	private_ipsec_processor_t *this;
+	lane_t *lane;
+	u_int i;
 
 	INIT(this,
 		.public = {
@@ -311,16 +551,32 @@ ipsec_processor_t *ipsec_processor_create()
 			.unregister_outbound = _unregister_outbound,
 			.destroy = _destroy,
 		},
-		.inbound_queue = blocking_queue_create(),
-		.outbound_queue = blocking_queue_create(),
+		.lane_count = max(1, lib->settings->get_int(lib->settings,
+							"libipsec.processor.lanes", DEFAULT_LANES)),
+		.queue_size = max(1, lib->settings->get_int(lib->settings,
+							"libipsec.processor.queue_size", DEFAULT_QUEUE_SIZE)),
+		.batch_size = max(1, lib->settings->get_int(lib->settings,
+							"libipsec.processor.batch_size", DEFAULT_BATCH_SIZE)),
 		.lock = rwlock_create(RWLOCK_TYPE_DEFAULT),
 	);
 
-	lib->processor->queue_job(lib->processor,
-		(job_t*)callback_job_create((callback_job_cb_t)process_inbound, this,
-									NULL, (callback_job_cancel_t)return_false));
-	lib->processor->queue_job(lib->processor,
-		(job_t*)callback_job_create((callback_job_cb_t)process_outbound, this,
-									NULL, (callback_job_cancel_t)return_false));
+	this->lanes = calloc(this->lane_count, sizeof(lane_t));
+	for (i = 0; i < this->lane_count; i++)
+	{
+		lane = &this->lanes[i];
+		lane->processor = this;
+		lane->inbound.entries = calloc(this->queue_size, sizeof(queue_entry_t));
+		lane->outbound.entries = calloc(this->queue_size,
+										sizeof(queue_entry_t));
+		lane->batch = calloc(2 * this->batch_size, sizeof(queue_entry_t));
+		lane->mutex = mutex_create(MUTEX_TYPE_DEFAULT);
+		lane->condvar = condvar_create(CONDVAR_TYPE_DEFAULT);
+
+		/* lanes never return their thread, like other long-running jobs */
+		lib->processor->queue_job(lib->processor,
+			(job_t*)callback_job_create_with_prio(
+					(callback_job_cb_t)process_lane, lane, NULL,
+					(callback_job_cancel_t)return_false, JOB_PRIO_CRITICAL));
+	}
 	return &this->public;
 }
@@ -47,6 +47,16 @@ typedef void (*ipsec_outbound_cb_t)(void *data, esp_packet_t *packet);
 
 /**
  *  IPsec processor
+ *
+ * Packets are processed by a configurable number of worker lanes, each
+ * permanently occupying a thread of the global processor. Lanes run as
+ * CRITICAL priority jobs, so they don't count against the threads reserved
+ * for other priorities, but the thread pool must be large enough to leave
+ * threads for regular jobs. Inbound packets are assigned
+ * to lanes by SPI, outbound packets by the reqid of the matching policy, so
+ * all packets of an SA are processed in order by the same lane. Each lane
+ * queues a bounded number of packets per direction, packets exceeding that
+ * limit get dropped and are counted, the totals get logged on destruction.
  */
 struct ipsec_processor_t {
 
@@ -26,70 +26,119 @@
 #include <collections/hashtable.h>
 #include <collections/linked_list.h>
 
+/* size of the hash tables (MUST be a power of 2) */
+#define TABLE_SIZE 1024
+
+/* number of segments the hash tables are locked with (MUST be a power of 2) */
+#define SEGMENT_COUNT 16
+
 typedef struct private_ipsec_sa_mgr_t private_ipsec_sa_mgr_t;
+typedef struct ipsec_sa_entry_t ipsec_sa_entry_t;
+typedef struct reqid_entry_t reqid_entry_t;
 
 /**
- * Private additions to ipsec_sa_mgr_t.
+ * Struct to keep track of locked IPsec SAs
  */
-struct private_ipsec_sa_mgr_t {
+struct ipsec_sa_entry_t {
 
 	/**
-	 * Public members of ipsec_sa_mgr_t.
+	 * IPsec SA
 	 */
-	ipsec_sa_mgr_t public;
+	ipsec_sa_t *sa;
 
 	/**
-	 * Installed SAs
+	 * Set if this SA is currently in use by a thread
 	 */
-	linked_list_t *sas;
+	bool locked;
 
 	/**
-	 * SPIs allocated using get_spi()
+	 * Condvar used by threads to wait for this entry
 	 */
-	hashtable_t *allocated_spis;
+	condvar_t *condvar;
+
+	/**
+	 * Number of threads waiting for this entry
+	 */
+	u_int waiting_threads;
 
 	/**
-	 * Mutex used to synchronize access to the SA manager
+	 * Set if this entry is awaiting deletion
 	 */
-	mutex_t *mutex;
+	bool awaits_deletion;
 
 	/**
-	 * RNG used to generate SPIs
+	 * Next entry in the same table row
 	 */
-	rng_t *rng;
+	ipsec_sa_entry_t *next;
 };
 
 /**
- * Struct to keep track of locked IPsec SAs
+ * Maps a reqid and direction to the SPI of an SA
  */
-typedef struct {
+struct reqid_entry_t {
 
 	/**
-	 * IPsec SA
+	 * Reqid of the SA
 	 */
-	ipsec_sa_t *sa;
+	u_int32_t reqid;
 
 	/**
-	 * Set if this SA is currently in use by a thread
+	 * Direction of the SA
 	 */
-	bool locked;
+	bool inbound;
 
 	/**
-	 * Condvar used by threads to wait for this entry
+	 * SPI of the SA
 	 */
-	condvar_t *condvar;
+	u_int32_t spi;
 
 	/**
-	 * Number of threads waiting for this entry
+	 * Next entry in the same table row
 	 */
-	u_int waiting_threads;
+	reqid_entry_t *next;
+};
+
+/**
+ * Private additions to ipsec_sa_mgr_t.
+ */
+struct private_ipsec_sa_mgr_t {
 
 	/**
-	 * Set if this entry is awaiting deletion
+	 * Public members of ipsec_sa_mgr_t.
 	 */
-	bool awaits_deletion;
+	ipsec_sa_mgr_t public;
+
+	/**
+	 * Installed SAs, hashed by SPI (ipsec_sa_entry_t*)
+	 */
+	ipsec_sa_entry_t *sas[TABLE_SIZE];
+
+	/**
+	 * SPIs of installed SAs, hashed by reqid (reqid_entry_t*)
+	 */
+	reqid_entry_t *reqids[TABLE_SIZE];
+
+	/**
+	 * Mutexes to lock the rows of both tables, row & (SEGMENT_COUNT - 1)
+	 * selects the segment. Never hold more than one of them at a time.
+	 */
+	mutex_t *segments[SEGMENT_COUNT];
+
+	/**
+	 * SPIs allocated using get_spi()
+	 */
+	hashtable_t *allocated_spis;
+
+	/**
+	 * Mutex used to synchronize access to allocated SPIs and the RNG
+	 */
+	mutex_t *mutex;
 
-}  ipsec_sa_entry_t;
+	/**
+	 * RNG used to generate SPIs
+	 */
+	rng_t *rng;
+};
 
 /**
  * Helper struct for expiration events
@@ -106,6 +155,11 @@ typedef struct {
 	 */
 	ipsec_sa_entry_t *entry;
 
+	/**
+	 * SPI of the expired SA, to find the entry
+	 */
+	u_int32_t spi;
+
 	/**
 	 * 0 if this is a hard expire, otherwise the offset in s (soft->hard)
 	 */
@@ -126,6 +180,30 @@ static u_int spi_hash(u_int32_t *spi)
 	return chunk_hash(chunk_from_thing(*spi));
 }
 
+/**
+ * Get the table row of an SPI
+ */
+static inline u_int spi_row(u_int32_t spi)
+{
+	return spi_hash(&spi) & (TABLE_SIZE - 1);
+}
+
+/**
+ * Get the table row of a reqid
+ */
+static inline u_int reqid_row(u_int32_t reqid)
+{
+	return chunk_hash(chunk_from_thing(reqid)) & (TABLE_SIZE - 1);
+}
+
+/**
+ * Get the mutex of the segment a table row belongs to
+ */
+static inline mutex_t *get_segment(private_ipsec_sa_mgr_t *this, u_int row)
+{
+	return this->segments[row & (SEGMENT_COUNT - 1)];
+}
+
 /**
  * Create an SA entry
  */
@@ -152,13 +230,12 @@ static void destroy_entry(ipsec_sa_entry_t *entry)
 
 /**
  * Makes sure an entry is safe to remove
- * Must be called with this->mutex held.
+ * Must be called with the mutex of the entry's segment held.
  *
  * @return			TRUE if entry can be removed, FALSE if entry is already
 *					being removed by another thread
  */
-static bool wait_remove_entry(private_ipsec_sa_mgr_t *this,
-							  ipsec_sa_entry_t *entry)
+static bool wait_remove_entry(mutex_t *mutex, ipsec_sa_entry_t *entry)
 {
 	if (entry->awaits_deletion)
 	{
@@ -168,27 +245,26 @@ static bool wait_remove_entry(private_ipsec_sa_mgr_t *this,
 	entry->awaits_deletion = TRUE;
 	while (entry->locked)
 	{
-		entry->condvar->wait(entry->condvar, this->mutex);
+		entry->condvar->wait(entry->condvar, mutex);
 	}
 	while (entry->waiting_threads > 0)
 	{
 		entry->condvar->broadcast(entry->condvar);
-		entry->condvar->wait(entry->condvar, this->mutex);
+		entry->condvar->wait(entry->condvar, mutex);
 	}
 	return TRUE;
 }
 
 /**
  * Waits until an is available and then locks it.
- * Must only be called with this->mutex held
+ * Must only be called with the mutex of the entry's segment held
  */
-static bool wait_for_entry(private_ipsec_sa_mgr_t *this,
-						   ipsec_sa_entry_t *entry)
+static bool wait_for_entry(mutex_t *mutex, ipsec_sa_entry_t *entry)
 {
 	while (entry->locked && !entry->awaits_deletion)
 	{
 		entry->waiting_threads++;
-		entry->condvar->wait(entry->condvar, this->mutex);
+		entry->condvar->wait(entry->condvar, mutex);
 		entry->waiting_threads--;
 	}
 	if (entry->awaits_deletion)
@@ -202,90 +278,240 @@ static bool wait_for_entry(private_ipsec_sa_mgr_t *this,
 }
 
 /**
- * Flushes all entries
- * Must be called with this->mutex held.
+ * Add an entry to the end of its table row.
+ * Must be called with the mutex of the row's segment held.
  */
-static void flush_entries(private_ipsec_sa_mgr_t *this)
+static void insert_entry(private_ipsec_sa_mgr_t *this, u_int row,
+						 ipsec_sa_entry_t *entry)
 {
-	ipsec_sa_entry_t *current;
-	enumerator_t *enumerator;
+	ipsec_sa_entry_t **item = &this->sas[row];
 
-	DBG2(DBG_ESP, "flushing SAD");
+	while (*item)
+	{
+		item = &(*item)->next;
+	}
+	*item = entry;
+}
+
+/**
+ * Unlink an entry from its table row.
+ * Must be called with the mutex of the row's segment held.
+ */
+static void unlink_entry(private_ipsec_sa_mgr_t *this, u_int row,
+						 ipsec_sa_entry_t *entry)
+{
+	ipsec_sa_entry_t **item = &this->sas[row];
 
-	enumerator = this->sas->create_enumerator(this->sas);
-	while (enumerator->enumerate(enumerator, (void**)&current))
+	while (*item)
 	{
-		if (wait_remove_entry(this, current))
+		if (*item == entry)
 		{
-			this->sas->remove_at(this->sas, enumerator);
-			destroy_entry(current);
+			*item = entry->next;
+			entry->next = NULL;
+			break;
 		}
+		item = &(*item)->next;
 	}
-	enumerator->destroy(enumerator);
 }
 
-/*
- * Different match functions to find SAs in the linked list
+/**
+ * Check if an entry is still contained in its table row.
+ * Must be called with the mutex of the row's segment held.
  */
-static bool match_entry_by_ptr(ipsec_sa_entry_t *item, ipsec_sa_entry_t *entry)
+static bool has_entry(private_ipsec_sa_mgr_t *this, u_int row,
+					  ipsec_sa_entry_t *entry)
 {
-	return item == entry;
+	ipsec_sa_entry_t *current;
+
+	for (current = this->sas[row]; current; current = current->next)
+	{
+		if (current == entry)
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
 }
 
-static bool match_entry_by_sa_ptr(ipsec_sa_entry_t *item, ipsec_sa_t *sa)
+/**
+ * Register the SPI of an SA under its reqid
+ */
+static void add_reqid(private_ipsec_sa_mgr_t *this, ipsec_sa_t *sa)
 {
-	return item->sa == sa;
+	reqid_entry_t *entry, **item;
+	mutex_t *mutex;
+	u_int row;
+
+	INIT(entry,
+		.reqid = sa->get_reqid(sa),
+		.inbound = sa->is_inbound(sa),
+		.spi = sa->get_spi(sa),
+	);
+	row = reqid_row(entry->reqid);
+	mutex = get_segment(this, row);
+	mutex->lock(mutex);
+	/* keep the order of installation, the oldest SA is used */
+	for (item = &this->reqids[row]; *item; item = &(*item)->next)
+	{
+		/* find the end of the row */
+	}
+	*item = entry;
+	mutex->unlock(mutex);
 }
 
-static bool match_entry_by_spi_inbound(ipsec_sa_entry_t *item, u_int32_t *spi,
-									   bool *inbound)
+/**
+ * Remove the SPI of an SA from the reqid table
+ */
+static void remove_reqid(private_ipsec_sa_mgr_t *this, u_int32_t reqid,
+						 bool inbound, u_int32_t spi)
 {
-	return item->sa->get_spi(item->sa) == *spi &&
-		   item->sa->is_inbound(item->sa) == *inbound;
+	reqid_entry_t *entry, **item;
+	mutex_t *mutex;
+	u_int row;
+
+	row = reqid_row(reqid);
+	mutex = get_segment(this, row);
+	mutex->lock(mutex);
+	for (item = &this->reqids[row]; *item; item = &(*item)->next)
+	{
+		entry = *item;
+		if (entry->reqid == reqid && entry->inbound == inbound &&
+			entry->spi == spi)
+		{
+			*item = entry->next;
+			free(entry);
+			break;
+		}
+	}
+	mutex->unlock(mutex);
 }
 
-static bool match_entry_by_spi_src_dst(ipsec_sa_entry_t *item, u_int32_t *spi,
-									   host_t *src, host_t *dst)
+/**
+ * Get the SPI of the nth SA with the given reqid and direction
+ */
+static bool lookup_reqid(private_ipsec_sa_mgr_t *this, u_int32_t reqid,
+						 bool inbound, int n, u_int32_t *spi)
 {
-	return item->sa->match_by_spi_src_dst(item->sa, *spi, src, dst);
+	reqid_entry_t *entry;
+	mutex_t *mutex;
+	bool found = FALSE;
+	u_int row;
+
+	row = reqid_row(reqid);
+	mutex = get_segment(this, row);
+	mutex->lock(mutex);
+	for (entry = this->reqids[row]; entry; entry = entry->next)
+	{
+		if (entry->reqid == reqid && entry->inbound == inbound && n-- == 0)
+		{
+			*spi = entry->spi;
+			found = TRUE;
+			break;
+		}
+	}
+	mutex->unlock(mutex);
+	return found;
 }
 
-static bool match_entry_by_reqid_inbound(ipsec_sa_entry_t *item,
-										 u_int32_t *reqid, bool *inbound)
+/**
+ * Unlink an entry from the tables and destroy it, must be called with the
+ * mutex of the entry's segment held, which gets released.
+ */
+static void remove_entry(private_ipsec_sa_mgr_t *this, u_int row,
+						 ipsec_sa_entry_t *entry)
 {
-	return item->sa->match_by_reqid(item->sa, *reqid, *inbound);
+	mutex_t *mutex = get_segment(this, row);
+	ipsec_sa_t *sa = entry->sa;
+
+	unlink_entry(this, row, entry);
+	mutex->unlock(mutex);
+	remove_reqid(this, sa->get_reqid(sa), sa->is_inbound(sa),
+				 sa->get_spi(sa));
+	destroy_entry(entry);
 }
 
-static bool match_entry_by_spi_dst(ipsec_sa_entry_t *item, u_int32_t *spi,
-								   host_t *dst)
+/**
+ * Flushes all entries
+ */
+static void flush_entries(private_ipsec_sa_mgr_t *this)
 {
-	return item->sa->match_by_spi_dst(item->sa, *spi, dst);
+	ipsec_sa_entry_t *current;
+	mutex_t *mutex;
+	u_int row;
+
+	DBG2(DBG_ESP, "flushing SAD");
+
+	for (row = 0; row < TABLE_SIZE; row++)
+	{
+		mutex = get_segment(this, row);
+		mutex->lock(mutex);
+		current = this->sas[row];
+		while (current)
+		{
+			if (wait_remove_entry(mutex, current))
+			{
+				remove_entry(this, row, current);
+				/* the row might have changed meanwhile, start over */
+				mutex->lock(mutex);
+				current = this->sas[row];
+				continue;
+			}
+			current = current->next;
+		}
+		mutex->unlock(mutex);
+	}
 }
 
 /**
- * Remove an entry
+ * Find an SA entry by SPI and additional criteria.
+ * On success, the mutex of the entry's segment is kept locked.
  */
-static bool remove_entry(private_ipsec_sa_mgr_t *this, ipsec_sa_entry_t *entry)
+static ipsec_sa_entry_t *find_entry(private_ipsec_sa_mgr_t *this,
+				u_int32_t spi, host_t *src, host_t *dst, u_int32_t *reqid,
+				bool *inbound, u_int *row_out)
 {
 	ipsec_sa_entry_t *current;
-	enumerator_t *enumerator;
-	bool removed = FALSE;
+	mutex_t *mutex;
+	ipsec_sa_t *sa;
+	u_int row;
 
-	enumerator = this->sas->create_enumerator(this->sas);
-	while (enumerator->enumerate(enumerator, (void**)&current))
+	row = spi_row(spi);
+	mutex = get_segment(this, row);
+	mutex->lock(mutex);
+	for (current = this->sas[row]; current; current = current->next)
 	{
-		if (current == entry)
+		sa = current->sa;
+		if (reqid)
 		{
-			if (wait_remove_entry(this, current))
+			if (sa->get_spi(sa) != spi ||
+				!sa->match_by_reqid(sa, *reqid, *inbound))
 			{
-				this->sas->remove_at(this->sas, enumerator);
-				removed = TRUE;
+				continue;
 			}
-			break;
 		}
+		else if (src)
+		{
+			if (!sa->match_by_spi_src_dst(sa, spi, src, dst))
+			{
+				continue;
+			}
+		}
+		else if (dst)
+		{
+			if (!sa->match_by_spi_dst(sa, spi, dst))
+			{
+				continue;
+			}
+		}
+		else if (sa->get_spi(sa) != spi || !sa->is_inbound(sa) != !*inbound)
+		{
+			continue;
+		}
+		*row_out = row;
+		return current;
 	}
-	enumerator->destroy(enumerator);
-	return removed;
+	mutex->unlock(mutex);
+	return NULL;
 }
 
 /**
@@ -294,10 +520,13 @@ static bool remove_entry(private_ipsec_sa_mgr_t *this, ipsec_sa_entry_t *entry)
 static job_requeue_t sa_expired(ipsec_sa_expired_t *expired)
 {
 	private_ipsec_sa_mgr_t *this = expired->manager;
+	mutex_t *mutex;
+	u_int row;
 
-	this->mutex->lock(this->mutex);
-	if (this->sas->find_first(this->sas, (void*)match_entry_by_ptr,
-							  NULL, expired->entry) == SUCCESS)
+	row = spi_row(expired->spi);
+	mutex = get_segment(this, row);
+	mutex->lock(mutex);
+	if (has_entry(this, row, expired->entry))
 	{
 		u_int32_t hard_offset = expired->hard_offset;
 		ipsec_sa_t *sa = expired->entry->sa;
@@ -308,16 +537,17 @@ static job_requeue_t sa_expired(ipsec_sa_expired_t *expired)
 		if (hard_offset)
 		{	/* soft limit reached, schedule hard expire */
 			expired->hard_offset = 0;
-			this->mutex->unlock(this->mutex);
+			mutex->unlock(mutex);
 			return JOB_RESCHEDULE(hard_offset);
 		}
 		/* hard limit reached */
-		if (remove_entry(this, expired->entry))
+		if (wait_remove_entry(mutex, expired->entry))
 		{
-			destroy_entry(expired->entry);
+			remove_entry(this, row, expired->entry);
+			return JOB_REQUEUE_NONE;
 		}
 	}
-	this->mutex->unlock(this->mutex);
+	mutex->unlock(mutex);
 	return JOB_REQUEUE_NONE;
 }
 
@@ -335,6 +565,7 @@ static void schedule_expiration(private_ipsec_sa_mgr_t *this,
 	INIT(expired,
 		.manager = this,
 		.entry = entry,
+		.spi = entry->sa->get_spi(entry->sa),
 	);
 
 	/* schedule a rekey first, a hard timeout will be scheduled then, if any */
@@ -374,15 +605,23 @@ static void flush_allocated_spis(private_ipsec_sa_mgr_t *this)
 
 /**
  * Pre-allocate an SPI for an inbound SA
+ * Must be called with this->mutex held.
  */
 static bool allocate_spi(private_ipsec_sa_mgr_t *this, u_int32_t spi)
 {
+	ipsec_sa_entry_t *entry;
 	u_int32_t *spi_alloc;
+	bool inbound = TRUE;
+	u_int row;
 
-	if (this->allocated_spis->get(this->allocated_spis, &spi) ||
-		this->sas->find_first(this->sas, (void*)match_entry_by_spi_inbound,
-							  NULL, &spi, TRUE) == SUCCESS)
+	if (this->allocated_spis->get(this->allocated_spis, &spi))
+	{
+		return FALSE;
+	}
+	entry = find_entry(this, spi, NULL, NULL, NULL, &inbound, &row);
+	if (entry)
 	{
+		get_segment(this, row)->unlock(get_segment(this, row));
 		return FALSE;
 	}
 	spi_alloc = malloc_thing(u_int32_t);
@@ -443,6 +682,8 @@ METHOD(ipsec_sa_mgr_t, add_sa, status_t,
 {
 	ipsec_sa_entry_t *entry;
 	ipsec_sa_t *sa_new;
+	mutex_t *mutex;
+	u_int row;
 
 	DBG2(DBG_ESP, "adding SAD entry with SPI %.8x and reqid {%u}",
 		 ntohl(spi), reqid);
@@ -460,30 +701,37 @@ METHOD(ipsec_sa_mgr_t, add_sa, status_t,
 		return FAILED;
 	}
 
-	this->mutex->lock(this->mutex);
-
 	if (inbound)
 	{	/* remove any pre-allocated SPIs */
 		u_int32_t *spi_alloc;
 
+		this->mutex->lock(this->mutex);
 		spi_alloc = this->allocated_spis->remove(this->allocated_spis, &spi);
+		this->mutex->unlock(this->mutex);
 		free(spi_alloc);
 	}
 
-	if (this->sas->find_first(this->sas, (void*)match_entry_by_spi_src_dst,
-							  NULL, &spi, src, dst) == SUCCESS)
+	/* register the reqid first, lookups ignore it until the SA is added */
+	add_reqid(this, sa_new);
+
+	row = spi_row(spi);
+	mutex = get_segment(this, row);
+	mutex->lock(mutex);
+	for (entry = this->sas[row]; entry; entry = entry->next)
 	{
-		this->mutex->unlock(this->mutex);
-		DBG1(DBG_ESP, "failed to install SAD entry: already installed");
-		sa_new->destroy(sa_new);
-		return FAILED;
+		if (entry->sa->match_by_spi_src_dst(entry->sa, spi, src, dst))
+		{
+			mutex->unlock(mutex);
+			DBG1(DBG_ESP, "failed to install SAD entry: already installed");
+			remove_reqid(this, reqid, inbound, spi);
+			sa_new->destroy(sa_new);
+			return FAILED;
+		}
 	}
-
 	entry = create_entry(sa_new);
 	schedule_expiration(this, entry);
-	this->sas->insert_last(this->sas, entry);
-
-	this->mutex->unlock(this->mutex);
+	insert_entry(this, row, entry);
+	mutex->unlock(mutex);
 	return SUCCESS;
 }
 
@@ -492,7 +740,9 @@ METHOD(ipsec_sa_mgr_t, update_sa, status_t,
 	u_int16_t cpi, host_t *src, host_t *dst, host_t *new_src, host_t *new_dst,
 	bool encap, bool new_encap, mark_t mark)
 {
-	ipsec_sa_entry_t *entry = NULL;
+	ipsec_sa_entry_t *entry;
+	mutex_t *mutex;
+	u_int row;
 
 	DBG2(DBG_ESP, "updating SAD entry with SPI %.8x from %#H..%#H to %#H..%#H",
 		 ntohl(spi), src, dst, new_src, new_dst);
@@ -504,10 +754,14 @@ METHOD(ipsec_sa_mgr_t, update_sa, status_t,
 		return NOT_SUPPORTED;
 	}
 
-	this->mutex->lock(this->mutex);
-	if (this->sas->find_first(this->sas, (void*)match_entry_by_spi_src_dst,
-							 (void**)&entry, &spi, src, dst) == SUCCESS &&
-		wait_for_entry(this, entry))
+	entry = find_entry(this, spi, src, dst, NULL, NULL, &row);
+	if (!entry)
+	{
+		DBG1(DBG_ESP, "failed to update SAD entry: not found");
+		return FAILED;
+	}
+	mutex = get_segment(this, row);
+	if (wait_for_entry(mutex, entry))
 	{
 		entry->sa->set_source(entry->sa, new_src);
 		entry->sa->set_destination(entry->sa, new_dst);
@@ -515,13 +769,7 @@ METHOD(ipsec_sa_mgr_t, update_sa, status_t,
 		entry->locked = FALSE;
 		entry->condvar->signal(entry->condvar);
 	}
-	this->mutex->unlock(this->mutex);
-
-	if (!entry)
-	{
-		DBG1(DBG_ESP, "failed to update SAD entry: not found");
-		return FAILED;
-	}
+	mutex->unlock(mutex);
 	return SUCCESS;
 }
 
@@ -529,34 +777,28 @@ METHOD(ipsec_sa_mgr_t, del_sa, status_t,
 	private_ipsec_sa_mgr_t *this, host_t *src, host_t *dst, u_int32_t spi,
 	u_int8_t protocol, u_int16_t cpi, mark_t mark)
 {
-	ipsec_sa_entry_t *current, *found = NULL;
-	enumerator_t *enumerator;
+	ipsec_sa_entry_t *entry;
+	mutex_t *mutex;
+	bool inbound;
+	u_int row;
 
-	this->mutex->lock(this->mutex);
-	enumerator = this->sas->create_enumerator(this->sas);
-	while (enumerator->enumerate(enumerator, (void**)&current))
+	entry = find_entry(this, spi, src, dst, NULL, NULL, &row);
+	if (!entry)
 	{
-		if (match_entry_by_spi_src_dst(current, &spi, src, dst))
-		{
-			if (wait_remove_entry(this, current))
-			{
-				this->sas->remove_at(this->sas, enumerator);
-				found = current;
-			}
-			break;
-		}
+		return FAILED;
 	}
-	enumerator->destroy(enumerator);
-	this->mutex->unlock(this->mutex);
-
-	if (found)
+	mutex = get_segment(this, row);
+	if (!wait_remove_entry(mutex, entry))
 	{
-		DBG2(DBG_ESP, "deleted %sbound SAD entry with SPI %.8x",
-			 found->sa->is_inbound(found->sa) ? "in" : "out", ntohl(spi));
-		destroy_entry(found);
-		return SUCCESS;
+		mutex->unlock(mutex);
+		return FAILED;
 	}
-	return FAILED;
+	inbound = entry->sa->is_inbound(entry->sa);
+	remove_entry(this, row, entry);
+
+	DBG2(DBG_ESP, "deleted %sbound SAD entry with SPI %.8x",
+		 inbound ? "in" : "out", ntohl(spi));
+	return SUCCESS;
 }
 
 METHOD(ipsec_sa_mgr_t, checkout_by_reqid, ipsec_sa_t*,
@@ -564,15 +806,26 @@ METHOD(ipsec_sa_mgr_t, checkout_by_reqid, ipsec_sa_t*,
 {
 	ipsec_sa_entry_t *entry;
 	ipsec_sa_t *sa = NULL;
+	mutex_t *mutex;
+	u_int32_t spi;
+	u_int row;
+	int n;
 
-	this->mutex->lock(this->mutex);
-	if (this->sas->find_first(this->sas, (void*)match_entry_by_reqid_inbound,
-							 (void**)&entry, &reqid, &inbound) == SUCCESS &&
-		wait_for_entry(this, entry))
+	/* the reqid table might refer to SAs that are just getting removed,
+	 * try the next SA with that reqid if so */
+	for (n = 0; !sa && lookup_reqid(this, reqid, inbound, n, &spi); n++)
 	{
-		sa = entry->sa;
+		entry = find_entry(this, spi, NULL, NULL, &reqid, &inbound, &row);
+		if (entry)
+		{
+			mutex = get_segment(this, row);
+			if (wait_for_entry(mutex, entry))
+			{
+				sa = entry->sa;
+			}
+			mutex->unlock(mutex);
+		}
 	}
-	this->mutex->unlock(this->mutex);
 	return sa;
 }
 
@@ -581,15 +834,19 @@ METHOD(ipsec_sa_mgr_t, checkout_by_spi, ipsec_sa_t*,
 {
 	ipsec_sa_entry_t *entry;
 	ipsec_sa_t *sa = NULL;
+	mutex_t *mutex;
+	u_int row;
 
-	this->mutex->lock(this->mutex);
-	if (this->sas->find_first(this->sas, (void*)match_entry_by_spi_dst,
-							 (void**)&entry, &spi, dst) == SUCCESS &&
-		wait_for_entry(this, entry))
+	entry = find_entry(this, spi, NULL, dst, NULL, NULL, &row);
+	if (entry)
 	{
-		sa = entry->sa;
+		mutex = get_segment(this, row);
+		if (wait_for_entry(mutex, entry))
+		{
+			sa = entry->sa;
+		}
+		mutex->unlock(mutex);
 	}
-	this->mutex->unlock(this->mutex);
 	return sa;
 }
 
@@ -597,40 +854,49 @@ METHOD(ipsec_sa_mgr_t, checkin, void,
 	private_ipsec_sa_mgr_t *this, ipsec_sa_t *sa)
 {
 	ipsec_sa_entry_t *entry;
+	mutex_t *mutex;
+	u_int row;
 
-	this->mutex->lock(this->mutex);
-	if (this->sas->find_first(this->sas, (void*)match_entry_by_sa_ptr,
-							 (void**)&entry, sa) == SUCCESS)
+	row = spi_row(sa->get_spi(sa));
+	mutex = get_segment(this, row);
+	mutex->lock(mutex);
+	for (entry = this->sas[row]; entry; entry = entry->next)
 	{
-		if (entry->locked)
+		if (entry->sa == sa)
 		{
-			entry->locked = FALSE;
-			entry->condvar->signal(entry->condvar);
+			if (entry->locked)
+			{
+				entry->locked = FALSE;
+				entry->condvar->signal(entry->condvar);
+			}
+			break;
 		}
 	}
-	this->mutex->unlock(this->mutex);
+	mutex->unlock(mutex);
 }
 
 METHOD(ipsec_sa_mgr_t, flush_sas, status_t,
 	private_ipsec_sa_mgr_t *this)
 {
-	this->mutex->lock(this->mutex);
 	flush_entries(this);
-	this->mutex->unlock(this->mutex);
 	return SUCCESS;
 }
 
 METHOD(ipsec_sa_mgr_t, destroy, void,
 	private_ipsec_sa_mgr_t *this)
 {
-	this->mutex->lock(this->mutex);
+	int i;
+
 	flush_entries(this);
+	this->mutex->lock(this->mutex);
 	flush_allocated_spis(this);
 	this->mutex->unlock(this->mutex);
 
 	this->allocated_spis->destroy(this->allocated_spis);
-	this->sas->destroy(this->sas);
-
+	for (i = 0; i < SEGMENT_COUNT; i++)
+	{
+		this->segments[i]->destroy(this->segments[i]);
+	}
 	this->mutex->destroy(this->mutex);
 	DESTROY_IF(this->rng);
 	free(this);
@@ -642,6 +908,7 @@ METHOD(ipsec_sa_mgr_t, destroy, void,
 ipsec_sa_mgr_t *ipsec_sa_mgr_create()
 {
 	private_ipsec_sa_mgr_t *this;
+	int i;
 
 	INIT(this,
 		.public = {
@@ -655,11 +922,14 @@ ipsec_sa_mgr_t *ipsec_sa_mgr_create()
 			.flush_sas = _flush_sas,
 			.destroy = _destroy,
 		},
-		.sas = linked_list_create(),
 		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
 		.allocated_spis = hashtable_create((hashtable_hash_t)spi_hash,
 										   (hashtable_equals_t)spi_equals, 16),
 	);
 
+	for (i = 0; i < SEGMENT_COUNT; i++)
+	{
+		this->segments[i] = mutex_create(MUTEX_TYPE_DEFAULT);
+	}
 	return &this->public;
 }
@@ -30,6 +30,11 @@
  */
 pts_component_manager_t *pts_components;
 
+/**
+ * PTS file measurement engine
+ */
+pts_file_hasher_t *pts_file_hasher;
+
 /**
  * Reference count for IMC/IMV instances
  */
@@ -67,6 +72,12 @@ bool libpts_init(void)
 									  PTS_ITA_COMP_FUNC_NAME_IMA,
 									  pts_ita_comp_ima_create);
 
+		pts_file_hasher = pts_file_hasher_create(
+			lib->settings->get_int(lib->settings,
+					"libimcv.plugins.imc-attestation.hash_threads", 4),
+			lib->settings->get_int(lib->settings,
+					"libimcv.plugins.imc-attestation.hash_cache_size", 4096));
+
 		DBG1(DBG_LIB, "libpts initialized");
 	}
 	ref_get(&libpts_ref);
@@ -84,6 +95,8 @@ void libpts_deinit(void)
 		pts_components->remove_vendor(pts_components, PEN_TCG);
 		pts_components->remove_vendor(pts_components, PEN_ITA);
 		pts_components->destroy(pts_components);
+		pts_file_hasher->destroy(pts_file_hasher);
+		pts_file_hasher = NULL;
 
 		if (!imcv_pa_tnc_attributes)
 		{
@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "pts_file_hasher.h"
+
+#include <utils/debug.h>
+#include <collections/hashtable.h>
+#include <collections/linked_list.h>
+#include <threading/mutex.h>
+#include <threading/condvar.h>
+#include <processing/jobs/callback_job.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/**
+ * Maximum size of the read buffer
+ */
+#define READ_BUFFER_SIZE 1048576
+
+typedef struct private_pts_file_hasher_t private_pts_file_hasher_t;
+
+/**
+ * Private data of a pts_file_hasher_t object.
+ */
+struct private_pts_file_hasher_t {
+
+	/**
+	 * Public pts_file_hasher_t interface.
+	 */
+	pts_file_hasher_t public;
+
+	/**
+	 * Cached hashes, entry_t => entry_t
+	 */
+	hashtable_t *cache;
+
+	/**
+	 * Cached hashes in the order they were added, as entry_t
+	 */
+	linked_list_t *order;
+
+	/**
+	 * Maximum number of cached hashes
+	 */
+	u_int cache_size;
+
+	/**
+	 * Maximum number of jobs hashing files in parallel
+	 */
+	u_int threads;
+
+	/**
+	 * Mutex protecting the cache
+	 */
+	mutex_t *mutex;
+};
+
+/**
+ * Cached hash of a file
+ */
+typedef struct {
+	/** device of the file */
+	dev_t dev;
+	/** inode of the file */
+	ino_t ino;
+	/** size of the file */
+	off_t size;
+	/** modification time of the file, with nanoseconds */
+	struct timespec mtime;
+	/** status change time of the file, with nanoseconds */
+	struct timespec ctime;
+	/** hash algorithm */
+	hash_algorithm_t alg;
+	/** hash of the file, allocated with the entry */
+	chunk_t hash;
+} entry_t;
+
+/**
+ * Files hashed by the calling thread and jobs
+ */
+typedef struct {
+	/** hasher instance */
+	private_pts_file_hasher_t *this;
+	/** hash algorithm */
+	hash_algorithm_t alg;
+	/** size of a hash */
+	size_t hash_size;
+	/** files to hash */
+	char **files;
+	/** number of files */
+	int count;
+	/** receives hashes */
+	u_char *hashes;
+	/** next file to hash */
+	int next;
+	/** number of files currently being hashed */
+	int active;
+	/** TRUE if hashing a file failed */
+	bool failed;
+	/** references held by the calling thread and jobs */
+	refcount_t refs;
+	/** mutex protecting this batch */
+	mutex_t *mutex;
+	/** signaled when a file has been hashed */
+	condvar_t *condvar;
+} batch_t;
+
+/**
+ * Hash function for cache entries
+ */
+static u_int entry_hash(entry_t *entry)
+{
+	return chunk_hash_inc(chunk_from_thing(entry->ino),
+						  chunk_hash_inc(chunk_from_thing(entry->mtime.tv_sec),
+							chunk_hash_inc(chunk_from_thing(entry->mtime.tv_nsec),
+										   entry->alg)));
+}
+
+/**
+ * Compare two timestamps
+ */
+static inline bool timespec_equals(struct timespec *a, struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/**
+ * Equals function for cache entries
+ */
+static bool entry_equals(entry_t *a, entry_t *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		   timespec_equals(&a->mtime, &b->mtime) &&
+		   timespec_equals(&a->ctime, &b->ctime) && a->alg == b->alg;
+}
+
+/**
+ * Initialize the cache key of a file
+ */
+static void init_key(entry_t *key, struct stat *st, hash_algorithm_t alg)
+{
+	*key = (entry_t){
+		.dev = st->st_dev,
+		.ino = st->st_ino,
+		.size = st->st_size,
+		.mtime = st->st_mtim,
+		.ctime = st->st_ctim,
+		.alg = alg,
+	};
+}
+
+/**
+ * Look up a cached hash
+ */
+static bool cache_lookup(private_pts_file_hasher_t *this, entry_t *key,
+						 u_char *hash)
+{
+	entry_t *entry;
+
+	this->mutex->lock(this->mutex);
+	entry = this->cache->get(this->cache, key);
+	if (entry)
+	{
+		memcpy(hash, entry->hash.ptr, entry->hash.len);
+	}
+	this->mutex->unlock(this->mutex);
+	return entry != NULL;
+}
+
+/**
+ * Cache a hash, evicting the oldest cached hash if the cache is full
+ */
+static void cache_add(private_pts_file_hasher_t *this, entry_t *key,
+					  chunk_t hash)
+{
+	entry_t *entry;
+
+	this->mutex->lock(this->mutex);
+	if (!this->cache->get(this->cache, key))
+	{
+		if (this->cache->get_count(this->cache) >= this->cache_size &&
+			this->order->remove_first(this->order, (void**)&entry) == SUCCESS)
+		{
+			this->cache->remove(this->cache, entry);
+			free(entry);
+		}
+		entry = malloc(sizeof(entry_t) + hash.len);
+		*entry = *key;
+		entry->hash = chunk_create((u_char*)(entry + 1), hash.len);
+		memcpy(entry->hash.ptr, hash.ptr, hash.len);
+		this->cache->put(this->cache, entry, entry);
+		this->order->insert_last(this->order, entry);
+	}
+	this->mutex->unlock(this->mutex);
+}
+
+/**
+ * Hash the contents of an open file
+ */
+static bool hash_fd(hasher_t *hasher, int fd, struct stat *st, u_char *hash)
+{
+	u_char *buffer;
+	size_t size;
+	ssize_t len;
+	bool success;
+
+	/* we don't mmap() files, as truncating a mapped file while hashing it
+	 * raises SIGBUS. Small files are read at once, larger ones in chunks */
+	size = READ_BUFFER_SIZE;
+	if (S_ISREG(st->st_mode) && st->st_size > 0 &&
+		st->st_size < READ_BUFFER_SIZE)
+	{
+		size = st->st_size;
+	}
+	buffer = malloc(size);
+	while (TRUE)
+	{
+		len = read(fd, buffer, size);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			success = FALSE;
+			break;
+		}
+		if (len == 0)
+		{
+			success = hasher->get_hash(hasher, chunk_empty, hash);
+			break;
+		}
+		if (!hasher->get_hash(hasher, chunk_create(buffer, len), NULL))
+		{
+			success = FALSE;
+			break;
+		}
+	}
+	free(buffer);
+	return success;
+}
+
+/**
+ * Hash a file, or get its cached hash
+ */
+static bool hash_file(private_pts_file_hasher_t *this, hasher_t *hasher,
+					  hash_algorithm_t alg, char *pathname, u_char *hash)
+{
+	struct stat st, st_after;
+	entry_t key;
+	bool success;
+	int fd;
+
+	if (this->cache_size && stat(pathname, &st) == 0)
+	{
+		init_key(&key, &st, alg);
+		if (cache_lookup(this, &key, hash))
+		{
+			return TRUE;
+		}
+	}
+	fd = open(pathname, O_RDONLY);
+	if (fd == -1)
+	{
+		DBG1(DBG_PTS, "  file '%s' can not be opened, %s", pathname,
+			 strerror(errno));
+		return FALSE;
+	}
+	if (fstat(fd, &st) == -1)
+	{
+		DBG1(DBG_PTS, "  file '%s' can not be accessed, %s", pathname,
+			 strerror(errno));
+		close(fd);
+		return FALSE;
+	}
+	success = hash_fd(hasher, fd, &st, hash);
+	if (!success)
+	{
+		DBG1(DBG_PTS, "  hashing file '%s' failed", pathname);
+	}
+	/* don't cache files modified recently or while hashing, a modification
+	 * within the timestamp granularity of the file system would not change
+	 * the cache key. The status change time catches timestamps reset by
+	 * utimes() and other changes of the file */
+	else if (this->cache_size && S_ISREG(st.st_mode) &&
+			 fstat(fd, &st_after) == 0 &&
+			 timespec_equals(&st.st_mtim, &st_after.st_mtim) &&
+			 timespec_equals(&st.st_ctim, &st_after.st_ctim) &&
+			 st.st_size == st_after.st_size &&
+			 st.st_ctime < time(NULL) - 1)
+	{
+		init_key(&key, &st, alg);
+		cache_add(this, &key,
+				  chunk_create(hash, hasher->get_hash_size(hasher)));
+	}
+	close(fd);
+	return success;
+}
+
+/**
+ * Release a reference to a batch
+ */
+static void batch_release(batch_t *batch)
+{
+	if (ref_put(&batch->refs))
+	{
+		batch->condvar->destroy(batch->condvar);
+		batch->mutex->destroy(batch->mutex);
+		free(batch);
+	}
+}
+
+/**
+ * Hash files of a batch until none are left, used by jobs and the caller
+ */
+static job_requeue_t process_batch(batch_t *batch)
+{
+	hasher_t *hasher;
+	bool success;
+	int i;
+
+	hasher = lib->crypto->create_hasher(lib->crypto, batch->alg);
+	if (!hasher)
+	{
+		return JOB_REQUEUE_NONE;
+	}
+	batch->mutex->lock(batch->mutex);
+	while (!batch->failed && batch->next < batch->count)
+	{
+		i = batch->next++;
+		batch->active++;
+		batch->mutex->unlock(batch->mutex);
+
+		success = hash_file(batch->this, hasher, batch->alg, batch->files[i],
+							batch->hashes + i * batch->hash_size);
+
+		batch->mutex->lock(batch->mutex);
+		batch->active--;
+		if (!success)
+		{
+			batch->failed = TRUE;
+		}
+		batch->condvar->signal(batch->condvar);
+	}
+	batch->mutex->unlock(batch->mutex);
+	hasher->destroy(hasher);
+	return JOB_REQUEUE_NONE;
+}
+
+METHOD(pts_file_hasher_t, hash_files, bool,
+	private_pts_file_hasher_t *this, hash_algorithm_t alg, char **files,
+	int count, u_char *hashes)
+{
+	hasher_t *hasher;
+	batch_t *batch;
+	bool success;
+	int i, jobs;
+
+	hasher = lib->crypto->create_hasher(lib->crypto, alg);
+	if (!hasher)
+	{
+		DBG1(DBG_PTS, "hasher %N not available", hash_algorithm_names, alg);
+		return FALSE;
+	}
+
+	INIT(batch,
+		.this = this,
+		.alg = alg,
+		.hash_size = hasher->get_hash_size(hasher),
+		.files = files,
+		.count = count,
+		.hashes = hashes,
+		.refs = 1,
+		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
+		.condvar = condvar_create(CONDVAR_TYPE_DEFAULT),
+	);
+	hasher->destroy(hasher);
+
+	/* jobs that don't get scheduled in time find no files left, as the
+	 * calling thread hashes files too */
+	jobs = lib->processor->get_total_threads(lib->processor);
+	jobs = min(jobs, this->threads);
+	jobs = min(jobs, count - 1);
+	for (i = 0; i < jobs; i++)
+	{
+		ref_get(&batch->refs);
+		lib->processor->queue_job(lib->processor,
+			(job_t*)callback_job_create((callback_job_cb_t)process_batch,
+					batch, (callback_job_cleanup_t)batch_release, NULL));
+	}
+	process_batch(batch);
+
+	batch->mutex->lock(batch->mutex);
+	while (batch->active)
+	{
+		batch->condvar->wait(batch->condvar, batch->mutex);
+	}
+	/* if we couldn't create a hasher, the loop didn't run */
+	success = !batch->failed && batch->next == batch->count;
+	/* prevent late jobs from accessing files and hashes */
+	batch->next = batch->count;
+	batch->mutex->unlock(batch->mutex);
+
+	batch_release(batch);
+	return success;
+}
+
+METHOD(pts_file_hasher_t, flush, void,
+	private_pts_file_hasher_t *this)
+{
+	entry_t *entry;
+
+	this->mutex->lock(this->mutex);
+	while (this->order->remove_first(this->order, (void**)&entry) == SUCCESS)
+	{
+		this->cache->remove(this->cache, entry);
+		free(entry);
+	}
+	this->mutex->unlock(this->mutex);
+}
+
+METHOD(pts_file_hasher_t, destroy, void,
+	private_pts_file_hasher_t *this)
+{
+	flush(this);
+	this->order->destroy(this->order);
+	this->cache->destroy(this->cache);
+	this->mutex->destroy(this->mutex);
+	free(this);
+}
+
+/**
+ * See header
+ */
+pts_file_hasher_t *pts_file_hasher_create(u_int threads, u_int cache_size)
+{
+	private_pts_file_hasher_t *this;
+
+	INIT(this,
+		.public = {
+			.hash_files = _hash_files,
+			.flush = _flush,
+			.destroy = _destroy,
+		},
+		.cache = hashtable_create((hashtable_hash_t)entry_hash,
+								  (hashtable_equals_t)entry_equals, 128),
+		.order = linked_list_create(),
+		.cache_size = cache_size,
+		.threads = threads,
+		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
+	);
+
+	return &this->public;
+}
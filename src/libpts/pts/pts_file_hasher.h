@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup pts_file_hasher pts_file_hasher
+ * @{ @ingroup pts
+ */
+
+#ifndef PTS_FILE_HASHER_H_
+#define PTS_FILE_HASHER_H_
+
+#include <library.h>
+#include <crypto/hashers/hasher.h>
+
+typedef struct pts_file_hasher_t pts_file_hasher_t;
+
+/**
+ * Measures files in parallel, caching the hashes of unchanged files.
+ *
+ * Files are hashed by the calling thread and by jobs on the processor
+ * thread pool. Hashes are cached by device, inode, size, modification time
+ * and hash algorithm of a file, recently modified files are not cached.
+ */
+struct pts_file_hasher_t {
+
+	/**
+	 * Hash a list of files.
+	 *
+	 * @param alg			hash algorithm to use
+	 * @param files			absolute pathnames of the files to hash
+	 * @param count			number of files
+	 * @param hashes		receives the hashes of all files, concatenated
+	 * @return				TRUE if all files hashed successfully
+	 */
+	bool (*hash_files)(pts_file_hasher_t *this, hash_algorithm_t alg,
+					   char **files, int count, u_char *hashes);
+
+	/**
+	 * Flush the cache of file hashes.
+	 */
+	void (*flush)(pts_file_hasher_t *this);
+
+	/**
+	 * Destroy a pts_file_hasher_t.
+	 */
+	void (*destroy)(pts_file_hasher_t *this);
+};
+
+/**
+ * Create a pts_file_hasher_t instance.
+ *
+ * @param threads			maximum number of jobs to hash files in parallel
+ * @param cache_size		maximum number of cached hashes, 0 to disable
+ */
+pts_file_hasher_t *pts_file_hasher_create(u_int threads, u_int cache_size);
+
+#endif /** PTS_FILE_HASHER_H_ @}*/
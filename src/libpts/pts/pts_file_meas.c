@@ -15,6 +15,8 @@
 
 #include "pts_file_meas.h"
 
+#include "libpts.h"
+
 #include <collections/linked_list.h>
 #include <utils/debug.h>
 
@@ -235,46 +237,23 @@ pts_file_meas_t *pts_file_meas_create(u_int16_t request_id)
 }
 
 /**
- * Hash a file with a given absolute pathname
+ * Hash files using the libpts file hasher, or a temporary one
  */
-static bool hash_file(hasher_t *hasher, char *pathname, u_char *hash)
+static bool hash_files(hash_algorithm_t alg, char **files, int count,
+					   u_char *hashes)
 {
-	u_char buffer[4096];
-	size_t bytes_read;
-	bool success = TRUE;
-	FILE *file;
+	pts_file_hasher_t *hasher = pts_file_hasher;
+	bool success;
 
-	file = fopen(pathname, "rb");
-	if (!file)
+	if (!hasher)
 	{
-		DBG1(DBG_PTS,"  file '%s' can not be opened, %s", pathname,
-			 strerror(errno));
-		return FALSE;
+		hasher = pts_file_hasher_create(0, 0);
 	}
-	while (TRUE)
+	success = hasher->hash_files(hasher, alg, files, count, hashes);
+	if (hasher != pts_file_hasher)
 	{
-		bytes_read = fread(buffer, 1, sizeof(buffer), file);
-		if (bytes_read > 0)
-		{
-			if (!hasher->get_hash(hasher, chunk_create(buffer, bytes_read), NULL))
-			{
-				DBG1(DBG_PTS, "  hasher increment error");
-				success = FALSE;
-				break;
-			}
-		}
-		else
-		{
-			if (!hasher->get_hash(hasher, chunk_empty, hash))
-			{
-				DBG1(DBG_PTS, "  hasher finalize error");
-				success = FALSE;
-			}
-			break;
-		}
+		hasher->destroy(hasher);
 	}
-	fclose(file);
-
 	return success;
 }
 
@@ -288,12 +267,15 @@ pts_file_meas_t *pts_file_meas_create_from_path(u_int16_t request_id,
 	private_pts_file_meas_t *this;
 	hash_algorithm_t hash_alg;
 	hasher_t *hasher;
-	u_char hash[HASH_SIZE_SHA384];
+	linked_list_t *abs_names, *rel_names;
+	enumerator_t *enumerator;
+	char **files, *filename, *rel_name, *abs_name;
+	u_char *hashes = NULL;
 	chunk_t measurement;
-	char* filename;
 	bool success = TRUE;
+	int count = 0, i;
 
-	/* Create a hasher and a hash measurement buffer */
+	/* Get the hash size of the measurement algorithm */
 	hash_alg = pts_meas_algo_to_hash(alg);
 	hasher = lib->crypto->create_hasher(lib->crypto, hash_alg);
 	if (!hasher)
@@ -301,7 +283,8 @@ pts_file_meas_t *pts_file_meas_create_from_path(u_int16_t request_id,
 		DBG1(DBG_PTS, "hasher %N not available", hash_algorithm_names, hash_alg);
 		return NULL;
 	}
-	measurement = chunk_create(hash, hasher->get_hash_size(hasher));
+	measurement = chunk_create(NULL, hasher->get_hash_size(hasher));
+	hasher->destroy(hasher);
 
 	INIT(this,
 		.public = {
@@ -317,10 +300,10 @@ pts_file_meas_t *pts_file_meas_create_from_path(u_int16_t request_id,
 		.list = linked_list_create(),
 	);
 
+	abs_names = linked_list_create();
+	rel_names = linked_list_create();
 	if (is_dir)
 	{
-		enumerator_t *enumerator;
-		char *rel_name, *abs_name;
 		struct stat st;
 
 		enumerator = enumerator_create_directory(pathname);
@@ -336,32 +319,58 @@ pts_file_meas_t *pts_file_meas_create_from_path(u_int16_t request_id,
 			/* measure regular files only */
 			if (S_ISREG(st.st_mode) && *rel_name != '.')
 			{
-				if (!hash_file(hasher, abs_name, hash))
-				{
-					success = FALSE;
-					break;
-				}
-				filename = use_rel_name ? rel_name : abs_name;
-				DBG2(DBG_PTS, "  %#B for '%s'", &measurement, filename);
-				add(this, filename, measurement);
+				abs_names->insert_last(abs_names, strdup(abs_name));
+				rel_names->insert_last(rel_names, strdup(rel_name));
 			}
 		}
 		enumerator->destroy(enumerator);
 	}
 	else
 	{
-		if (!hash_file(hasher, pathname, hash))
+		abs_names->insert_last(abs_names, strdup(pathname));
+		rel_names->insert_last(rel_names, strdup(basename(pathname)));
+	}
+
+	/* hash all files at once, which allows hashing them in parallel */
+	count = abs_names->get_count(abs_names);
+	files = malloc(sizeof(char*) * max(count, 1));
+	enumerator = abs_names->create_enumerator(abs_names);
+	for (i = 0; enumerator->enumerate(enumerator, &abs_name); i++)
+	{
+		files[i] = abs_name;
+	}
+	enumerator->destroy(enumerator);
+	hashes = malloc(measurement.len * max(count, 1));
+	success = hash_files(hash_alg, files, count, hashes);
+	free(files);
+	if (!success)
+	{
+		goto end;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		abs_names->remove_first(abs_names, (void**)&abs_name);
+		rel_names->remove_first(rel_names, (void**)&rel_name);
+		if (is_dir)
 		{
-			success = FALSE;
-			goto end;
+			filename = use_rel_name ? rel_name : abs_name;
 		}
-		filename = use_rel_name ? basename(pathname) : pathname;
+		else
+		{
+			filename = use_rel_name ? rel_name : pathname;
+		}
+		measurement.ptr = hashes + i * measurement.len;
 		DBG2(DBG_PTS, "  %#B for '%s'", &measurement, filename);
 		add(this, filename, measurement);
+		free(abs_name);
+		free(rel_name);
 	}
 
 end:
-	hasher->destroy(hasher);
+	abs_names->destroy_function(abs_names, free);
+	rel_names->destroy_function(rel_names, free);
+	free(hashes);
 	if (success)
 	{
 		return &this->public;
@@ -78,13 +78,12 @@ static void save_state(private_radius_client_t *this, radius_message_t *msg)
 	chunk_free(&this->state);
 }
 
-METHOD(radius_client_t, request, radius_message_t*,
-	private_radius_client_t *this, radius_message_t *req)
+/**
+ * Add NAS-Identifier and State attributes to a request, get a socket
+ */
+static radius_socket_t *prepare(private_radius_client_t *this,
+								radius_message_t *req)
 {
-	radius_socket_t *socket;
-	radius_message_t *res;
-	chunk_t data;
-
 	/* add our NAS-Identifier */
 	req->add(req, RAT_NAS_IDENTIFIER,
 			 this->config->get_nas_identifier(this->config));
@@ -93,19 +92,36 @@ METHOD(radius_client_t, request, radius_message_t*,
 	{
 		req->add(req, RAT_STATE, this->state);
 	}
-	socket = this->config->get_socket(this->config);
 	DBG1(DBG_CFG, "sending RADIUS %N to server '%s'", radius_message_code_names,
 		 req->get_code(req), this->config->get_name(this->config));
+	return this->config->get_socket(this->config);
+}
+
+/**
+ * Log a received response
+ */
+static void log_response(radius_config_t *config, radius_message_t *res)
+{
+	chunk_t data;
 
+	DBG1(DBG_CFG, "received RADIUS %N from server '%s'",
+		 radius_message_code_names, res->get_code(res),
+		 config->get_name(config));
+	data = res->get_encoding(res);
+	DBG3(DBG_CFG, "%B", &data);
+}
+
+METHOD(radius_client_t, request, radius_message_t*,
+	private_radius_client_t *this, radius_message_t *req)
+{
+	radius_socket_t *socket;
+	radius_message_t *res;
+
+	socket = prepare(this, req);
 	res = socket->request(socket, req);
 	if (res)
 	{
-		DBG1(DBG_CFG, "received RADIUS %N from server '%s'",
-			 radius_message_code_names, res->get_code(res),
-			 this->config->get_name(this->config));
-		data = res->get_encoding(res);
-		DBG3(DBG_CFG, "%B", &data);
-
+		log_response(this->config, res);
 		save_state(this, res);
 		if (res->get_code(res) == RMC_ACCESS_ACCEPT)
 		{
@@ -119,6 +135,71 @@ METHOD(radius_client_t, request, radius_message_t*,
 	return NULL;
 }
 
+/**
+ * Context of an asynchronous request
+ */
+typedef struct {
+
+	/**
+	 * Server configuration the request was sent to
+	 */
+	radius_config_t *config;
+
+	/**
+	 * Socket used to send the request
+	 */
+	radius_socket_t *socket;
+
+	/**
+	 * User callback
+	 */
+	radius_socket_cb_t cb;
+
+	/**
+	 * User data
+	 */
+	void *data;
+} async_t;
+
+/**
+ * Completion callback for asynchronous requests
+ */
+static void async_cb(async_t *async, radius_message_t *req,
+					 radius_message_t *res)
+{
+	if (res)
+	{
+		log_response(async->config, res);
+	}
+	async->config->put_socket(async->config, async->socket, res != NULL);
+	async->cb(async->data, req, res);
+	async->config->destroy(async->config);
+	free(async);
+}
+
+METHOD(radius_client_t, request_async, bool,
+	private_radius_client_t *this, radius_message_t *req,
+	radius_socket_cb_t cb, void *data)
+{
+	async_t *async;
+
+	INIT(async,
+		.config = this->config->get_ref(this->config),
+		.socket = prepare(this, req),
+		.cb = cb,
+		.data = data,
+	);
+	if (!async->socket->request_async(async->socket, req,
+									  (radius_socket_cb_t)async_cb, async))
+	{
+		this->config->put_socket(this->config, async->socket, FALSE);
+		async->config->destroy(async->config);
+		free(async);
+		return FALSE;
+	}
+	return TRUE;
+}
+
 METHOD(radius_client_t, get_msk, chunk_t,
 	private_radius_client_t *this)
 {
@@ -144,6 +225,7 @@ radius_client_t *radius_client_create(radius_config_t *config)
 	INIT(this,
 		.public = {
 			.request = _request,
+			.request_async = _request_async,
 			.get_msk = _get_msk,
 			.destroy = _destroy,
 		},
@@ -39,11 +39,32 @@ struct radius_client_t {
 	 *
 	 * The client fills in NAS-Identifier nad NAS-Port-Type
 	 *
+	 * The calling thread blocks until the response arrives or the request
+	 * timed out. This is used for EAP exchanges, as EAP methods can't
+	 * suspend the IKE_SA task waiting for the RADIUS server.
+	 *
 	 * @param msg			RADIUS request message to send
 	 * @return				response, NULL if timed out/verification failed
 	 */
 	radius_message_t* (*request)(radius_client_t *this, radius_message_t *msg);
 
+	/**
+	 * Send a RADIUS request without waiting for the response.
+	 *
+	 * Like request(), but the callback gets invoked from a different thread
+	 * once the response arrived or the request timed out. The server State
+	 * and the MSK of the client are not updated, so this is intended for
+	 * standalone requests, such as accounting, that don't need to block an
+	 * IKE_SA. The client may be destroyed before the request completes.
+	 *
+	 * @param msg			RADIUS request message to send, gets owned
+	 * @param cb			callback to invoke on completion
+	 * @param data			user data to pass to callback
+	 * @return				TRUE if request queued, FALSE if sending failed
+	 */
+	bool (*request_async)(radius_client_t *this, radius_message_t *msg,
+						  radius_socket_cb_t cb, void *data);
+
 	/**
 	 * Get the EAP MSK after successful RADIUS authentication.
 	 *
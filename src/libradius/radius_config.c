@@ -15,9 +15,38 @@
 
 #include "radius_config.h"
 
+#include <utils/debug.h>
 #include <threading/mutex.h>
-#include <threading/condvar.h>
 #include <collections/linked_list.h>
+#include <processing/jobs/callback_job.h>
+
+/**
+ * Default initial backoff for failed servers, in seconds
+ */
+#define RADIUS_BACKOFF 5
+
+/**
+ * Default maximum backoff for failed servers, in seconds
+ */
+#define RADIUS_BACKOFF_MAX 300
+
+/**
+ * Number of consecutive failed requests before a reachable server is
+ * considered down
+ */
+#define RADIUS_FAILURES 3
+
+/**
+ * Reference round-trip time in ms, servers with this RTT get half the
+ * latency part of the preference
+ */
+#define RTT_REFERENCE 100
+
+ENUM(radius_server_state_names, RADIUS_SERVER_UP, RADIUS_SERVER_PROBING,
+	"up",
+	"down",
+	"probing",
+);
 
 typedef struct private_radius_config_t private_radius_config_t;
 
@@ -37,19 +66,19 @@ struct private_radius_config_t {
 	linked_list_t *sockets;
 
 	/**
-	 * Total number of sockets, in list + currently in use
+	 * Total number of sockets
 	 */
 	int socket_count;
 
 	/**
-	 * mutex to lock sockets list
+	 * Number of requests currently using a socket of this config
 	 */
-	mutex_t *mutex;
+	int in_use;
 
 	/**
-	 * condvar to wait for sockets
+	 * mutex to lock sockets list
 	 */
-	condvar_t *condvar;
+	mutex_t *mutex;
 
 	/**
 	 * Server name
@@ -67,14 +96,64 @@ struct private_radius_config_t {
 	int preference;
 
 	/**
-	 * Is the server currently reachable
+	 * Current health state
+	 */
+	radius_server_state_t state;
+
+	/**
+	 * Number of consecutive failures
+	 */
+	u_int failures;
+
+	/**
+	 * Initial backoff for failed servers, in seconds
+	 */
+	u_int backoff_min;
+
+	/**
+	 * Maximum backoff for failed servers, in seconds
+	 */
+	u_int backoff_max;
+
+	/**
+	 * Current backoff, in seconds
+	 */
+	u_int backoff;
+
+	/**
+	 * Monotonic time a failed server gets retried
+	 */
+	time_t retry;
+
+	/**
+	 * Probe failed servers using Status-Server
+	 */
+	bool probe;
+
+	/**
+	 * Callback to invoke if a probe fails
+	 */
+	radius_probe_cb_t probe_cb;
+
+	/**
+	 * Data to pass to probe_cb
+	 */
+	void *probe_data;
+
+	/**
+	 * Number of requests sent
+	 */
+	u_int64_t requests;
+
+	/**
+	 * Number of requests that got a response
 	 */
-	bool reachable;
+	u_int64_t responses;
 
 	/**
-	 * Retry counter for unreachable servers
+	 * Number of requests that timed out
 	 */
-	int retry;
+	u_int64_t timeouts;
 
 	/**
 	 * reference count
@@ -82,16 +161,191 @@ struct private_radius_config_t {
 	refcount_t ref;
 };
 
+/**
+ * Get the socket with the fewest pending requests, mutex must be held
+ */
+static radius_socket_t *least_loaded(private_radius_config_t *this)
+{
+	enumerator_t *enumerator;
+	radius_socket_t *skt, *best = NULL;
+	u_int pending, best_pending = 0;
+
+	enumerator = this->sockets->create_enumerator(this->sockets);
+	while (enumerator->enumerate(enumerator, &skt))
+	{
+		pending = skt->get_pending(skt);
+		if (!best || pending < best_pending)
+		{
+			best = skt;
+			best_pending = pending;
+		}
+	}
+	enumerator->destroy(enumerator);
+	return best;
+}
+
+/**
+ * Get the average round-trip time over all sockets, mutex must be held
+ */
+static u_int get_rtt(private_radius_config_t *this)
+{
+	enumerator_t *enumerator;
+	radius_socket_t *skt;
+	u_int rtt, sum = 0, count = 0;
+
+	enumerator = this->sockets->create_enumerator(this->sockets);
+	while (enumerator->enumerate(enumerator, &skt))
+	{
+		rtt = skt->get_rtt(skt);
+		if (rtt)
+		{
+			sum += rtt;
+			count++;
+		}
+	}
+	enumerator->destroy(enumerator);
+	return count ? sum / count : 0;
+}
+
+/**
+ * Mark the server as up, mutex must be held
+ */
+static void mark_up(private_radius_config_t *this)
+{
+	if (this->state != RADIUS_SERVER_UP)
+	{
+		DBG1(DBG_CFG, "RADIUS server '%s' is responding again", this->name);
+	}
+	this->state = RADIUS_SERVER_UP;
+	this->failures = 0;
+	this->backoff = 0;
+}
+
+static job_requeue_t send_probe(private_radius_config_t *this);
+
+/**
+ * Register a failed request, mark the server as down and open the circuit
+ * after several consecutive failures or a failed retry, mutex must be held
+ */
+static void mark_down(private_radius_config_t *this)
+{
+	this->failures++;
+	switch (this->state)
+	{
+		case RADIUS_SERVER_UP:
+			if (this->failures < RADIUS_FAILURES)
+			{	/* tolerate single lost requests */
+				return;
+			}
+			break;
+		case RADIUS_SERVER_DOWN:
+			/* already down, e.g. another request timed out */
+			return;
+		case RADIUS_SERVER_PROBING:
+		default:
+			break;
+	}
+	if (this->backoff)
+	{
+		this->backoff = min(this->backoff * 2, this->backoff_max);
+	}
+	else
+	{
+		this->backoff = this->backoff_min;
+	}
+	this->state = RADIUS_SERVER_DOWN;
+	this->retry = time_monotonic(NULL) + this->backoff;
+	DBG1(DBG_CFG, "RADIUS server '%s' failed, retrying in %us",
+		 this->name, this->backoff);
+	if (this->probe)
+	{	/* the probe holds a reference, released with the job */
+		this->public.get_ref(&this->public);
+		lib->scheduler->schedule_job(lib->scheduler, (job_t*)
+				callback_job_create_with_prio((callback_job_cb_t)send_probe,
+					this, (callback_job_cleanup_t)this->public.destroy,
+					(callback_job_cancel_t)return_false, JOB_PRIO_HIGH),
+				this->backoff);
+	}
+}
+
+/**
+ * Completion callback for Status-Server probes
+ */
+static void probe_cb(private_radius_config_t *this, radius_message_t *request,
+					 radius_message_t *response)
+{
+	radius_probe_cb_t cb = NULL;
+	void *data;
+
+	this->mutex->lock(this->mutex);
+	if (response && response->get_code(response) == RMC_ACCESS_ACCEPT)
+	{
+		mark_up(this);
+	}
+	else
+	{
+		mark_down(this);
+		cb = this->probe_cb;
+		data = this->probe_data;
+	}
+	this->mutex->unlock(this->mutex);
+	DESTROY_IF(response);
+	if (cb)
+	{
+		cb(data, &this->public);
+	}
+	this->public.destroy(&this->public);
+}
+
+/**
+ * Send a Status-Server request to a failed server once its backoff expired
+ */
+static job_requeue_t send_probe(private_radius_config_t *this)
+{
+	radius_message_t *request;
+	radius_socket_t *skt;
+
+	this->mutex->lock(this->mutex);
+	if (this->state != RADIUS_SERVER_DOWN)
+	{	/* a request found the server responding again */
+		this->mutex->unlock(this->mutex);
+		return JOB_REQUEUE_NONE;
+	}
+	this->state = RADIUS_SERVER_PROBING;
+	skt = least_loaded(this);
+	this->mutex->unlock(this->mutex);
+
+	DBG1(DBG_CFG, "probing RADIUS server '%s' using Status-Server",
+		 this->name);
+	request = radius_message_create(RMC_STATUS_SERVER);
+	request->add(request, RAT_NAS_IDENTIFIER, this->nas_identifier);
+	/* the pending probe holds a reference, released in probe_cb() */
+	this->public.get_ref(&this->public);
+	if (!skt->request_async(skt, request, (radius_socket_cb_t)probe_cb, this))
+	{
+		this->mutex->lock(this->mutex);
+		mark_down(this);
+		this->mutex->unlock(this->mutex);
+		this->public.destroy(&this->public);
+	}
+	return JOB_REQUEUE_NONE;
+}
+
 METHOD(radius_config_t, get_socket, radius_socket_t*,
 	private_radius_config_t *this)
 {
 	radius_socket_t *skt;
 
+	/* sockets multiplex requests, use the one with the fewest pending */
 	this->mutex->lock(this->mutex);
-	while (this->sockets->remove_first(this->sockets, (void**)&skt) != SUCCESS)
-	{
-		this->condvar->wait(this->condvar, this->mutex);
+	skt = least_loaded(this);
+	if (this->state == RADIUS_SERVER_DOWN && !this->probe &&
+		time_monotonic(NULL) >= this->retry)
+	{	/* let this request check if the server is back */
+		this->state = RADIUS_SERVER_PROBING;
 	}
+	this->in_use++;
+	this->requests++;
 	this->mutex->unlock(this->mutex);
 	return skt;
 }
@@ -100,10 +354,18 @@ METHOD(radius_config_t, put_socket, void,
 	private_radius_config_t *this, radius_socket_t *skt, bool result)
 {
 	this->mutex->lock(this->mutex);
-	this->sockets->insert_last(this->sockets, skt);
+	this->in_use--;
+	if (result)
+	{
+		this->responses++;
+		mark_up(this);
+	}
+	else
+	{
+		this->timeouts++;
+		mark_down(this);
+	}
 	this->mutex->unlock(this->mutex);
-	this->condvar->signal(this->condvar);
-	this->reachable = result;
 }
 
 METHOD(radius_config_t, get_nas_identifier, chunk_t,
@@ -115,38 +377,88 @@ METHOD(radius_config_t, get_nas_identifier, chunk_t,
 METHOD(radius_config_t, get_preference, int,
 	private_radius_config_t *this)
 {
-	int pref;
+	int pref, load, latency;
 
 	if (this->socket_count == 0)
 	{	/* don't have sockets, huh? */
 		return -1;
 	}
+	this->mutex->lock(this->mutex);
+	/* load: 100 if idle, decreasing with outstanding requests per socket */
+	load = this->socket_count * 100 / (this->socket_count + this->in_use);
+	/* latency: 100 if RTT unknown/zero, 50 at reference RTT */
+	latency = RTT_REFERENCE * 100 / (RTT_REFERENCE + get_rtt(this));
 	/* calculate preference between 0-100 + boost */
-	pref = this->preference;
-	pref += this->sockets->get_count(this->sockets) * 100 / this->socket_count;
-	if (this->reachable)
-	{	/* reachable server get a boost: pref = 110-210 + boost */
-		return pref + 110;
-	}
-	/* Not reachable. Increase preference randomly to let it retry from
-	 * time to time, especially if other servers have high load. */
-	this->retry++;
-	if (this->retry % 128 == 0)
-	{	/* every 64th request gets 210, same as unloaded reachable */
-		return pref + 110;
-	}
-	if (this->retry % 32 == 0)
-	{	/* every 32th request gets 190, wins against average loaded */
-		return pref + 90;
-	}
-	if (this->retry % 8 == 0)
-	{	/* every 8th request gets 110, same as server under load */
-		return pref + 10;
-	}
-	/* other get ~100, less than fully loaded */
+	pref = this->preference + load * latency / 100;
+
+	switch (this->state)
+	{
+		case RADIUS_SERVER_UP:
+			/* reachable server get a boost: pref = 110-210 + boost */
+			pref += 110;
+			break;
+		case RADIUS_SERVER_DOWN:
+			if (this->probe || time_monotonic(NULL) < this->retry)
+			{	/* circuit open, only used if all servers failed. If probing,
+				 * a scheduled Status-Server request checks if it is back */
+				break;
+			}
+			/* backoff expired, compete with reachable servers to let a
+			 * request check if it is back */
+			pref += 110;
+			break;
+		case RADIUS_SERVER_PROBING:
+		default:
+			break;
+	}
+	this->mutex->unlock(this->mutex);
 	return pref;
 }
 
+METHOD(radius_config_t, set_backoff, void,
+	private_radius_config_t *this, u_int backoff, u_int backoff_max,
+	bool probe)
+{
+	this->mutex->lock(this->mutex);
+	this->backoff_min = max(backoff, 1);
+	this->backoff_max = max(backoff_max, this->backoff_min);
+	this->probe = probe;
+	this->mutex->unlock(this->mutex);
+}
+
+METHOD(radius_config_t, set_probe_cb, void,
+	private_radius_config_t *this, radius_probe_cb_t cb, void *data)
+{
+	this->mutex->lock(this->mutex);
+	this->probe_cb = cb;
+	this->probe_data = data;
+	this->mutex->unlock(this->mutex);
+}
+
+METHOD(radius_config_t, get_stats, void,
+	private_radius_config_t *this, radius_stats_t *stats)
+{
+	time_t now;
+
+	now = time_monotonic(NULL);
+	this->mutex->lock(this->mutex);
+	*stats = (radius_stats_t){
+		.state = this->state,
+		.requests = this->requests,
+		.responses = this->responses,
+		.timeouts = this->timeouts,
+		.outstanding = this->in_use,
+		.rtt = get_rtt(this),
+		.failures = this->failures,
+		.backoff = this->backoff,
+	};
+	if (this->state == RADIUS_SERVER_DOWN && this->retry > now)
+	{
+		stats->retry = this->retry - now;
+	}
+	this->mutex->unlock(this->mutex);
+}
+
 METHOD(radius_config_t, get_name, char*,
 	private_radius_config_t *this)
 {
@@ -167,7 +479,6 @@ METHOD(radius_config_t, destroy, void,
 	if (ref_put(&this->ref))
 	{
 		this->mutex->destroy(this->mutex);
-		this->condvar->destroy(this->condvar);
 		this->sockets->destroy_offset(this->sockets,
 									  offsetof(radius_socket_t, destroy));
 		free(this);
@@ -191,16 +502,20 @@ radius_config_t *radius_config_create(char *name, char *address,
 			.put_socket = _put_socket,
 			.get_nas_identifier = _get_nas_identifier,
 			.get_preference = _get_preference,
+			.set_backoff = _set_backoff,
+			.set_probe_cb = _set_probe_cb,
+			.get_stats = _get_stats,
 			.get_name = _get_name,
 			.get_ref = _get_ref,
 			.destroy = _destroy,
 		},
-		.reachable = TRUE,
+		.state = RADIUS_SERVER_UP,
+		.backoff_min = RADIUS_BACKOFF,
+		.backoff_max = RADIUS_BACKOFF_MAX,
 		.nas_identifier = chunk_create(nas_identifier, strlen(nas_identifier)),
 		.socket_count = sockets,
 		.sockets = linked_list_create(),
 		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
-		.condvar = condvar_create(CONDVAR_TYPE_DEFAULT),
 		.name = name,
 		.preference = preference,
 		.ref = 1,
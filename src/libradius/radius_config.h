@@ -22,9 +22,69 @@
 #define RADIUS_CONFIG_H_
 
 typedef struct radius_config_t radius_config_t;
+typedef struct radius_stats_t radius_stats_t;
+typedef enum radius_server_state_t radius_server_state_t;
 
 #include "radius_socket.h"
 
+/**
+ * Callback invoked if a failed RADIUS server did not respond to a probe.
+ *
+ * @param data			data passed to set_probe_cb()
+ * @param config		server that did not respond
+ */
+typedef void (*radius_probe_cb_t)(void *data, radius_config_t *config);
+
+/**
+ * Health state of a RADIUS server.
+ */
+enum radius_server_state_t {
+	/** server is responding */
+	RADIUS_SERVER_UP,
+	/** server failed, requests avoid it until the backoff expired */
+	RADIUS_SERVER_DOWN,
+	/** backoff expired, a single trial or Status-Server request is pending */
+	RADIUS_SERVER_PROBING,
+};
+
+/**
+ * Enum names for radius_server_state_t.
+ */
+extern enum_name_t *radius_server_state_names;
+
+/**
+ * Statistics and health information of a RADIUS server.
+ */
+struct radius_stats_t {
+
+	/** current health state */
+	radius_server_state_t state;
+
+	/** number of requests sent */
+	u_int64_t requests;
+
+	/** number of requests that got a response */
+	u_int64_t responses;
+
+	/** number of requests that timed out */
+	u_int64_t timeouts;
+
+	/** number of requests currently outstanding */
+	u_int outstanding;
+
+	/** smoothed round-trip time in ms, 0 if unknown */
+	u_int rtt;
+
+	/** number of consecutive failures */
+	u_int failures;
+
+	/** current backoff in seconds, if not up */
+	u_int backoff;
+
+	/** seconds until the server is retried, if down */
+	u_int retry;
+};
+
 /**
  * RADIUS server configuration.
  */
@@ -33,12 +93,16 @@ struct radius_config_t {
 	/**
 	 * Get a RADIUS socket from the pool to communicate with this config.
 	 *
+	 * Sockets multiplex requests and are shared, the socket with the fewest
+	 * pending requests is returned. Each socket must be released using
+	 * put_socket() once the request completed.
+	 *
 	 * @return			RADIUS socket
 	 */
 	radius_socket_t* (*get_socket)(radius_config_t *this);
 
 	/**
-	 * Release a socket to the pool after use.
+	 * Release a socket to the pool after a request completed.
 	 *
 	 * @param skt		RADIUS socket to release
 	 * @param result	result of the socket use, TRUE for success
@@ -55,11 +119,47 @@ struct radius_config_t {
 	/**
 	 * Get the preference of this server.
 	 *
-	 * Based on the available sockets and the server reachability a preference
-	 * value is calculated: better servers return a higher value.
+	 * Based on the outstanding requests, the measured round-trip time and
+	 * the server health a preference value is calculated: better servers
+	 * return a higher value.
 	 */
 	int (*get_preference)(radius_config_t *this);
 
+	/**
+	 * Configure the circuit breaker of this server.
+	 *
+	 * A server that failed to respond to several consecutive requests is
+	 * avoided for a backoff time that starts at backoff and doubles with
+	 * each failed retry, up to backoff_max. It is retried using a real
+	 * request or, if probe is set, a Status-Server request (RFC 5997) sent
+	 * once the backoff expired.
+	 *
+	 * @param backoff		initial backoff in seconds
+	 * @param backoff_max	maximum backoff in seconds
+	 * @param probe			TRUE to probe failed servers using Status-Server
+	 */
+	void (*set_backoff)(radius_config_t *this, u_int backoff, u_int backoff_max,
+						bool probe);
+
+	/**
+	 * Set a callback to invoke if a Status-Server probe fails.
+	 *
+	 * Failed probes have no request waiting for them, the callback gets
+	 * invoked instead to report the failure.
+	 *
+	 * @param cb			callback function, NULL to unset
+	 * @param data			data to pass to callback
+	 */
+	void (*set_probe_cb)(radius_config_t *this, radius_probe_cb_t cb,
+						 void *data);
+
+	/**
+	 * Get statistics and health information of this server.
+	 *
+	 * @param stats			receives statistics
+	 */
+	void (*get_stats)(radius_config_t *this, radius_stats_t *stats);
+
 	/**
 	 * Get the name of the RADIUS server.
 	 *
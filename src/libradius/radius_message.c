@@ -81,9 +81,10 @@ ENUM_BEGIN(radius_message_code_names, RMC_ACCESS_REQUEST, RMC_ACCOUNTING_RESPONS
 	"Access-Reject",
 	"Accounting-Request",
 	"Accounting-Response");
-ENUM_NEXT(radius_message_code_names, RMC_ACCESS_CHALLENGE, RMC_ACCESS_CHALLENGE, RMC_ACCOUNTING_RESPONSE,
-	"Access-Challenge");
-ENUM_NEXT(radius_message_code_names, RMC_DISCONNECT_REQUEST, RMC_COA_NAK, RMC_ACCESS_CHALLENGE,
+ENUM_NEXT(radius_message_code_names, RMC_ACCESS_CHALLENGE, RMC_STATUS_SERVER, RMC_ACCOUNTING_RESPONSE,
+	"Access-Challenge",
+	"Status-Server");
+ENUM_NEXT(radius_message_code_names, RMC_DISCONNECT_REQUEST, RMC_COA_NAK, RMC_STATUS_SERVER,
 	"Disconnect-Request",
 	"Disconnect-ACK",
 	"Disconnect-NAK",
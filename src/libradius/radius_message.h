@@ -47,6 +47,7 @@ enum radius_message_code_t {
 	RMC_ACCOUNTING_REQUEST = 4,
 	RMC_ACCOUNTING_RESPONSE = 5,
 	RMC_ACCESS_CHALLENGE = 11,
+	RMC_STATUS_SERVER = 12,
 	RMC_DISCONNECT_REQUEST = 40,
 	RMC_DISCONNECT_ACK = 41,
 	RMC_DISCONNECT_NAK = 42,
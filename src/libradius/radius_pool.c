@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "radius_pool.h"
+
+#include <utils/debug.h>
+#include <threading/rwlock.h>
+
+typedef struct private_radius_pool_t private_radius_pool_t;
+
+/**
+ * Private data of an radius_pool_t object.
+ */
+struct private_radius_pool_t {
+
+	/**
+	 * Public radius_pool_t interface.
+	 */
+	radius_pool_t public;
+
+	/**
+	 * List of RADIUS server configurations
+	 */
+	linked_list_t *configs;
+
+	/**
+	 * Lock for configs list
+	 */
+	rwlock_t *lock;
+};
+
+METHOD(radius_pool_t, select_config, radius_config_t*,
+	private_radius_pool_t *this)
+{
+	enumerator_t *enumerator;
+	radius_config_t *config, *selected = NULL;
+	int current, best = -1;
+
+	this->lock->read_lock(this->lock);
+	enumerator = this->configs->create_enumerator(this->configs);
+	while (enumerator->enumerate(enumerator, &config))
+	{
+		current = config->get_preference(config);
+		if (current > best ||
+			/* for two with equal preference, 50-50 chance */
+			(current == best && random() % 2 == 0))
+		{
+			DBG2(DBG_CFG, "RADIUS server '%s' is candidate: %d",
+				 config->get_name(config), current);
+			best = current;
+			DESTROY_IF(selected);
+			selected = config->get_ref(config);
+		}
+		else
+		{
+			DBG2(DBG_CFG, "RADIUS server '%s' skipped: %d",
+				 config->get_name(config), current);
+		}
+	}
+	enumerator->destroy(enumerator);
+	this->lock->unlock(this->lock);
+
+	return selected;
+}
+
+METHOD(radius_pool_t, replace, void,
+	private_radius_pool_t *this, linked_list_t *configs)
+{
+	linked_list_t *old;
+
+	this->lock->write_lock(this->lock);
+	old = this->configs;
+	this->configs = configs;
+	this->lock->unlock(this->lock);
+
+	old->destroy_offset(old, offsetof(radius_config_t, destroy));
+}
+
+METHOD(radius_pool_t, get_count, int,
+	private_radius_pool_t *this)
+{
+	int count;
+
+	this->lock->read_lock(this->lock);
+	count = this->configs->get_count(this->configs);
+	this->lock->unlock(this->lock);
+	return count;
+}
+
+METHOD(radius_pool_t, create_enumerator, enumerator_t*,
+	private_radius_pool_t *this)
+{
+	this->lock->read_lock(this->lock);
+	return enumerator_create_cleaner(
+						this->configs->create_enumerator(this->configs),
+						(void*)this->lock->unlock, this->lock);
+}
+
+METHOD(radius_pool_t, destroy, void,
+	private_radius_pool_t *this)
+{
+	this->configs->destroy_offset(this->configs,
+								  offsetof(radius_config_t, destroy));
+	this->lock->destroy(this->lock);
+	free(this);
+}
+
+/**
+ * See header
+ */
+radius_pool_t *radius_pool_create()
+{
+	private_radius_pool_t *this;
+
+	INIT(this,
+		.public = {
+			.select_config = _select_config,
+			.replace = _replace,
+			.get_count = _get_count,
+			.create_enumerator = _create_enumerator,
+			.destroy = _destroy,
+		},
+		.configs = linked_list_create(),
+		.lock = rwlock_create(RWLOCK_TYPE_DEFAULT),
+	);
+
+	return &this->public;
+}
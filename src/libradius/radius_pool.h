@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup radius_pool radius_pool
+ * @{ @ingroup libradius
+ */
+
+#ifndef RADIUS_POOL_H_
+#define RADIUS_POOL_H_
+
+typedef struct radius_pool_t radius_pool_t;
+
+#include "radius_config.h"
+
+#include <collections/linked_list.h>
+
+/**
+ * Pool of RADIUS servers to select the best server from.
+ *
+ * Users of the pool may register it using lib->set() to make the servers
+ * and their statistics available to other components.
+ */
+struct radius_pool_t {
+
+	/**
+	 * Select the server with the highest preference.
+	 *
+	 * Servers with equal preference are selected randomly.
+	 *
+	 * @return			reference to server config, NULL if none available
+	 */
+	radius_config_t* (*select_config)(radius_pool_t *this);
+
+	/**
+	 * Replace all servers of the pool atomically.
+	 *
+	 * @param configs	list of radius_config_t, gets owned
+	 */
+	void (*replace)(radius_pool_t *this, linked_list_t *configs);
+
+	/**
+	 * Get the number of servers in the pool.
+	 *
+	 * @return			number of servers
+	 */
+	int (*get_count)(radius_pool_t *this);
+
+	/**
+	 * Create an enumerator over the servers in the pool.
+	 *
+	 * The pool is locked during enumeration, the enumerator must be
+	 * destroyed before calling other methods of the pool.
+	 *
+	 * @return			enumerator over radius_config_t
+	 */
+	enumerator_t* (*create_enumerator)(radius_pool_t *this);
+
+	/**
+	 * Destroy a radius_pool_t and all its servers.
+	 */
+	void (*destroy)(radius_pool_t *this);
+};
+
+/**
+ * Create an empty radius_pool_t instance.
+ *
+ * @return			radius_pool_t object
+ */
+radius_pool_t *radius_pool_create();
+
+#endif /** RADIUS_POOL_H_ @}*/
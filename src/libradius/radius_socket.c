@@ -18,11 +18,74 @@
 
 #include <errno.h>
 #include <unistd.h>
+#include <sys/select.h>
 
 #include <pen/pen.h>
 #include <utils/debug.h>
+#include <threading/thread.h>
+#include <threading/mutex.h>
+#include <collections/linked_list.h>
+#include <processing/jobs/callback_job.h>
+
+/**
+ * Retransmission timeouts in seconds, the request fails after the last one
+ */
+static const u_int timeouts[] = { 2, 3, 4, 5 };
 
 typedef struct private_radius_socket_t private_radius_socket_t;
+typedef struct pending_t pending_t;
+
+/**
+ * A request sent to the server or waiting for a free identifier
+ */
+struct pending_t {
+
+	/**
+	 * Request message
+	 */
+	radius_message_t *request;
+
+	/**
+	 * Do we own the request message
+	 */
+	bool owned;
+
+	/**
+	 * Callback to invoke on completion
+	 */
+	radius_socket_cb_t cb;
+
+	/**
+	 * User data for callback
+	 */
+	void *data;
+
+	/**
+	 * Number of retransmissions done so far
+	 */
+	int retransmitted;
+
+	/**
+	 * Unique sequence number, detects stale retransmission jobs
+	 */
+	u_int32_t seq;
+
+	/**
+	 * Time the request was sent first
+	 */
+	timeval_t sent;
+
+	/**
+	 * Time of the next retransmission
+	 */
+	timeval_t next;
+
+	/**
+	 * Synchronous request, the requesting thread receives responses and
+	 * retransmits, and destroys this entry after completion
+	 */
+	bool sync;
+};
 
 /**
  * Private data of an radius_socket_t object.
@@ -83,10 +146,131 @@ struct private_radius_socket_t {
 	 * RADIUS secret
 	 */
 	chunk_t secret;
+
+	/**
+	 * Requests sent to the server, indexed by identifier
+	 */
+	pending_t *pending[RADIUS_SOCKET_MAX_PENDING];
+
+	/**
+	 * Number of requests in pending
+	 */
+	u_int pending_count;
+
+	/**
+	 * Requests waiting for a free identifier, as pending_t
+	 */
+	linked_list_t *backlog;
+
+	/**
+	 * Next sequence number to assign to a request
+	 */
+	u_int32_t seq;
+
+	/**
+	 * Smoothed round-trip time in ms, 0 if unknown
+	 */
+	u_int rtt;
+
+	/**
+	 * Is a receiver job active
+	 */
+	bool receiving;
+
+	/**
+	 * Pipe to wake up the receiver job blocking in select()
+	 */
+	int notify[2];
+
+	/**
+	 * Mutex to lock request state, crypto primitives and sockets
+	 */
+	mutex_t *mutex;
+
+	/**
+	 * Reference count, held by owner, receiver and retransmission jobs
+	 */
+	refcount_t ref;
 };
 
 /**
- * Check or establish RADIUS connection
+ * Data for a retransmission job
+ */
+typedef struct {
+
+	/**
+	 * Socket the request was sent on
+	 */
+	private_radius_socket_t *this;
+
+	/**
+	 * Identifier of the request
+	 */
+	u_int8_t identifier;
+
+	/**
+	 * Sequence number of the request
+	 */
+	u_int32_t seq;
+} retransmit_t;
+
+/**
+ * Release a reference, destroy the socket after the last one
+ */
+static void release(private_radius_socket_t *this)
+{
+	if (ref_put(&this->ref))
+	{
+		DESTROY_IF(this->hasher);
+		DESTROY_IF(this->signer);
+		DESTROY_IF(this->rng);
+		if (this->auth_fd != -1)
+		{
+			close(this->auth_fd);
+		}
+		if (this->acct_fd != -1)
+		{
+			close(this->acct_fd);
+		}
+		if (this->notify[0] != -1)
+		{
+			close(this->notify[0]);
+			close(this->notify[1]);
+		}
+		this->backlog->destroy(this->backlog);
+		this->mutex->destroy(this->mutex);
+		free(this);
+	}
+}
+
+/**
+ * Destroy a pending request entry
+ */
+static void pending_destroy(pending_t *pending)
+{
+	if (pending->owned)
+	{
+		pending->request->destroy(pending->request);
+	}
+	free(pending);
+}
+
+/**
+ * Wake up the receiver job to update its file descriptors or to exit,
+ * mutex must be held
+ */
+static void wakeup(private_radius_socket_t *this)
+{
+	char c = 0;
+
+	if (this->receiving)
+	{
+		ignore_result(write(this->notify[1], &c, 1));
+	}
+}
+
+/**
+ * Check or establish RADIUS connection, mutex must be held
  */
 static bool check_connection(private_radius_socket_t *this,
 							 int *fd, u_int16_t port)
@@ -121,17 +305,82 @@ static bool check_connection(private_radius_socket_t *this,
 			return FALSE;
 		}
 		server->destroy(server);
+		wakeup(this);
 	}
 	return TRUE;
 }
 
-METHOD(radius_socket_t, request, radius_message_t*,
-	private_radius_socket_t *this, radius_message_t *request)
+/**
+ * Get the file descriptor to use for a request
+ */
+static int get_fd(private_radius_socket_t *this, radius_message_t *request)
+{
+	if (request->get_code(request) == RMC_ACCOUNTING_REQUEST)
+	{
+		return this->acct_fd;
+	}
+	return this->auth_fd;
+}
+
+static job_requeue_t retransmit(retransmit_t *data);
+static job_requeue_t receive(private_radius_socket_t *this);
+
+/**
+ * Destroy retransmission job data
+ */
+static void retransmit_destroy(retransmit_t *data)
+{
+	release(data->this);
+	free(data);
+}
+
+/**
+ * Schedule the next retransmission of a request, mutex must be held
+ */
+static void schedule_retransmit(private_radius_socket_t *this,
+								pending_t *pending)
+{
+	retransmit_t *data;
+
+	INIT(data,
+		.this = this,
+		.identifier = pending->request->get_identifier(pending->request),
+		.seq = pending->seq,
+	);
+	ref_get(&this->ref);
+	lib->scheduler->schedule_job_ms(lib->scheduler, (job_t*)
+			callback_job_create_with_prio((callback_job_cb_t)retransmit,
+				data, (void*)retransmit_destroy,
+				(callback_job_cancel_t)return_false, JOB_PRIO_HIGH),
+			timeouts[pending->retransmitted] * 1000);
+}
+
+/**
+ * Start the receiver job, if not already running, mutex must be held
+ */
+static void start_receiving(private_radius_socket_t *this)
+{
+	if (!this->receiving)
+	{
+		this->receiving = TRUE;
+		ref_get(&this->ref);
+		lib->processor->queue_job(lib->processor, (job_t*)
+			callback_job_create_with_prio((callback_job_cb_t)receive,
+				this, (void*)release, (callback_job_cancel_t)return_false,
+				JOB_PRIO_CRITICAL));
+	}
+}
+
+/**
+ * Assign an identifier to a request and send it, mutex must be held
+ */
+static bool send_pending(private_radius_socket_t *this, pending_t *pending)
 {
+	radius_message_t *request = pending->request;
 	chunk_t data;
-	int i, *fd;
-	u_int16_t port;
 	rng_t *rng = NULL;
+	int *fd, i;
+	u_int16_t port;
 
 	if (request->get_code(request) == RMC_ACCOUNTING_REQUEST)
 	{
@@ -145,86 +394,503 @@ METHOD(radius_socket_t, request, radius_message_t*,
 		rng = this->rng;
 	}
 
-	/* set Message Identifier */
+	/* find a free Message Identifier */
+	for (i = 0; this->pending[this->identifier]; i++)
+	{
+		if (i == RADIUS_SOCKET_MAX_PENDING)
+		{
+			return FALSE;
+		}
+		this->identifier++;
+	}
 	request->set_identifier(request, this->identifier++);
 	/* sign the request */
 	if (!request->sign(request, NULL, this->secret, this->hasher, this->signer,
 					   rng, rng != NULL))
 	{
-		return NULL;
+		return FALSE;
 	}
 
 	if (!check_connection(this, fd, port))
 	{
-		return NULL;
+		return FALSE;
 	}
 
 	data = request->get_encoding(request);
 	DBG3(DBG_CFG, "%B", &data);
 
-	/* timeout after 2, 3, 4, 5 seconds */
-	for (i = 2; i <= 5; i++)
+	if (send(*fd, data.ptr, data.len, 0) != data.len)
+	{
+		DBG1(DBG_CFG, "sending RADIUS message failed: %s", strerror(errno));
+		return FALSE;
+	}
+	pending->seq = this->seq++;
+	time_monotonic(&pending->sent);
+	pending->next = pending->sent;
+	timeval_add_ms(&pending->next, timeouts[0] * 1000);
+	this->pending[request->get_identifier(request)] = pending;
+	this->pending_count++;
+	if (!pending->sync)
 	{
-		radius_message_t *response;
-		bool retransmit = FALSE;
-		struct timeval tv;
-		char buf[4096];
-		fd_set fds;
-		int res;
+		schedule_retransmit(this, pending);
+		start_receiving(this);
+	}
+	return TRUE;
+}
 
-		if (send(*fd, data.ptr, data.len, 0) != data.len)
+/**
+ * Send requests from the backlog while identifiers are available, mutex
+ * must be held. Requests that fail are returned in a list, if any.
+ */
+static linked_list_t *flush_backlog(private_radius_socket_t *this)
+{
+	linked_list_t *failed = NULL;
+	pending_t *pending;
+
+	while (this->pending_count < RADIUS_SOCKET_MAX_PENDING &&
+		   this->backlog->remove_first(this->backlog,
+									   (void**)&pending) == SUCCESS)
+	{
+		if (!send_pending(this, pending))
 		{
-			DBG1(DBG_CFG, "sending RADIUS message failed: %s", strerror(errno));
-			return NULL;
+			if (!failed)
+			{
+				failed = linked_list_create();
+			}
+			failed->insert_last(failed, pending);
 		}
-		tv.tv_sec = i;
-		tv.tv_usec = 0;
+	}
+	return failed;
+}
 
+/**
+ * Invoke the callback of a completed request and destroy it
+ */
+static void complete(pending_t *pending, radius_message_t *response)
+{
+	if (pending->sync)
+	{	/* the waiting thread destroys it, don't touch it after the callback */
+		pending->cb(pending->data, pending->request, response);
+		return;
+	}
+	pending->cb(pending->data, pending->request, response);
+	pending_destroy(pending);
+}
+
+/**
+ * Remove a pending request and send queued ones, mutex must be held.
+ * Requests failed while sending are returned in a list, if any.
+ */
+static linked_list_t *remove_pending(private_radius_socket_t *this,
+									 u_int8_t identifier)
+{
+	this->pending[identifier] = NULL;
+	if (!--this->pending_count)
+	{
+		wakeup(this);
+	}
+	return flush_backlog(this);
+}
+
+/**
+ * Complete all requests in a list of failed requests
+ */
+static void complete_failed(linked_list_t *failed)
+{
+	pending_t *pending;
+
+	if (failed)
+	{
+		while (failed->remove_first(failed, (void**)&pending) == SUCCESS)
+		{
+			complete(pending, NULL);
+		}
+		failed->destroy(failed);
+	}
+}
+
+/**
+ * Retransmit a sent request, or remove it after the last timeout, mutex must
+ * be held. Returns FALSE if the request has been removed, requests failed
+ * while sending queued ones are returned in failed, if any.
+ */
+static bool resend(private_radius_socket_t *this, pending_t *pending,
+				   linked_list_t **failed)
+{
+	chunk_t encoding;
+	int fd;
+
+	if (++pending->retransmitted < countof(timeouts))
+	{
+		DBG1(DBG_CFG, "retransmitting RADIUS message");
+		encoding = pending->request->get_encoding(pending->request);
+		fd = get_fd(this, pending->request);
+		if (send(fd, encoding.ptr, encoding.len, 0) == encoding.len)
+		{
+			time_monotonic(&pending->next);
+			timeval_add_ms(&pending->next,
+						   timeouts[pending->retransmitted] * 1000);
+			return TRUE;
+		}
+		DBG1(DBG_CFG, "sending RADIUS message failed: %s", strerror(errno));
+	}
+	else
+	{
+		DBG1(DBG_CFG, "RADIUS server is not responding");
+	}
+	*failed = remove_pending(this,
+						pending->request->get_identifier(pending->request));
+	return FALSE;
+}
+
+/**
+ * Retransmit an asynchronous request, or fail it after the last timeout
+ */
+static job_requeue_t retransmit(retransmit_t *data)
+{
+	private_radius_socket_t *this = data->this;
+	linked_list_t *failed = NULL;
+	pending_t *pending;
+
+	this->mutex->lock(this->mutex);
+	pending = this->pending[data->identifier];
+	if (!pending || pending->seq != data->seq)
+	{	/* completed in the meantime */
+		this->mutex->unlock(this->mutex);
+		return JOB_REQUEUE_NONE;
+	}
+	if (resend(this, pending, &failed))
+	{
+		schedule_retransmit(this, pending);
+		this->mutex->unlock(this->mutex);
+		return JOB_REQUEUE_NONE;
+	}
+	this->mutex->unlock(this->mutex);
+
+	complete(pending, NULL);
+	complete_failed(failed);
+	return JOB_REQUEUE_NONE;
+}
+
+/**
+ * Update the smoothed round-trip time, mutex must be held
+ */
+static void update_rtt(private_radius_socket_t *this, pending_t *pending)
+{
+	timeval_t now;
+	u_int rtt;
+
+	if (pending->retransmitted)
+	{	/* ambiguous, can't tell which transmission got answered */
+		return;
+	}
+	time_monotonic(&now);
+	rtt = (now.tv_sec - pending->sent.tv_sec) * 1000 +
+		  (now.tv_usec - pending->sent.tv_usec) / 1000;
+	/* exponentially weighted moving average, as in RFC 6298 */
+	this->rtt = this->rtt ? (7 * this->rtt + rtt) / 8 : max(rtt, 1);
+}
+
+/**
+ * Process a message received on a file descriptor
+ */
+static void process_response(private_radius_socket_t *this, int fd)
+{
+	radius_message_t *response;
+	pending_t *pending = NULL;
+	linked_list_t *failed = NULL;
+	char buf[4096];
+	int res;
+
+	res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (res <= 0)
+	{
+		if (errno != EAGAIN && errno != EINTR)
+		{
+			DBG1(DBG_CFG, "receiving RADIUS message failed: %s",
+				 strerror(errno));
+		}
+		return;
+	}
+	response = radius_message_parse(chunk_create(buf, res));
+	if (response)
+	{
+		this->mutex->lock(this->mutex);
+		pending = this->pending[response->get_identifier(response)];
+		if (pending && get_fd(this, pending->request) == fd &&
+			response->verify(response,
+					pending->request->get_authenticator(pending->request),
+					this->secret, this->hasher, this->signer))
+		{
+			update_rtt(this, pending);
+			failed = remove_pending(this, response->get_identifier(response));
+		}
+		else
+		{
+			pending = NULL;
+		}
+		this->mutex->unlock(this->mutex);
+	}
+	if (!pending)
+	{
+		DBG1(DBG_CFG, "received invalid RADIUS message, ignored");
+		DESTROY_IF(response);
+		return;
+	}
+	complete(pending, response);
+	complete_failed(failed);
+}
+
+/**
+ * Receive responses while requests are pending
+ */
+static job_requeue_t receive(private_radius_socket_t *this)
+{
+	int fds[] = { -1, -1 }, maxfd, i, res;
+	bool oldstate;
+	fd_set set;
+	char buf[32];
+
+	FD_ZERO(&set);
+	FD_SET(this->notify[0], &set);
+	maxfd = this->notify[0];
+
+	this->mutex->lock(this->mutex);
+	if (!this->pending_count)
+	{	/* exit, the job gets restarted with the next request */
+		this->receiving = FALSE;
+		this->mutex->unlock(this->mutex);
+		return JOB_REQUEUE_NONE;
+	}
+	fds[0] = this->auth_fd;
+	fds[1] = this->acct_fd;
+	this->mutex->unlock(this->mutex);
+
+	for (i = 0; i < countof(fds); i++)
+	{
+		if (fds[i] != -1)
+		{
+			FD_SET(fds[i], &set);
+			maxfd = max(maxfd, fds[i]);
+		}
+	}
+
+	oldstate = thread_cancelability(TRUE);
+	res = select(maxfd + 1, &set, NULL, NULL, NULL);
+	thread_cancelability(oldstate);
+	if (res < 0)
+	{
+		if (errno != EINTR)
+		{
+			DBG1(DBG_CFG, "waiting for RADIUS message failed: %s",
+				 strerror(errno));
+			sleep(1);
+		}
+		return JOB_REQUEUE_DIRECT;
+	}
+	if (FD_ISSET(this->notify[0], &set))
+	{
+		ignore_result(read(this->notify[0], buf, sizeof(buf)));
+	}
+	for (i = 0; i < countof(fds); i++)
+	{
+		if (fds[i] != -1 && FD_ISSET(fds[i], &set))
+		{
+			process_response(this, fds[i]);
+		}
+	}
+	return JOB_REQUEUE_DIRECT;
+}
+
+/**
+ * Queue a request for sending, returns FALSE if sending it failed
+ */
+static bool queue_pending(private_radius_socket_t *this, pending_t *pending)
+{
+	bool success = TRUE;
+
+	this->mutex->lock(this->mutex);
+	if (this->pending_count >= RADIUS_SOCKET_MAX_PENDING)
+	{
+		DBG2(DBG_CFG, "all RADIUS identifiers in use, queueing request");
+		this->backlog->insert_last(this->backlog, pending);
+	}
+	else
+	{
+		success = send_pending(this, pending);
+	}
+	this->mutex->unlock(this->mutex);
+	return success;
+}
+
+METHOD(radius_socket_t, request_async, bool,
+	private_radius_socket_t *this, radius_message_t *request,
+	radius_socket_cb_t cb, void *data)
+{
+	pending_t *pending;
+
+	INIT(pending,
+		.request = request,
+		.owned = TRUE,
+		.cb = cb,
+		.data = data,
+	);
+	if (!queue_pending(this, pending))
+	{
+		pending_destroy(pending);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * State of a synchronous request
+ */
+typedef struct {
+
+	/**
+	 * Pipe to notify the waiting thread about completion
+	 */
+	int notify[2];
+
+	/**
+	 * Received response, if any
+	 */
+	radius_message_t *response;
+} sync_request_t;
+
+/**
+ * Completion callback for synchronous requests, might get invoked by the
+ * waiting thread itself or by another thread receiving on this socket
+ */
+static void sync_cb(sync_request_t *sync, radius_message_t *request,
+					radius_message_t *response)
+{
+	char c = 0;
+
+	sync->response = response;
+	/* the waiting thread returns once notified, don't touch sync afterwards */
+	ignore_result(write(sync->notify[1], &c, 1));
+}
+
+/**
+ * Check if the next retransmission of a synchronous request is due, and
+ * get the file descriptor and time to wait for its response.
+ * Returns FALSE if the request timed out and got completed.
+ */
+static bool sync_check(private_radius_socket_t *this, pending_t *pending,
+					   int *fd, struct timeval *tv)
+{
+	linked_list_t *failed = NULL;
+	timeval_t now;
+
+	/* if not sent yet, check again later */
+	*fd = -1;
+	tv->tv_sec = 1;
+	tv->tv_usec = 0;
+
+	this->mutex->lock(this->mutex);
+	if (this->pending[pending->request->get_identifier(pending->request)] !=
+																	pending)
+	{
+		this->mutex->unlock(this->mutex);
+		return TRUE;
+	}
+	time_monotonic(&now);
+	if (!timercmp(&now, &pending->next, <))
+	{
+		if (!resend(this, pending, &failed))
+		{
+			this->mutex->unlock(this->mutex);
+			complete(pending, NULL);
+			complete_failed(failed);
+			return FALSE;
+		}
+		time_monotonic(&now);
+	}
+	timersub(&pending->next, &now, tv);
+	*fd = get_fd(this, pending->request);
+	this->mutex->unlock(this->mutex);
+	return TRUE;
+}
+
+METHOD(radius_socket_t, request, radius_message_t*,
+	private_radius_socket_t *this, radius_message_t *request)
+{
+	sync_request_t sync = {};
+	pending_t *pending;
+	struct timeval tv;
+	fd_set set;
+	int fd, res;
+	char c;
+
+	if (pipe(sync.notify) != 0)
+	{
+		DBG1(DBG_CFG, "creating RADIUS notification pipe failed: %s",
+			 strerror(errno));
+		return NULL;
+	}
+	INIT(pending,
+		.request = request,
+		.cb = (void*)sync_cb,
+		.data = &sync,
+		.sync = TRUE,
+	);
+	if (queue_pending(this, pending))
+	{
+		/* we receive and retransmit ourselves, as the jobs doing that for
+		 * asynchronous requests might not get a worker thread */
 		while (TRUE)
 		{
-			FD_ZERO(&fds);
-			FD_SET(*fd, &fds);
-			res = select((*fd) + 1, &fds, NULL, NULL, &tv);
-			/* TODO: updated tv to time not waited. Linux does this for us. */
-			if (res < 0)
-			{	/* failed */
-				DBG1(DBG_CFG, "waiting for RADIUS message failed: %s",
-					 strerror(errno));
-				break;
+			if (!sync_check(this, pending, &fd, &tv))
+			{	/* completed, we get notified */
+				fd = -1;
+				tv.tv_sec = 1;
+				tv.tv_usec = 0;
 			}
-			if (res == 0)
-			{	/* timeout */
-				DBG1(DBG_CFG, "retransmitting RADIUS message");
-				retransmit = TRUE;
-				break;
-			}
-			res = recv(*fd, buf, sizeof(buf), MSG_DONTWAIT);
-			if (res <= 0)
+			FD_ZERO(&set);
+			FD_SET(sync.notify[0], &set);
+			if (fd != -1)
 			{
-				DBG1(DBG_CFG, "receiving RADIUS message failed: %s",
-					 strerror(errno));
-				break;
+				FD_SET(fd, &set);
 			}
-			response = radius_message_parse(chunk_create(buf, res));
-			if (response)
+			res = select(max(fd, sync.notify[0]) + 1, &set, NULL, NULL, &tv);
+			if (res < 0)
 			{
-				if (response->verify(response,
-							request->get_authenticator(request), this->secret,
-							this->hasher, this->signer))
+				if (errno != EINTR)
 				{
-					return response;
+					DBG1(DBG_CFG, "waiting for RADIUS message failed: %s",
+						 strerror(errno));
+					sleep(1);
 				}
-				response->destroy(response);
+				continue;
+			}
+			if (FD_ISSET(sync.notify[0], &set))
+			{
+				ignore_result(read(sync.notify[0], &c, 1));
+				break;
+			}
+			if (fd != -1 && FD_ISSET(fd, &set))
+			{
+				process_response(this, fd);
 			}
-			DBG1(DBG_CFG, "received invalid RADIUS message, ignored");
-		}
-		if (!retransmit)
-		{
-			break;
 		}
 	}
-	DBG1(DBG_CFG, "RADIUS server is not responding");
-	return NULL;
+	free(pending);
+	close(sync.notify[0]);
+	close(sync.notify[1]);
+	return sync.response;
+}
+
+METHOD(radius_socket_t, get_pending, u_int,
+	private_radius_socket_t *this)
+{
+	u_int count;
+
+	this->mutex->lock(this->mutex);
+	count = this->pending_count + this->backlog->get_count(this->backlog);
+	this->mutex->unlock(this->mutex);
+	return count;
 }
 
 /**
@@ -283,6 +949,17 @@ static chunk_t decrypt_mppe_key(private_radius_socket_t *this, u_int16_t salt,
 	return chunk_clone(chunk_create(P.ptr + 1, *P.ptr));
 }
 
+METHOD(radius_socket_t, get_rtt, u_int,
+	private_radius_socket_t *this)
+{
+	u_int rtt;
+
+	this->mutex->lock(this->mutex);
+	rtt = this->rtt;
+	this->mutex->unlock(this->mutex);
+	return rtt;
+}
+
 METHOD(radius_socket_t, decrypt_msk, chunk_t,
 	private_radius_socket_t *this, radius_message_t *request,
 	radius_message_t *response)
@@ -292,6 +969,8 @@ METHOD(radius_socket_t, decrypt_msk, chunk_t,
 	chunk_t data, send = chunk_empty, recv = chunk_empty;
 	int type;
 
+	/* the hasher is shared with the receiver */
+	this->mutex->lock(this->mutex);
 	enumerator = response->create_enumerator(response);
 	while (enumerator->enumerate(enumerator, &type, &data))
 	{
@@ -314,6 +993,7 @@ METHOD(radius_socket_t, decrypt_msk, chunk_t,
 		}
 	}
 	enumerator->destroy(enumerator);
+	this->mutex->unlock(this->mutex);
 	if (send.ptr && recv.ptr)
 	{
 		return chunk_cat("mm", recv, send);
@@ -326,18 +1006,7 @@ METHOD(radius_socket_t, decrypt_msk, chunk_t,
 METHOD(radius_socket_t, destroy, void,
 	private_radius_socket_t *this)
 {
-	DESTROY_IF(this->hasher);
-	DESTROY_IF(this->signer);
-	DESTROY_IF(this->rng);
-	if (this->auth_fd != -1)
-	{
-		close(this->auth_fd);
-	};
-	if (this->acct_fd != -1)
-	{
-		close(this->acct_fd);
-	}
-	free(this);
+	release(this);
 }
 
 /**
@@ -351,6 +1020,9 @@ radius_socket_t *radius_socket_create(char *address, u_int16_t auth_port,
 	INIT(this,
 		.public = {
 			.request = _request,
+			.request_async = _request_async,
+			.get_pending = _get_pending,
+			.get_rtt = _get_rtt,
 			.decrypt_msk = _decrypt_msk,
 			.destroy = _destroy,
 		},
@@ -362,8 +1034,21 @@ radius_socket_t *radius_socket_create(char *address, u_int16_t auth_port,
 		.hasher = lib->crypto->create_hasher(lib->crypto, HASH_MD5),
 		.signer = lib->crypto->create_signer(lib->crypto, AUTH_HMAC_MD5_128),
 		.rng = lib->crypto->create_rng(lib->crypto, RNG_WEAK),
+		.backlog = linked_list_create(),
+		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
+		.notify = { -1, -1 },
+		.ref = 1,
 	);
 
+	if (pipe(this->notify) != 0)
+	{
+		DBG1(DBG_CFG, "creating RADIUS notification pipe failed: %s",
+			 strerror(errno));
+		this->notify[0] = this->notify[1] = -1;
+		destroy(this);
+		return NULL;
+	}
+
 	if (!this->hasher || !this->signer || !this->rng ||
 		!this->signer->set_key(this->signer, secret))
 	{
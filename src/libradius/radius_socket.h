@@ -27,8 +27,33 @@ typedef struct radius_socket_t radius_socket_t;
 
 #include <networking/host.h>
 
+/**
+ * Maximum number of outstanding requests on a socket, one per identifier
+ */
+#define RADIUS_SOCKET_MAX_PENDING 256
+
+/**
+ * Callback function invoked when an asynchronous RADIUS request completes.
+ *
+ * The callback is invoked without any locks held, from the thread receiving
+ * the response or handling the retransmission timeout. It is never invoked
+ * if request_async() returns FALSE.
+ *
+ * @param data			user data passed to request_async()
+ * @param request		request message sent to the server
+ * @param response		verified response, gets owned; NULL on timeout
+ */
+typedef void (*radius_socket_cb_t)(void *data, radius_message_t *request,
+								   radius_message_t *response);
+
 /**
  * RADIUS socket to a server.
+ *
+ * A socket multiplexes concurrent requests using the RADIUS identifier. While
+ * asynchronous requests are pending, a receiver job blocks in select() on the
+ * sockets and dispatches responses to the matching request, occupying one
+ * worker thread per server socket. Retransmissions are driven by the
+ * scheduler.
  */
 struct radius_socket_t {
 
@@ -41,12 +66,46 @@ struct radius_socket_t {
 	 * The received response gets verified using the Response-Identifier
 	 * and the Message-Authenticator attribute.
 	 *
+	 * Only the calling thread blocks, other requests may be sent over the
+	 * same socket concurrently. The calling thread receives and retransmits
+	 * itself and returns after the last retransmission timed out.
+	 *
 	 * @param request		request message
 	 * @return				response message, NULL if timed out
 	 */
 	radius_message_t* (*request)(radius_socket_t *this,
 								 radius_message_t *request);
 
+	/**
+	 * Send a RADIUS request, invoke a callback when the response arrives.
+	 *
+	 * Same as request(), but returns immediately. If all identifiers are in
+	 * use, the request gets queued until one is released.
+	 *
+	 * @param request		request message, gets owned
+	 * @param cb			callback to invoke with the response
+	 * @param data			user data to pass to callback
+	 * @return				TRUE if request queued, FALSE if sending failed
+	 */
+	bool (*request_async)(radius_socket_t *this, radius_message_t *request,
+						  radius_socket_cb_t cb, void *data);
+
+	/**
+	 * Get the number of requests currently pending on this socket.
+	 *
+	 * @return				number of requests sent or queued
+	 */
+	u_int (*get_pending)(radius_socket_t *this);
+
+	/**
+	 * Get the smoothed round-trip time of requests on this socket.
+	 *
+	 * Responses to retransmitted requests are not considered.
+	 *
+	 * @return				round-trip time in ms, 0 if not yet known
+	 */
+	u_int (*get_rtt)(radius_socket_t *this);
+
 	/**
 	 * Decrypt the MSK encoded in a messages MS-MPPE-Send/Recv-Key.
 	 *
@@ -59,6 +118,9 @@ struct radius_socket_t {
 
 	/**
 	 * Destroy a radius_socket_t.
+	 *
+	 * Pending requests complete normally, the socket gets closed after
+	 * the last one completed.
 	 */
 	void (*destroy)(radius_socket_t *this);
 };
@@ -22,7 +22,8 @@ credentials/ietf_attributes/ietf_attributes.c credentials/credential_manager.c \
 credentials/sets/auth_cfg_wrapper.c credentials/sets/ocsp_response_wrapper.c \
 credentials/sets/cert_cache.c credentials/sets/mem_cred.c \
 credentials/sets/callback_cred.c credentials/auth_cfg.c database/database.c \
-database/database_factory.c fetcher/fetcher.c fetcher/fetcher_manager.c eap/eap.c \
+database/database_factory.c fetcher/fetcher.c fetcher/fetcher_manager.c \
+fetcher/revocation_cache.c fetcher/revocation_fetcher.c eap/eap.c \
 ipsec/ipsec_types.c \
 networking/host.c networking/host_resolver.c networking/packet.c \
 networking/tun_device.c \
@@ -33,7 +34,7 @@ selectors/traffic_selector.c threading/thread.c threading/thread_value.c \
 threading/mutex.c threading/semaphore.c threading/rwlock.c threading/spinlock.c \
 utils/utils.c utils/chunk.c utils/debug.c utils/enum.c utils/identification.c \
 utils/lexparser.c utils/optionsfrom.c utils/capabilities.c utils/backtrace.c \
-utils/printf_hook.c utils/settings.c
+utils/printf_hook.c utils/settings.c utils/cpu_feature.c
 
 # adding the plugin source files
 
@@ -95,6 +95,17 @@ struct crl_t {
 	 * @return			enumerator over revoked certificates.
 	 */
 	enumerator_t* (*create_enumerator)(crl_t *this);
+
+	/**
+	 * Check if a certificate is listed as revoked.
+	 *
+	 * @param serial	serial of the certificate to look up
+	 * @param date		receives the revocation date, or NULL
+	 * @param reason	receives the revocation reason, or NULL
+	 * @return			TRUE if certificate is listed
+	 */
+	bool (*is_revoked)(crl_t *this, chunk_t serial, time_t *date,
+					   crl_reason_t *reason);
 };
 
 /**
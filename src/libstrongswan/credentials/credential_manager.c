@@ -1224,6 +1224,17 @@ METHOD(credential_manager_t, flush_cache, void,
 	}
 }
 
+METHOD(credential_manager_t, get_cache_stats, bool,
+	private_credential_manager_t *this, cert_cache_stats_t *stats)
+{
+	if (this->cache)
+	{
+		this->cache->get_stats(this->cache, stats);
+		return TRUE;
+	}
+	return FALSE;
+}
+
 METHOD(credential_manager_t, add_set, void,
 	private_credential_manager_t *this, credential_set_t *set)
 {
@@ -1293,6 +1304,7 @@ credential_manager_t *credential_manager_create()
 			.create_trusted_enumerator = _create_trusted_enumerator,
 			.create_public_enumerator = _create_public_enumerator,
 			.flush_cache = _flush_cache,
+			.get_cache_stats = _get_cache_stats,
 			.cache_cert = _cache_cert,
 			.issued_by = _issued_by,
 			.add_set = _add_set,
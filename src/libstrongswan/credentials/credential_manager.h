@@ -22,6 +22,7 @@
 #define CREDENTIAL_MANAGER_H_
 
 typedef struct credential_manager_t credential_manager_t;
+typedef struct cert_cache_stats_t cert_cache_stats_t;
 
 #include <utils/identification.h>
 #include <collections/enumerator.h>
@@ -32,6 +33,37 @@ typedef struct credential_manager_t credential_manager_t;
 #include <credentials/certificates/certificate.h>
 #include <credentials/cert_validator.h>
 
+/**
+ * Statistics of the certificate relation cache, see get_cache_stats().
+ */
+struct cert_cache_stats_t {
+
+	/**
+	 * Number of cached relations
+	 */
+	u_int count;
+
+	/**
+	 * Maximum number of cached relations
+	 */
+	u_int capacity;
+
+	/**
+	 * Number of issued_by() calls answered from the cache
+	 */
+	u_int hits;
+
+	/**
+	 * Number of issued_by() calls that required signature verification
+	 */
+	u_int misses;
+
+	/**
+	 * Number of relations replaced to make room for others
+	 */
+	u_int evictions;
+};
+
 /**
  * Manages credentials using credential_sets.
  *
@@ -196,6 +228,15 @@ struct credential_manager_t {
 	 */
 	void (*flush_cache)(credential_manager_t *this, certificate_type_t type);
 
+	/**
+	 * Get statistics of the managers local certificate relation cache.
+	 *
+	 * @param stats		receives cache statistics
+	 * @return			TRUE if stats returned, FALSE if cache disabled
+	 */
+	bool (*get_cache_stats)(credential_manager_t *this,
+							cert_cache_stats_t *stats);
+
 	/**
 	 * Check if a given subject certificate is issued by an issuer certificate.
 	 *
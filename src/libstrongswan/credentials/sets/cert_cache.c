@@ -1,4 +1,5 @@
 /*
+ * Copyright (C) 2013 revosec AG
  * Copyright (C) 2008 Martin Willi
  * Hochschule fuer Technik Rapperswil
  *
@@ -15,21 +16,22 @@
 
 #include "cert_cache.h"
 
-#include <time.h>
-#include <sched.h>
-
 #include <library.h>
 #include <threading/rwlock.h>
-#include <collections/linked_list.h>
+#include <collections/hashtable.h>
+#include <credentials/certificates/x509.h>
+#include <credentials/certificates/crl.h>
+#include <credentials/certificates/ac.h>
 
-/** cache size, a power of 2 for fast modulo */
-#define CACHE_SIZE 32
+/** default number of cached relations */
+#define CACHE_SIZE_DEFAULT 1024
 
-/** attempts to acquire a cache lock */
-#define REPLACE_TRIES 5
+/** number of segments, a power of 2 */
+#define SEGMENTS 16
 
 typedef struct private_cert_cache_t private_cert_cache_t;
 typedef struct relation_t relation_t;
+typedef struct segment_t segment_t;
 
 /**
  * A trusted relation between subject and issuer
@@ -52,12 +54,63 @@ struct relation_t {
 	signature_scheme_t scheme;
 
 	/**
-	 * Cache hits
+	 * Hash over the fingerprints of subject and issuer
+	 */
+	u_int hash;
+
+	/**
+	 * Time the relation has been verified
+	 */
+	time_t created;
+
+	/**
+	 * Set on cache hits, cleared by the CLOCK hand
+	 */
+	bool referenced;
+};
+
+/**
+ * A segment of the cache, with its own lock and CLOCK replacement
+ */
+struct segment_t {
+
+	/**
+	 * Cached relations, relation_t => relation_t
+	 */
+	hashtable_t *table;
+
+	/**
+	 * Slots for CLOCK replacement, the first "count" are in use
+	 */
+	relation_t **slots;
+
+	/**
+	 * Number of used slots
 	 */
-	u_int hits;
+	u_int count;
 
 	/**
-	 * Lock for this relation
+	 * Current position of the CLOCK hand
+	 */
+	u_int hand;
+
+	/**
+	 * Cache hits, updated without locking
+	 */
+	refcount_t hits;
+
+	/**
+	 * Cache misses, updated without locking
+	 */
+	refcount_t misses;
+
+	/**
+	 * Relations replaced to make room for others
+	 */
+	u_int evictions;
+
+	/**
+	 * Lock for this segment
 	 */
 	rwlock_t *lock;
 };
@@ -73,115 +126,246 @@ struct private_cert_cache_t {
 	cert_cache_t public;
 
 	/**
-	 * array of trusted subject-issuer relations
+	 * segments of the cache
+	 */
+	segment_t segments[SEGMENTS];
+
+	/**
+	 * maximum number of relations per segment
 	 */
-	relation_t relations[CACHE_SIZE];
+	u_int capacity;
+
+	/**
+	 * lifetime of cached relations in seconds, 0 for no limit
+	 */
+	u_int32_t ttl;
 };
 
 /**
- * Cache relation in a free slot/replace an other
+ * Hash function for relations
  */
-static void cache(private_cert_cache_t *this,
-				  certificate_t *subject, certificate_t *issuer,
-				  signature_scheme_t scheme)
+static u_int relation_hash(relation_t *rel)
 {
-	relation_t *rel;
-	int i, offset, try;
-	u_int total_hits = 0;
+	return rel->hash;
+}
+
+/**
+ * Equality function for relations
+ */
+static bool relation_equals(relation_t *a, relation_t *b)
+{
+	return a->hash == b->hash &&
+		   a->subject->equals(a->subject, b->subject) &&
+		   a->issuer->equals(a->issuer, b->issuer);
+}
+
+/**
+ * Destroy a cached relation
+ */
+static void relation_destroy(relation_t *rel)
+{
+	rel->subject->destroy(rel->subject);
+	rel->issuer->destroy(rel->issuer);
+	free(rel);
+}
+
+/**
+ * Hash a certificate into hash. X.509 certificates, CRLs and attribute
+ * certificates are hashed over their serial and key identifier, which are
+ * available without allocation. Other certificates are hashed over their
+ * encoding. Returns FALSE if no encoding is available.
+ */
+static bool hash_cert(certificate_t *cert, u_int *hash)
+{
+	chunk_t encoding;
 
-	/* check for a unused relation slot first */
-	for (i = 0; i < CACHE_SIZE; i++)
+	switch (cert->get_type(cert))
 	{
-		rel = &this->relations[i];
+		case CERT_X509:
+		{
+			x509_t *x509 = (x509_t*)cert;
 
-		if (!rel->subject && rel->lock->try_write_lock(rel->lock))
+			*hash = chunk_hash_inc(x509->get_subjectKeyIdentifier(x509),
+							chunk_hash_inc(x509->get_serial(x509), *hash));
+			return TRUE;
+		}
+		case CERT_X509_CRL:
 		{
-			/* double-check having lock */
-			if (!rel->subject)
+			crl_t *crl = (crl_t*)cert;
+
+			*hash = chunk_hash_inc(crl->get_authKeyIdentifier(crl),
+							chunk_hash_inc(crl->get_serial(crl), *hash));
+			return TRUE;
+		}
+		case CERT_X509_AC:
+		{
+			ac_t *ac = (ac_t*)cert;
+
+			*hash = chunk_hash_inc(ac->get_authKeyIdentifier(ac),
+							chunk_hash_inc(ac->get_serial(ac), *hash));
+			return TRUE;
+		}
+		default:
+			if (!cert->get_encoding(cert, CERT_ASN1_DER, &encoding))
 			{
-				rel->subject = subject->get_ref(subject);
-				rel->issuer = issuer->get_ref(issuer);
-				rel->scheme = scheme;
-				return rel->lock->unlock(rel->lock);
+				return FALSE;
 			}
-			rel->lock->unlock(rel->lock);
-		}
-		total_hits += rel->hits;
+			*hash = chunk_hash_inc(encoding, *hash);
+			free(encoding.ptr);
+			return TRUE;
 	}
-	/* run several attempts to replace a random slot, never block. */
-	for (try = 0; try < REPLACE_TRIES; try++)
+}
+
+/**
+ * Build the hash over the fingerprints of subject and issuer. Returns FALSE
+ * if a certificate can't be hashed.
+ */
+static bool build_hash(certificate_t *subject, certificate_t *issuer,
+					   u_int *hash)
+{
+	*hash = 0;
+	return hash_cert(subject, hash) && hash_cert(issuer, hash);
+}
+
+/**
+ * Check if a relation has exceeded its lifetime
+ */
+static bool is_expired(private_cert_cache_t *this, relation_t *rel, time_t now)
+{
+	return this->ttl && rel->created + this->ttl < now;
+}
+
+/**
+ * Remove the relation in the given slot, segment must be write locked
+ */
+static void remove_slot(segment_t *segment, u_int slot)
+{
+	relation_t *rel;
+
+	rel = segment->slots[slot];
+	segment->table->remove(segment->table, rel);
+	segment->slots[slot] = segment->slots[--segment->count];
+	relation_destroy(rel);
+}
+
+/**
+ * Find a slot for a new relation, evicting a relation if the segment is full.
+ * An expired relation is evicted first, if any. Otherwise, the CLOCK hand
+ * evicts the first relation not referenced since its last pass. Segment must
+ * be write locked.
+ */
+static u_int get_slot(private_cert_cache_t *this, segment_t *segment,
+					  time_t now)
+{
+	relation_t *rel;
+	u_int slot;
+
+	if (this->ttl && segment->count >= this->capacity)
 	{
-		/* replace a random relation */
-		offset = random();
-		for (i = 0; i < CACHE_SIZE; i++)
+		for (slot = 0; slot < segment->count; slot++)
 		{
-			rel = &this->relations[(i + offset) % CACHE_SIZE];
-
-			if (rel->hits > total_hits / CACHE_SIZE)
-			{	/* skip often used slots */
-				continue;
-			}
-			if (rel->lock->try_write_lock(rel->lock))
+			if (is_expired(this, segment->slots[slot], now))
 			{
-				if (rel->subject)
-				{
-					rel->subject->destroy(rel->subject);
-					rel->issuer->destroy(rel->issuer);
-				}
-				rel->subject = subject->get_ref(subject);
-				rel->issuer = issuer->get_ref(issuer);
-				rel->scheme = scheme;
-				rel->hits = 0;
-				return rel->lock->unlock(rel->lock);
+				remove_slot(segment, slot);
+				segment->evictions++;
+				break;
 			}
 		}
-		/* give other threads a chance to release locks */
-		sched_yield();
 	}
+	while (segment->count >= this->capacity)
+	{
+		slot = segment->hand++ % segment->count;
+		rel = segment->slots[slot];
+		if (rel->referenced && !is_expired(this, rel, now))
+		{
+			rel->referenced = FALSE;
+			continue;
+		}
+		remove_slot(segment, slot);
+		segment->evictions++;
+	}
+	return segment->count++;
+}
+
+/**
+ * Cache a verified relation, never blocks
+ */
+static void cache(private_cert_cache_t *this, segment_t *segment,
+				  relation_t *key, signature_scheme_t scheme)
+{
+	relation_t *rel;
+	time_t now;
+
+	/* we might be called while enumerating, so don't block */
+	if (!segment->lock->try_write_lock(segment->lock))
+	{
+		return;
+	}
+	now = time_monotonic(NULL);
+	rel = segment->table->get(segment->table, key);
+	if (rel)
+	{	/* replace an expired relation, or one cached concurrently */
+		rel->scheme = scheme;
+		rel->created = now;
+		rel->referenced = FALSE;
+	}
+	else
+	{
+		INIT(rel,
+			.subject = key->subject->get_ref(key->subject),
+			.issuer = key->issuer->get_ref(key->issuer),
+			.scheme = scheme,
+			.hash = key->hash,
+			.created = now,
+		);
+		segment->slots[get_slot(this, segment, now)] = rel;
+		segment->table->put(segment->table, rel, rel);
+	}
+	segment->lock->unlock(segment->lock);
 }
 
 METHOD(cert_cache_t, issued_by, bool,
 	private_cert_cache_t *this, certificate_t *subject, certificate_t *issuer,
 	signature_scheme_t *schemep)
 {
-	relation_t *found = NULL, *current;
+	relation_t *found, key = {
+		.subject = subject,
+		.issuer = issuer,
+	};
+	segment_t *segment;
 	signature_scheme_t scheme;
-	int i;
+	bool hit = FALSE;
 
-	for (i = 0; i < CACHE_SIZE; i++)
+	if (!build_hash(subject, issuer, &key.hash))
 	{
-		current = &this->relations[i];
+		return subject->issued_by(subject, issuer, schemep);
+	}
+	segment = &this->segments[key.hash & (SEGMENTS - 1)];
 
-		current->lock->read_lock(current->lock);
-		if (current->subject)
-		{
-			/* check for equal issuer */
-			if (issuer->equals(issuer, current->issuer))
-			{
-				/* reuse issuer instance in cache() */
-				issuer = current->issuer;
-				if (subject->equals(subject, current->subject))
-				{
-					/* write hit counter is not locked, but not critical */
-					current->hits++;
-					found = current;;
-					if (schemep)
-					{
-						*schemep = current->scheme;
-					}
-				}
-			}
-		}
-		current->lock->unlock(current->lock);
-		if (found)
+	segment->lock->read_lock(segment->lock);
+	found = segment->table->get(segment->table, &key);
+	if (found && !is_expired(this, found, time_monotonic(NULL)))
+	{
+		/* flag is not locked, but not critical */
+		found->referenced = TRUE;
+		if (schemep)
 		{
-			return TRUE;
+			*schemep = found->scheme;
 		}
+		hit = TRUE;
+	}
+	segment->lock->unlock(segment->lock);
+	if (hit)
+	{
+		ref_get(&segment->hits);
+		return TRUE;
 	}
+	ref_get(&segment->misses);
+
 	/* no cache hit, check and cache signature */
 	if (subject->issued_by(subject, issuer, &scheme))
 	{
-		cache(this, subject, issuer, scheme);
+		cache(this, segment, &key, scheme);
 		if (schemep)
 		{
 			*schemep = scheme;
@@ -204,11 +388,13 @@ typedef struct {
 	/** ID to get a cert for */
 	identification_t *id;
 	/** cache */
-	relation_t *relations;
-	/** current position in array cache */
+	private_cert_cache_t *cache;
+	/** current segment */
+	int segment;
+	/** current slot in segment */
 	int index;
-	/** currently locked relation */
-	int locked;
+	/** TRUE if current segment is locked */
+	bool locked;
 } cert_enumerator_t;
 
 /**
@@ -217,22 +403,21 @@ typedef struct {
 static bool cert_enumerate(cert_enumerator_t *this, certificate_t **out)
 {
 	public_key_t *public;
+	segment_t *segment;
 	relation_t *rel;
 
-	if (this->locked >= 0)
+	while (this->segment < SEGMENTS)
 	{
-		rel = &this->relations[this->locked];
-		rel->lock->unlock(rel->lock);
-		this->locked = -1;
-	}
-
-	while (++this->index < CACHE_SIZE)
-	{
-		rel = &this->relations[this->index];
-		rel->lock->read_lock(rel->lock);
-		this->locked = this->index;
-		if (rel->subject)
+		segment = &this->cache->segments[this->segment];
+		if (!this->locked)
+		{
+			segment->lock->read_lock(segment->lock);
+			this->locked = TRUE;
+		}
+		while (++this->index < segment->count)
 		{
+			rel = segment->slots[this->index];
+
 			/* CRL lookup is done using issuer/authkeyidentifier */
 			if (this->key == KEY_ANY && this->id &&
 				(this->cert == CERT_ANY || this->cert == CERT_X509_CRL) &&
@@ -264,8 +449,10 @@ static bool cert_enumerate(cert_enumerator_t *this, certificate_t **out)
 				}
 			}
 		}
-		this->locked = -1;
-		rel->lock->unlock(rel->lock);
+		segment->lock->unlock(segment->lock);
+		this->locked = FALSE;
+		this->segment++;
+		this->index = -1;
 	}
 	return FALSE;
 }
@@ -275,12 +462,12 @@ static bool cert_enumerate(cert_enumerator_t *this, certificate_t **out)
  */
 static void cert_enumerator_destroy(cert_enumerator_t *this)
 {
-	relation_t *rel;
+	segment_t *segment;
 
-	if (this->locked >= 0)
+	if (this->locked)
 	{
-		rel = &this->relations[this->locked];
-		rel->lock->unlock(rel->lock);
+		segment = &this->cache->segments[this->segment];
+		segment->lock->unlock(segment->lock);
 	}
 	free(this);
 }
@@ -295,75 +482,80 @@ METHOD(credential_set_t, create_enumerator, enumerator_t*,
 	{
 		return NULL;
 	}
-	enumerator = malloc_thing(cert_enumerator_t);
-	enumerator->public.enumerate = (void*)cert_enumerate;
-	enumerator->public.destroy = (void*)cert_enumerator_destroy;
-	enumerator->cert = cert;
-	enumerator->key = key;
-	enumerator->id = id;
-	enumerator->relations = this->relations;
-	enumerator->index = -1;
-	enumerator->locked = -1;
-
+	INIT(enumerator,
+		.public = {
+			.enumerate = (void*)cert_enumerate,
+			.destroy = (void*)cert_enumerator_destroy,
+		},
+		.cert = cert,
+		.key = key,
+		.id = id,
+		.cache = this,
+		.index = -1,
+	);
 	return &enumerator->public;
 }
 
 METHOD(cert_cache_t, flush, void,
 	private_cert_cache_t *this, certificate_type_t type)
 {
+	segment_t *segment;
 	relation_t *rel;
-	int i;
+	int i, slot;
 
-	for (i = 0; i < CACHE_SIZE; i++)
+	for (i = 0; i < SEGMENTS; i++)
 	{
-		rel = &this->relations[i];
-		if (!rel->subject)
-		{
-			continue;
-		}
-		/* check with cheap read lock first */
-		if (type != CERT_ANY)
-		{
-			rel->lock->read_lock(rel->lock);
-			if (!rel->subject || type != rel->subject->get_type(rel->subject))
-			{
-				rel->lock->unlock(rel->lock);
-				continue;
-			}
-			rel->lock->unlock(rel->lock);
-		}
-		/* double check in write lock */
-		rel->lock->write_lock(rel->lock);
-		if (rel->subject)
+		segment = &this->segments[i];
+		segment->lock->write_lock(segment->lock);
+		for (slot = segment->count - 1; slot >= 0; slot--)
 		{
+			rel = segment->slots[slot];
 			if (type == CERT_ANY || type == rel->subject->get_type(rel->subject))
 			{
-				rel->subject->destroy(rel->subject);
-				rel->issuer->destroy(rel->issuer);
-				rel->subject = NULL;
-				rel->issuer = NULL;
-				rel->hits = 0;
+				remove_slot(segment, slot);
 			}
 		}
-		rel->lock->unlock(rel->lock);
+		segment->lock->unlock(segment->lock);
+	}
+}
+
+METHOD(cert_cache_t, get_stats, void,
+	private_cert_cache_t *this, cert_cache_stats_t *stats)
+{
+	segment_t *segment;
+	int i;
+
+	*stats = (cert_cache_stats_t){
+		.capacity = this->capacity * SEGMENTS,
+	};
+	for (i = 0; i < SEGMENTS; i++)
+	{
+		segment = &this->segments[i];
+		segment->lock->read_lock(segment->lock);
+		stats->count += segment->count;
+		stats->evictions += segment->evictions;
+		segment->lock->unlock(segment->lock);
+		stats->hits += segment->hits;
+		stats->misses += segment->misses;
 	}
 }
 
 METHOD(cert_cache_t, destroy, void,
 	private_cert_cache_t *this)
 {
-	relation_t *rel;
+	segment_t *segment;
 	int i;
 
-	for (i = 0; i < CACHE_SIZE; i++)
+	for (i = 0; i < SEGMENTS; i++)
 	{
-		rel = &this->relations[i];
-		if (rel->subject)
+		segment = &this->segments[i];
+		while (segment->count)
 		{
-			rel->subject->destroy(rel->subject);
-			rel->issuer->destroy(rel->issuer);
+			remove_slot(segment, segment->count - 1);
 		}
-		rel->lock->destroy(rel->lock);
+		segment->table->destroy(segment->table);
+		segment->lock->destroy(segment->lock);
+		free(segment->slots);
 	}
 	free(this);
 }
@@ -374,6 +566,7 @@ METHOD(cert_cache_t, destroy, void,
 cert_cache_t *cert_cache_create()
 {
 	private_cert_cache_t *this;
+	u_int size;
 	int i;
 
 	INIT(this,
@@ -387,16 +580,25 @@ cert_cache_t *cert_cache_create()
 			},
 			.issued_by = _issued_by,
 			.flush = _flush,
+			.get_stats = _get_stats,
 			.destroy = _destroy,
 		},
+		.ttl = lib->settings->get_time(lib->settings,
+									   "libstrongswan.cert_cache_ttl", 0),
 	);
 
-	for (i = 0; i < CACHE_SIZE; i++)
+	size = lib->settings->get_int(lib->settings,
+						"libstrongswan.cert_cache_size", CACHE_SIZE_DEFAULT);
+	this->capacity = max(1, (size + SEGMENTS - 1) / SEGMENTS);
+
+	for (i = 0; i < SEGMENTS; i++)
 	{
-		this->relations[i].subject = NULL;
-		this->relations[i].issuer = NULL;
-		this->relations[i].hits = 0;
-		this->relations[i].lock = rwlock_create(RWLOCK_TYPE_DEFAULT);
+		this->segments[i].table = hashtable_create(
+									(hashtable_hash_t)relation_hash,
+									(hashtable_equals_t)relation_equals,
+									this->capacity);
+		this->segments[i].slots = calloc(this->capacity, sizeof(relation_t*));
+		this->segments[i].lock = rwlock_create(RWLOCK_TYPE_DEFAULT);
 	}
 
 	return &this->public;
@@ -32,6 +32,12 @@ typedef struct cert_cache_t cert_cache_t;
  * and serves them as untrusted through the credential set interface. Further,
  * it caches valid subject-issuer relationships to speed up the issued_by
  * method.
+ *
+ * Relations are stored in a hashtable segmented by a hash over the subject and
+ * issuer encodings. The number of cached relations is limited by
+ * libstrongswan.cert_cache_size, if a segment is full, relations not used
+ * recently are replaced (CLOCK algorithm). Relations expire after
+ * libstrongswan.cert_cache_ttl, if configured.
  */
 struct cert_cache_t {
 
@@ -59,6 +65,13 @@ struct cert_cache_t {
 	 */
 	void (*flush)(cert_cache_t *this, certificate_type_t type);
 
+	/**
+	 * Get statistics about cached relations.
+	 *
+	 * @param stats			receives cache statistics
+	 */
+	void (*get_stats)(cert_cache_t *this, cert_cache_stats_t *stats);
+
 	/**
 	 * Destroy a cert_cache instance.
 	 */
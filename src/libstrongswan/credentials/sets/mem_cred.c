@@ -19,8 +19,11 @@
 
 #include <threading/rwlock.h>
 #include <collections/linked_list.h>
+#include <collections/hashtable.h>
+#include <credentials/certificates/x509.h>
 
 typedef struct private_mem_cred_t private_mem_cred_t;
+typedef struct cert_store_t cert_store_t;
 
 /**
  * Private data of an mem_cred_t object.
@@ -38,31 +41,309 @@ struct private_mem_cred_t {
 	rwlock_t *lock;
 
 	/**
-	 * List of trusted certificates, certificate_t
+	 * Trusted certificates
 	 */
-	linked_list_t *trusted;
+	cert_store_t *trusted;
 
 	/**
-	 * List of trusted and untrusted certificates, certificate_t
+	 * Trusted and untrusted certificates
 	 */
-	linked_list_t *untrusted;
+	cert_store_t *untrusted;
 
 	/**
 	 * List of private keys, private_key_t
 	 */
 	linked_list_t *keys;
 
+	/**
+	 * Private keys by their key identifiers, identification_t* => bucket_t
+	 */
+	hashtable_t *key_index;
+
 	/**
 	 * List of shared keys, as shared_entry_t
 	 */
 	linked_list_t *shared;
 
+	/**
+	 * Shared keys by owner, identification_t* => bucket_t
+	 */
+	hashtable_t *shared_index;
+
+	/**
+	 * Shared keys with wildcard owners or no owners at all, shared_entry_t
+	 */
+	linked_list_t *shared_wildcards;
+
 	/**
 	 * List of CDPs, as cdp_t
 	 */
 	linked_list_t *cdps;
 };
 
+/**
+ * Items sharing the same identity in an index
+ */
+typedef struct {
+
+	/**
+	 * Identity of the items
+	 */
+	identification_t *id;
+
+	/**
+	 * Indexed items
+	 */
+	linked_list_t *items;
+} bucket_t;
+
+/**
+ * Hash function for index keys
+ */
+static u_int id_hash(identification_t *id)
+{
+	return id->hash(id, 0);
+}
+
+/**
+ * Equality function for index keys
+ */
+static bool id_equals(identification_t *a, identification_t *b)
+{
+	return a->equals(a, b);
+}
+
+/**
+ * Create an index, identification_t* => bucket_t
+ */
+static hashtable_t *index_create()
+{
+	return hashtable_create((hashtable_hash_t)id_hash,
+							(hashtable_equals_t)id_equals, 32);
+}
+
+/**
+ * Remove all buckets from an index
+ */
+static void index_flush(hashtable_t *index)
+{
+	enumerator_t *enumerator;
+	identification_t *id;
+	bucket_t *bucket;
+
+	enumerator = index->create_enumerator(index);
+	while (enumerator->enumerate(enumerator, &id, &bucket))
+	{
+		index->remove_at(index, enumerator);
+		bucket->id->destroy(bucket->id);
+		bucket->items->destroy(bucket->items);
+		free(bucket);
+	}
+	enumerator->destroy(enumerator);
+}
+
+/**
+ * Add an item to the bucket of an identity, if not already contained.
+ * Items are added at the front, or at the end if append is set, to keep the
+ * order of buckets consistent with the list the items are stored in.
+ */
+static void index_add(hashtable_t *index, identification_t *id, void *item,
+					  bool append)
+{
+	bucket_t *bucket;
+	void *found = item;
+
+	bucket = index->get(index, id);
+	if (!bucket)
+	{
+		INIT(bucket,
+			.id = id->clone(id),
+			.items = linked_list_create(),
+		);
+		index->put(index, bucket->id, bucket);
+	}
+	if (bucket->items->find_first(bucket->items, NULL, &found) != SUCCESS)
+	{
+		if (append)
+		{
+			bucket->items->insert_last(bucket->items, item);
+		}
+		else
+		{
+			bucket->items->insert_first(bucket->items, item);
+		}
+	}
+}
+
+/**
+ * Add an item to the bucket of a key identifier
+ */
+static void index_add_keyid(hashtable_t *index, chunk_t keyid, void *item,
+							bool append)
+{
+	identification_t *id;
+
+	id = identification_create_from_encoding(ID_KEY_ID, keyid);
+	index_add(index, id, item, append);
+	id->destroy(id);
+}
+
+/**
+ * Get the items in the bucket of an identity, NULL if none
+ */
+static linked_list_t *index_get(hashtable_t *index, identification_t *id)
+{
+	bucket_t *bucket;
+
+	bucket = index->get(index, id);
+	return bucket ? bucket->items : NULL;
+}
+
+/**
+ * Inner enumerator constructor over the items in a list
+ */
+static enumerator_t *list_enum_create(linked_list_t *list, void *null)
+{
+	return list->create_enumerator(list);
+}
+
+/**
+ * Create an enumerator over the items of multiple lists, the passed list
+ * of lists gets destroyed with the enumerator
+ */
+static enumerator_t *create_lists_enumerator(linked_list_t *lists)
+{
+	return enumerator_create_nested(lists->create_enumerator(lists),
+									(void*)list_enum_create, lists,
+									(void*)lists->destroy);
+}
+
+/**
+ * Certificates, with an index over X.509 certificates
+ */
+struct cert_store_t {
+
+	/**
+	 * All certificates, certificate_t
+	 */
+	linked_list_t *certs;
+
+	/**
+	 * X.509 certificates by subject, subjectAltNames and key identifiers,
+	 * identification_t* => bucket_t
+	 */
+	hashtable_t *index;
+
+	/**
+	 * Certificates of other types, not indexed, certificate_t
+	 */
+	linked_list_t *unindexed;
+};
+
+/**
+ * Create an empty certificate store
+ */
+static cert_store_t *cert_store_create()
+{
+	cert_store_t *store;
+
+	INIT(store,
+		.certs = linked_list_create(),
+		.index = index_create(),
+		.unindexed = linked_list_create(),
+	);
+	return store;
+}
+
+/**
+ * Destroy a certificate store and the contained certificates
+ */
+static void cert_store_destroy(cert_store_t *store)
+{
+	index_flush(store->index);
+	store->index->destroy(store->index);
+	store->unindexed->destroy(store->unindexed);
+	store->certs->destroy_offset(store->certs,
+								 offsetof(certificate_t, destroy));
+	free(store);
+}
+
+/**
+ * Add an X.509 certificate to an index, by all identities
+ * certificate_t.has_subject() considers a match
+ */
+static void index_cert(hashtable_t *index, certificate_t *cert)
+{
+	x509_t *x509 = (x509_t*)cert;
+	cred_encoding_type_t type;
+	enumerator_t *enumerator;
+	identification_t *id;
+	public_key_t *public;
+	hasher_t *hasher;
+	chunk_t chunk, encoding;
+
+	index_add(index, cert->get_subject(cert), cert, FALSE);
+	enumerator = x509->create_subjectAltName_enumerator(x509);
+	while (enumerator->enumerate(enumerator, &id))
+	{
+		index_add(index, id, cert, FALSE);
+	}
+	enumerator->destroy(enumerator);
+
+	chunk = x509->get_subjectKeyIdentifier(x509);
+	if (chunk.len)
+	{
+		index_add_keyid(index, chunk, cert, FALSE);
+	}
+	chunk = x509->get_serial(x509);
+	if (chunk.len)
+	{
+		index_add_keyid(index, chunk, cert, FALSE);
+	}
+	public = cert->get_public_key(cert);
+	if (public)
+	{
+		for (type = 0; type < KEYID_MAX; type++)
+		{
+			if (public->get_fingerprint(public, type, &chunk))
+			{
+				index_add_keyid(index, chunk, cert, FALSE);
+			}
+		}
+		public->destroy(public);
+	}
+	hasher = lib->crypto->create_hasher(lib->crypto, HASH_SHA1);
+	if (hasher)
+	{
+		if (cert->get_encoding(cert, CERT_ASN1_DER, &encoding))
+		{
+			if (hasher->allocate_hash(hasher, encoding, &chunk))
+			{
+				index_add_keyid(index, chunk, cert, FALSE);
+				chunk_free(&chunk);
+			}
+			chunk_free(&encoding);
+		}
+		hasher->destroy(hasher);
+	}
+}
+
+/**
+ * Add a certificate to a store
+ */
+static void cert_store_add(cert_store_t *store, certificate_t *cert)
+{
+	store->certs->insert_first(store->certs, cert);
+	if (cert->get_type(cert) == CERT_X509)
+	{
+		index_cert(store->index, cert);
+	}
+	else
+	{
+		store->unindexed->insert_first(store->unindexed, cert);
+	}
+}
+
 /**
  * Data for the certificate enumerator
  */
@@ -126,6 +407,8 @@ METHOD(credential_set_t, create_cert_enumerator, enumerator_t*,
 {
 	cert_data_t *data;
 	enumerator_t *enumerator;
+	linked_list_t *lists, *bucket;
+	cert_store_t *store;
 
 	INIT(data,
 		.lock = this->lock,
@@ -134,13 +417,24 @@ METHOD(credential_set_t, create_cert_enumerator, enumerator_t*,
 		.id = id,
 	);
 	this->lock->read_lock(this->lock);
-	if (trusted)
+	store = trusted ? this->trusted : this->untrusted;
+	if (!id || id->get_type(id) == ID_ANY || id->contains_wildcards(id))
 	{
-		enumerator = this->trusted->create_enumerator(this->trusted);
+		enumerator = store->certs->create_enumerator(store->certs);
 	}
 	else
-	{
-		enumerator = this->untrusted->create_enumerator(this->untrusted);
+	{	/* X.509 certificates get looked up in the index, others filtered */
+		lists = linked_list_create();
+		bucket = index_get(store->index, id);
+		if (bucket && (cert == CERT_ANY || cert == CERT_X509))
+		{
+			lists->insert_last(lists, bucket);
+		}
+		if (cert != CERT_X509)
+		{
+			lists->insert_last(lists, store->unindexed);
+		}
+		enumerator = create_lists_enumerator(lists);
 	}
 	return enumerator_create_filter(enumerator, (void*)certs_filter, data,
 									(void*)cert_data_destroy);
@@ -159,10 +453,19 @@ static certificate_t *add_cert_internal(private_mem_cred_t *this, bool trusted,
 										certificate_t *cert)
 {
 	certificate_t *cached;
+	linked_list_t *list;
+
 	this->lock->write_lock(this->lock);
-	if (this->untrusted->find_first(this->untrusted,
-									(linked_list_match_t)certificate_equals,
-									(void**)&cached, cert) == SUCCESS)
+	if (cert->get_type(cert) == CERT_X509)
+	{
+		list = index_get(this->untrusted->index, cert->get_subject(cert));
+	}
+	else
+	{
+		list = this->untrusted->unindexed;
+	}
+	if (list && list->find_first(list, (linked_list_match_t)certificate_equals,
+								 (void**)&cached, cert) == SUCCESS)
 	{
 		cert->destroy(cert);
 		cert = cached->get_ref(cached);
@@ -171,9 +474,9 @@ static certificate_t *add_cert_internal(private_mem_cred_t *this, bool trusted,
 	{
 		if (trusted)
 		{
-			this->trusted->insert_first(this->trusted, cert->get_ref(cert));
+			cert_store_add(this->trusted, cert->get_ref(cert));
 		}
-		this->untrusted->insert_first(this->untrusted, cert->get_ref(cert));
+		cert_store_add(this->untrusted, cert->get_ref(cert));
 	}
 	this->lock->unlock(this->lock);
 	return cert;
@@ -200,7 +503,8 @@ METHOD(mem_cred_t, add_crl, bool,
 	bool new = TRUE;
 
 	this->lock->write_lock(this->lock);
-	enumerator = this->untrusted->create_enumerator(this->untrusted);
+	enumerator = this->untrusted->unindexed->create_enumerator(
+												this->untrusted->unindexed);
 	while (enumerator->enumerate(enumerator, (void**)&current))
 	{
 		if (current->get_type(current) == CERT_X509_CRL)
@@ -231,7 +535,11 @@ METHOD(mem_cred_t, add_crl, bool,
 				new = crl_is_newer(crl, crl_c);
 				if (new)
 				{
-					this->untrusted->remove_at(this->untrusted, enumerator);
+					this->untrusted->unindexed->remove_at(
+										this->untrusted->unindexed, enumerator);
+					this->untrusted->certs->remove(this->untrusted->certs,
+												   current, NULL);
+					current->destroy(current);
 				}
 				else
 				{
@@ -245,7 +553,7 @@ METHOD(mem_cred_t, add_crl, bool,
 
 	if (new)
 	{
-		this->untrusted->insert_first(this->untrusted, cert);
+		cert_store_add(this->untrusted, cert);
 	}
 	this->lock->unlock(this->lock);
 	return new;
@@ -293,6 +601,9 @@ METHOD(credential_set_t, create_private_enumerator, enumerator_t*,
 	private_mem_cred_t *this, key_type_t type, identification_t *id)
 {
 	key_data_t *data;
+	enumerator_t *enumerator;
+	identification_t *keyid;
+	linked_list_t *bucket;
 
 	INIT(data,
 		.lock = this->lock,
@@ -300,8 +611,52 @@ METHOD(credential_set_t, create_private_enumerator, enumerator_t*,
 		.id = id,
 	);
 	this->lock->read_lock(this->lock);
-	return enumerator_create_filter(this->keys->create_enumerator(this->keys),
-							(void*)key_filter, data, (void*)key_data_destroy);
+	if (!id)
+	{
+		enumerator = this->keys->create_enumerator(this->keys);
+	}
+	else
+	{	/* keys are matched by the encoding of id, whatever its type */
+		if (id->get_type(id) == ID_KEY_ID)
+		{
+			bucket = index_get(this->key_index, id);
+		}
+		else
+		{
+			keyid = identification_create_from_encoding(ID_KEY_ID,
+													id->get_encoding(id));
+			bucket = index_get(this->key_index, keyid);
+			keyid->destroy(keyid);
+		}
+		if (bucket)
+		{
+			enumerator = bucket->create_enumerator(bucket);
+		}
+		else
+		{
+			enumerator = enumerator_create_empty();
+		}
+	}
+	return enumerator_create_filter(enumerator, (void*)key_filter, data,
+									(void*)key_data_destroy);
+}
+
+/**
+ * Add a private key to the index, by all its key identifiers
+ */
+static void index_key(private_mem_cred_t *this, private_key_t *key,
+					  bool append)
+{
+	cred_encoding_type_t type;
+	chunk_t chunk;
+
+	for (type = 0; type < KEYID_MAX; type++)
+	{
+		if (key->get_fingerprint(key, type, &chunk))
+		{
+			index_add_keyid(this->key_index, chunk, key, append);
+		}
+	}
 }
 
 METHOD(mem_cred_t, add_key, void,
@@ -309,6 +664,7 @@ METHOD(mem_cred_t, add_key, void,
 {
 	this->lock->write_lock(this->lock);
 	this->keys->insert_first(this->keys, key);
+	index_key(this, key, FALSE);
 	this->lock->unlock(this->lock);
 }
 
@@ -341,6 +697,7 @@ typedef struct {
 	identification_t *me;
 	identification_t *other;
 	shared_key_type_t type;
+	linked_list_t *candidates;
 } shared_data_t;
 
 /**
@@ -349,6 +706,7 @@ typedef struct {
 static void shared_data_destroy(shared_data_t *data)
 {
 	data->lock->unlock(data->lock);
+	DESTROY_IF(data->candidates);
 	free(data);
 }
 
@@ -414,11 +772,49 @@ static bool shared_filter(shared_data_t *data,
 	return TRUE;
 }
 
+/**
+ * Add the entries indexed by an owner to a list of candidates, once
+ */
+static void add_candidates(private_mem_cred_t *this, linked_list_t *candidates,
+						   identification_t *owner)
+{
+	enumerator_t *enumerator;
+	shared_entry_t *entry;
+	linked_list_t *bucket;
+	void *found;
+
+	bucket = index_get(this->shared_index, owner);
+	if (bucket)
+	{
+		enumerator = bucket->create_enumerator(bucket);
+		while (enumerator->enumerate(enumerator, &entry))
+		{
+			found = entry;
+			if (candidates->find_first(candidates, NULL, &found) != SUCCESS)
+			{
+				candidates->insert_last(candidates, entry);
+			}
+		}
+		enumerator->destroy(enumerator);
+	}
+}
+
+/**
+ * Check if entries matching an identity can be looked up in the index. Other
+ * identities might match entries of different owners, so all entries are
+ * checked for them.
+ */
+static bool indexable(identification_t *id)
+{
+	return id && id->get_type(id) != ID_ANY && !id->contains_wildcards(id);
+}
+
 METHOD(credential_set_t, create_shared_enumerator, enumerator_t*,
 	private_mem_cred_t *this, shared_key_type_t type,
 	identification_t *me, identification_t *other)
 {
 	shared_data_t *data;
+	enumerator_t *enumerator;
 
 	INIT(data,
 		.lock = this->lock,
@@ -427,9 +823,62 @@ METHOD(credential_set_t, create_shared_enumerator, enumerator_t*,
 		.type = type,
 	);
 	data->lock->read_lock(data->lock);
-	return enumerator_create_filter(
-						this->shared->create_enumerator(this->shared),
-						(void*)shared_filter, data, (void*)shared_data_destroy);
+	if (!indexable(me) || !indexable(other))
+	{
+		enumerator = this->shared->create_enumerator(this->shared);
+	}
+	else
+	{	/* entries matching any of the two owners, plus the wildcard ones */
+		data->candidates = linked_list_create();
+		add_candidates(this, data->candidates, me);
+		add_candidates(this, data->candidates, other);
+		enumerator = create_lists_enumerator(linked_list_create_with_items(
+							data->candidates, this->shared_wildcards, NULL));
+	}
+	return enumerator_create_filter(enumerator, (void*)shared_filter, data,
+									(void*)shared_data_destroy);
+}
+
+/**
+ * Add a shared key entry to the index, by all its owners. Entries with
+ * wildcard owners are matched against every lookup.
+ */
+static void index_shared(private_mem_cred_t *this, shared_entry_t *entry,
+						 bool append)
+{
+	enumerator_t *enumerator;
+	identification_t *id;
+	bool wildcard = FALSE;
+
+	enumerator = entry->owners->create_enumerator(entry->owners);
+	while (enumerator->enumerate(enumerator, &id))
+	{
+		if (id->get_type(id) == ID_ANY || id->contains_wildcards(id))
+		{
+			wildcard = TRUE;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+
+	if (wildcard || entry->owners->get_count(entry->owners) == 0)
+	{
+		if (append)
+		{
+			this->shared_wildcards->insert_last(this->shared_wildcards, entry);
+		}
+		else
+		{
+			this->shared_wildcards->insert_first(this->shared_wildcards, entry);
+		}
+		return;
+	}
+	enumerator = entry->owners->create_enumerator(entry->owners);
+	while (enumerator->enumerate(enumerator, &id))
+	{
+		index_add(this->shared_index, id, entry, append);
+	}
+	enumerator->destroy(enumerator);
 }
 
 METHOD(mem_cred_t, add_shared_list, void,
@@ -444,6 +893,7 @@ METHOD(mem_cred_t, add_shared_list, void,
 
 	this->lock->write_lock(this->lock);
 	this->shared->insert_first(this->shared, entry);
+	index_shared(this, entry, FALSE);
 	this->lock->unlock(this->lock);
 }
 
@@ -557,10 +1007,14 @@ METHOD(credential_set_t, create_cdp_enumerator, enumerator_t*,
 
 static void reset_secrets(private_mem_cred_t *this)
 {
+	index_flush(this->key_index);
+	index_flush(this->shared_index);
+	this->shared_wildcards->destroy(this->shared_wildcards);
 	this->keys->destroy_offset(this->keys, offsetof(private_key_t, destroy));
 	this->shared->destroy_function(this->shared, (void*)shared_entry_destroy);
 	this->keys = linked_list_create();
 	this->shared = linked_list_create();
+	this->shared_wildcards = linked_list_create();
 }
 
 METHOD(mem_cred_t, replace_secrets, void,
@@ -581,6 +1035,7 @@ METHOD(mem_cred_t, replace_secrets, void,
 		while (enumerator->enumerate(enumerator, &key))
 		{
 			this->keys->insert_last(this->keys, key->get_ref(key));
+			index_key(this, key, TRUE);
 		}
 		enumerator->destroy(enumerator);
 		enumerator = other->shared->create_enumerator(other->shared);
@@ -592,6 +1047,7 @@ METHOD(mem_cred_t, replace_secrets, void,
 											offsetof(identification_t, clone)),
 			);
 			this->shared->insert_last(this->shared, new_entry);
+			index_shared(this, new_entry, TRUE);
 		}
 		enumerator->destroy(enumerator);
 	}
@@ -600,12 +1056,18 @@ METHOD(mem_cred_t, replace_secrets, void,
 		while (other->keys->remove_first(other->keys, (void**)&key) == SUCCESS)
 		{
 			this->keys->insert_last(this->keys, key);
+			index_key(this, key, TRUE);
 		}
 		while (other->shared->remove_first(other->shared,
 										  (void**)&entry) == SUCCESS)
 		{
 			this->shared->insert_last(this->shared, entry);
+			index_shared(this, entry, TRUE);
 		}
+		index_flush(other->key_index);
+		index_flush(other->shared_index);
+		other->shared_wildcards->destroy(other->shared_wildcards);
+		other->shared_wildcards = linked_list_create();
 	}
 	this->lock->unlock(this->lock);
 }
@@ -622,13 +1084,11 @@ METHOD(mem_cred_t, clear_, void,
 	private_mem_cred_t *this)
 {
 	this->lock->write_lock(this->lock);
-	this->trusted->destroy_offset(this->trusted,
-								  offsetof(certificate_t, destroy));
-	this->untrusted->destroy_offset(this->untrusted,
-									offsetof(certificate_t, destroy));
+	cert_store_destroy(this->trusted);
+	cert_store_destroy(this->untrusted);
 	this->cdps->destroy_function(this->cdps, (void*)cdp_destroy);
-	this->trusted = linked_list_create();
-	this->untrusted = linked_list_create();
+	this->trusted = cert_store_create();
+	this->untrusted = cert_store_create();
 	this->cdps = linked_list_create();
 	this->lock->unlock(this->lock);
 
@@ -639,10 +1099,13 @@ METHOD(mem_cred_t, destroy, void,
 	private_mem_cred_t *this)
 {
 	clear_(this);
-	this->trusted->destroy(this->trusted);
-	this->untrusted->destroy(this->untrusted);
+	cert_store_destroy(this->trusted);
+	cert_store_destroy(this->untrusted);
 	this->keys->destroy(this->keys);
+	this->key_index->destroy(this->key_index);
 	this->shared->destroy(this->shared);
+	this->shared_index->destroy(this->shared_index);
+	this->shared_wildcards->destroy(this->shared_wildcards);
 	this->cdps->destroy(this->cdps);
 	this->lock->destroy(this->lock);
 	free(this);
@@ -676,10 +1139,13 @@ mem_cred_t *mem_cred_create()
 			.clear_secrets = _clear_secrets,
 			.destroy = _destroy,
 		},
-		.trusted = linked_list_create(),
-		.untrusted = linked_list_create(),
+		.trusted = cert_store_create(),
+		.untrusted = cert_store_create(),
 		.keys = linked_list_create(),
+		.key_index = index_create(),
 		.shared = linked_list_create(),
+		.shared_index = index_create(),
+		.shared_wildcards = linked_list_create(),
 		.cdps = linked_list_create(),
 		.lock = rwlock_create(RWLOCK_TYPE_DEFAULT),
 	);
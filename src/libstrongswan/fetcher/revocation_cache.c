@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "revocation_cache.h"
+
+#include <time.h>
+
+#include <collections/hashtable.h>
+#include <collections/linked_list.h>
+#include <threading/mutex.h>
+
+/**
+ * Minimum number of cached entries before stale entries get purged
+ */
+#define PURGE_MIN 64
+
+typedef struct private_revocation_cache_t private_revocation_cache_t;
+
+/**
+ * Private data of an revocation_cache_t object.
+ */
+struct private_revocation_cache_t {
+
+	/**
+	 * Public revocation_cache_t interface.
+	 */
+	revocation_cache_t public;
+
+	/**
+	 * Cached responses, chunk_t* => entry_t
+	 */
+	hashtable_t *cache;
+
+	/**
+	 * Number of cache entries at which stale entries get purged
+	 */
+	u_int purge;
+
+	/**
+	 * Time before expiration to refetch used responses, 0 to disable
+	 */
+	u_int prefetch;
+
+	/**
+	 * Mutex protecting cache
+	 */
+	mutex_t *mutex;
+};
+
+/**
+ * A cached response
+ */
+typedef struct {
+
+	/**
+	 * Key identifying the response
+	 */
+	chunk_t key;
+
+	/**
+	 * The verified response
+	 */
+	certificate_t *response;
+
+	/**
+	 * URI the response has been fetched from
+	 */
+	char *uri;
+
+	/**
+	 * TRUE if a refetch of this response is pending
+	 */
+	bool refreshing;
+} entry_t;
+
+/**
+ * Destroy a cache entry
+ */
+static void entry_destroy(entry_t *entry)
+{
+	entry->response->destroy(entry->response);
+	free(entry->key.ptr);
+	free(entry->uri);
+	free(entry);
+}
+
+/**
+ * Hash function for cache keys
+ */
+static u_int key_hash(chunk_t *key)
+{
+	return chunk_hash(*key);
+}
+
+/**
+ * Equality function for cache keys
+ */
+static bool key_equals(chunk_t *a, chunk_t *b)
+{
+	return chunk_equals(*a, *b);
+}
+
+METHOD(revocation_cache_t, get, certificate_t*,
+	private_revocation_cache_t *this, chunk_t key, char **refresh)
+{
+	certificate_t *response = NULL;
+	entry_t *entry;
+	time_t until;
+
+	*refresh = NULL;
+	this->mutex->lock(this->mutex);
+	entry = this->cache->get(this->cache, &key);
+	if (entry)
+	{
+		if (entry->response->get_validity(entry->response, NULL, NULL, &until))
+		{
+			response = entry->response->get_ref(entry->response);
+			if (this->prefetch && !entry->refreshing &&
+				until - time(NULL) < this->prefetch)
+			{
+				entry->refreshing = TRUE;
+				*refresh = strdup(entry->uri);
+			}
+		}
+		else
+		{
+			this->cache->remove(this->cache, &key);
+		}
+	}
+	this->mutex->unlock(this->mutex);
+
+	if (entry && !response)
+	{
+		entry_destroy(entry);
+	}
+	return response;
+}
+
+METHOD(revocation_cache_t, add, void,
+	private_revocation_cache_t *this, chunk_t key, certificate_t *response,
+	char *uri)
+{
+	enumerator_t *enumerator;
+	entry_t *entry, *old;
+	linked_list_t *stale;
+	chunk_t *current;
+
+	INIT(entry,
+		.key = chunk_clone(key),
+		.response = response->get_ref(response),
+		.uri = strdup(uri),
+	);
+	stale = linked_list_create();
+
+	this->mutex->lock(this->mutex);
+	old = this->cache->put(this->cache, &entry->key, entry);
+	if (old)
+	{
+		stale->insert_last(stale, old);
+	}
+	if (this->cache->get_count(this->cache) >= this->purge)
+	{
+		enumerator = this->cache->create_enumerator(this->cache);
+		while (enumerator->enumerate(enumerator, &current, &old))
+		{
+			if (!old->response->get_validity(old->response, NULL, NULL, NULL))
+			{
+				this->cache->remove_at(this->cache, enumerator);
+				stale->insert_last(stale, old);
+			}
+		}
+		enumerator->destroy(enumerator);
+		this->purge = max(PURGE_MIN, this->cache->get_count(this->cache) * 2);
+	}
+	this->mutex->unlock(this->mutex);
+
+	stale->destroy_function(stale, (void*)entry_destroy);
+}
+
+METHOD(revocation_cache_t, refreshed, void,
+	private_revocation_cache_t *this, chunk_t key)
+{
+	entry_t *entry;
+
+	this->mutex->lock(this->mutex);
+	entry = this->cache->get(this->cache, &key);
+	if (entry)
+	{	/* a new response replaced the entry, otherwise allow a retry */
+		entry->refreshing = FALSE;
+	}
+	this->mutex->unlock(this->mutex);
+}
+
+METHOD(revocation_cache_t, get_count, u_int,
+	private_revocation_cache_t *this)
+{
+	u_int count;
+
+	this->mutex->lock(this->mutex);
+	count = this->cache->get_count(this->cache);
+	this->mutex->unlock(this->mutex);
+	return count;
+}
+
+METHOD(revocation_cache_t, destroy, void,
+	private_revocation_cache_t *this)
+{
+	enumerator_t *enumerator;
+	entry_t *entry;
+	chunk_t *key;
+
+	enumerator = this->cache->create_enumerator(this->cache);
+	while (enumerator->enumerate(enumerator, &key, &entry))
+	{
+		entry_destroy(entry);
+	}
+	enumerator->destroy(enumerator);
+	this->cache->destroy(this->cache);
+	this->mutex->destroy(this->mutex);
+	free(this);
+}
+
+/**
+ * See header
+ */
+revocation_cache_t *revocation_cache_create(u_int prefetch)
+{
+	private_revocation_cache_t *this;
+
+	INIT(this,
+		.public = {
+			.get = _get,
+			.add = _add,
+			.refreshed = _refreshed,
+			.get_count = _get_count,
+			.destroy = _destroy,
+		},
+		.cache = hashtable_create((hashtable_hash_t)key_hash,
+								  (hashtable_equals_t)key_equals, 32),
+		.purge = PURGE_MIN,
+		.prefetch = prefetch,
+		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
+	);
+
+	return &this->public;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup revocation_cache revocation_cache
+ * @{ @ingroup fetcher
+ */
+
+#ifndef REVOCATION_CACHE_H_
+#define REVOCATION_CACHE_H_
+
+#include <library.h>
+#include <credentials/certificates/certificate.h>
+
+typedef struct revocation_cache_t revocation_cache_t;
+
+/**
+ * Cache for verified OCSP responses, keyed by issuer DN and serial.
+ *
+ * Responses stay cached until they expire. Expired entries get removed when
+ * looked up, and purged whenever the number of entries has doubled.
+ */
+struct revocation_cache_t {
+
+	/**
+	 * Get a cached, non-stale response.
+	 *
+	 * If the response expires within the prefetch time, refresh receives
+	 * the URI to refetch it from. This happens once per cached response,
+	 * until refreshed() gets called for it.
+	 *
+	 * @param key		key identifying the response
+	 * @param refresh	allocated URI to refetch the response from, or NULL
+	 * @return			reference to cached response, NULL if none found
+	 */
+	certificate_t* (*get)(revocation_cache_t *this, chunk_t key,
+						  char **refresh);
+
+	/**
+	 * Add a verified response, replacing any cached one with the same key.
+	 *
+	 * @param key		key identifying the response
+	 * @param response	response to cache, gets referenced
+	 * @param uri		URI the response has been fetched from
+	 */
+	void (*add)(revocation_cache_t *this, chunk_t key, certificate_t *response,
+				char *uri);
+
+	/**
+	 * Mark a refetch returned by get() as completed.
+	 *
+	 * @param key		key identifying the response
+	 */
+	void (*refreshed)(revocation_cache_t *this, chunk_t key);
+
+	/**
+	 * Get the number of cached responses, including expired ones.
+	 *
+	 * @return			number of cached responses
+	 */
+	u_int (*get_count)(revocation_cache_t *this);
+
+	/**
+	 * Destroy a revocation_cache_t.
+	 */
+	void (*destroy)(revocation_cache_t *this);
+};
+
+/**
+ * Create a revocation_cache instance.
+ *
+ * @param prefetch		time before expiration to refetch used responses,
+ *						0 to disable
+ */
+revocation_cache_t *revocation_cache_create(u_int prefetch);
+
+#endif /** REVOCATION_CACHE_H_ @}*/
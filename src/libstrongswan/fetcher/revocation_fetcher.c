@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "revocation_fetcher.h"
+
+#include <utils/debug.h>
+#include <collections/hashtable.h>
+#include <collections/linked_list.h>
+#include <threading/mutex.h>
+#include <threading/condvar.h>
+#include <processing/jobs/callback_job.h>
+
+/**
+ * Default number of concurrent background fetch jobs
+ */
+#define DEFAULT_FETCH_JOBS 4
+
+typedef struct private_revocation_fetcher_t private_revocation_fetcher_t;
+
+/**
+ * Private data of an revocation_fetcher_t object.
+ */
+struct private_revocation_fetcher_t {
+
+	/**
+	 * Public revocation_fetcher_t interface.
+	 */
+	revocation_fetcher_t public;
+
+	/**
+	 * Queued and running fetches, fetch_t => fetch_t
+	 */
+	hashtable_t *fetches;
+
+	/**
+	 * Fetches not yet started, as fetch_t
+	 */
+	linked_list_t *queue;
+
+	/**
+	 * Number of background jobs currently processing the queue
+	 */
+	u_int jobs;
+
+	/**
+	 * Maximum number of background jobs
+	 */
+	u_int max_jobs;
+
+	/**
+	 * Time to wait for a fetch in progress, in ms, 0 to wait until it completes
+	 */
+	u_int timeout;
+
+	/**
+	 * Mutex protecting fetches and queue
+	 */
+	mutex_t *mutex;
+
+	/**
+	 * Condvar signaled whenever a fetch completes
+	 */
+	condvar_t *condvar;
+};
+
+/**
+ * State of a fetch
+ */
+typedef enum {
+	FETCH_QUEUED,
+	FETCH_RUNNING,
+	FETCH_DONE,
+} fetch_state_t;
+
+/**
+ * A queued or running fetch
+ */
+typedef struct {
+
+	/**
+	 * URI to fetch from
+	 */
+	char *uri;
+
+	/**
+	 * Key identifying fetch, together with uri
+	 */
+	chunk_t key;
+
+	/**
+	 * Data to send with request
+	 */
+	chunk_t request;
+
+	/**
+	 * MIME type of request data, NULL for a GET request
+	 */
+	char *type;
+
+	/**
+	 * State of this fetch
+	 */
+	fetch_state_t state;
+
+	/**
+	 * Result of the fetch, if done
+	 */
+	status_t status;
+
+	/**
+	 * Fetched data, if done
+	 */
+	chunk_t response;
+
+	/**
+	 * Number of threads performing or waiting for this fetch
+	 */
+	u_int refs;
+
+	/**
+	 * Registered callbacks, as callback_t
+	 */
+	linked_list_t *callbacks;
+} fetch_t;
+
+/**
+ * Callback registered with fetch_async()
+ */
+typedef struct {
+
+	/**
+	 * Callback function
+	 */
+	revocation_fetcher_cb_t cb;
+
+	/**
+	 * User data to pass to cb
+	 */
+	void *data;
+} callback_t;
+
+/**
+ * Hash a fetch by URI and key
+ */
+static u_int fetch_hash(fetch_t *fetch)
+{
+	return chunk_hash_inc(chunk_from_str(fetch->uri), chunk_hash(fetch->key));
+}
+
+/**
+ * Compare two fetches by URI and key
+ */
+static bool fetch_equals(fetch_t *a, fetch_t *b)
+{
+	return streq(a->uri, b->uri) && a->key.len == b->key.len &&
+		   memeq(a->key.ptr, b->key.ptr, a->key.len);
+}
+
+/**
+ * Create a fetch_t
+ */
+static fetch_t *fetch_create(char *uri, chunk_t key, chunk_t request,
+							 char *type)
+{
+	fetch_t *fetch;
+
+	INIT(fetch,
+		.uri = strdup(uri),
+		.key = chunk_clone(key),
+		.request = chunk_clone(request),
+		.type = strdupnull(type),
+		.callbacks = linked_list_create(),
+	);
+	return fetch;
+}
+
+/**
+ * Destroy a fetch_t
+ */
+static void fetch_destroy(fetch_t *fetch)
+{
+	fetch->callbacks->destroy_function(fetch->callbacks, free);
+	free(fetch->uri);
+	free(fetch->key.ptr);
+	free(fetch->request.ptr);
+	free(fetch->type);
+	free(fetch->response.ptr);
+	free(fetch);
+}
+
+/**
+ * Release a reference to a fetch, destroys it if done and unused
+ */
+static void fetch_release(private_revocation_fetcher_t *this, fetch_t *fetch)
+{
+	bool destroy;
+
+	this->mutex->lock(this->mutex);
+	destroy = --fetch->refs == 0 && fetch->state == FETCH_DONE;
+	this->mutex->unlock(this->mutex);
+	if (destroy)
+	{
+		fetch_destroy(fetch);
+	}
+}
+
+/**
+ * Complete a fetch, invoke callbacks and wake up waiting threads.
+ * The caller holds a reference to the fetch, or owns it if refs is zero.
+ */
+static void fetch_complete(private_revocation_fetcher_t *this, fetch_t *fetch,
+						   status_t status, chunk_t response)
+{
+	linked_list_t *callbacks;
+	callback_t *callback;
+
+	this->mutex->lock(this->mutex);
+	this->fetches->remove(this->fetches, fetch);
+	fetch->state = FETCH_DONE;
+	fetch->status = status;
+	fetch->response = response;
+	callbacks = fetch->callbacks;
+	fetch->callbacks = linked_list_create();
+	this->condvar->broadcast(this->condvar);
+	this->mutex->unlock(this->mutex);
+
+	while (callbacks->remove_first(callbacks, (void**)&callback) == SUCCESS)
+	{
+		callback->cb(callback->data,
+					 status == SUCCESS ? response : chunk_empty);
+		free(callback);
+	}
+	callbacks->destroy(callbacks);
+}
+
+/**
+ * Perform a fetch, the calling thread holds a reference to it
+ */
+static void fetch_perform(private_revocation_fetcher_t *this, fetch_t *fetch)
+{
+	chunk_t response = chunk_empty;
+	status_t status;
+
+	if (fetch->type)
+	{
+		status = lib->fetcher->fetch(lib->fetcher, fetch->uri, &response,
+									 FETCH_REQUEST_DATA, fetch->request,
+									 FETCH_REQUEST_TYPE, fetch->type,
+									 FETCH_END);
+	}
+	else
+	{
+		status = lib->fetcher->fetch(lib->fetcher, fetch->uri, &response,
+									 FETCH_END);
+	}
+	if (status != SUCCESS)
+	{
+		chunk_free(&response);
+	}
+	fetch_complete(this, fetch, status, response);
+}
+
+/**
+ * Background job processing queued fetches
+ */
+static job_requeue_t process_queue(private_revocation_fetcher_t *this)
+{
+	fetch_t *fetch;
+
+	while (TRUE)
+	{
+		this->mutex->lock(this->mutex);
+		if (this->queue->remove_first(this->queue, (void**)&fetch) != SUCCESS)
+		{
+			this->jobs--;
+			this->mutex->unlock(this->mutex);
+			return JOB_REQUEUE_NONE;
+		}
+		fetch->state = FETCH_RUNNING;
+		fetch->refs++;
+		this->mutex->unlock(this->mutex);
+
+		fetch_perform(this, fetch);
+		fetch_release(this, fetch);
+	}
+}
+
+METHOD(revocation_fetcher_t, fetch_, status_t,
+	private_revocation_fetcher_t *this, char *uri, chunk_t key,
+	chunk_t request, char *type, chunk_t *response)
+{
+	fetch_t *fetch, lookup = {
+		.uri = uri,
+		.key = key,
+	};
+	timeval_t tv;
+	status_t status = FAILED;
+	bool timed_out = FALSE, done;
+
+	this->mutex->lock(this->mutex);
+	fetch = this->fetches->get(this->fetches, &lookup);
+	if (!fetch || fetch->state == FETCH_QUEUED)
+	{
+		if (fetch)
+		{	/* queued but not started yet, do it ourselves */
+			this->queue->remove(this->queue, fetch, NULL);
+		}
+		else
+		{
+			fetch = fetch_create(uri, key, request, type);
+			this->fetches->put(this->fetches, fetch, fetch);
+		}
+		fetch->state = FETCH_RUNNING;
+		fetch->refs++;
+		this->mutex->unlock(this->mutex);
+
+		fetch_perform(this, fetch);
+		done = TRUE;
+	}
+	else
+	{
+		DBG2(DBG_CFG, "  waiting for pending fetch from '%s'", uri);
+		fetch->refs++;
+		if (this->timeout)
+		{
+			time_monotonic(&tv);
+			timeval_add_ms(&tv, this->timeout);
+		}
+		while (fetch->state != FETCH_DONE && !timed_out)
+		{
+			if (this->timeout)
+			{
+				timed_out = this->condvar->timed_wait_abs(this->condvar,
+														  this->mutex, tv);
+			}
+			else
+			{
+				this->condvar->wait(this->condvar, this->mutex);
+			}
+		}
+		done = fetch->state == FETCH_DONE;
+		this->mutex->unlock(this->mutex);
+	}
+	if (done)
+	{	/* the result does not change once done */
+		status = fetch->status;
+		if (status == SUCCESS)
+		{
+			*response = chunk_clone(fetch->response);
+		}
+	}
+	else
+	{
+		DBG1(DBG_CFG, "  pending fetch from '%s' timed out", uri);
+	}
+	fetch_release(this, fetch);
+	return status;
+}
+
+METHOD(revocation_fetcher_t, fetch_async, void,
+	private_revocation_fetcher_t *this, char *uri, chunk_t key,
+	chunk_t request, char *type, revocation_fetcher_cb_t cb, void *data)
+{
+	fetch_t *fetch, lookup = {
+		.uri = uri,
+		.key = key,
+	};
+	callback_t *callback;
+	bool start = FALSE;
+
+	INIT(callback,
+		.cb = cb,
+		.data = data,
+	);
+
+	this->mutex->lock(this->mutex);
+	fetch = this->fetches->get(this->fetches, &lookup);
+	if (!fetch)
+	{
+		fetch = fetch_create(uri, key, request, type);
+		this->fetches->put(this->fetches, fetch, fetch);
+		this->queue->insert_last(this->queue, fetch);
+		if (this->jobs < this->max_jobs)
+		{
+			this->jobs++;
+			start = TRUE;
+		}
+	}
+	fetch->callbacks->insert_last(fetch->callbacks, callback);
+	this->mutex->unlock(this->mutex);
+
+	if (start)
+	{
+		lib->processor->queue_job(lib->processor,
+			(job_t*)callback_job_create_with_prio((callback_job_cb_t)process_queue,
+					this, NULL, NULL,
+					JOB_PRIO_LOW));
+	}
+}
+
+METHOD(revocation_fetcher_t, destroy, void,
+	private_revocation_fetcher_t *this)
+{
+	enumerator_t *enumerator;
+	fetch_t *fetch, *key;
+
+	/* fail queued fetches, and those left by canceled jobs */
+	while (this->fetches->get_count(this->fetches))
+	{
+		enumerator = this->fetches->create_enumerator(this->fetches);
+		enumerator->enumerate(enumerator, &key, &fetch);
+		enumerator->destroy(enumerator);
+		fetch_complete(this, fetch, FAILED, chunk_empty);
+		fetch_destroy(fetch);
+	}
+	this->queue->destroy(this->queue);
+	this->fetches->destroy(this->fetches);
+	this->condvar->destroy(this->condvar);
+	this->mutex->destroy(this->mutex);
+	free(this);
+}
+
+/**
+ * See header
+ */
+revocation_fetcher_t *revocation_fetcher_create()
+{
+	private_revocation_fetcher_t *this;
+
+	INIT(this,
+		.public = {
+			.fetch = _fetch_,
+			.fetch_async = _fetch_async,
+			.destroy = _destroy,
+		},
+		.fetches = hashtable_create((hashtable_hash_t)fetch_hash,
+									(hashtable_equals_t)fetch_equals, 8),
+		.queue = linked_list_create(),
+		.max_jobs = max(1, lib->settings->get_int(lib->settings,
+								"libstrongswan.plugins.revocation.fetch_jobs",
+								DEFAULT_FETCH_JOBS)),
+		.timeout = lib->settings->get_time(lib->settings,
+								"libstrongswan.plugins.revocation.timeout",
+								0) * 1000,
+		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
+		.condvar = condvar_create(CONDVAR_TYPE_DEFAULT),
+	);
+
+	return &this->public;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup revocation_fetcher revocation_fetcher
+ * @{ @ingroup fetcher
+ */
+
+#ifndef REVOCATION_FETCHER_H_
+#define REVOCATION_FETCHER_H_
+
+#include <library.h>
+
+typedef struct revocation_fetcher_t revocation_fetcher_t;
+
+/**
+ * Callback function invoked for a completed asynchronous fetch.
+ *
+ * @param data			user data supplied to fetch_async()
+ * @param response		fetched data, chunk_empty if fetching failed
+ */
+typedef void (*revocation_fetcher_cb_t)(void *data, chunk_t response);
+
+/**
+ * Fetch queue for OCSP responses and CRLs, coalescing concurrent fetches.
+ *
+ * Fetches are identified by the URI and a key, e.g. the serial of the
+ * certificate an OCSP request is made for. Requesting a fetch identical to
+ * one already queued or in progress does not start another one, but uses the
+ * result of the pending fetch. Fetching itself is synchronous, background
+ * jobs are only used for fetch_async(), e.g. to prefetch OCSP responses.
+ */
+struct revocation_fetcher_t {
+
+	/**
+	 * Fetch data from a URI, waiting for the result.
+	 *
+	 * This call blocks. If no identical fetch is in progress, the calling
+	 * thread performs it itself, as it does if an identical fetch is queued
+	 * but not yet started. Only fetches started with fetch_async() run in
+	 * background jobs. If an identical fetch is in progress, the calling
+	 * thread waits for its result, but no longer than the configured timeout.
+	 *
+	 * @param uri		URI to fetch from
+	 * @param key		key identifying the fetch together with the URI
+	 * @param request	data to send with the request, chunk_empty for none
+	 * @param type		MIME type of request data, NULL for none
+	 * @param response	allocated response data
+	 * @return			SUCCESS if data fetched
+	 */
+	status_t (*fetch)(revocation_fetcher_t *this, char *uri, chunk_t key,
+					  chunk_t request, char *type, chunk_t *response);
+
+	/**
+	 * Queue a fetch, processed by a job in the background.
+	 *
+	 * The callback is invoked exactly once, with chunk_empty if fetching
+	 * failed or the fetcher gets destroyed before the fetch completes.
+	 *
+	 * @param uri		URI to fetch from
+	 * @param key		key identifying the fetch together with the URI
+	 * @param request	data to send with the request, chunk_empty for none
+	 * @param type		MIME type of request data, NULL for none
+	 * @param cb		callback function to invoke with the result
+	 * @param data		user data to pass to callback
+	 */
+	void (*fetch_async)(revocation_fetcher_t *this, char *uri, chunk_t key,
+						chunk_t request, char *type,
+						revocation_fetcher_cb_t cb, void *data);
+
+	/**
+	 * Destroy a revocation_fetcher_t.
+	 */
+	void (*destroy)(revocation_fetcher_t *this);
+};
+
+/**
+ * Create a revocation_fetcher instance.
+ */
+revocation_fetcher_t *revocation_fetcher_create();
+
+#endif /** REVOCATION_FETCHER_H_ @}*/
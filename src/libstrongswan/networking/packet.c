@@ -94,6 +94,20 @@ METHOD(packet_t, set_data, void,
 	this->adjusted_data = this->data = data;
 }
 
+METHOD(packet_t, extract_data, chunk_t,
+	private_packet_t *this)
+{
+	chunk_t data;
+
+	data = chunk_create(this->data.ptr, this->adjusted_data.len);
+	if (this->adjusted_data.ptr != this->data.ptr)
+	{
+		memmove(data.ptr, this->adjusted_data.ptr, data.len);
+	}
+	this->adjusted_data = this->data = chunk_empty;
+	return data;
+}
+
 METHOD(packet_t, get_dscp, u_int8_t,
 	private_packet_t *this)
 {
@@ -154,6 +168,7 @@ packet_t *packet_create_from_data(host_t *src, host_t *dst, chunk_t data)
 		.public = {
 			.set_data = _set_data,
 			.get_data = _get_data,
+			.extract_data = _extract_data,
 			.set_source = _set_source,
 			.get_source = _get_source,
 			.set_destination = _set_destination,
@@ -75,6 +75,15 @@ struct packet_t {
 	 */
 	void (*set_data)(packet_t *packet, chunk_t data);
 
+	/**
+	 * Extract the data from the packet, the packet is empty afterwards.
+	 *
+	 * Skipped bytes are removed, the returned chunk may be freed directly.
+	 *
+	 * @return			packet data (gets owned by caller)
+	 */
+	chunk_t (*extract_data)(packet_t *packet);
+
 	/**
 	 * Get the DiffServ Code Point set on this packet.
 	 *
@@ -0,0 +1,574 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "aes_ni_crypter.h"
+
+#include <utils/cpu_feature.h>
+
+#ifdef __x86_64__
+
+#define AES_BLOCK_SIZE 16
+#define AES_MAX_ROUNDS 14
+
+/**
+ * Size of nonce and IV for AES-CTR, RFC 3686
+ */
+#define CTR_NONCE_SIZE 4
+#define CTR_IV_SIZE 8
+
+/**
+ * Number of blocks processed in parallel in CBC decryption and CTR mode
+ */
+#define PARALLEL_BLOCKS 4
+
+/**
+ * A 128-bit AES block in an SSE register
+ */
+typedef long long block_t __attribute__((vector_size(16)));
+
+typedef struct private_aes_ni_crypter_t private_aes_ni_crypter_t;
+
+/**
+ * Private data of an aes_ni_crypter_t object.
+ */
+struct private_aes_ni_crypter_t {
+
+	/**
+	 * Public aes_ni_crypter_t interface.
+	 */
+	aes_ni_crypter_t public;
+
+	/**
+	 * Expanded encryption key schedule
+	 */
+	block_t ekey[AES_MAX_ROUNDS + 1];
+
+	/**
+	 * Expanded decryption key schedule, for the equivalent inverse cipher
+	 */
+	block_t dkey[AES_MAX_ROUNDS + 1];
+
+	/**
+	 * Number of AES rounds
+	 */
+	int rounds;
+
+	/**
+	 * AES key size, in bytes
+	 */
+	size_t key_size;
+
+	/**
+	 * Nonce value for CTR mode
+	 */
+	char nonce[CTR_NONCE_SIZE];
+};
+
+/**
+ * Load a block from a possibly unaligned buffer
+ */
+static inline block_t load(void *in)
+{
+	block_t b;
+
+	memcpy(&b, in, sizeof(b));
+	return b;
+}
+
+/**
+ * Store a block to a possibly unaligned buffer
+ */
+static inline void store(void *out, block_t b)
+{
+	memcpy(out, &b, sizeof(b));
+}
+
+/**
+ * Single AES encryption round
+ */
+static inline block_t aesenc(block_t state, block_t key)
+{
+	asm("aesenc %1, %0" : "+x" (state) : "x" (key));
+	return state;
+}
+
+/**
+ * Last AES encryption round
+ */
+static inline block_t aesenclast(block_t state, block_t key)
+{
+	asm("aesenclast %1, %0" : "+x" (state) : "x" (key));
+	return state;
+}
+
+/**
+ * Single AES decryption round
+ */
+static inline block_t aesdec(block_t state, block_t key)
+{
+	asm("aesdec %1, %0" : "+x" (state) : "x" (key));
+	return state;
+}
+
+/**
+ * Last AES decryption round
+ */
+static inline block_t aesdeclast(block_t state, block_t key)
+{
+	asm("aesdeclast %1, %0" : "+x" (state) : "x" (key));
+	return state;
+}
+
+/**
+ * Apply InvMixColumns to a round key
+ */
+static inline block_t aesimc(block_t key)
+{
+	block_t out;
+
+	asm("aesimc %1, %0" : "=x" (out) : "x" (key));
+	return out;
+}
+
+/**
+ * Apply the AES S-box to each byte of a word
+ */
+static u_int32_t sub_word(u_int32_t w)
+{
+	union {
+		block_t b;
+		u_int32_t w[4];
+	} u = { .w = { 0, w, 0, 0 } };
+
+	/* the first word of the result is SubWord() of the second input word */
+	asm("aeskeygenassist $0x00, %1, %0" : "=x" (u.b) : "x" (u.b));
+	return u.w[0];
+}
+
+/**
+ * Expand the encryption and decryption key schedules
+ */
+static void expand_key(private_aes_ni_crypter_t *this, u_char *key)
+{
+	u_int32_t w[4 * (AES_MAX_ROUNDS + 1)], t, rcon = 0x01;
+	int i, nk;
+
+	nk = this->key_size / 4;
+	memcpy(w, key, this->key_size);
+	for (i = nk; i < 4 * (this->rounds + 1); i++)
+	{
+		t = w[i - 1];
+		if (i % nk == 0)
+		{	/* words are in little endian, RotWord() is a rotation right */
+			t = sub_word((t >> 8) | (t << 24)) ^ rcon;
+			rcon = ((rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0x00)) & 0xff;
+		}
+		else if (nk > 6 && i % nk == 4)
+		{
+			t = sub_word(t);
+		}
+		w[i] = w[i - nk] ^ t;
+	}
+	memcpy(this->ekey, w, (this->rounds + 1) * AES_BLOCK_SIZE);
+	memwipe(w, sizeof(w));
+
+	this->dkey[0] = this->ekey[this->rounds];
+	for (i = 1; i < this->rounds; i++)
+	{
+		this->dkey[i] = aesimc(this->ekey[this->rounds - i]);
+	}
+	this->dkey[this->rounds] = this->ekey[0];
+}
+
+/**
+ * Encrypt a single block
+ */
+static inline block_t encrypt_block(private_aes_ni_crypter_t *this, block_t b)
+{
+	int i;
+
+	b ^= this->ekey[0];
+	for (i = 1; i < this->rounds; i++)
+	{
+		b = aesenc(b, this->ekey[i]);
+	}
+	return aesenclast(b, this->ekey[this->rounds]);
+}
+
+/**
+ * Decrypt a single block
+ */
+static inline block_t decrypt_block(private_aes_ni_crypter_t *this, block_t b)
+{
+	int i;
+
+	b ^= this->dkey[0];
+	for (i = 1; i < this->rounds; i++)
+	{
+		b = aesdec(b, this->dkey[i]);
+	}
+	return aesdeclast(b, this->dkey[this->rounds]);
+}
+
+/**
+ * Encrypt PARALLEL_BLOCKS independent blocks, interleaving the rounds
+ */
+static inline void encrypt_blocks(private_aes_ni_crypter_t *this, block_t *b)
+{
+	int i, j;
+
+	for (j = 0; j < PARALLEL_BLOCKS; j++)
+	{
+		b[j] ^= this->ekey[0];
+	}
+	for (i = 1; i < this->rounds; i++)
+	{
+		for (j = 0; j < PARALLEL_BLOCKS; j++)
+		{
+			b[j] = aesenc(b[j], this->ekey[i]);
+		}
+	}
+	for (j = 0; j < PARALLEL_BLOCKS; j++)
+	{
+		b[j] = aesenclast(b[j], this->ekey[this->rounds]);
+	}
+}
+
+/**
+ * Decrypt PARALLEL_BLOCKS independent blocks, interleaving the rounds
+ */
+static inline void decrypt_blocks(private_aes_ni_crypter_t *this, block_t *b)
+{
+	int i, j;
+
+	for (j = 0; j < PARALLEL_BLOCKS; j++)
+	{
+		b[j] ^= this->dkey[0];
+	}
+	for (i = 1; i < this->rounds; i++)
+	{
+		for (j = 0; j < PARALLEL_BLOCKS; j++)
+		{
+			b[j] = aesdec(b[j], this->dkey[i]);
+		}
+	}
+	for (j = 0; j < PARALLEL_BLOCKS; j++)
+	{
+		b[j] = aesdeclast(b[j], this->dkey[this->rounds]);
+	}
+}
+
+/**
+ * CBC encryption, inherently sequential
+ */
+static void cbc_encrypt(private_aes_ni_crypter_t *this, u_char *in,
+						u_char *out, size_t len, u_char *iv)
+{
+	block_t state;
+
+	state = load(iv);
+	while (len)
+	{
+		state = encrypt_block(this, state ^ load(in));
+		store(out, state);
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+		len -= AES_BLOCK_SIZE;
+	}
+}
+
+/**
+ * CBC decryption, processing multiple blocks in parallel
+ */
+static void cbc_decrypt(private_aes_ni_crypter_t *this, u_char *in,
+						u_char *out, size_t len, u_char *iv)
+{
+	block_t b[PARALLEL_BLOCKS], c[PARALLEL_BLOCKS], prev;
+	int j;
+
+	prev = load(iv);
+	while (len >= PARALLEL_BLOCKS * AES_BLOCK_SIZE)
+	{
+		/* load all ciphertext blocks first, as in and out may overlap */
+		for (j = 0; j < PARALLEL_BLOCKS; j++)
+		{
+			c[j] = b[j] = load(in + j * AES_BLOCK_SIZE);
+		}
+		decrypt_blocks(this, b);
+		store(out, b[0] ^ prev);
+		for (j = 1; j < PARALLEL_BLOCKS; j++)
+		{
+			store(out + j * AES_BLOCK_SIZE, b[j] ^ c[j - 1]);
+		}
+		prev = c[PARALLEL_BLOCKS - 1];
+		in += PARALLEL_BLOCKS * AES_BLOCK_SIZE;
+		out += PARALLEL_BLOCKS * AES_BLOCK_SIZE;
+		len -= PARALLEL_BLOCKS * AES_BLOCK_SIZE;
+	}
+	while (len)
+	{
+		c[0] = load(in);
+		store(out, decrypt_block(this, c[0]) ^ prev);
+		prev = c[0];
+		in += AES_BLOCK_SIZE;
+		out += AES_BLOCK_SIZE;
+		len -= AES_BLOCK_SIZE;
+	}
+}
+
+/**
+ * CTR en-/decryption, generating multiple keystream blocks in parallel
+ */
+static void ctr_crypt(private_aes_ni_crypter_t *this, u_char *in,
+					  u_char *out, size_t len, u_char *iv)
+{
+	block_t b[PARALLEL_BLOCKS];
+	u_char state[AES_BLOCK_SIZE], keystream[AES_BLOCK_SIZE];
+	u_int32_t counter = 1;
+	int j;
+
+	memcpy(state, this->nonce, CTR_NONCE_SIZE);
+	memcpy(state + CTR_NONCE_SIZE, iv, CTR_IV_SIZE);
+
+	while (len >= PARALLEL_BLOCKS * AES_BLOCK_SIZE)
+	{
+		for (j = 0; j < PARALLEL_BLOCKS; j++)
+		{
+			htoun32(state + CTR_NONCE_SIZE + CTR_IV_SIZE, counter++);
+			b[j] = load(state);
+		}
+		encrypt_blocks(this, b);
+		for (j = 0; j < PARALLEL_BLOCKS; j++)
+		{
+			store(out + j * AES_BLOCK_SIZE,
+				  b[j] ^ load(in + j * AES_BLOCK_SIZE));
+		}
+		in += PARALLEL_BLOCKS * AES_BLOCK_SIZE;
+		out += PARALLEL_BLOCKS * AES_BLOCK_SIZE;
+		len -= PARALLEL_BLOCKS * AES_BLOCK_SIZE;
+	}
+	while (len)
+	{
+		htoun32(state + CTR_NONCE_SIZE + CTR_IV_SIZE, counter++);
+		b[0] = encrypt_block(this, load(state));
+		if (len >= AES_BLOCK_SIZE)
+		{
+			store(out, b[0] ^ load(in));
+			in += AES_BLOCK_SIZE;
+			out += AES_BLOCK_SIZE;
+			len -= AES_BLOCK_SIZE;
+			continue;
+		}
+		/* partial last block */
+		store(keystream, b[0]);
+		if (in != out)
+		{
+			memcpy(out, in, len);
+		}
+		memxor(out, keystream, len);
+		memwipe(keystream, sizeof(keystream));
+		break;
+	}
+}
+
+/**
+ * Prepare output buffer for en-/decryption
+ */
+static u_char *prepare_out(chunk_t data, chunk_t *out)
+{
+	if (out)
+	{
+		*out = chunk_alloc(data.len);
+		return out->ptr;
+	}
+	return data.ptr;
+}
+
+METHOD(crypter_t, encrypt_cbc, bool,
+	private_aes_ni_crypter_t *this, chunk_t data, chunk_t iv,
+	chunk_t *encrypted)
+{
+	if (data.len % AES_BLOCK_SIZE || iv.len != AES_BLOCK_SIZE)
+	{
+		return FALSE;
+	}
+	cbc_encrypt(this, data.ptr, prepare_out(data, encrypted), data.len,
+				iv.ptr);
+	return TRUE;
+}
+
+METHOD(crypter_t, decrypt_cbc, bool,
+	private_aes_ni_crypter_t *this, chunk_t data, chunk_t iv,
+	chunk_t *decrypted)
+{
+	if (data.len % AES_BLOCK_SIZE || iv.len != AES_BLOCK_SIZE)
+	{
+		return FALSE;
+	}
+	cbc_decrypt(this, data.ptr, prepare_out(data, decrypted), data.len,
+				iv.ptr);
+	return TRUE;
+}
+
+METHOD(crypter_t, crypt_ctr, bool,
+	private_aes_ni_crypter_t *this, chunk_t data, chunk_t iv, chunk_t *out)
+{
+	if (iv.len != CTR_IV_SIZE)
+	{
+		return FALSE;
+	}
+	ctr_crypt(this, data.ptr, prepare_out(data, out), data.len, iv.ptr);
+	return TRUE;
+}
+
+METHOD(crypter_t, get_block_size_cbc, size_t,
+	private_aes_ni_crypter_t *this)
+{
+	return AES_BLOCK_SIZE;
+}
+
+METHOD(crypter_t, get_block_size_ctr, size_t,
+	private_aes_ni_crypter_t *this)
+{
+	return 1;
+}
+
+METHOD(crypter_t, get_iv_size_cbc, size_t,
+	private_aes_ni_crypter_t *this)
+{
+	return AES_BLOCK_SIZE;
+}
+
+METHOD(crypter_t, get_iv_size_ctr, size_t,
+	private_aes_ni_crypter_t *this)
+{
+	return CTR_IV_SIZE;
+}
+
+METHOD(crypter_t, get_key_size_cbc, size_t,
+	private_aes_ni_crypter_t *this)
+{
+	return this->key_size;
+}
+
+METHOD(crypter_t, get_key_size_ctr, size_t,
+	private_aes_ni_crypter_t *this)
+{
+	return this->key_size + CTR_NONCE_SIZE;
+}
+
+METHOD(crypter_t, set_key_cbc, bool,
+	private_aes_ni_crypter_t *this, chunk_t key)
+{
+	if (key.len != this->key_size)
+	{
+		return FALSE;
+	}
+	expand_key(this, key.ptr);
+	return TRUE;
+}
+
+METHOD(crypter_t, set_key_ctr, bool,
+	private_aes_ni_crypter_t *this, chunk_t key)
+{
+	if (key.len != this->key_size + CTR_NONCE_SIZE)
+	{
+		return FALSE;
+	}
+	memcpy(this->nonce, key.ptr + this->key_size, CTR_NONCE_SIZE);
+	expand_key(this, key.ptr);
+	return TRUE;
+}
+
+METHOD(crypter_t, destroy, void,
+	private_aes_ni_crypter_t *this)
+{
+	memwipe(this, sizeof(*this));
+	free(this);
+}
+
+/*
+ * Described in header
+ */
+aes_ni_crypter_t *aes_ni_crypter_create(encryption_algorithm_t algo,
+										size_t key_size)
+{
+	private_aes_ni_crypter_t *this;
+
+	switch (algo)
+	{
+		case ENCR_AES_CBC:
+		case ENCR_AES_CTR:
+			break;
+		default:
+			return NULL;
+	}
+	switch (key_size)
+	{
+		case 0:
+			key_size = 16;
+			break;
+		case 32:
+		case 24:
+		case 16:
+			break;
+		default:
+			return NULL;
+	}
+	if (!cpu_feature_available(CPU_FEATURE_AESNI))
+	{
+		return NULL;
+	}
+
+	INIT(this,
+		.public = {
+			.crypter = {
+				.encrypt = _encrypt_cbc,
+				.decrypt = _decrypt_cbc,
+				.get_block_size = _get_block_size_cbc,
+				.get_iv_size = _get_iv_size_cbc,
+				.get_key_size = _get_key_size_cbc,
+				.set_key = _set_key_cbc,
+				.destroy = _destroy,
+			},
+		},
+		.key_size = key_size,
+		.rounds = key_size / 4 + 6,
+	);
+
+	if (algo == ENCR_AES_CTR)
+	{
+		this->public.crypter.encrypt = _crypt_ctr;
+		this->public.crypter.decrypt = _crypt_ctr;
+		this->public.crypter.get_block_size = _get_block_size_ctr;
+		this->public.crypter.get_iv_size = _get_iv_size_ctr;
+		this->public.crypter.get_key_size = _get_key_size_ctr;
+		this->public.crypter.set_key = _set_key_ctr;
+	}
+
+	return &this->public;
+}
+
+#else /* !__x86_64__ */
+
+/*
+ * Described in header
+ */
+aes_ni_crypter_t *aes_ni_crypter_create(encryption_algorithm_t algo,
+										size_t key_size)
+{
+	return NULL;
+}
+
+#endif /* __x86_64__ */
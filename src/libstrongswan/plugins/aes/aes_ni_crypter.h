@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup aes_ni_crypter aes_ni_crypter
+ * @{ @ingroup aes_p
+ */
+
+#ifndef AES_NI_CRYPTER_H_
+#define AES_NI_CRYPTER_H_
+
+typedef struct aes_ni_crypter_t aes_ni_crypter_t;
+
+#include <crypto/crypters/crypter.h>
+
+/**
+ * AES-CBC and AES-CTR implementation using Intel AES New Instructions.
+ *
+ * The key schedule is expanded once in set_key(). CBC decryption and CTR
+ * keystream generation process multiple blocks in parallel to fill the
+ * AES-NI pipelines.
+ */
+struct aes_ni_crypter_t {
+
+	/**
+	 * Implements crypter_t interface.
+	 */
+	crypter_t crypter;
+};
+
+/**
+ * Create an aes_ni_crypter instance.
+ *
+ * Fails if the CPU does not support AES-NI.
+ *
+ * @param algo			algorithm to implement, ENCR_AES_CBC or ENCR_AES_CTR
+ * @param key_size		AES key size in bytes
+ * @return				aes_ni_crypter_t object, NULL if not supported
+ */
+aes_ni_crypter_t *aes_ni_crypter_create(encryption_algorithm_t algo,
+										size_t key_size);
+
+#endif /** AES_NI_CRYPTER_H_ @}*/
@@ -16,7 +16,10 @@
 #include "aes_plugin.h"
 
 #include <library.h>
+#include <utils/cpu_feature.h>
+
 #include "aes_crypter.h"
+#include "aes_ni_crypter.h"
 
 typedef struct private_aes_plugin_t private_aes_plugin_t;
 
@@ -29,6 +32,11 @@ struct private_aes_plugin_t {
 	 * public functions
 	 */
 	aes_plugin_t public;
+
+	/**
+	 * Register the AES-NI accelerated crypter
+	 */
+	bool aesni;
 };
 
 METHOD(plugin_t, get_name, char*,
@@ -41,11 +49,32 @@ METHOD(plugin_t, get_features, int,
 	private_aes_plugin_t *this, plugin_feature_t *features[])
 {
 	static plugin_feature_t f[] = {
+		/* portable T-table implementation, always available */
 		PLUGIN_REGISTER(CRYPTER, aes_crypter_create),
 			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 16),
 			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 24),
 			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 32),
 	};
+	static plugin_feature_t f_ni[] = {
+		/* AES-NI implementation, registered first to be preferred */
+		PLUGIN_REGISTER(CRYPTER, aes_ni_crypter_create),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 16),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 24),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 32),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CTR, 16),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CTR, 24),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CTR, 32),
+		PLUGIN_REGISTER(CRYPTER, aes_crypter_create),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 16),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 24),
+			PLUGIN_PROVIDE(CRYPTER, ENCR_AES_CBC, 32),
+	};
+
+	if (this->aesni)
+	{
+		*features = f_ni;
+		return countof(f_ni);
+	}
 	*features = f;
 	return countof(f);
 }
@@ -71,6 +100,9 @@ plugin_t *aes_plugin_create()
 				.destroy = _destroy,
 			},
 		},
+		.aesni = cpu_feature_available(CPU_FEATURE_AESNI) &&
+				 lib->settings->get_bool(lib->settings,
+								"libstrongswan.plugins.aes.aesni", TRUE),
 	);
 
 	return &this->public.plugin;
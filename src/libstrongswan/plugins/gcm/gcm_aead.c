@@ -15,7 +15,7 @@
 
 #include "gcm_aead.h"
 
-#include <limits.h>
+#include <utils/cpu_feature.h>
 
 #define BLOCK_SIZE 16
 #define NONCE_SIZE 12
@@ -23,6 +23,22 @@
 #define SALT_SIZE (NONCE_SIZE - IV_SIZE)
 
 typedef struct private_gcm_aead_t private_gcm_aead_t;
+typedef struct gf128_t gf128_t;
+
+/**
+ * Element of GF(2^128), a GHASH block as two 64-bit words in host order
+ */
+struct gf128_t {
+	/** first eight bytes of the block */
+	u_int64_t hi;
+	/** last eight bytes of the block */
+	u_int64_t lo;
+};
+
+/**
+ * Multiply a block in place by the GHASH subkey H
+ */
+typedef void (*ghash_mult_t)(private_gcm_aead_t *this, gf128_t *x);
 
 /**
  * Private data of an gcm_aead_t object.
@@ -52,98 +68,168 @@ struct private_gcm_aead_t {
 	/**
 	 * GHASH subkey H
 	 */
-	char h[BLOCK_SIZE];
+	gf128_t h;
+
+	/**
+	 * Precomputed 4-bit Shoup table, multiples of H for each nibble
+	 */
+	gf128_t htable[16];
+
+	/**
+	 * GHASH multiplication implementation to use
+	 */
+	ghash_mult_t mult;
 };
 
 /**
- * Find a suiteable word size and network order conversion functions
+ * Reduction constants for the 4-bit table multiplication, shifted in by 48
  */
-#if ULONG_MAX == 18446744073709551615UL && defined(htobe64)
-#	define htobeword htobe64
-#	define bewordtoh be64toh
-#	define SHIFT_WORD_TYPE u_int64_t
-#else
-#	define htobeword htonl
-#	define bewordtoh ntohl
-#	define SHIFT_WORD_TYPE u_int32_t
-#endif
+static const u_int16_t rem_4bit[16] = {
+	0x0000, 0x1C20, 0x3840, 0x2460, 0x7080, 0x6CA0, 0x48C0, 0x54E0,
+	0xE100, 0xFD20, 0xD940, 0xC560, 0x9180, 0x8DA0, 0xA9C0, 0xB5E0,
+};
 
 /**
- * Bitshift a block right by one bit
+ * Precompute the 4-bit multiplication table for H
  */
-static void sr_block(char *block)
+static void init_table(private_gcm_aead_t *this)
 {
-	int i;
-	SHIFT_WORD_TYPE *word = (SHIFT_WORD_TYPE*)block;
-
-	for (i = 0; i < BLOCK_SIZE / sizeof(*word); i++)
-	{
-		word[i] = bewordtoh(word[i]);
+	gf128_t v;
+	u_int64_t carry;
+	int i, j;
+
+	v = this->h;
+	memset(this->htable, 0, sizeof(this->htable));
+	this->htable[8] = v;
+	for (i = 4; i > 0; i >>= 1)
+	{	/* multiply by x, i.e. shift right by one bit and reduce */
+		carry = v.lo & 0x01;
+		v.lo = (v.hi << 63) | (v.lo >> 1);
+		v.hi = (v.hi >> 1) ^ (0xE100000000000000ULL & -carry);
+		this->htable[i] = v;
 	}
-	for (i = BLOCK_SIZE / sizeof(*word) - 1; i >= 0; i--)
+	for (i = 2; i < 16; i <<= 1)
 	{
-		word[i] >>= 1;
-		if (i != 0)
+		for (j = 1; j < i; j++)
 		{
-			word[i] |= word[i - 1] << (sizeof(*word) * 8 - 1);
+			this->htable[i + j].hi = this->htable[i].hi ^ this->htable[j].hi;
+			this->htable[i + j].lo = this->htable[i].lo ^ this->htable[j].lo;
 		}
 	}
-	for (i = 0; i < BLOCK_SIZE / sizeof(*word); i++)
-	{
-		word[i] = htobeword(word[i]);
-	}
 }
 
 /**
- * Naive implementation of block multiplication in GF128, no tables
+ * Shift Z right by four bits, reduce, and add table entry for nibble n
+ */
+static inline void shift_add_4bit(private_gcm_aead_t *this, gf128_t *z,
+								  u_int8_t n)
+{
+	u_int8_t rem;
+
+	rem = z->lo & 0x0F;
+	z->lo = (z->hi << 60) | (z->lo >> 4);
+	z->hi = (z->hi >> 4) ^ ((u_int64_t)rem_4bit[rem] << 48);
+	z->hi ^= this->htable[n].hi;
+	z->lo ^= this->htable[n].lo;
+}
+
+/**
+ * Table driven multiplication in GF(2^128), processing four bits at a time
  */
-static void mult_block(char *x, char *y, char *res)
+static void mult_table(private_gcm_aead_t *this, gf128_t *x)
 {
-	char z[BLOCK_SIZE], v[BLOCK_SIZE], r;
-	int bit, byte;
+	u_int8_t block[BLOCK_SIZE];
+	gf128_t z;
+	int i;
 
-	r = 0xE1;
-	memset(z, 0, BLOCK_SIZE);
-	memcpy(v, y, BLOCK_SIZE);
+	htoun64(block, x->hi);
+	htoun64(block + 8, x->lo);
 
-	for (byte = 0; byte < BLOCK_SIZE; byte++)
+	z = this->htable[block[BLOCK_SIZE - 1] & 0x0F];
+	shift_add_4bit(this, &z, block[BLOCK_SIZE - 1] >> 4);
+	for (i = BLOCK_SIZE - 2; i >= 0; i--)
 	{
-		for (bit = 7; bit >= 0; bit--)
-		{
-			if (x[byte] & (1 << bit))
-			{
-				memxor(z, v, BLOCK_SIZE);
-			}
-			if (v[BLOCK_SIZE - 1] & 0x01)
-			{
-				sr_block(v);
-				v[0] ^= r;
-			}
-			else
-			{
-				sr_block(v);
-			}
-		}
+		shift_add_4bit(this, &z, block[i] & 0x0F);
+		shift_add_4bit(this, &z, block[i] >> 4);
 	}
-	memcpy(res, z, BLOCK_SIZE);
+	*x = z;
 }
 
+#ifdef __x86_64__
+
 /**
- * GHASH function
+ * Carry-less multiplication of two 64-bit words using PCLMULQDQ
  */
-static void ghash(private_gcm_aead_t *this, chunk_t x, char *res)
+static inline gf128_t clmul64(u_int64_t a, u_int64_t b)
 {
-	char y[BLOCK_SIZE];
+	typedef long long v2di_t __attribute__((vector_size(16)));
+	union {
+		v2di_t v;
+		u_int64_t w[2];
+	} x = { .w = { a, 0 } }, y = { .w = { b, 0 } };
 
-	memset(y, 0, BLOCK_SIZE);
+	asm("pclmulqdq $0x00, %1, %0" : "+x" (x.v) : "x" (y.v));
 
-	while (x.len)
+	return (gf128_t){ .hi = x.w[1], .lo = x.w[0] };
+}
+
+/**
+ * Multiplication in GF(2^128) using carry-less multiplication instructions
+ */
+static void mult_clmul(private_gcm_aead_t *this, gf128_t *x)
+{
+	gf128_t z0, z1, z2;
+	u_int64_t d0, d1, d2, d3;
+
+	/* 256-bit product using Karatsuba, d3 being the most significant word */
+	z0 = clmul64(x->lo, this->h.lo);
+	z2 = clmul64(x->hi, this->h.hi);
+	z1 = clmul64(x->hi ^ x->lo, this->h.hi ^ this->h.lo);
+	z1.hi ^= z0.hi ^ z2.hi;
+	z1.lo ^= z0.lo ^ z2.lo;
+	d3 = z2.hi;
+	d2 = z2.lo ^ z1.hi;
+	d1 = z0.hi ^ z1.lo;
+	d0 = z0.lo;
+
+	/* GHASH uses a reflected bit order, which requires a shift by one bit */
+	d3 = (d3 << 1) | (d2 >> 63);
+	d2 = (d2 << 1) | (d1 >> 63);
+	d1 = (d1 << 1) | (d0 >> 63);
+	d0 = (d0 << 1);
+
+	/* reduce d1:d0 modulo x^128 + x^7 + x^2 + x + 1, first fold the bits
+	 * shifted out below, then add the shifted terms to d3:d2 */
+	d1 ^= (d0 << 63) ^ (d0 << 62) ^ (d0 << 57);
+	x->hi = d3 ^ d1 ^ (d1 >> 1) ^ (d1 >> 2) ^ (d1 >> 7);
+	x->lo = d2 ^ d0 ^ ((d0 >> 1) | (d1 << 63)) ^
+			((d0 >> 2) | (d1 << 62)) ^ ((d0 >> 7) | (d1 << 57));
+}
+
+#endif /* __x86_64__ */
+
+/**
+ * GHASH function, process data zero-padded to a multiple of the block size
+ */
+static void ghash(private_gcm_aead_t *this, chunk_t x, gf128_t *y)
+{
+	char block[BLOCK_SIZE];
+
+	while (x.len >= BLOCK_SIZE)
 	{
-		memxor(y, x.ptr, BLOCK_SIZE);
-		mult_block(y, this->h, y);
+		y->hi ^= untoh64(x.ptr);
+		y->lo ^= untoh64(x.ptr + 8);
+		this->mult(this, y);
 		x = chunk_skip(x, BLOCK_SIZE);
 	}
-	memcpy(res, y, BLOCK_SIZE);
+	if (x.len)
+	{
+		memset(block, 0, BLOCK_SIZE);
+		memcpy(block, x.ptr, x.len);
+		y->hi ^= untoh64(block);
+		y->lo ^= untoh64(block + 8);
+		this->mult(this, y);
+	}
 }
 
 /**
@@ -182,17 +268,25 @@ static void create_j(private_gcm_aead_t *this, char *iv, char *j)
 }
 
 /**
- * Create GHASH subkey H
+ * Create GHASH subkey H and precompute multiplication tables
  */
-static bool create_h(private_gcm_aead_t *this, char *h)
+static bool create_h(private_gcm_aead_t *this)
 {
-	char zero[BLOCK_SIZE];
+	char zero[BLOCK_SIZE], h[BLOCK_SIZE];
 
 	memset(zero, 0, BLOCK_SIZE);
 	memset(h, 0, BLOCK_SIZE);
 
-	return this->crypter->encrypt(this->crypter, chunk_create(h, BLOCK_SIZE),
-								  chunk_from_thing(zero), NULL);
+	if (!this->crypter->encrypt(this->crypter, chunk_from_thing(h),
+								chunk_from_thing(zero), NULL))
+	{
+		return FALSE;
+	}
+	this->h.hi = untoh64(h);
+	this->h.lo = untoh64(h + 8);
+	init_table(this);
+	memwipe(h, sizeof(h));
+	return TRUE;
 }
 
 /**
@@ -219,40 +313,18 @@ static bool crypt(private_gcm_aead_t *this, char *j, chunk_t in, chunk_t out)
 static bool create_icv(private_gcm_aead_t *this, chunk_t assoc, chunk_t crypt,
 					   char *j, char *icv)
 {
-	size_t assoc_pad, crypt_pad;
-	chunk_t chunk;
-	char s[BLOCK_SIZE], *pos;
-
-	assoc_pad = (BLOCK_SIZE - (assoc.len % BLOCK_SIZE)) % BLOCK_SIZE;
-	crypt_pad = (BLOCK_SIZE - (crypt.len % BLOCK_SIZE)) % BLOCK_SIZE;
-
-	/* concatenate data to a new chunk */
-	chunk = chunk_alloc(assoc.len + assoc_pad +
-						crypt.len + crypt_pad + BLOCK_SIZE);
-	pos = chunk.ptr;
-	/* add associated data */
-	memcpy(pos, assoc.ptr, assoc.len);
-	pos += assoc.len;
-	memset(pos, 0, assoc_pad);
-	pos += assoc_pad;
-	/* add encrypted data */
-	memcpy(pos, crypt.ptr, crypt.len);
-	pos += crypt.len;
-	memset(pos, 0, crypt_pad);
-	pos += crypt_pad;
-	/* write associated len */
-	memset(pos, 0, 4);
-	pos += 4;
-	htoun32(pos, assoc.len * 8);
-	pos += 4;
-	/* write encrypted length */
-	memset(pos, 0, 4);
-	pos += 4;
-	htoun32(pos, crypt.len * 8);
-	pos += 4;
-
-	ghash(this, chunk, s);
-	free(chunk.ptr);
+	gf128_t y = {};
+	char s[BLOCK_SIZE];
+
+	ghash(this, assoc, &y);
+	ghash(this, crypt, &y);
+	/* add lengths of associated and encrypted data in bits */
+	y.hi ^= (u_int64_t)assoc.len * 8;
+	y.lo ^= (u_int64_t)crypt.len * 8;
+	this->mult(this, &y);
+
+	htoun64(s, y.hi);
+	htoun64(s + 8, y.lo);
 	if (!gctr(this, j, chunk_from_thing(s)))
 	{
 		return FALSE;
@@ -349,20 +421,23 @@ METHOD(aead_t, set_key, bool,
 	memcpy(this->salt, key.ptr + key.len - SALT_SIZE, SALT_SIZE);
 	key.len -= SALT_SIZE;
 	return this->crypter->set_key(this->crypter, key) &&
-		   create_h(this, this->h);
+		   create_h(this);
 }
 
 METHOD(aead_t, destroy, void,
 	private_gcm_aead_t *this)
 {
 	this->crypter->destroy(this->crypter);
+	memwipe(&this->h, sizeof(this->h));
+	memwipe(this->htable, sizeof(this->htable));
 	free(this);
 }
 
 /**
- * See header
+ * Create a GCM instance using a given GHASH multiplication implementation
  */
-gcm_aead_t *gcm_aead_create(encryption_algorithm_t algo, size_t key_size)
+static gcm_aead_t *create(encryption_algorithm_t algo, size_t key_size,
+						  ghash_mult_t mult)
 {
 	private_gcm_aead_t *this;
 	size_t icv_size;
@@ -412,6 +487,7 @@ gcm_aead_t *gcm_aead_create(encryption_algorithm_t algo, size_t key_size)
 		},
 		.crypter = lib->crypto->create_crypter(lib->crypto, algo, key_size),
 		.icv_size = icv_size,
+		.mult = mult,
 	);
 
 	if (!this->crypter)
@@ -422,3 +498,25 @@ gcm_aead_t *gcm_aead_create(encryption_algorithm_t algo, size_t key_size)
 
 	return &this->public;
 }
+
+/**
+ * See header
+ */
+gcm_aead_t *gcm_aead_create(encryption_algorithm_t algo, size_t key_size)
+{
+	return create(algo, key_size, mult_table);
+}
+
+/**
+ * See header
+ */
+gcm_aead_t *gcm_aead_create_clmul(encryption_algorithm_t algo, size_t key_size)
+{
+#ifdef __x86_64__
+	if (cpu_feature_available(CPU_FEATURE_PCLMULQDQ))
+	{
+		return create(algo, key_size, mult_clmul);
+	}
+#endif /* __x86_64__ */
+	return NULL;
+}
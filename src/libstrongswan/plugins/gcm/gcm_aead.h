@@ -40,7 +40,7 @@ struct gcm_aead_t {
 };
 
 /**
- * Create a gcm_aead instance.
+ * Create a gcm_aead instance using a portable table driven GHASH.
  *
  * @param algo			algorithm to implement, a gcm mode
  * @param key_size		key size in bytes
@@ -48,4 +48,16 @@ struct gcm_aead_t {
  */
 gcm_aead_t *gcm_aead_create(encryption_algorithm_t algo, size_t key_size);
 
+/**
+ * Create a gcm_aead instance using PCLMULQDQ accelerated GHASH.
+ *
+ * Fails if the CPU does not support carry-less multiplication.
+ *
+ * @param algo			algorithm to implement, a gcm mode
+ * @param key_size		key size in bytes
+ * @return				aead, NULL if not supported
+ */
+gcm_aead_t *gcm_aead_create_clmul(encryption_algorithm_t algo,
+								  size_t key_size);
+
 #endif /** GCM_AEAD_H_ @}*/
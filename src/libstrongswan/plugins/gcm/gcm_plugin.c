@@ -16,6 +16,7 @@
 #include "gcm_plugin.h"
 
 #include <library.h>
+#include <utils/cpu_feature.h>
 
 #include "gcm_aead.h"
 
@@ -30,6 +31,11 @@ struct private_gcm_plugin_t {
 	 * public functions
 	 */
 	gcm_plugin_t public;
+
+	/**
+	 * Register the PCLMULQDQ accelerated GHASH implementation
+	 */
+	bool clmul;
 };
 
 METHOD(plugin_t, get_name, char*,
@@ -42,6 +48,27 @@ METHOD(plugin_t, get_features, int,
 	private_gcm_plugin_t *this, plugin_feature_t *features[])
 {
 	static plugin_feature_t f[] = {
+		/* PCLMULQDQ accelerated GHASH, registered first to be preferred */
+		PLUGIN_REGISTER(AEAD, gcm_aead_create_clmul),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV8, 16),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 16),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV8, 24),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 24),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV8, 32),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 32),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV12, 16),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 16),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV12, 24),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 24),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV12, 32),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 32),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV16, 16),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 16),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV16, 24),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 24),
+			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV16, 32),
+				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 32),
+		/* portable table driven GHASH, always available */
 		PLUGIN_REGISTER(AEAD, gcm_aead_create),
 			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV8, 16),
 				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 16),
@@ -62,8 +89,15 @@ METHOD(plugin_t, get_features, int,
 			PLUGIN_PROVIDE(AEAD, ENCR_AES_GCM_ICV16, 32),
 				PLUGIN_DEPENDS(CRYPTER, ENCR_AES_CBC, 32),
 	};
-	*features = f;
-	return countof(f);
+
+	if (this->clmul)
+	{
+		*features = f;
+		return countof(f);
+	}
+	/* skip the accelerated half of the feature list */
+	*features = &f[countof(f) / 2];
+	return countof(f) / 2;
 }
 
 METHOD(plugin_t, destroy, void,
@@ -87,6 +121,9 @@ plugin_t *gcm_plugin_create()
 				.destroy = _destroy,
 			},
 		},
+		.clmul = cpu_feature_available(CPU_FEATURE_PCLMULQDQ) &&
+				 lib->settings->get_bool(lib->settings,
+								"libstrongswan.plugins.gcm.clmul", TRUE),
 	);
 
 	return &this->public.plugin;
@@ -1,4 +1,5 @@
 /*
+ * Copyright (C) 2013 revosec AG
  * Copyright (C) 2007 Martin Willi
  * Hochschule fuer Technik Rapperswil
  *
@@ -16,13 +17,17 @@
 #define _GNU_SOURCE
 #include <string.h>
 #include <mysql.h>
+#include <errmsg.h>
 
 #include "mysql_database.h"
 
+#include <library.h>
 #include <utils/debug.h>
 #include <utils/chunk.h>
 #include <threading/thread_value.h>
 #include <threading/mutex.h>
+#include <threading/condvar.h>
+#include <collections/hashtable.h>
 #include <collections/linked_list.h>
 
 /* Older mysql.h headers do not define it, but we need it. It is not returned
@@ -32,6 +37,21 @@
 #define MYSQL_DATA_TRUNCATED 101
 #endif
 
+/**
+ * Default number of prepared statements cached per connection
+ */
+#define DEFAULT_STATEMENT_CACHE 32
+
+/**
+ * Default time in s a connection may be idle before we check it with a ping
+ */
+#define DEFAULT_PING_INTERVAL 10
+
+/**
+ * Time in ms to wait for a released connection if the pool is exhausted
+ */
+#define POOL_WAIT 1000
+
 typedef struct private_mysql_database_t private_mysql_database_t;
 
 /**
@@ -54,6 +74,26 @@ struct private_mysql_database_t {
 	 */
 	mutex_t *mutex;
 
+	/**
+	 * condvar signaled if a connection gets released
+	 */
+	condvar_t *condvar;
+
+	/**
+	 * maximum number of pooled connections, 0 for no limit
+	 */
+	u_int max_connections;
+
+	/**
+	 * maximum number of prepared statements cached per connection
+	 */
+	u_int cache_size;
+
+	/**
+	 * time in s a connection may be idle before it gets checked
+	 */
+	u_int ping_interval;
+
 	/**
 	 * hostname to connect to
 	 */
@@ -78,6 +118,11 @@ struct private_mysql_database_t {
 	 * tcp port
 	 */
 	int port;
+
+	/**
+	 * connection of the running transaction of a thread, conn_t
+	 */
+	thread_value_t *transaction;
 };
 
 typedef struct conn_t conn_t;
@@ -96,14 +141,62 @@ struct conn_t {
 	 * connection in use?
 	 */
 	bool in_use;
+
+	/**
+	 * connection failed and may not be reused
+	 */
+	bool broken;
+
+	/**
+	 * monotonic time the connection was released the last time
+	 */
+	time_t released;
+
+	/**
+	 * cached prepared statements, SQL string => stmt_t
+	 */
+	hashtable_t *stmts;
+
+	/**
+	 * cached prepared statements, least recently used first, as stmt_t
+	 */
+	linked_list_t *lru;
 };
 
 /**
- * Release a mysql connection
+ * A cached prepared statement
+ */
+typedef struct {
+	/** SQL string of the statement */
+	char *sql;
+	/** prepared statement */
+	MYSQL_STMT *stmt;
+} stmt_t;
+
+/**
+ * Hash function for SQL strings
+ */
+static u_int sql_hash(char *sql)
+{
+	return chunk_hash(chunk_from_str(sql));
+}
+
+/**
+ * Equals function for SQL strings
  */
-static void conn_release(conn_t *conn)
+static bool sql_equals(char *a, char *b)
 {
-	conn->in_use = FALSE;
+	return streq(a, b);
+}
+
+/**
+ * Destroy a cached statement
+ */
+static void stmt_destroy(stmt_t *this)
+{
+	mysql_stmt_close(this->stmt);
+	free(this->sql);
+	free(this);
 }
 
 /**
@@ -151,10 +244,59 @@ void mysql_database_deinit()
  */
 static void conn_destroy(conn_t *this)
 {
+	this->lru->destroy_function(this->lru, (void*)stmt_destroy);
+	this->stmts->destroy(this->stmts);
 	mysql_close(this->mysql);
 	free(this);
 }
 
+/**
+ * Release a mysql connection, destroys it if broken or the pool is too large
+ */
+static void conn_release(private_mysql_database_t *this, conn_t *conn)
+{
+	bool destroy;
+
+	if (this->transaction->get(this->transaction) == conn)
+	{	/* kept until the transaction completes */
+		return;
+	}
+	this->mutex->lock(this->mutex);
+	destroy = conn->broken || (this->max_connections &&
+					this->pool->get_count(this->pool) > this->max_connections);
+	if (destroy)
+	{
+		this->pool->remove(this->pool, conn, NULL);
+	}
+	else
+	{
+		conn->in_use = FALSE;
+		conn->released = time_monotonic(NULL);
+	}
+	this->condvar->signal(this->condvar);
+	this->mutex->unlock(this->mutex);
+	if (destroy)
+	{
+		conn_destroy(conn);
+	}
+}
+
+/**
+ * Mark a connection as broken if an error indicates a lost connection
+ */
+static void conn_check_error(conn_t *conn, u_int error)
+{
+	switch (error)
+	{
+		case CR_SERVER_GONE_ERROR:
+		case CR_SERVER_LOST:
+			conn->broken = TRUE;
+			break;
+		default:
+			break;
+	}
+}
+
 /**
  * Acquire/Reuse a mysql connection
  */
@@ -162,88 +304,183 @@ static conn_t *conn_get(private_mysql_database_t *this)
 {
 	conn_t *current, *found = NULL;
 	enumerator_t *enumerator;
+	bool timeout = FALSE;
 
 	thread_initialize();
 
+	found = this->transaction->get(this->transaction);
+	if (found)
+	{
+		return found;
+	}
+
 	while (TRUE)
 	{
 		this->mutex->lock(this->mutex);
-		enumerator = this->pool->create_enumerator(this->pool);
-		while (enumerator->enumerate(enumerator, &current))
+		while (TRUE)
 		{
-			if (!current->in_use)
+			enumerator = this->pool->create_enumerator(this->pool);
+			while (enumerator->enumerate(enumerator, &current))
+			{
+				if (!current->in_use)
+				{
+					found = current;
+					found->in_use = TRUE;
+					break;
+				}
+			}
+			enumerator->destroy(enumerator);
+			if (found || timeout || !this->max_connections ||
+				this->pool->get_count(this->pool) < this->max_connections)
 			{
-				found = current;
-				found->in_use = TRUE;
 				break;
 			}
+			/* don't wait forever, the calling thread might hold connections
+			 * itself, for instance, in nested queries */
+			timeout = this->condvar->timed_wait(this->condvar, this->mutex,
+												POOL_WAIT);
 		}
-		enumerator->destroy(enumerator);
-		this->mutex->unlock(this->mutex);
-		if (found)
-		{	/* check connection if found, release if ping fails */
-			if (mysql_ping(found->mysql) == 0)
+		if (!found)
+		{	/* reserve a place in the pool while we connect */
+			INIT(found,
+				.in_use = TRUE,
+				.stmts = hashtable_create((hashtable_hash_t)sql_hash,
+										  (hashtable_equals_t)sql_equals, 16),
+				.lru = linked_list_create(),
+			);
+			this->pool->insert_last(this->pool, found);
+			if (timeout)
 			{
-				break;
+				DBG1(DBG_LIB, "MySQL connection pool exhausted, increasing "
+					 "its size to %d", this->pool->get_count(this->pool));
+			}
+			else
+			{
+				DBG2(DBG_LIB, "increased MySQL connection pool size to %d",
+					 this->pool->get_count(this->pool));
 			}
-			this->mutex->lock(this->mutex);
-			this->pool->remove(this->pool, found, NULL);
 			this->mutex->unlock(this->mutex);
-			conn_destroy(found);
-			found = NULL;
-			continue;
-		}
-		break;
-	}
-	if (found == NULL)
-	{
-		found = malloc_thing(conn_t);
-		found->in_use = TRUE;
-		found->mysql = mysql_init(NULL);
-		if (!mysql_real_connect(found->mysql, this->host, this->username,
-								this->password, this->database, this->port,
-								NULL, 0))
-		{
-			DBG1(DBG_LIB, "connecting to mysql://%s:***@%s:%d/%s failed: %s",
-				 this->username, this->host, this->port, this->database,
-				 mysql_error(found->mysql));
-			conn_destroy(found);
-			found = NULL;
+			found->mysql = mysql_init(NULL);
+			if (!mysql_real_connect(found->mysql, this->host, this->username,
+									this->password, this->database, this->port,
+									NULL, 0))
+			{
+				DBG1(DBG_LIB, "connecting to mysql://%s:***@%s:%d/%s failed: %s",
+					 this->username, this->host, this->port, this->database,
+					 mysql_error(found->mysql));
+				found->broken = TRUE;
+				conn_release(this, found);
+				return NULL;
+			}
+			return found;
 		}
-		else
+		this->mutex->unlock(this->mutex);
+
+		/* check the connection only if it was idle for a while, a lost
+		 * connection gets detected when running a statement otherwise */
+		if (time_monotonic(NULL) - found->released < this->ping_interval ||
+			mysql_ping(found->mysql) == 0)
 		{
-			this->mutex->lock(this->mutex);
-			this->pool->insert_last(this->pool, found);
-			DBG2(DBG_LIB, "increased MySQL connection pool size to %d",
-				 this->pool->get_count(this->pool));
-			this->mutex->unlock(this->mutex);
+			return found;
 		}
+		found->broken = TRUE;
+		conn_release(this, found);
+		found = NULL;
 	}
-	return found;
 }
 
 /**
- * Create and run a MySQL stmt using a sql string and args
+ * Get a cached or newly prepared statement on a connection
  */
-static MYSQL_STMT* run(MYSQL *mysql, char *sql, va_list *args)
+static MYSQL_STMT *stmt_get(private_mysql_database_t *this, conn_t *conn,
+							char *sql)
 {
 	MYSQL_STMT *stmt;
-	int params;
+	stmt_t *entry;
 
-	stmt = mysql_stmt_init(mysql);
+	entry = conn->stmts->get(conn->stmts, sql);
+	if (entry)
+	{
+		conn->lru->remove(conn->lru, entry, NULL);
+		conn->lru->insert_last(conn->lru, entry);
+		return entry->stmt;
+	}
+	stmt = mysql_stmt_init(conn->mysql);
 	if (stmt == NULL)
 	{
 		DBG1(DBG_LIB, "creating MySQL statement failed: %s",
-			 mysql_error(mysql));
+			 mysql_error(conn->mysql));
 		return NULL;
 	}
 	if (mysql_stmt_prepare(stmt, sql, strlen(sql)))
 	{
 		DBG1(DBG_LIB, "preparing MySQL statement failed: %s",
 			 mysql_stmt_error(stmt));
+		conn_check_error(conn, mysql_stmt_errno(stmt));
 		mysql_stmt_close(stmt);
 		return NULL;
 	}
+	if (this->cache_size)
+	{
+		/* the connection is ours, so none of its statements is in use */
+		if (conn->stmts->get_count(conn->stmts) >= this->cache_size &&
+			conn->lru->remove_first(conn->lru, (void**)&entry) == SUCCESS)
+		{
+			conn->stmts->remove(conn->stmts, entry->sql);
+			stmt_destroy(entry);
+		}
+		INIT(entry,
+			.sql = strdup(sql),
+			.stmt = stmt,
+		);
+		conn->stmts->put(conn->stmts, entry->sql, entry);
+		conn->lru->insert_last(conn->lru, entry);
+	}
+	return stmt;
+}
+
+/**
+ * Release a statement after use, keeps it prepared if cached
+ */
+static void stmt_release(conn_t *conn, char *sql, MYSQL_STMT *stmt,
+						 bool failed)
+{
+	stmt_t *entry;
+
+	if (failed)
+	{
+		conn_check_error(conn, mysql_stmt_errno(stmt));
+	}
+	entry = conn->stmts->get(conn->stmts, sql);
+	if (entry && entry->stmt == stmt)
+	{
+		if (!failed)
+		{
+			mysql_stmt_free_result(stmt);
+			return;
+		}
+		conn->stmts->remove(conn->stmts, sql);
+		conn->lru->remove(conn->lru, entry, NULL);
+		free(entry->sql);
+		free(entry);
+	}
+	mysql_stmt_close(stmt);
+}
+
+/**
+ * Create and run a MySQL stmt using a sql string and args
+ */
+static MYSQL_STMT* run(private_mysql_database_t *this, conn_t *conn,
+					   char *sql, va_list *args)
+{
+	MYSQL_STMT *stmt;
+	int params;
+
+	stmt = stmt_get(this, conn, sql);
+	if (stmt == NULL)
+	{
+		return NULL;
+	}
 	params = mysql_stmt_param_count(stmt);
 	if (params > 0)
 	{
@@ -307,7 +544,7 @@ static MYSQL_STMT* run(MYSQL *mysql, char *sql, va_list *args)
 				}
 				default:
 					DBG1(DBG_LIB, "invalid data type supplied");
-					mysql_stmt_close(stmt);
+					stmt_release(conn, sql, stmt, TRUE);
 					return NULL;
 			}
 		}
@@ -315,7 +552,7 @@ static MYSQL_STMT* run(MYSQL *mysql, char *sql, va_list *args)
 		{
 			DBG1(DBG_LIB, "binding MySQL param failed: %s",
 				 mysql_stmt_error(stmt));
-			mysql_stmt_close(stmt);
+			stmt_release(conn, sql, stmt, TRUE);
 			return NULL;
 		}
 	}
@@ -323,7 +560,7 @@ static MYSQL_STMT* run(MYSQL *mysql, char *sql, va_list *args)
 	{
 		DBG1(DBG_LIB, "executing MySQL statement failed: %s",
 			 mysql_stmt_error(stmt));
-		mysql_stmt_close(stmt);
+		stmt_release(conn, sql, stmt, TRUE);
 		return NULL;
 	}
 	return stmt;
@@ -334,10 +571,14 @@ typedef struct {
 	enumerator_t public;
 	/** associated MySQL statement */
 	MYSQL_STMT *stmt;
+	/** SQL string of the statement */
+	char *sql;
 	/** result bindings */
 	MYSQL_BIND *bind;
 	/** pooled connection handle */
 	conn_t *conn;
+	/** back reference to parent */
+	private_mysql_database_t *database;
 	/** value for INT, UINT, double */
 	union {
 		void *p_void;;
@@ -347,6 +588,8 @@ typedef struct {
 	} val;
 	/* length for TEXT and BLOB */
 	unsigned long *length;
+	/** TRUE if fetching a row failed */
+	bool failed;
 } mysql_enumerator_t;
 
 /**
@@ -372,8 +615,9 @@ static void mysql_enumerator_destroy(mysql_enumerator_t *this)
 				break;
 		}
 	}
-	mysql_stmt_close(this->stmt);
-	conn_release(this->conn);
+	stmt_release(this->conn, this->sql, this->stmt, this->failed);
+	conn_release(this->database, this->conn);
+	free(this->sql);
 	free(this->bind);
 	free(this->val.p_void);
 	free(this->length);
@@ -420,6 +664,7 @@ static bool mysql_enumerator_enumerate(mysql_enumerator_t *this, ...)
 		default:
 			DBG1(DBG_LIB, "fetching MySQL row failed: %s",
 				 mysql_stmt_error(this->stmt));
+			this->failed = TRUE;
 			return FALSE;
 	}
 
@@ -491,7 +736,7 @@ METHOD(database_t, query, enumerator_t*,
 	}
 
 	va_start(args, sql);
-	stmt = run(conn->mysql, sql, &args);
+	stmt = run(this, conn, sql, &args);
 	if (stmt)
 	{
 		int columns, i;
@@ -500,7 +745,10 @@ METHOD(database_t, query, enumerator_t*,
 		enumerator->public.enumerate = (void*)mysql_enumerator_enumerate;
 		enumerator->public.destroy = (void*)mysql_enumerator_destroy;
 		enumerator->stmt = stmt;
+		enumerator->sql = strdup(sql);
 		enumerator->conn = conn;
+		enumerator->database = this;
+		enumerator->failed = FALSE;
 		columns = mysql_stmt_field_count(stmt);
 		enumerator->bind = calloc(columns, sizeof(MYSQL_BIND));
 		enumerator->length = calloc(columns, sizeof(unsigned long));
@@ -551,13 +799,14 @@ METHOD(database_t, query, enumerator_t*,
 		{
 			DBG1(DBG_LIB, "binding MySQL result failed: %s",
 				 mysql_stmt_error(stmt));
+			enumerator->failed = TRUE;
 			mysql_enumerator_destroy(enumerator);
 			enumerator = NULL;
 		}
 	}
 	else
 	{
-		conn_release(conn);
+		conn_release(this, conn);
 	}
 	va_end(args);
 	return (enumerator_t*)enumerator;
@@ -577,7 +826,7 @@ METHOD(database_t, execute, int,
 		return -1;
 	}
 	va_start(args, sql);
-	stmt = run(conn->mysql, sql, &args);
+	stmt = run(this, conn, sql, &args);
 	if (stmt)
 	{
 		if (rowid)
@@ -585,13 +834,84 @@ METHOD(database_t, execute, int,
 			*rowid = mysql_stmt_insert_id(stmt);
 		}
 		affected = mysql_stmt_affected_rows(stmt);
-		mysql_stmt_close(stmt);
+		stmt_release(conn, sql, stmt, FALSE);
 	}
 	va_end(args);
-	conn_release(conn);
+	conn_release(this, conn);
 	return affected;
 }
 
+METHOD(database_t, transaction, bool,
+	private_mysql_database_t *this)
+{
+	conn_t *conn;
+
+	if (this->transaction->get(this->transaction))
+	{
+		DBG1(DBG_LIB, "MySQL transactions can not be nested");
+		return FALSE;
+	}
+	conn = conn_get(this);
+	if (!conn)
+	{
+		return FALSE;
+	}
+	if (mysql_query(conn->mysql, "START TRANSACTION") != 0)
+	{
+		DBG1(DBG_LIB, "starting MySQL transaction failed: %s",
+			 mysql_error(conn->mysql));
+		conn_check_error(conn, mysql_errno(conn->mysql));
+		conn_release(this, conn);
+		return FALSE;
+	}
+	this->transaction->set(this->transaction, conn);
+	return TRUE;
+}
+
+/**
+ * Complete the transaction of the calling thread
+ */
+static bool finish_transaction(private_mysql_database_t *this, bool commit)
+{
+	conn_t *conn;
+	bool success;
+
+	conn = this->transaction->get(this->transaction);
+	if (!conn)
+	{
+		return FALSE;
+	}
+	if (commit)
+	{
+		success = mysql_commit(conn->mysql) == 0;
+	}
+	else
+	{
+		success = mysql_rollback(conn->mysql) == 0;
+	}
+	if (!success)
+	{
+		DBG1(DBG_LIB, "completing MySQL transaction failed: %s",
+			 mysql_error(conn->mysql));
+		conn_check_error(conn, mysql_errno(conn->mysql));
+	}
+	this->transaction->set(this->transaction, NULL);
+	conn_release(this, conn);
+	return success;
+}
+
+METHOD(database_t, commit, bool,
+	private_mysql_database_t *this)
+{
+	return finish_transaction(this, TRUE);
+}
+
+METHOD(database_t, rollback, bool,
+	private_mysql_database_t *this)
+{
+	return finish_transaction(this, FALSE);
+}
+
 METHOD(database_t, get_driver,db_driver_t,
 	private_mysql_database_t *this)
 {
@@ -603,6 +923,8 @@ METHOD(database_t, destroy, void,
 {
 	this->pool->destroy_function(this->pool, (void*)conn_destroy);
 	this->mutex->destroy(this->mutex);
+	this->condvar->destroy(this->condvar);
+	this->transaction->destroy(this->transaction);
 	free(this->host);
 	free(this->username);
 	free(this->password);
@@ -676,6 +998,9 @@ mysql_database_t *mysql_database_create(char *uri)
 			.db = {
 				.query = _query,
 				.execute = _execute,
+				.transaction = _transaction,
+				.commit = _commit,
+				.rollback = _rollback,
 				.get_driver = _get_driver,
 				.destroy = _destroy,
 			},
@@ -688,7 +1013,17 @@ mysql_database_t *mysql_database_create(char *uri)
 		return NULL;
 	}
 	this->mutex = mutex_create(MUTEX_TYPE_DEFAULT);
+	this->condvar = condvar_create(CONDVAR_TYPE_DEFAULT);
 	this->pool = linked_list_create();
+	this->transaction = thread_value_create(NULL);
+	this->max_connections = lib->settings->get_int(lib->settings,
+								"libstrongswan.plugins.mysql.max_connections", 0);
+	this->cache_size = lib->settings->get_int(lib->settings,
+								"libstrongswan.plugins.mysql.statement_cache",
+								DEFAULT_STATEMENT_CACHE);
+	this->ping_interval = lib->settings->get_time(lib->settings,
+								"libstrongswan.plugins.mysql.ping_interval",
+								DEFAULT_PING_INTERVAL);
 
 	/* check connectivity */
 	conn = conn_get(this);
@@ -697,7 +1032,7 @@ mysql_database_t *mysql_database_create(char *uri)
 		destroy(this);
 		return NULL;
 	}
-	conn_release(conn);
+	conn_release(this, conn);
 	return &this->public;
 }
 
@@ -189,6 +189,27 @@ METHOD(crl_t, create_enumerator, enumerator_t*,
 	return &enumerator->public;
 }
 
+METHOD(crl_t, is_revoked, bool,
+	private_openssl_crl_t *this, chunk_t serial, time_t *date,
+	crl_reason_t *reason)
+{
+	enumerator_t *enumerator;
+	chunk_t current;
+	bool found = FALSE;
+
+	enumerator = create_enumerator(this);
+	while (enumerator->enumerate(enumerator, &current, date, reason))
+	{
+		if (chunk_equals(serial, current))
+		{
+			found = TRUE;
+			break;
+		}
+	}
+	enumerator->destroy(enumerator);
+	return found;
+}
+
 METHOD(crl_t, get_serial, chunk_t,
 	private_openssl_crl_t *this)
 {
@@ -390,6 +411,7 @@ static private_openssl_crl_t *create_empty()
 				.is_delta_crl = (void*)return_false,
 				.create_delta_crl_uri_enumerator = (void*)enumerator_create_empty,
 				.create_enumerator = _create_enumerator,
+				.is_revoked = _is_revoked,
 			},
 		},
 		.ref = 1,
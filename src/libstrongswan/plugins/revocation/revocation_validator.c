@@ -18,6 +18,8 @@
 #include "revocation_validator.h"
 
 #include <utils/debug.h>
+#include <fetcher/revocation_fetcher.h>
+#include <fetcher/revocation_cache.h>
 #include <credentials/certificates/x509.h>
 #include <credentials/certificates/crl.h>
 #include <credentials/certificates/ocsp_request.h>
@@ -36,52 +38,95 @@ struct private_revocation_validator_t {
 	 * Public revocation_validator_t interface.
 	 */
 	revocation_validator_t public;
+
+	/**
+	 * Fetcher for OCSP responses and CRLs
+	 */
+	revocation_fetcher_t *fetcher;
+
+	/**
+	 * Cache of verified OCSP responses
+	 */
+	revocation_cache_t *cache;
 };
 
 /**
- * Do an OCSP request
+ * Context for a prefetch of an OCSP response
  */
-static certificate_t *fetch_ocsp(char *url, certificate_t *subject,
-								 certificate_t *issuer)
+typedef struct {
+
+	/**
+	 * Validator instance
+	 */
+	private_revocation_validator_t *this;
+
+	/**
+	 * Subject certificate
+	 */
+	certificate_t *subject;
+
+	/**
+	 * Issuer of the subject certificate
+	 */
+	certificate_t *issuer;
+
+	/**
+	 * URI to fetch from
+	 */
+	char *uri;
+} prefetch_t;
+
+/**
+ * Build the cache key for a certificate, issuer DN and serial
+ */
+static chunk_t build_key(x509_t *subject)
 {
-	certificate_t *request, *response;
-	chunk_t send, receive;
+	identification_t *issuer;
+
+	issuer = subject->interface.get_issuer(&subject->interface);
+	return chunk_cat("cc", issuer->get_encoding(issuer),
+					 subject->get_serial(subject));
+}
+
+/**
+ * Build an encoded OCSP request for a certificate
+ */
+static bool build_ocsp_request(x509_t *subject, x509_t *issuer,
+							   chunk_t *encoding)
+{
+	certificate_t *request;
 
 	/* TODO: requestor name, signature */
 	request = lib->creds->create(lib->creds,
 						CRED_CERTIFICATE, CERT_X509_OCSP_REQUEST,
-						BUILD_CA_CERT, issuer,
-						BUILD_CERT, subject, BUILD_END);
+						BUILD_CA_CERT, &issuer->interface,
+						BUILD_CERT, &subject->interface, BUILD_END);
 	if (!request)
 	{
 		DBG1(DBG_CFG, "generating ocsp request failed");
-		return NULL;
+		return FALSE;
 	}
 
-	if (!request->get_encoding(request, CERT_ASN1_DER, &send))
+	if (!request->get_encoding(request, CERT_ASN1_DER, encoding))
 	{
 		DBG1(DBG_CFG, "encoding ocsp request failed");
 		request->destroy(request);
-		return NULL;
+		return FALSE;
 	}
 	request->destroy(request);
+	return TRUE;
+}
 
-	DBG1(DBG_CFG, "  requesting ocsp status from '%s' ...", url);
-	if (lib->fetcher->fetch(lib->fetcher, url, &receive,
-							FETCH_REQUEST_DATA, send,
-							FETCH_REQUEST_TYPE, "application/ocsp-request",
-							FETCH_END) != SUCCESS)
-	{
-		DBG1(DBG_CFG, "ocsp request to %s failed", url);
-		chunk_free(&send);
-		return NULL;
-	}
-	chunk_free(&send);
+/**
+ * Parse a fetched OCSP response
+ */
+static certificate_t *parse_ocsp(chunk_t encoding)
+{
+	certificate_t *response;
 
 	response = lib->creds->create(lib->creds,
 								  CRED_CERTIFICATE, CERT_X509_OCSP_RESPONSE,
-								  BUILD_BLOB_ASN1_DER, receive, BUILD_END);
-	chunk_free(&receive);
+								  BUILD_BLOB_ASN1_DER, encoding, BUILD_END);
 	if (!response)
 	{
 		DBG1(DBG_CFG, "parsing ocsp response failed");
@@ -90,6 +135,38 @@ static certificate_t *fetch_ocsp(char *url, certificate_t *subject,
 	return response;
 }
 
+/**
+ * Do an OCSP request
+ */
+static certificate_t *fetch_ocsp(private_revocation_validator_t *this,
+								 char *url, x509_t *subject, x509_t *issuer)
+{
+	certificate_t *response;
+	chunk_t send, receive, key;
+	status_t status;
+
+	if (!build_ocsp_request(subject, issuer, &send))
+	{
+		return NULL;
+	}
+
+	DBG1(DBG_CFG, "  requesting ocsp status from '%s' ...", url);
+	key = build_key(subject);
+	status = this->fetcher->fetch(this->fetcher, url, key, send,
+								  "application/ocsp-request", &receive);
+	chunk_free(&key);
+	chunk_free(&send);
+	if (status != SUCCESS)
+	{
+		DBG1(DBG_CFG, "ocsp request to %s failed", url);
+		return NULL;
+	}
+
+	response = parse_ocsp(receive);
+	chunk_free(&receive);
+	return response;
+}
+
 /**
  * check the signature of an OCSP response
  */
@@ -133,14 +210,16 @@ static bool verify_ocsp(ocsp_response_t *response, auth_cfg_t *auth)
 /**
  * Get the better of two OCSP responses, and check for usable OCSP info
  */
-static certificate_t *get_better_ocsp(certificate_t *cand, certificate_t *best,
+static certificate_t *get_better_ocsp(private_revocation_validator_t *this,
+					certificate_t *cand, certificate_t *best,
 					x509_t *subject, x509_t *issuer, cert_validation_t *valid,
-					auth_cfg_t *auth, bool cache)
+					auth_cfg_t *auth, char *uri)
 {
 	ocsp_response_t *response;
 	time_t revocation, this_update, next_update, valid_until;
 	crl_reason_t reason;
 	bool revoked = FALSE;
+	chunk_t key;
 
 	response = (ocsp_response_t*)cand;
 
@@ -182,9 +261,11 @@ static certificate_t *get_better_ocsp(certificate_t *cand, certificate_t *best,
 			DBG1(DBG_CFG, "  ocsp response is valid: until %T",
 							 &valid_until, FALSE);
 			*valid = VALIDATION_GOOD;
-			if (cache)
+			if (uri)
 			{	/* cache non-stale only, stale certs get refetched */
-				lib->credmgr->cache_cert(lib->credmgr, best);
+				key = build_key(subject);
+				this->cache->add(this->cache, key, best, uri);
+				chunk_free(&key);
 			}
 		}
 		else
@@ -206,11 +287,100 @@ static certificate_t *get_better_ocsp(certificate_t *cand, certificate_t *best,
 	return best;
 }
 
+/**
+ * Process the result of an OCSP prefetch
+ */
+static void ocsp_prefetched(prefetch_t *prefetch, chunk_t encoding)
+{
+	private_revocation_validator_t *this = prefetch->this;
+	cert_validation_t valid = VALIDATION_SKIPPED;
+	certificate_t *response;
+	chunk_t key;
+
+	if (encoding.len)
+	{
+		response = parse_ocsp(encoding);
+		if (response)
+		{
+			DBG1(DBG_CFG, "prefetched ocsp response for \"%Y\"",
+				 prefetch->subject->get_subject(prefetch->subject));
+			response = get_better_ocsp(this, response, NULL,
+							(x509_t*)prefetch->subject, (x509_t*)prefetch->issuer,
+							&valid, NULL, prefetch->uri);
+			DESTROY_IF(response);
+		}
+	}
+	else
+	{
+		DBG1(DBG_CFG, "prefetching ocsp response from '%s' failed",
+			 prefetch->uri);
+	}
+
+	key = build_key((x509_t*)prefetch->subject);
+	this->cache->refreshed(this->cache, key);
+	chunk_free(&key);
+
+	prefetch->subject->destroy(prefetch->subject);
+	prefetch->issuer->destroy(prefetch->issuer);
+	free(prefetch->uri);
+	free(prefetch);
+}
+
+/**
+ * Start fetching an OCSP response in the background
+ */
+static void start_prefetch(private_revocation_validator_t *this,
+						   prefetch_t *prefetch, chunk_t key)
+{
+	chunk_t send;
+
+	if (!build_ocsp_request((x509_t*)prefetch->subject,
+							(x509_t*)prefetch->issuer, &send))
+	{
+		ocsp_prefetched(prefetch, chunk_empty);
+		return;
+	}
+	DBG2(DBG_CFG, "  prefetching ocsp status from '%s'", prefetch->uri);
+	this->fetcher->fetch_async(this->fetcher, prefetch->uri, key, send,
+							   "application/ocsp-request",
+							   (revocation_fetcher_cb_t)ocsp_prefetched,
+							   prefetch);
+	chunk_free(&send);
+}
+
+/**
+ * Get a cached OCSP response for a certificate, starts a prefetch if it is
+ * about to expire
+ */
+static certificate_t *get_cached_ocsp(private_revocation_validator_t *this,
+									  x509_t *subject, x509_t *issuer)
+{
+	certificate_t *response;
+	prefetch_t *prefetch;
+	char *uri;
+	chunk_t key;
+
+	key = build_key(subject);
+	response = this->cache->get(this->cache, key, &uri);
+	if (uri)
+	{
+		INIT(prefetch,
+			.this = this,
+			.subject = subject->interface.get_ref(&subject->interface),
+			.issuer = issuer->interface.get_ref(&issuer->interface),
+			.uri = uri,
+		);
+		start_prefetch(this, prefetch, key);
+	}
+	chunk_free(&key);
+	return response;
+}
+
 /**
  * validate a x509 certificate using OCSP
  */
-static cert_validation_t check_ocsp(x509_t *subject, x509_t *issuer,
-									auth_cfg_t *auth)
+static cert_validation_t check_ocsp(private_revocation_validator_t *this,
+								x509_t *subject, x509_t *issuer, auth_cfg_t *auth)
 {
 	enumerator_t *enumerator;
 	cert_validation_t valid = VALIDATION_SKIPPED;
@@ -220,21 +390,36 @@ static cert_validation_t check_ocsp(x509_t *subject, x509_t *issuer,
 	chunk_t chunk;
 	char *uri = NULL;
 
-	/** lookup cache for valid OCSP responses */
-	enumerator = lib->credmgr->create_cert_enumerator(lib->credmgr,
-								CERT_X509_OCSP_RESPONSE, KEY_ANY, NULL, FALSE);
-	while (enumerator->enumerate(enumerator, &current))
+	/** lookup our cache for a valid OCSP response of this certificate */
+	current = get_cached_ocsp(this, subject, issuer);
+	if (current)
 	{
-		current->get_ref(current);
-		best = get_better_ocsp(current, best, subject, issuer,
-							   &valid, auth, FALSE);
+		best = get_better_ocsp(this, current, best, subject, issuer,
+							   &valid, auth, NULL);
 		if (best && valid != VALIDATION_STALE)
 		{
 			DBG1(DBG_CFG, "  using cached ocsp response");
-			break;
 		}
 	}
-	enumerator->destroy(enumerator);
+
+	/** lookup credential sets for valid OCSP responses */
+	if (valid != VALIDATION_GOOD && valid != VALIDATION_REVOKED)
+	{
+		enumerator = lib->credmgr->create_cert_enumerator(lib->credmgr,
+								CERT_X509_OCSP_RESPONSE, KEY_ANY, NULL, FALSE);
+		while (enumerator->enumerate(enumerator, &current))
+		{
+			current->get_ref(current);
+			best = get_better_ocsp(this, current, best, subject, issuer,
+								   &valid, auth, NULL);
+			if (best && valid != VALIDATION_STALE)
+			{
+				DBG1(DBG_CFG, "  using cached ocsp response");
+				break;
+			}
+		}
+		enumerator->destroy(enumerator);
+	}
 
 	/* derive the authorityKeyIdentifier from the issuer's public key */
 	current = &issuer->interface;
@@ -250,11 +435,11 @@ static cert_validation_t check_ocsp(x509_t *subject, x509_t *issuer,
 											CERT_X509_OCSP_RESPONSE, keyid);
 		while (enumerator->enumerate(enumerator, &uri))
 		{
-			current = fetch_ocsp(uri, &subject->interface, &issuer->interface);
+			current = fetch_ocsp(this, uri, subject, issuer);
 			if (current)
 			{
-				best = get_better_ocsp(current, best, subject, issuer,
-									   &valid, auth, TRUE);
+				best = get_better_ocsp(this, current, best, subject, issuer,
+									   &valid, auth, uri);
 				if (best && valid != VALIDATION_STALE)
 				{
 					break;
@@ -272,11 +457,11 @@ static cert_validation_t check_ocsp(x509_t *subject, x509_t *issuer,
 		enumerator = subject->create_ocsp_uri_enumerator(subject);
 		while (enumerator->enumerate(enumerator, &uri))
 		{
-			current = fetch_ocsp(uri, &subject->interface, &issuer->interface);
+			current = fetch_ocsp(this, uri, subject, issuer);
 			if (current)
 			{
-				best = get_better_ocsp(current, best, subject, issuer,
-									   &valid, auth, TRUE);
+				best = get_better_ocsp(this, current, best, subject, issuer,
+									   &valid, auth, uri);
 				if (best && valid != VALIDATION_STALE)
 				{
 					break;
@@ -305,13 +490,14 @@ static cert_validation_t check_ocsp(x509_t *subject, x509_t *issuer,
 /**
  * fetch a CRL from an URL
  */
-static certificate_t* fetch_crl(char *url)
+static certificate_t* fetch_crl(private_revocation_validator_t *this, char *url)
 {
 	certificate_t *crl;
 	chunk_t chunk;
 
 	DBG1(DBG_CFG, "  fetching crl from '%s' ...", url);
-	if (lib->fetcher->fetch(lib->fetcher, url, &chunk, FETCH_END) != SUCCESS)
+	if (this->fetcher->fetch(this->fetcher, url, chunk_empty, chunk_empty,
+							 NULL, &chunk) != SUCCESS)
 	{
 		DBG1(DBG_CFG, "crl fetching failed");
 		return NULL;
@@ -365,7 +551,6 @@ static certificate_t *get_better_crl(certificate_t *cand, certificate_t *best,
 					x509_t *subject, cert_validation_t *valid, auth_cfg_t *auth,
 					bool cache, crl_t *base)
 {
-	enumerator_t *enumerator;
 	time_t revocation, valid_until;
 	crl_reason_t reason;
 	chunk_t serial;
@@ -397,28 +582,23 @@ static certificate_t *get_better_crl(certificate_t *cand, certificate_t *best,
 		return best;
 	}
 
-	enumerator = crl->create_enumerator(crl);
-	while (enumerator->enumerate(enumerator, &serial, &revocation, &reason))
+	if (crl->is_revoked(crl, subject->get_serial(subject), &revocation,
+						&reason))
 	{
-		if (chunk_equals(serial, subject->get_serial(subject)))
+		DBG1(DBG_CFG, "certificate was revoked on %T, reason: %N",
+			 &revocation, TRUE, crl_reason_names, reason);
+		if (reason != CRL_REASON_CERTIFICATE_HOLD)
 		{
-			DBG1(DBG_CFG, "certificate was revoked on %T, reason: %N",
-				 &revocation, TRUE, crl_reason_names, reason);
-			if (reason != CRL_REASON_CERTIFICATE_HOLD)
-			{
-				*valid = VALIDATION_REVOKED;
-			}
-			else
-			{
-				/* if the cert is on hold, a newer CRL might not contain it */
-				*valid = VALIDATION_ON_HOLD;
-			}
-			enumerator->destroy(enumerator);
-			DESTROY_IF(best);
-			return cand;
+			*valid = VALIDATION_REVOKED;
+		}
+		else
+		{
+			/* if the cert is on hold, a newer CRL might not contain it */
+			*valid = VALIDATION_ON_HOLD;
 		}
+		DESTROY_IF(best);
+		return cand;
 	}
-	enumerator->destroy(enumerator);
 
 	/* select the better of the two CRLs */
 	if (best == NULL || crl_is_newer(crl, (crl_t*)best))
@@ -451,7 +631,8 @@ static certificate_t *get_better_crl(certificate_t *cand, certificate_t *best,
 /**
  * Find or fetch a certificate for a given crlIssuer
  */
-static cert_validation_t find_crl(x509_t *subject, identification_t *issuer,
+static cert_validation_t find_crl(private_revocation_validator_t *this,
+								  x509_t *subject, identification_t *issuer,
 								  auth_cfg_t *auth, crl_t *base,
 								  certificate_t **best, bool *uri_found)
 {
@@ -484,7 +665,7 @@ static cert_validation_t find_crl(x509_t *subject, identification_t *issuer,
 		while (enumerator->enumerate(enumerator, &uri))
 		{
 			*uri_found = TRUE;
-			current = fetch_crl(uri);
+			current = fetch_crl(this, uri);
 			if (current)
 			{
 				if (!current->has_issuer(current, issuer))
@@ -510,8 +691,9 @@ static cert_validation_t find_crl(x509_t *subject, identification_t *issuer,
 /**
  * Look for a delta CRL for a given base CRL
  */
-static cert_validation_t check_delta_crl(x509_t *subject, x509_t *issuer,
-					crl_t *base, cert_validation_t base_valid, auth_cfg_t *auth)
+static cert_validation_t check_delta_crl(private_revocation_validator_t *this,
+					x509_t *subject, x509_t *issuer, crl_t *base,
+					cert_validation_t base_valid, auth_cfg_t *auth)
 {
 	cert_validation_t valid = VALIDATION_SKIPPED;
 	certificate_t *best = NULL, *current;
@@ -526,7 +708,7 @@ static cert_validation_t check_delta_crl(x509_t *subject, x509_t *issuer,
 	if (chunk.len)
 	{
 		id = identification_create_from_encoding(ID_KEY_ID, chunk);
-		valid = find_crl(subject, id, auth, base, &best, &uri);
+		valid = find_crl(this, subject, id, auth, base, &best, &uri);
 		id->destroy(id);
 	}
 
@@ -537,7 +719,8 @@ static cert_validation_t check_delta_crl(x509_t *subject, x509_t *issuer,
 	{
 		if (cdp->issuer)
 		{
-			valid = find_crl(subject, cdp->issuer, auth, base, &best, &uri);
+			valid = find_crl(this, subject, cdp->issuer, auth, base,
+							 &best, &uri);
 		}
 	}
 	enumerator->destroy(enumerator);
@@ -547,7 +730,7 @@ static cert_validation_t check_delta_crl(x509_t *subject, x509_t *issuer,
 	while (valid != VALIDATION_GOOD && valid != VALIDATION_REVOKED &&
 		   enumerator->enumerate(enumerator, &cdp))
 	{
-		current = fetch_crl(cdp->uri);
+		current = fetch_crl(this, cdp->uri);
 		if (current)
 		{
 			if (cdp->issuer && !current->has_issuer(current, cdp->issuer))
@@ -580,8 +763,8 @@ static cert_validation_t check_delta_crl(x509_t *subject, x509_t *issuer,
 /**
  * validate a x509 certificate using CRL
  */
-static cert_validation_t check_crl(x509_t *subject, x509_t *issuer,
-								   auth_cfg_t *auth)
+static cert_validation_t check_crl(private_revocation_validator_t *this,
+								x509_t *subject, x509_t *issuer, auth_cfg_t *auth)
 {
 	cert_validation_t valid = VALIDATION_SKIPPED;
 	certificate_t *best = NULL;
@@ -597,7 +780,7 @@ static cert_validation_t check_crl(x509_t *subject, x509_t *issuer,
 	if (chunk.len)
 	{
 		id = identification_create_from_encoding(ID_KEY_ID, chunk);
-		valid = find_crl(subject, id, auth, NULL, &best, &uri_found);
+		valid = find_crl(this, subject, id, auth, NULL, &best, &uri_found);
 		id->destroy(id);
 	}
 
@@ -608,7 +791,7 @@ static cert_validation_t check_crl(x509_t *subject, x509_t *issuer,
 	{
 		if (cdp->issuer)
 		{
-			valid = find_crl(subject, cdp->issuer, auth, NULL,
+			valid = find_crl(this, subject, cdp->issuer, auth, NULL,
 							 &best, &uri_found);
 		}
 	}
@@ -621,7 +804,7 @@ static cert_validation_t check_crl(x509_t *subject, x509_t *issuer,
 		while (enumerator->enumerate(enumerator, &cdp))
 		{
 			uri_found = TRUE;
-			current = fetch_crl(cdp->uri);
+			current = fetch_crl(this, cdp->uri);
 			if (current)
 			{
 				if (cdp->issuer && !current->has_issuer(current, cdp->issuer))
@@ -646,7 +829,8 @@ static cert_validation_t check_crl(x509_t *subject, x509_t *issuer,
 	/* look for delta CRLs */
 	if (best && (valid == VALIDATION_GOOD || valid == VALIDATION_STALE))
 	{
-		valid = check_delta_crl(subject, issuer, (crl_t*)best, valid, auth);
+		valid = check_delta_crl(this, subject, issuer, (crl_t*)best,
+								valid, auth);
 	}
 
 	/* an uri was found, but no result. switch validation state to failed */
@@ -682,7 +866,7 @@ METHOD(cert_validator_t, validate, bool,
 	{
 		DBG1(DBG_CFG, "checking certificate status of \"%Y\"",
 					   subject->get_subject(subject));
-		switch (check_ocsp((x509_t*)subject, (x509_t*)issuer,
+		switch (check_ocsp(this, (x509_t*)subject, (x509_t*)issuer,
 						   pathlen ? NULL : auth))
 		{
 			case VALIDATION_GOOD:
@@ -702,7 +886,7 @@ METHOD(cert_validator_t, validate, bool,
 				DBG1(DBG_CFG, "ocsp check failed, fallback to crl");
 				break;
 		}
-		switch (check_crl((x509_t*)subject, (x509_t*)issuer,
+		switch (check_crl(this, (x509_t*)subject, (x509_t*)issuer,
 						  pathlen ? NULL : auth))
 		{
 			case VALIDATION_GOOD:
@@ -727,6 +911,8 @@ METHOD(cert_validator_t, validate, bool,
 METHOD(revocation_validator_t, destroy, void,
 	private_revocation_validator_t *this)
 {
+	this->fetcher->destroy(this->fetcher);
+	this->cache->destroy(this->cache);
 	free(this);
 }
 
@@ -742,6 +928,9 @@ revocation_validator_t *revocation_validator_create()
 			.validator.validate = _validate,
 			.destroy = _destroy,
 		},
+		.fetcher = revocation_fetcher_create(),
+		.cache = revocation_cache_create(lib->settings->get_time(lib->settings,
+							"libstrongswan.plugins.revocation.prefetch", 0)),
 	);
 
 	return &this->public;
@@ -1,4 +1,5 @@
 /*
+ * Copyright (C) 2013 revosec AG
  * Copyright (C) 2007 Martin Willi
  * Hochschule fuer Technik Rapperswil
  *
@@ -20,6 +21,13 @@
 #include <library.h>
 #include <utils/debug.h>
 #include <threading/mutex.h>
+#include <collections/hashtable.h>
+#include <collections/linked_list.h>
+
+/**
+ * Default number of prepared statements cached per connection
+ */
+#define DEFAULT_STATEMENT_CACHE 32
 
 typedef struct private_sqlite_database_t private_sqlite_database_t;
 
@@ -42,8 +50,159 @@ struct private_sqlite_database_t {
 	 * mutex used to lock execute()
 	 */
 	mutex_t *mutex;
+
+	/**
+	 * Cached prepared statements, SQL string => stmt_t
+	 */
+	hashtable_t *stmts;
+
+	/**
+	 * Cached prepared statements, least recently used first, as stmt_t
+	 */
+	linked_list_t *lru;
+
+	/**
+	 * Maximum number of cached prepared statements
+	 */
+	u_int cache_size;
+
+	/**
+	 * Mutex protecting the statement cache
+	 */
+	mutex_t *cache_mutex;
 };
 
+/**
+ * A cached prepared statement
+ */
+typedef struct {
+	/** SQL string of the statement */
+	char *sql;
+	/** prepared statement */
+	sqlite3_stmt *stmt;
+	/** TRUE if the statement is currently in use */
+	bool in_use;
+} stmt_t;
+
+/**
+ * Hash function for SQL strings
+ */
+static u_int sql_hash(char *sql)
+{
+	return chunk_hash(chunk_from_str(sql));
+}
+
+/**
+ * Equals function for SQL strings
+ */
+static bool sql_equals(char *a, char *b)
+{
+	return streq(a, b);
+}
+
+/**
+ * Destroy a cached statement
+ */
+static void stmt_destroy(stmt_t *this)
+{
+	sqlite3_finalize(this->stmt);
+	free(this->sql);
+	free(this);
+}
+
+/**
+ * Get a cached prepared statement for an SQL string, if not in use
+ */
+static sqlite3_stmt *stmt_get(private_sqlite_database_t *this, char *sql)
+{
+	sqlite3_stmt *stmt = NULL;
+	stmt_t *entry;
+
+	this->cache_mutex->lock(this->cache_mutex);
+	entry = this->stmts->get(this->stmts, sql);
+	if (entry && !entry->in_use)
+	{
+		entry->in_use = TRUE;
+		this->lru->remove(this->lru, entry, NULL);
+		this->lru->insert_last(this->lru, entry);
+		stmt = entry->stmt;
+	}
+	this->cache_mutex->unlock(this->cache_mutex);
+	return stmt;
+}
+
+/**
+ * Cache a freshly prepared statement, which is in use by the caller
+ */
+static void stmt_add(private_sqlite_database_t *this, char *sql,
+					 sqlite3_stmt *stmt)
+{
+	enumerator_t *enumerator;
+	stmt_t *entry, *current;
+
+	this->cache_mutex->lock(this->cache_mutex);
+	if (!this->stmts->get(this->stmts, sql))
+	{
+		if (this->stmts->get_count(this->stmts) >= this->cache_size)
+		{	/* evict the least recently used statement not in use */
+			enumerator = this->lru->create_enumerator(this->lru);
+			while (enumerator->enumerate(enumerator, &current))
+			{
+				if (!current->in_use)
+				{
+					this->lru->remove_at(this->lru, enumerator);
+					this->stmts->remove(this->stmts, current->sql);
+					stmt_destroy(current);
+					break;
+				}
+			}
+			enumerator->destroy(enumerator);
+		}
+		if (this->stmts->get_count(this->stmts) < this->cache_size)
+		{
+			INIT(entry,
+				.sql = strdup(sql),
+				.stmt = stmt,
+				.in_use = TRUE,
+			);
+			this->stmts->put(this->stmts, entry->sql, entry);
+			this->lru->insert_last(this->lru, entry);
+		}
+	}
+	this->cache_mutex->unlock(this->cache_mutex);
+}
+
+/**
+ * Release a statement, either back to the cache or by finalizing it
+ */
+static void stmt_release(private_sqlite_database_t *this, char *sql,
+						 sqlite3_stmt *stmt)
+{
+	stmt_t *entry = NULL;
+
+	if (this->cache_size)
+	{
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+
+		this->cache_mutex->lock(this->cache_mutex);
+		entry = this->stmts->get(this->stmts, sql);
+		if (entry && entry->stmt == stmt)
+		{
+			entry->in_use = FALSE;
+		}
+		else
+		{
+			entry = NULL;
+		}
+		this->cache_mutex->unlock(this->cache_mutex);
+	}
+	if (!entry)
+	{
+		sqlite3_finalize(stmt);
+	}
+}
+
 /**
  * Create and run a sqlite stmt using a sql string and args
  */
@@ -53,71 +212,80 @@ static sqlite3_stmt* run(private_sqlite_database_t *this, char *sql,
 	sqlite3_stmt *stmt = NULL;
 	int params, i, res = SQLITE_OK;
 
+	if (this->cache_size)
+	{
+		stmt = stmt_get(this, sql);
+	}
+	if (!stmt)
+	{
 #ifdef HAVE_SQLITE3_PREPARE_V2
-	if (sqlite3_prepare_v2(this->db, sql, -1, &stmt, NULL) == SQLITE_OK)
+		if (sqlite3_prepare_v2(this->db, sql, -1, &stmt, NULL) != SQLITE_OK)
 #else
-	if (sqlite3_prepare(this->db, sql, -1, &stmt, NULL) == SQLITE_OK)
+		if (sqlite3_prepare(this->db, sql, -1, &stmt, NULL) != SQLITE_OK)
 #endif
+		{
+			DBG1(DBG_LIB, "preparing sqlite statement failed: %s",
+				 sqlite3_errmsg(this->db));
+			return NULL;
+		}
+		if (this->cache_size)
+		{
+			stmt_add(this, sql, stmt);
+		}
+	}
+	params = sqlite3_bind_parameter_count(stmt);
+	for (i = 1; i <= params; i++)
 	{
-		params = sqlite3_bind_parameter_count(stmt);
-		for (i = 1; i <= params; i++)
+		switch (va_arg(*args, db_type_t))
 		{
-			switch (va_arg(*args, db_type_t))
+			case DB_INT:
 			{
-				case DB_INT:
-				{
-					res = sqlite3_bind_int(stmt, i, va_arg(*args, int));
-					break;
-				}
-				case DB_UINT:
-				{
-					res = sqlite3_bind_int64(stmt, i, va_arg(*args, u_int));
-					break;
-				}
-				case DB_TEXT:
-				{
-					const char *text = va_arg(*args, const char*);
-					res = sqlite3_bind_text(stmt, i, text, -1, SQLITE_STATIC);
-					break;
-				}
-				case DB_BLOB:
-				{
-					chunk_t c = va_arg(*args, chunk_t);
-					res = sqlite3_bind_blob(stmt, i, c.ptr, c.len, SQLITE_STATIC);
-					break;
-				}
-				case DB_DOUBLE:
-				{
-					res = sqlite3_bind_double(stmt, i, va_arg(*args, double));
-					break;
-				}
-				case DB_NULL:
-				{
-					res = sqlite3_bind_null(stmt, i);
-					break;
-				}
-				default:
-				{
-					res = SQLITE_MISUSE;
-					break;
-				}
+				res = sqlite3_bind_int(stmt, i, va_arg(*args, int));
+				break;
 			}
-			if (res != SQLITE_OK)
+			case DB_UINT:
+			{
+				res = sqlite3_bind_int64(stmt, i, va_arg(*args, u_int));
+				break;
+			}
+			case DB_TEXT:
+			{
+				const char *text = va_arg(*args, const char*);
+				res = sqlite3_bind_text(stmt, i, text, -1, SQLITE_STATIC);
+				break;
+			}
+			case DB_BLOB:
+			{
+				chunk_t c = va_arg(*args, chunk_t);
+				res = sqlite3_bind_blob(stmt, i, c.ptr, c.len, SQLITE_STATIC);
+				break;
+			}
+			case DB_DOUBLE:
 			{
+				res = sqlite3_bind_double(stmt, i, va_arg(*args, double));
+				break;
+			}
+			case DB_NULL:
+			{
+				res = sqlite3_bind_null(stmt, i);
+				break;
+			}
+			default:
+			{
+				res = SQLITE_MISUSE;
 				break;
 			}
 		}
-	}
-	else
-	{
-		DBG1(DBG_LIB, "preparing sqlite statement failed: %s",
-			 sqlite3_errmsg(this->db));
+		if (res != SQLITE_OK)
+		{
+			break;
+		}
 	}
 	if (res != SQLITE_OK)
 	{
 		DBG1(DBG_LIB, "binding sqlite statement failed: %s",
 			 sqlite3_errmsg(this->db));
-		sqlite3_finalize(stmt);
+		stmt_release(this, sql, stmt);
 		return NULL;
 	}
 	return stmt;
@@ -128,6 +296,8 @@ typedef struct {
 	enumerator_t public;
 	/** associated sqlite statement */
 	sqlite3_stmt *stmt;
+	/** SQL string of the statement */
+	char *sql;
 	/** number of result columns */
 	int count;
 	/** column types */
@@ -141,7 +311,8 @@ typedef struct {
  */
 static void sqlite_enumerator_destroy(sqlite_enumerator_t *this)
 {
-	sqlite3_finalize(this->stmt);
+	stmt_release(this->database, this->sql, this->stmt);
+	free(this->sql);
 #if SQLITE_VERSION_NUMBER < 3005000
 	this->database->mutex->unlock(this->database->mutex);
 #endif
@@ -235,6 +406,7 @@ METHOD(database_t, query, enumerator_t*,
 		enumerator->public.enumerate = (void*)sqlite_enumerator_enumerate;
 		enumerator->public.destroy = (void*)sqlite_enumerator_destroy;
 		enumerator->stmt = stmt;
+		enumerator->sql = strdup(sql);
 		enumerator->count = sqlite3_column_count(stmt);
 		enumerator->columns = malloc(sizeof(db_type_t) * enumerator->count);
 		enumerator->database = this;
@@ -274,12 +446,49 @@ METHOD(database_t, execute, int,
 			DBG1(DBG_LIB, "sqlite execute failed: %s",
 				 sqlite3_errmsg(this->db));
 		}
-		sqlite3_finalize(stmt);
+		stmt_release(this, sql, stmt);
 	}
 	this->mutex->unlock(this->mutex);
 	return affected;
 }
 
+METHOD(database_t, transaction, bool,
+	private_sqlite_database_t *this)
+{
+	/* keep other threads from executing during the transaction */
+	this->mutex->lock(this->mutex);
+	if (execute(this, NULL, "BEGIN TRANSACTION") < 0)
+	{
+		this->mutex->unlock(this->mutex);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Finish the transaction of the calling thread with the given statement
+ */
+static bool finish_transaction(private_sqlite_database_t *this, char *sql)
+{
+	bool success;
+
+	success = execute(this, NULL, sql) >= 0;
+	this->mutex->unlock(this->mutex);
+	return success;
+}
+
+METHOD(database_t, commit, bool,
+	private_sqlite_database_t *this)
+{
+	return finish_transaction(this, "COMMIT TRANSACTION");
+}
+
+METHOD(database_t, rollback, bool,
+	private_sqlite_database_t *this)
+{
+	return finish_transaction(this, "ROLLBACK TRANSACTION");
+}
+
 METHOD(database_t, get_driver, db_driver_t,
 	private_sqlite_database_t *this)
 {
@@ -300,11 +509,14 @@ static int busy_handler(private_sqlite_database_t *this, int count)
 METHOD(database_t, destroy, void,
 	private_sqlite_database_t *this)
 {
+	this->lru->destroy_function(this->lru, (void*)stmt_destroy);
+	this->stmts->destroy(this->stmts);
 	if (sqlite3_close(this->db) == SQLITE_BUSY)
 	{
 		DBG1(DBG_LIB, "sqlite close failed because database is busy");
 	}
 	this->mutex->destroy(this->mutex);
+	this->cache_mutex->destroy(this->cache_mutex);
 	free(this);
 }
 
@@ -330,11 +542,24 @@ sqlite_database_t *sqlite_database_create(char *uri)
 			.db = {
 				.query = _query,
 				.execute = _execute,
+				.transaction = _transaction,
+				.commit = _commit,
+				.rollback = _rollback,
 				.get_driver = _get_driver,
 				.destroy = _destroy,
 			},
 		},
 		.mutex = mutex_create(MUTEX_TYPE_RECURSIVE),
+		.stmts = hashtable_create((hashtable_hash_t)sql_hash,
+								  (hashtable_equals_t)sql_equals, 32),
+		.lru = linked_list_create(),
+#ifdef HAVE_SQLITE3_PREPARE_V2
+		/* legacy statements must be prepared again after schema changes */
+		.cache_size = lib->settings->get_int(lib->settings,
+								"libstrongswan.plugins.sqlite.statement_cache",
+								DEFAULT_STATEMENT_CACHE),
+#endif
+		.cache_mutex = mutex_create(MUTEX_TYPE_DEFAULT),
 	);
 
 	if (sqlite3_open(file, &this->db) != SQLITE_OK)
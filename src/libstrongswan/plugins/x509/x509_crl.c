@@ -1,4 +1,5 @@
 /*
+ * Copyright (C) 2013 revosec AG
  * Copyright (C) 2008-2009 Martin Willi
  * Hochschule fuer Technik Rapperswil
  *
@@ -19,6 +20,7 @@ typedef struct private_x509_crl_t private_x509_crl_t;
 typedef struct revoked_t revoked_t;
 
 #include <time.h>
+#include <stdlib.h>
 
 #include <utils/debug.h>
 #include <library.h>
@@ -30,7 +32,7 @@ typedef struct revoked_t revoked_t;
 #include <collections/linked_list.h>
 
 /**
- * entry for a revoked certificate
+ * entry for a revoked certificate, used to generate CRLs
  */
 struct revoked_t {
 	/**
@@ -95,7 +97,23 @@ struct private_x509_crl_t {
 	time_t nextUpdate;
 
 	/**
-	 * list of revoked certificates as revoked_t
+	 * Contents of the revokedCertificates sequence, points into encoding
+	 */
+	chunk_t revokedCertificates;
+
+	/**
+	 * Offsets of the revoked certificate entries in revokedCertificates,
+	 * sorted by serial
+	 */
+	u_int32_t *index;
+
+	/**
+	 * Number of revoked certificates
+	 */
+	u_int count;
+
+	/**
+	 * list of revoked certificates as revoked_t, to generate a CRL
 	 */
 	linked_list_t *revoked;
 
@@ -171,30 +189,19 @@ static const asn1Object_t crlObjects[] = {
 	{ 2,     "thisUpdate",				ASN1_EOC,          ASN1_RAW  }, /*  6 */
 	{ 2,     "nextUpdate",				ASN1_EOC,          ASN1_RAW  }, /*  7 */
 	{ 2,     "revokedCertificates",		ASN1_SEQUENCE,     ASN1_OPT |
-														   ASN1_LOOP }, /*  8 */
-	{ 3,       "certList",				ASN1_SEQUENCE,     ASN1_NONE }, /*  9 */
-	{ 4,         "userCertificate",		ASN1_INTEGER,      ASN1_BODY }, /* 10 */
-	{ 4,         "revocationDate",		ASN1_EOC,          ASN1_RAW  }, /* 11 */
-	{ 4,         "crlEntryExtensions",  ASN1_SEQUENCE,     ASN1_OPT |
-														   ASN1_LOOP }, /* 12 */
-	{ 5,           "extension",			ASN1_SEQUENCE,	   ASN1_NONE }, /* 13 */
-	{ 6,             "extnID",			ASN1_OID,          ASN1_BODY }, /* 14 */
-	{ 6,             "critical",		ASN1_BOOLEAN,      ASN1_DEF |
-														   ASN1_BODY }, /* 15 */
-	{ 6,             "extnValue",		ASN1_OCTET_STRING, ASN1_BODY }, /* 16 */
-	{ 4,         "end opt or loop",		ASN1_EOC,          ASN1_END  }, /* 17 */
-	{ 2,     "end opt or loop",			ASN1_EOC,          ASN1_END  }, /* 18 */
-	{ 2,     "optional extensions",		ASN1_CONTEXT_C_0,  ASN1_OPT  }, /* 19 */
-	{ 3,       "crlExtensions",			ASN1_SEQUENCE,     ASN1_LOOP }, /* 20 */
-	{ 4,         "extension",			ASN1_SEQUENCE,     ASN1_NONE }, /* 21 */
-	{ 5,           "extnID",			ASN1_OID,          ASN1_BODY }, /* 22 */
+														   ASN1_RAW  }, /*  8 */
+	{ 2,     "end opt",					ASN1_EOC,          ASN1_END  }, /*  9 */
+	{ 2,     "optional extensions",		ASN1_CONTEXT_C_0,  ASN1_OPT  }, /* 10 */
+	{ 3,       "crlExtensions",			ASN1_SEQUENCE,     ASN1_LOOP }, /* 11 */
+	{ 4,         "extension",			ASN1_SEQUENCE,     ASN1_NONE }, /* 12 */
+	{ 5,           "extnID",			ASN1_OID,          ASN1_BODY }, /* 13 */
 	{ 5,           "critical",			ASN1_BOOLEAN,      ASN1_DEF |
-														   ASN1_BODY }, /* 23 */
-	{ 5,           "extnValue",			ASN1_OCTET_STRING, ASN1_BODY }, /* 24 */
-	{ 3,       "end loop",				ASN1_EOC,          ASN1_END  }, /* 25 */
-	{ 2,     "end opt",					ASN1_EOC,          ASN1_END  }, /* 26 */
-	{ 1,   "signatureAlgorithm",		ASN1_EOC,          ASN1_RAW  }, /* 27 */
-	{ 1,   "signatureValue",			ASN1_BIT_STRING,   ASN1_BODY }, /* 28 */
+														   ASN1_BODY }, /* 14 */
+	{ 5,           "extnValue",			ASN1_OCTET_STRING, ASN1_BODY }, /* 15 */
+	{ 3,       "end loop",				ASN1_EOC,          ASN1_END  }, /* 16 */
+	{ 2,     "end opt",					ASN1_EOC,          ASN1_END  }, /* 17 */
+	{ 1,   "signatureAlgorithm",		ASN1_EOC,          ASN1_RAW  }, /* 18 */
+	{ 1,   "signatureValue",			ASN1_BIT_STRING,   ASN1_BODY }, /* 19 */
 	{ 0, "exit",						ASN1_EOC,		   ASN1_EXIT }
 };
 #define CRL_OBJ_TBS_CERT_LIST			 1
@@ -203,16 +210,209 @@ static const asn1Object_t crlObjects[] = {
 #define CRL_OBJ_ISSUER					 5
 #define CRL_OBJ_THIS_UPDATE				 6
 #define CRL_OBJ_NEXT_UPDATE				 7
-#define CRL_OBJ_USER_CERTIFICATE		10
-#define CRL_OBJ_REVOCATION_DATE			11
-#define CRL_OBJ_CRL_ENTRY_EXTN_ID		14
-#define CRL_OBJ_CRL_ENTRY_CRITICAL		15
-#define CRL_OBJ_CRL_ENTRY_EXTN_VALUE	16
-#define CRL_OBJ_EXTN_ID					22
-#define CRL_OBJ_CRITICAL				23
-#define CRL_OBJ_EXTN_VALUE				24
-#define CRL_OBJ_ALGORITHM				27
-#define CRL_OBJ_SIGNATURE				28
+#define CRL_OBJ_REVOKED_CERTIFICATES	 8
+#define CRL_OBJ_EXTN_ID					13
+#define CRL_OBJ_CRITICAL				14
+#define CRL_OBJ_EXTN_VALUE				15
+#define CRL_OBJ_ALGORITHM				18
+#define CRL_OBJ_SIGNATURE				19
+
+/**
+ * Parse a revoked certificate entry (without the outer SEQUENCE).
+ *
+ * Revoked certificates are not parsed with the ASN.1 parser, as CRLs might
+ * contain hundreds of thousands of them. Date and reason are optional.
+ *
+ * @param entry		contents of the entry
+ * @param enforce	TRUE to reject unsupported critical extensions
+ * @param serial	receives serial of revoked certificate
+ * @param date		receives revocation date, or NULL
+ * @param reason	receives revocation reason, or NULL
+ * @return			TRUE if entry parsed successfully
+ */
+static bool parse_entry(chunk_t entry, bool enforce, chunk_t *serial,
+						time_t *date, crl_reason_t *reason)
+{
+	chunk_t time, extensions, extension, oid, value;
+	int type;
+
+	if (asn1_unwrap(&entry, serial) != ASN1_INTEGER)
+	{
+		return FALSE;
+	}
+	type = asn1_unwrap(&entry, &time);
+	if (type != ASN1_UTCTIME && type != ASN1_GENERALIZEDTIME)
+	{
+		return FALSE;
+	}
+	if (date)
+	{
+		*date = asn1_to_time(&time, type);
+	}
+	if (reason)
+	{
+		*reason = CRL_REASON_UNSPECIFIED;
+	}
+	if (!entry.len)
+	{
+		return TRUE;
+	}
+	if (asn1_unwrap(&entry, &extensions) != ASN1_SEQUENCE)
+	{
+		return FALSE;
+	}
+	while (extensions.len)
+	{
+		bool critical = FALSE;
+
+		if (asn1_unwrap(&extensions, &extension) != ASN1_SEQUENCE ||
+			asn1_unwrap(&extension, &oid) != ASN1_OID)
+		{
+			return FALSE;
+		}
+		type = asn1_unwrap(&extension, &value);
+		if (type == ASN1_BOOLEAN)
+		{
+			critical = value.len && *value.ptr;
+			type = asn1_unwrap(&extension, &value);
+		}
+		if (type != ASN1_OCTET_STRING)
+		{
+			return FALSE;
+		}
+		switch (asn1_known_oid(oid))
+		{
+			case OID_CRL_REASON_CODE:
+				if (reason && value.len && *value.ptr == ASN1_ENUMERATED &&
+					asn1_length(&value) == 1)
+				{
+					*reason = *value.ptr;
+				}
+				break;
+			default:
+				if (critical && enforce)
+				{
+					DBG1(DBG_ASN, "critical crlEntryExtension not supported");
+					return FALSE;
+				}
+				break;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Get the entry of a revoked certificate at an offset in revokedCertificates
+ */
+static chunk_t get_entry(private_x509_crl_t *this, u_int32_t offset)
+{
+	chunk_t entry, inner;
+
+	entry = chunk_skip(this->revokedCertificates, offset);
+	if (asn1_unwrap(&entry, &inner) != ASN1_SEQUENCE)
+	{
+		return chunk_empty;
+	}
+	return inner;
+}
+
+/**
+ * Get the serial of a revoked certificate at an offset in revokedCertificates
+ */
+static chunk_t get_entry_serial(private_x509_crl_t *this, u_int32_t offset)
+{
+	chunk_t entry, serial;
+
+	entry = get_entry(this, offset);
+	if (asn1_unwrap(&entry, &serial) != ASN1_INTEGER)
+	{
+		return chunk_empty;
+	}
+	return serial;
+}
+
+/**
+ * Compare two serials, sorted by length first
+ */
+static int serial_cmp(chunk_t a, chunk_t b)
+{
+	if (a.len != b.len)
+	{
+		return a.len < b.len ? -1 : 1;
+	}
+	return memcmp(a.ptr, b.ptr, a.len);
+}
+
+/**
+ * Serial and offset of an entry, used to sort the index
+ */
+typedef struct {
+	/** serial of the revoked certificate */
+	chunk_t serial;
+	/** offset of the entry */
+	u_int32_t offset;
+} sort_entry_t;
+
+/**
+ * qsort() callback to sort entries by serial
+ */
+static int sort_entry_cmp(const void *a, const void *b)
+{
+	const sort_entry_t *ea = a, *eb = b;
+
+	return serial_cmp(ea->serial, eb->serial);
+}
+
+/**
+ * Validate the revoked certificates and build the index sorted by serial.
+ *
+ * @param list		revokedCertificates SEQUENCE, as raw ASN.1 object
+ * @param enforce	TRUE to reject unsupported critical extensions
+ * @return			TRUE if all entries are valid
+ */
+static bool build_index(private_x509_crl_t *this, chunk_t list, bool enforce)
+{
+	sort_entry_t *entries = NULL;
+	chunk_t pos, entry;
+	u_int size = 0, i;
+
+	if (asn1_unwrap(&list, &this->revokedCertificates) != ASN1_SEQUENCE ||
+		this->revokedCertificates.len > 0xFFFFFFFF)
+	{
+		return FALSE;
+	}
+	pos = this->revokedCertificates;
+	while (pos.len)
+	{
+		if (this->count == size)
+		{
+			size = max(64, size * 2);
+			entries = realloc(entries, size * sizeof(sort_entry_t));
+		}
+		entries[this->count].offset = pos.ptr - this->revokedCertificates.ptr;
+		if (asn1_unwrap(&pos, &entry) != ASN1_SEQUENCE ||
+			!parse_entry(entry, enforce, &entries[this->count].serial,
+						 NULL, NULL))
+		{
+			DBG1(DBG_ASN, "invalid revoked certificate entry");
+			free(entries);
+			return FALSE;
+		}
+		this->count++;
+	}
+	if (this->count)
+	{
+		qsort(entries, this->count, sizeof(sort_entry_t), sort_entry_cmp);
+		this->index = malloc(this->count * sizeof(u_int32_t));
+		for (i = 0; i < this->count; i++)
+		{
+			this->index[i] = entries[i].offset;
+		}
+	}
+	free(entries);
+	DBG2(DBG_ASN, "  %u revoked certificates", this->count);
+	return TRUE;
+}
 
 /**
  *  Parses an X.509 Certificate Revocation List (CRL)
@@ -222,13 +422,14 @@ static bool parse(private_x509_crl_t *this)
 	asn1_parser_t *parser;
 	chunk_t object;
 	chunk_t extnID = chunk_empty;
-	chunk_t userCertificate = chunk_empty;
 	int objectID;
 	int sig_alg = OID_UNKNOWN;
 	bool success = FALSE;
 	bool critical = FALSE;
-	revoked_t *revoked = NULL;
+	bool enforce;
 
+	enforce = lib->settings->get_bool(lib->settings,
+							"libstrongswan.x509.enforce_critical", TRUE);
 	parser = asn1_parser_create(crlObjects, this->encoding);
 
 	while (parser->iterate(parser, &objectID, &object))
@@ -257,44 +458,25 @@ static bool parse(private_x509_crl_t *this)
 			case CRL_OBJ_NEXT_UPDATE:
 				this->nextUpdate = asn1_parse_time(object, level);
 				break;
-			case CRL_OBJ_USER_CERTIFICATE:
-				userCertificate = object;
-				break;
-			case CRL_OBJ_REVOCATION_DATE:
-				revoked = malloc_thing(revoked_t);
-				revoked->serial = chunk_clone(userCertificate);
-				revoked->date = asn1_parse_time(object, level);
-				revoked->reason = CRL_REASON_UNSPECIFIED;
-				this->revoked->insert_last(this->revoked, (void *)revoked);
+			case CRL_OBJ_REVOKED_CERTIFICATES:
+				if (!build_index(this, object, enforce))
+				{
+					goto end;
+				}
 				break;
-			case CRL_OBJ_CRL_ENTRY_EXTN_ID:
 			case CRL_OBJ_EXTN_ID:
 				extnID = object;
 				break;
-			case CRL_OBJ_CRL_ENTRY_CRITICAL:
 			case CRL_OBJ_CRITICAL:
 				critical = object.len && *object.ptr;
 				DBG2(DBG_ASN, "  %s", critical ? "TRUE" : "FALSE");
 				break;
-			case CRL_OBJ_CRL_ENTRY_EXTN_VALUE:
 			case CRL_OBJ_EXTN_VALUE:
 			{
 				int extn_oid = asn1_known_oid(extnID);
 
 				switch (extn_oid)
 				{
-					case OID_CRL_REASON_CODE:
-						if (revoked)
-						{
-							if (object.len && *object.ptr == ASN1_ENUMERATED &&
-								asn1_length(&object) == 1)
-							{
-								revoked->reason = *object.ptr;
-							}
-							DBG2(DBG_ASN, "  '%N'", crl_reason_names,
-								 revoked->reason);
-						}
-						break;
 					case OID_AUTHORITY_KEY_ID:
 						this->authKeyIdentifier =
 							x509_parse_authorityKeyIdentifier(
@@ -321,8 +503,7 @@ static bool parse(private_x509_crl_t *this)
 						this->baseCrlNumber = object;
 						break;
 					default:
-						if (critical && lib->settings->get_bool(lib->settings,
-							"libstrongswan.x509.enforce_critical", TRUE))
+						if (critical && enforce)
 						{
 							DBG1(DBG_ASN, "critical '%s' extension not supported",
 								 (extn_oid == OID_UNKNOWN) ? "unknown" :
@@ -358,7 +539,38 @@ end:
 }
 
 /**
- * enumerator filter callback for create_enumerator
+ * Enumerator over revoked certificates, parsing them from the encoding
+ */
+typedef struct {
+	/** implements enumerator_t */
+	enumerator_t public;
+	/** remaining revoked certificate entries */
+	chunk_t entries;
+} revoked_enumerator_t;
+
+METHOD(enumerator_t, revoked_enumerate, bool,
+	revoked_enumerator_t *this, chunk_t *serial, time_t *date,
+	crl_reason_t *reason)
+{
+	chunk_t entry, userCertificate;
+
+	while (this->entries.len)
+	{
+		if (asn1_unwrap(&this->entries, &entry) == ASN1_SEQUENCE &&
+			parse_entry(entry, FALSE, &userCertificate, date, reason))
+		{
+			if (serial)
+			{
+				*serial = userCertificate;
+			}
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * enumerator filter callback for create_enumerator of a generated CRL
  */
 static bool filter(void *data, revoked_t **revoked, chunk_t *serial, void *p2,
 				   time_t *date, void *p3, crl_reason_t *reason)
@@ -413,9 +625,52 @@ METHOD(crl_t, create_delta_crl_uri_enumerator, enumerator_t*,
 METHOD(crl_t, create_enumerator, enumerator_t*,
 	private_x509_crl_t *this)
 {
-	return enumerator_create_filter(
+	revoked_enumerator_t *enumerator;
+
+	if (!this->encoding.ptr)
+	{	/* not yet generated */
+		return enumerator_create_filter(
 								this->revoked->create_enumerator(this->revoked),
 								(void*)filter, NULL, NULL);
+	}
+	INIT(enumerator,
+		.public = {
+			.enumerate = (void*)_revoked_enumerate,
+			.destroy = (void*)free,
+		},
+		.entries = this->revokedCertificates,
+	);
+	return &enumerator->public;
+}
+
+METHOD(crl_t, is_revoked, bool,
+	private_x509_crl_t *this, chunk_t serial, time_t *date,
+	crl_reason_t *reason)
+{
+	chunk_t current;
+	u_int low = 0, high = this->count, mid;
+	int cmp;
+
+	while (low < high)
+	{
+		mid = low + (high - low) / 2;
+		current = get_entry_serial(this, this->index[mid]);
+		cmp = serial_cmp(serial, current);
+		if (cmp == 0)
+		{
+			return parse_entry(get_entry(this, this->index[mid]), FALSE,
+							   &current, date, reason);
+		}
+		if (cmp < 0)
+		{
+			high = mid;
+		}
+		else
+		{
+			low = mid + 1;
+		}
+	}
+	return FALSE;
 }
 
 METHOD(certificate_t, get_type, certificate_type_t,
@@ -590,6 +845,7 @@ METHOD(certificate_t, destroy, void,
 		this->crl_uris->destroy_function(this->crl_uris, (void*)cdp_destroy);
 		DESTROY_IF(this->issuer);
 		free(this->authKeyIdentifier.ptr);
+		free(this->index);
 		free(this->encoding.ptr);
 		if (this->generated)
 		{
@@ -631,6 +887,7 @@ static private_x509_crl_t* create_empty(void)
 				.is_delta_crl = _is_delta_crl,
 				.create_delta_crl_uri_enumerator = _create_delta_crl_uri_enumerator,
 				.create_enumerator = _create_enumerator,
+				.is_revoked = _is_revoked,
 			},
 		},
 		.revoked = linked_list_create(),
@@ -704,10 +961,12 @@ static bool generate(private_x509_crl_t *this, certificate_t *cert,
 {
 	chunk_t extensions = chunk_empty, certList = chunk_empty, serial;
 	chunk_t crlDistributionPoints = chunk_empty, baseCrlNumber = chunk_empty;
+	chunk_t tbs, skip;
 	enumerator_t *enumerator;
 	crl_reason_t reason;
 	time_t date;
 	x509_t *x509;
+	int i;
 
 	x509 = (x509_t*)cert;
 
@@ -791,7 +1050,22 @@ static bool generate(private_x509_crl_t *this, certificate_t *cert,
 							this->tbsCertList,
 							asn1_algorithmIdentifier(this->algorithm),
 							asn1_bitstring("c", this->signature));
-	return TRUE;
+
+	/* skip version, signature, issuer, thisUpdate and nextUpdate to index
+	 * the generated revokedCertificates */
+	tbs = this->tbsCertList;
+	if (asn1_unwrap(&tbs, &tbs) != ASN1_SEQUENCE)
+	{
+		return FALSE;
+	}
+	for (i = 0; i < 5; i++)
+	{
+		if (asn1_unwrap(&tbs, &skip) == ASN1_INVALID)
+		{
+			return FALSE;
+		}
+	}
+	return build_index(this, tbs, FALSE);
 }
 
 /**
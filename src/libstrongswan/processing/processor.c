@@ -26,10 +26,49 @@
 #include <threading/thread.h>
 #include <threading/condvar.h>
 #include <threading/mutex.h>
+#include <threading/spinlock.h>
 #include <threading/thread_value.h>
 #include <collections/linked_list.h>
 
+/**
+ * Initial number of jobs a queue can hold before it grows
+ */
+#define QUEUE_SIZE 64
+
 typedef struct private_processor_t private_processor_t;
+typedef struct job_queue_t job_queue_t;
+typedef struct worker_thread_t worker_thread_t;
+
+/**
+ * Ring buffer of queued jobs for a single priority
+ */
+struct job_queue_t {
+
+	/**
+	 * Lock for this queue only, held just for inserting/removing a job
+	 */
+	spinlock_t *lock;
+
+	/**
+	 * Queued jobs, as ring buffer
+	 */
+	job_t **jobs;
+
+	/**
+	 * Allocated size of jobs
+	 */
+	u_int size;
+
+	/**
+	 * Index of the first queued job
+	 */
+	u_int head;
+
+	/**
+	 * Number of queued jobs
+	 */
+	u_int count;
+};
 
 /**
  * Private data of processor_t class.
@@ -63,24 +102,35 @@ struct private_processor_t {
 	linked_list_t *threads;
 
 	/**
-	 * A list of queued jobs for each priority
+	 * Idle threads waiting for a job, most recently idle last
 	 */
-	linked_list_t *jobs[JOB_PRIO_MAX];
+	linked_list_t *idle;
 
 	/**
-	 * Threads reserved for each priority
+	 * Number of threads in idle
 	 */
-	int prio_threads[JOB_PRIO_MAX];
+	refcount_t sleeping;
 
 	/**
-	 * access to job lists is locked through this mutex
+	 * Incremented for each queued job, used to detect missed jobs
 	 */
-	mutex_t *mutex;
+	refcount_t added;
 
 	/**
-	 * Condvar to wait for new jobs
+	 * A queue of jobs for each priority
 	 */
-	condvar_t *job_added;
+	job_queue_t jobs[JOB_PRIO_MAX];
+
+	/**
+	 * Threads reserved for each priority
+	 */
+	int prio_threads[JOB_PRIO_MAX];
+
+	/**
+	 * access to thread counters, the idle list and the assignment of jobs to
+	 * workers is locked through this mutex
+	 */
+	mutex_t *mutex;
 
 	/**
 	 * Condvar to wait for terminated threads
@@ -91,7 +141,7 @@ struct private_processor_t {
 /**
  * Worker thread
  */
-typedef struct {
+struct worker_thread_t {
 
 	/**
 	 * Reference to the processor
@@ -113,10 +163,139 @@ typedef struct {
 	 */
 	job_priority_t priority;
 
-} worker_thread_t;
+	/**
+	 * Protects job against concurrent cancellation
+	 */
+	mutex_t *lock;
+
+	/**
+	 * Condvar this thread waits on while idle, signaled for a single job
+	 */
+	condvar_t *wakeup;
+
+	/**
+	 * TRUE if this thread got removed from the idle list to get woken up
+	 */
+	bool woken;
+};
 
 static void process_jobs(worker_thread_t *worker);
 
+/**
+ * Create a worker thread, returns NULL on failure
+ */
+static worker_thread_t *worker_create(private_processor_t *this)
+{
+	worker_thread_t *worker;
+
+	INIT(worker,
+		.processor = this,
+		.lock = mutex_create(MUTEX_TYPE_DEFAULT),
+		.wakeup = condvar_create(CONDVAR_TYPE_DEFAULT),
+	);
+	worker->thread = thread_create((thread_main_t)process_jobs, worker);
+	if (!worker->thread)
+	{
+		worker->wakeup->destroy(worker->wakeup);
+		worker->lock->destroy(worker->lock);
+		free(worker);
+		return NULL;
+	}
+	return worker;
+}
+
+/**
+ * Destroy a worker thread after it got joined
+ */
+static void worker_destroy(worker_thread_t *worker)
+{
+	worker->wakeup->destroy(worker->wakeup);
+	worker->lock->destroy(worker->lock);
+	free(worker);
+}
+
+/**
+ * Add a job to the ring buffer of a queue
+ */
+static void enqueue(job_queue_t *queue, job_t *job)
+{
+	queue->lock->lock(queue->lock);
+	if (queue->count == queue->size)
+	{	/* grow the ring buffer, and unwrap it while at it */
+		job_t **jobs;
+		u_int first;
+
+		jobs = malloc(sizeof(job_t*) * queue->size * 2);
+		first = queue->size - queue->head;
+		memcpy(jobs, queue->jobs + queue->head, sizeof(job_t*) * first);
+		memcpy(jobs + first, queue->jobs, sizeof(job_t*) * queue->head);
+		free(queue->jobs);
+		queue->jobs = jobs;
+		queue->head = 0;
+		queue->size *= 2;
+	}
+	queue->jobs[(queue->head + queue->count) % queue->size] = job;
+	queue->count++;
+	queue->lock->unlock(queue->lock);
+}
+
+/**
+ * Remove the first job from a queue, returns NULL if empty
+ */
+static job_t *dequeue(job_queue_t *queue)
+{
+	job_t *job = NULL;
+
+	queue->lock->lock(queue->lock);
+	if (queue->count)
+	{
+		job = queue->jobs[queue->head];
+		queue->head = (queue->head + 1) % queue->size;
+		queue->count--;
+	}
+	queue->lock->unlock(queue->lock);
+	return job;
+}
+
+/**
+ * Queue a job and wake up a single idle thread, if any
+ */
+static void add_job(private_processor_t *this, job_t *job, job_priority_t prio)
+{
+	worker_thread_t *worker;
+
+	enqueue(&this->jobs[prio], job);
+	/* the full barrier in ref_get() orders this against the check of
+	 * sleeping threads, see wait_for_job() */
+	ref_get(&this->added);
+	if (this->sleeping)
+	{
+		this->mutex->lock(this->mutex);
+		if (this->idle->remove_last(this->idle, (void**)&worker) == SUCCESS)
+		{
+			ignore_result(ref_put(&this->sleeping));
+			worker->woken = TRUE;
+			worker->wakeup->signal(worker->wakeup);
+		}
+		this->mutex->unlock(this->mutex);
+	}
+}
+
+/**
+ * Wake up all idle threads, mutex must be held
+ */
+static void wakeup_all(private_processor_t *this)
+{
+	worker_thread_t *worker;
+
+	while (this->idle->remove_last(this->idle, (void**)&worker) == SUCCESS)
+	{
+		ignore_result(ref_put(&this->sleeping));
+		worker->woken = TRUE;
+		worker->wakeup->signal(worker->wakeup);
+	}
+}
+
 /**
  * restart a terminated thread
  */
@@ -129,27 +308,24 @@ static void restart(worker_thread_t *worker)
 	this->mutex->lock(this->mutex);
 	/* cleanup worker thread  */
 	this->working_threads[worker->priority]--;
+	worker->lock->lock(worker->lock);
 	worker->job->status = JOB_STATUS_CANCELED;
 	worker->job->destroy(worker->job);
 	worker->job = NULL;
+	worker->lock->unlock(worker->lock);
 
 	/* respawn thread if required */
 	if (this->desired_threads >= this->total_threads)
 	{
 		worker_thread_t *new_worker;
 
-		INIT(new_worker,
-			.processor = this,
-		);
-		new_worker->thread = thread_create((thread_main_t)process_jobs,
-										   new_worker);
-		if (new_worker->thread)
+		new_worker = worker_create(this);
+		if (new_worker)
 		{
 			this->threads->insert_last(this->threads, new_worker);
 			this->mutex->unlock(this->mutex);
 			return;
 		}
-		free(new_worker);
 	}
 	this->total_threads--;
 	this->thread_terminated->signal(this->thread_terminated);
@@ -171,12 +347,163 @@ static u_int get_idle_threads_nolock(private_processor_t *this)
 	return count;
 }
 
+/**
+ * Get the next job to execute while respecting reserved threads, mutex must
+ * be held. Jobs are assigned under the mutex, so cancel() sees all of them.
+ */
+static bool get_job(private_processor_t *this, worker_thread_t *worker)
+{
+	int i, reserved = 0, idle;
+	job_t *job;
+
+	idle = get_idle_threads_nolock(this);
+
+	for (i = 0; i < JOB_PRIO_MAX; i++)
+	{
+		if (reserved && reserved >= idle)
+		{
+			DBG2(DBG_JOB, "delaying %N priority jobs: %d threads idle, "
+				 "but %d reserved for higher priorities",
+				 job_priority_names, i, idle, reserved);
+			return FALSE;
+		}
+		if (this->working_threads[i] < this->prio_threads[i])
+		{
+			reserved += this->prio_threads[i] - this->working_threads[i];
+		}
+		job = dequeue(&this->jobs[i]);
+		if (job)
+		{
+			this->working_threads[i]++;
+			worker->lock->lock(worker->lock);
+			worker->job = job;
+			worker->job->status = JOB_STATUS_EXECUTING;
+			worker->priority = i;
+			worker->lock->unlock(worker->lock);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * Execute the job assigned to a worker and requeue/destroy it, returns FALSE
+ * if the thread should terminate. Called without holding the mutex, the
+ * caller updates the working thread counter afterwards.
+ */
+static bool execute_job(private_processor_t *this, worker_thread_t *worker)
+{
+	job_requeue_t requeue;
+	job_t *job;
+	bool canceled;
+
+	/* canceled threads are restarted to get a constant pool */
+	thread_cleanup_push((thread_cleanup_t)restart, worker);
+	while (TRUE)
+	{
+		requeue = worker->job->execute(worker->job);
+		if (requeue.type != JOB_REQUEUE_TYPE_DIRECT)
+		{
+			break;
+		}
+		else if (!worker->job->cancel)
+		{	/* only allow cancelable jobs to requeue directly */
+			requeue.type = JOB_REQUEUE_TYPE_FAIR;
+			break;
+		}
+	}
+	thread_cleanup_pop(FALSE);
+
+	worker->lock->lock(worker->lock);
+	job = worker->job;
+	worker->job = NULL;
+	canceled = job->status == JOB_STATUS_CANCELED;
+	worker->lock->unlock(worker->lock);
+
+	if (canceled)
+	{	/* job was canceled via a custom cancel() method or did not
+		 * use JOB_REQUEUE_TYPE_DIRECT */
+		job->destroy(job);
+		return FALSE;
+	}
+	switch (requeue.type)
+	{
+		case JOB_REQUEUE_TYPE_NONE:
+			job->status = JOB_STATUS_DONE;
+			job->destroy(job);
+			break;
+		case JOB_REQUEUE_TYPE_FAIR:
+			job->status = JOB_STATUS_QUEUED;
+			add_job(this, job, worker->priority);
+			break;
+		case JOB_REQUEUE_TYPE_SCHEDULE:
+			switch (requeue.schedule)
+			{
+				case JOB_SCHEDULE:
+					lib->scheduler->schedule_job(lib->scheduler, job,
+												 requeue.time.rel);
+					break;
+				case JOB_SCHEDULE_MS:
+					lib->scheduler->schedule_job_ms(lib->scheduler, job,
+													requeue.time.rel);
+					break;
+				case JOB_SCHEDULE_TV:
+					lib->scheduler->schedule_job_tv(lib->scheduler, job,
+													requeue.time.abs);
+					break;
+			}
+			break;
+		default:
+			break;
+	}
+	return TRUE;
+}
+
+/**
+ * Terminate the calling thread if the pool is too large, mutex must be held
+ */
+static bool terminate_nolock(private_processor_t *this)
+{
+	if (this->desired_threads < this->total_threads)
+	{
+		this->total_threads--;
+		this->thread_terminated->signal(this->thread_terminated);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * Wait until a job gets queued, mutex must be held.
+ * Jobs queued since added was read are not missed: either we see the new
+ * value before sleeping, or the queueing thread sees us sleeping.
+ */
+static void wait_for_job(private_processor_t *this, worker_thread_t *worker,
+						 u_int added)
+{
+	worker->woken = FALSE;
+	this->idle->insert_last(this->idle, worker);
+	ref_get(&this->sleeping);
+	if (this->added != added)
+	{
+		this->idle->remove(this->idle, worker, NULL);
+		ignore_result(ref_put(&this->sleeping));
+		return;
+	}
+	while (!worker->woken)
+	{
+		worker->wakeup->wait(worker->wakeup, this->mutex);
+	}
+}
+
 /**
  * Process queued jobs, called by the worker threads
  */
 static void process_jobs(worker_thread_t *worker)
 {
 	private_processor_t *this = worker->processor;
+	bool executed;
+	u_int added;
 
 	/* worker threads are not cancelable by default */
 	thread_cancelability(FALSE);
@@ -184,103 +511,25 @@ static void process_jobs(worker_thread_t *worker)
 	DBG2(DBG_JOB, "started worker thread %.2u", thread_current_id());
 
 	this->mutex->lock(this->mutex);
-	while (this->desired_threads >= this->total_threads)
+	while (!terminate_nolock(this))
 	{
-		int i, reserved = 0, idle;
-
-		idle = get_idle_threads_nolock(this);
-
-		for (i = 0; i < JOB_PRIO_MAX; i++)
+		added = this->added;
+		if (get_job(this, worker))
 		{
-			if (reserved && reserved >= idle)
+			this->mutex->unlock(this->mutex);
+			executed = execute_job(this, worker);
+			this->mutex->lock(this->mutex);
+			this->working_threads[worker->priority]--;
+			if (!executed)
 			{
-				DBG2(DBG_JOB, "delaying %N priority jobs: %d threads idle, "
-					 "but %d reserved for higher priorities",
-					 job_priority_names, i, idle, reserved);
+				this->total_threads--;
+				this->thread_terminated->signal(this->thread_terminated);
 				break;
 			}
-			if (this->working_threads[i] < this->prio_threads[i])
-			{
-				reserved += this->prio_threads[i] - this->working_threads[i];
-			}
-			if (this->jobs[i]->remove_first(this->jobs[i],
-											(void**)&worker->job) == SUCCESS)
-			{
-				job_requeue_t requeue;
-
-				this->working_threads[i]++;
-				worker->job->status = JOB_STATUS_EXECUTING;
-				worker->priority = i;
-				this->mutex->unlock(this->mutex);
-				/* canceled threads are restarted to get a constant pool */
-				thread_cleanup_push((thread_cleanup_t)restart, worker);
-				while (TRUE)
-				{
-					requeue = worker->job->execute(worker->job);
-					if (requeue.type != JOB_REQUEUE_TYPE_DIRECT)
-					{
-						break;
-					}
-					else if (!worker->job->cancel)
-					{	/* only allow cancelable jobs to requeue directly */
-						requeue.type = JOB_REQUEUE_TYPE_FAIR;
-						break;
-					}
-				}
-				thread_cleanup_pop(FALSE);
-				this->mutex->lock(this->mutex);
-				this->working_threads[i]--;
-				if (worker->job->status == JOB_STATUS_CANCELED)
-				{	/* job was canceled via a custom cancel() method or did not
-					 * use JOB_REQUEUE_TYPE_DIRECT */
-					worker->job->destroy(worker->job);
-					break;
-				}
-				switch (requeue.type)
-				{
-					case JOB_REQUEUE_TYPE_NONE:
-						worker->job->status = JOB_STATUS_DONE;
-						worker->job->destroy(worker->job);
-						break;
-					case JOB_REQUEUE_TYPE_FAIR:
-						worker->job->status = JOB_STATUS_QUEUED;
-						this->jobs[i]->insert_last(this->jobs[i],
-												   worker->job);
-						this->job_added->signal(this->job_added);
-						break;
-					case JOB_REQUEUE_TYPE_SCHEDULE:
-						/* scheduler_t does not hold its lock when queeuing jobs
-						 * so this should be safe without unlocking our mutex */
-						switch (requeue.schedule)
-						{
-							case JOB_SCHEDULE:
-								lib->scheduler->schedule_job(lib->scheduler,
-											worker->job, requeue.time.rel);
-								break;
-							case JOB_SCHEDULE_MS:
-								lib->scheduler->schedule_job_ms(lib->scheduler,
-											worker->job, requeue.time.rel);
-								break;
-							case JOB_SCHEDULE_TV:
-								lib->scheduler->schedule_job_tv(lib->scheduler,
-											worker->job, requeue.time.abs);
-								break;
-						}
-						break;
-					default:
-						break;
-				}
-				break;
-			}
-		}
-		if (!worker->job)
-		{
-			this->job_added->wait(this->job_added, this->mutex);
+			continue;
 		}
-		worker->job = NULL;
+		wait_for_job(this, worker, added);
 	}
-	this->total_threads--;
-	this->thread_terminated->signal(this->thread_terminated);
 	this->mutex->unlock(this->mutex);
 }
 
@@ -332,12 +581,13 @@ METHOD(processor_t, get_working_threads, u_int,
 METHOD(processor_t, get_job_load, u_int,
 	private_processor_t *this, job_priority_t prio)
 {
+	job_queue_t *queue;
 	u_int load;
 
-	prio = sane_prio(prio);
-	this->mutex->lock(this->mutex);
-	load = this->jobs[prio]->get_count(this->jobs[prio]);
-	this->mutex->unlock(this->mutex);
+	queue = &this->jobs[sane_prio(prio)];
+	queue->lock->lock(queue->lock);
+	load = queue->count;
+	queue->lock->unlock(queue->lock);
 	return load;
 }
 
@@ -349,10 +599,7 @@ METHOD(processor_t, queue_job, void,
 	prio = sane_prio(job->get_priority(job));
 	job->status = JOB_STATUS_QUEUED;
 
-	this->mutex->lock(this->mutex);
-	this->jobs[prio]->insert_last(this->jobs[prio], job);
-	this->job_added->signal(this->job_added);
-	this->mutex->unlock(this->mutex);
+	add_job(this, job, prio);
 }
 
 METHOD(processor_t, set_threads, void,
@@ -368,26 +615,19 @@ METHOD(processor_t, set_threads, void,
 		DBG1(DBG_JOB, "spawning %d worker threads", count - this->total_threads);
 		for (i = this->total_threads; i < count; i++)
 		{
-			INIT(worker,
-				.processor = this,
-			);
-			worker->thread = thread_create((thread_main_t)process_jobs, worker);
-			if (worker->thread)
+			worker = worker_create(this);
+			if (worker)
 			{
 				this->threads->insert_last(this->threads, worker);
 				this->total_threads++;
 			}
-			else
-			{
-				free(worker);
-			}
 		}
 	}
 	else if (count < this->total_threads)
 	{	/* decrease thread count */
 		this->desired_threads = count;
 	}
-	this->job_added->broadcast(this->job_added);
+	wakeup_all(this);
 	this->mutex->unlock(this->mutex);
 }
 
@@ -403,6 +643,7 @@ METHOD(processor_t, cancel, void,
 	enumerator = this->threads->create_enumerator(this->threads);
 	while (enumerator->enumerate(enumerator, (void**)&worker))
 	{
+		worker->lock->lock(worker->lock);
 		if (worker->job && worker->job->cancel)
 		{
 			worker->job->status = JOB_STATUS_CANCELED;
@@ -412,18 +653,19 @@ METHOD(processor_t, cancel, void,
 				worker->thread->cancel(worker->thread);
 			}
 		}
+		worker->lock->unlock(worker->lock);
 	}
 	enumerator->destroy(enumerator);
 	while (this->total_threads > 0)
 	{
-		this->job_added->broadcast(this->job_added);
+		wakeup_all(this);
 		this->thread_terminated->wait(this->thread_terminated, this->mutex);
 	}
 	while (this->threads->remove_first(this->threads,
 									  (void**)&worker) == SUCCESS)
 	{
 		worker->thread->join(worker->thread);
-		free(worker);
+		worker_destroy(worker);
 	}
 	this->mutex->unlock(this->mutex);
 }
@@ -435,13 +677,20 @@ METHOD(processor_t, destroy, void,
 
 	cancel(this);
 	this->thread_terminated->destroy(this->thread_terminated);
-	this->job_added->destroy(this->job_added);
 	this->mutex->destroy(this->mutex);
 	for (i = 0; i < JOB_PRIO_MAX; i++)
 	{
-		this->jobs[i]->destroy_offset(this->jobs[i], offsetof(job_t, destroy));
+		job_t *job;
+
+		while ((job = dequeue(&this->jobs[i])))
+		{
+			job->destroy(job);
+		}
+		this->jobs[i].lock->destroy(this->jobs[i].lock);
+		free(this->jobs[i].jobs);
 	}
 	this->threads->destroy(this->threads);
+	this->idle->destroy(this->idle);
 	free(this);
 }
 
@@ -465,13 +714,17 @@ processor_t *processor_create()
 			.destroy = _destroy,
 		},
 		.threads = linked_list_create(),
+		.idle = linked_list_create(),
 		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
-		.job_added = condvar_create(CONDVAR_TYPE_DEFAULT),
 		.thread_terminated = condvar_create(CONDVAR_TYPE_DEFAULT),
 	);
 	for (i = 0; i < JOB_PRIO_MAX; i++)
 	{
-		this->jobs[i] = linked_list_create();
+		this->jobs[i] = (job_queue_t){
+			.lock = spinlock_create(),
+			.jobs = malloc(sizeof(job_t*) * QUEUE_SIZE),
+			.size = QUEUE_SIZE,
+		};
 		this->prio_threads[i] = lib->settings->get_int(lib->settings,
 						"libstrongswan.processor.priority_threads.%N", 0,
 						job_priority_names, i);
@@ -25,9 +25,25 @@
 #include <threading/thread.h>
 #include <threading/condvar.h>
 #include <threading/mutex.h>
+#include <collections/hashtable.h>
 
-/* the initial size of the heap */
-#define HEAP_SIZE_DEFAULT 64
+/* resolution of the timing wheels, in ms */
+#define TICK_MS 10
+
+/* number of wheels */
+#define WHEELS 4
+
+/* bits of a tick used to select the slot in a wheel */
+#define WHEEL_BITS 8
+
+/* number of slots per wheel */
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+
+/* mask to get the slot in a wheel */
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+/* maximum number of unused events kept for reuse */
+#define EVENT_CACHE 1024
 
 typedef struct event_t event_t;
 
@@ -35,25 +51,37 @@ typedef struct event_t event_t;
  * Event containing a job and a schedule time
  */
 struct event_t {
+
 	/**
-	 * Time to fire the event.
+	 * Tick to fire the event.
 	 */
-	timeval_t time;
+	u_int64_t tick;
 
 	/**
 	 * Every event has its assigned job.
 	 */
 	job_t *job;
-};
 
-/**
- * destroy an event and its job
- */
-static void event_destroy(event_t *event)
-{
-	event->job->destroy(event->job);
-	free(event);
-}
+	/**
+	 * Identifier to cancel the event, 0 if not cancelable
+	 */
+	u_int id;
+
+	/**
+	 * Slot the event is linked in
+	 */
+	event_t **slot;
+
+	/**
+	 * Previous event in the same slot
+	 */
+	event_t *prev;
+
+	/**
+	 * Next event in the same slot, or in a list of expired events
+	 */
+	event_t *next;
+};
 
 typedef struct private_scheduler_t private_scheduler_t;
 
@@ -68,20 +96,45 @@ struct private_scheduler_t {
 	 scheduler_t public;
 
 	/**
-	 * The heap in which the events are stored.
+	 * The timing wheels, each slot a list of events
+	 */
+	event_t *wheels[WHEELS][WHEEL_SIZE];
+
+	/**
+	 * Next tick to process, all earlier ticks have been processed
 	 */
-	event_t **heap;
+	u_int64_t current;
 
 	/**
-	 * The size of the heap.
+	 * Tick the scheduler thread waits for, if waiting
 	 */
-	u_int heap_size;
+	u_int64_t next;
 
 	/**
 	 * The number of scheduled events.
 	 */
 	u_int event_count;
 
+	/**
+	 * Cancelable events, u_int => event_t
+	 */
+	hashtable_t *ids;
+
+	/**
+	 * Last assigned event identifier
+	 */
+	u_int last_id;
+
+	/**
+	 * Unused events kept for reuse, linked by next
+	 */
+	event_t *cache;
+
+	/**
+	 * Number of events in cache
+	 */
+	u_int cache_count;
+
 	/**
 	 * Exclusive access to list
 	 */
@@ -94,84 +147,232 @@ struct private_scheduler_t {
 };
 
 /**
- * Comparse two timevals, return >0 if a > b, <0 if a < b and =0 if equal
+ * Hash function for event identifiers
  */
-static int timeval_cmp(timeval_t *a, timeval_t *b)
+static u_int id_hash(void *key)
 {
-	if (a->tv_sec > b->tv_sec)
+	return (uintptr_t)key;
+}
+
+/**
+ * Comparison function for event identifiers
+ */
+static bool id_equals(void *key, void *other_key)
+{
+	return key == other_key;
+}
+
+/**
+ * Convert a monotonic time to ticks, rounded down or up
+ */
+static u_int64_t time2tick(timeval_t *tv, bool up)
+{
+	u_int64_t ms;
+
+	ms = (u_int64_t)tv->tv_sec * 1000;
+	if (up)
 	{
-		return 1;
+		ms += (tv->tv_usec + 999) / 1000;
+		return (ms + TICK_MS - 1) / TICK_MS;
 	}
-	if (a->tv_sec < b->tv_sec)
+	ms += tv->tv_usec / 1000;
+	return ms / TICK_MS;
+}
+
+/**
+ * Convert ticks to a monotonic time
+ */
+static timeval_t tick2time(u_int64_t tick)
+{
+	timeval_t tv;
+
+	tv.tv_sec = tick * TICK_MS / 1000;
+	tv.tv_usec = (tick * TICK_MS % 1000) * 1000;
+	return tv;
+}
+
+/**
+ * Get the current tick
+ */
+static u_int64_t current_tick()
+{
+	timeval_t tv;
+
+	time_monotonic(&tv);
+	return time2tick(&tv, FALSE);
+}
+
+/**
+ * Get an unused event, from the cache if possible
+ */
+static event_t *event_get(private_scheduler_t *this)
+{
+	event_t *event;
+
+	if (this->cache)
 	{
-		return -1;
+		event = this->cache;
+		this->cache = event->next;
+		this->cache_count--;
+		return event;
 	}
-	if (a->tv_usec > b->tv_usec)
+	return malloc_thing(event_t);
+}
+
+/**
+ * Put an unused event back to the cache, or free it
+ */
+static void event_put(private_scheduler_t *this, event_t *event)
+{
+	if (this->cache_count < EVENT_CACHE)
+	{
+		event->next = this->cache;
+		this->cache = event;
+		this->cache_count++;
+		return;
+	}
+	free(event);
+}
+
+/**
+ * Link an event into the slot of the wheel matching its tick
+ */
+static void link_event(private_scheduler_t *this, event_t *event)
+{
+	u_int64_t tick, delta;
+	int wheel;
+
+	tick = max(event->tick, this->current);
+	delta = tick - this->current;
+	for (wheel = 0; wheel < WHEELS - 1; wheel++)
 	{
-		return 1;
+		if (delta < (1ULL << (WHEEL_BITS * (wheel + 1))))
+		{
+			break;
+		}
+	}
+	if (delta >= (1ULL << (WHEEL_BITS * WHEELS)))
+	{	/* too far in the future, cascaded again from the last wheel */
+		tick = this->current + (1ULL << (WHEEL_BITS * WHEELS)) - 1;
 	}
-	if (a->tv_usec < b->tv_usec)
+	event->slot = &this->wheels[wheel][(tick >> (WHEEL_BITS * wheel)) &
+									   WHEEL_MASK];
+	event->prev = NULL;
+	event->next = *event->slot;
+	if (event->next)
 	{
-		return -1;
+		event->next->prev = event;
 	}
-	return 0;
+	*event->slot = event;
 }
 
 /**
- * Returns the top event without removing it. Returns NULL if the heap is empty.
+ * Unlink an event from its slot
  */
-static event_t *peek_event(private_scheduler_t *this)
+static void unlink_event(event_t *event)
 {
-	return this->event_count > 0 ? this->heap[1] : NULL;
+	if (event->prev)
+	{
+		event->prev->next = event->next;
+	}
+	else
+	{
+		*event->slot = event->next;
+	}
+	if (event->next)
+	{
+		event->next->prev = event->prev;
+	}
 }
 
 /**
- * Removes the top event from the heap and returns it. Returns NULL if the heap
- * is empty.
+ * Redistribute the events of a slot to the lower wheels
  */
-static event_t *remove_event(private_scheduler_t *this)
+static void cascade(private_scheduler_t *this, int wheel, u_int slot)
 {
-	event_t *event, *top;
-	if (!this->event_count)
+	event_t *event, *next;
+
+	event = this->wheels[wheel][slot];
+	this->wheels[wheel][slot] = NULL;
+	while (event)
 	{
-		return NULL;
+		next = event->next;
+		link_event(this, event);
+		event = next;
 	}
+}
 
-	/* store the value to return */
-	event = this->heap[1];
-	/* move the bottom event to the top */
-	top = this->heap[1] = this->heap[this->event_count];
+/**
+ * Process all ticks up to now, returns the list of expired events
+ */
+static event_t *expire(private_scheduler_t *this, u_int64_t now)
+{
+	event_t *expired = NULL, *event, *last;
+	u_int slot;
+	int wheel;
 
-	if (--this->event_count > 1)
+	if (!this->event_count)
+	{	/* nothing to cascade, skip idle time */
+		this->current = max(this->current, now + 1);
+		return NULL;
+	}
+	while (this->current <= now && this->event_count)
 	{
-		/* seep down the top event */
-		u_int position = 1;
-		while ((position << 1) <= this->event_count)
+		slot = this->current & WHEEL_MASK;
+		/* cascade higher wheels whenever a lower wheel completed a turn */
+		for (wheel = 1; wheel < WHEELS && slot == 0; wheel++)
 		{
-			u_int child = position << 1;
-
-			if ((child + 1) <= this->event_count &&
-				timeval_cmp(&this->heap[child + 1]->time,
-							&this->heap[child]->time) < 0)
+			slot = (this->current >> (WHEEL_BITS * wheel)) & WHEEL_MASK;
+			cascade(this, wheel, slot);
+		}
+		event = this->wheels[0][this->current & WHEEL_MASK];
+		if (event)
+		{
+			this->wheels[0][this->current & WHEEL_MASK] = NULL;
+			for (last = event; ; last = last->next)
 			{
-				/* the "right" child is smaller */
-				child++;
+				this->event_count--;
+				if (last->id)
+				{
+					this->ids->remove(this->ids, (void*)(uintptr_t)last->id);
+				}
+				if (!last->next)
+				{
+					break;
+				}
 			}
+			last->next = expired;
+			expired = event;
+		}
+		this->current++;
+	}
+	if (!this->event_count)
+	{
+		this->current = max(this->current, now + 1);
+	}
+	return expired;
+}
 
-			if (timeval_cmp(&top->time, &this->heap[child]->time) <= 0)
-			{
-				/* the top event fires before the smaller of the two children,
-				 * stop */
-				break;
-			}
+/**
+ * Get the tick at which the wheels have to be processed next
+ */
+static u_int64_t next_tick(private_scheduler_t *this)
+{
+	u_int slot;
 
-			/* swap with the smaller child */
-			this->heap[position] = this->heap[child];
-			position = child;
+	if (!(this->current & WHEEL_MASK))
+	{	/* higher wheels have to be cascaded first */
+		return this->current;
+	}
+	for (slot = this->current & WHEEL_MASK; slot < WHEEL_SIZE; slot++)
+	{
+		if (this->wheels[0][slot])
+		{
+			return (this->current & ~(u_int64_t)WHEEL_MASK) + slot;
 		}
-		this->heap[position] = top;
 	}
-	return event;
+	/* nothing in the first wheel, wait until it completes its turn */
+	return (this->current | WHEEL_MASK) + 1;
 }
 
 /**
@@ -179,43 +380,51 @@ static event_t *remove_event(private_scheduler_t *this)
  */
 static job_requeue_t schedule(private_scheduler_t * this)
 {
-	timeval_t now;
-	event_t *event;
+	event_t *expired, *event;
+	timeval_t tv;
+	u_int64_t now;
 	bool timed = FALSE, oldstate;
 
 	this->mutex->lock(this->mutex);
 
-	time_monotonic(&now);
-
-	if ((event = peek_event(this)) != NULL)
+	now = current_tick();
+	expired = expire(this, now);
+	if (expired)
 	{
-		if (timeval_cmp(&now, &event->time) >= 0)
+		this->mutex->unlock(this->mutex);
+		for (event = expired; event; event = event->next)
 		{
-			remove_event(this);
-			this->mutex->unlock(this->mutex);
 			DBG2(DBG_JOB, "got event, queuing job for execution");
 			lib->processor->queue_job(lib->processor, event->job);
-			free(event);
-			return JOB_REQUEUE_DIRECT;
 		}
-		timersub(&event->time, &now, &now);
-		if (now.tv_sec)
+		this->mutex->lock(this->mutex);
+		while (expired)
 		{
-			DBG2(DBG_JOB, "next event in %ds %dms, waiting",
-				 now.tv_sec, now.tv_usec/1000);
-		}
-		else
-		{
-			DBG2(DBG_JOB, "next event in %dms, waiting", now.tv_usec/1000);
+			event = expired;
+			expired = event->next;
+			event_put(this, event);
 		}
+		this->mutex->unlock(this->mutex);
+		return JOB_REQUEUE_DIRECT;
+	}
+	if (this->event_count)
+	{
+		this->next = next_tick(this);
+		DBG2(DBG_JOB, "next check in %dms, waiting",
+			 (int)((this->next - now) * TICK_MS));
 		timed = TRUE;
 	}
+	else
+	{
+		this->next = ~(u_int64_t)0;
+	}
 	thread_cleanup_push((thread_cleanup_t)this->mutex->unlock, this->mutex);
 	oldstate = thread_cancelability(TRUE);
 
 	if (timed)
 	{
-		this->condvar->timed_wait_abs(this->condvar, this->mutex, event->time);
+		tv = tick2time(this->next);
+		this->condvar->timed_wait_abs(this->condvar, this->mutex, tv);
 	}
 	else
 	{
@@ -237,42 +446,51 @@ METHOD(scheduler_t, get_job_load, u_int,
 	return count;
 }
 
-METHOD(scheduler_t, schedule_job_tv, void,
-	private_scheduler_t *this, job_t *job, timeval_t tv)
+/**
+ * Add an event to the wheels, returns the assigned identifier if cancelable
+ */
+static u_int add_event(private_scheduler_t *this, job_t *job, timeval_t tv,
+					   bool cancelable)
 {
 	event_t *event;
-	u_int position;
+	u_int id = 0;
 
-	event = malloc_thing(event_t);
-	event->job = job;
-	event->job->status = JOB_STATUS_QUEUED;
-	event->time = tv;
+	job->status = JOB_STATUS_QUEUED;
 
 	this->mutex->lock(this->mutex);
-
-	this->event_count++;
-	if (this->event_count > this->heap_size)
-	{
-		/* double the size of the heap */
-		this->heap_size <<= 1;
-		this->heap = (event_t**)realloc(this->heap,
-									(this->heap_size + 1) * sizeof(event_t*));
+	if (!this->event_count)
+	{	/* the wheels might not have been processed for a while */
+		this->current = max(this->current, current_tick());
 	}
-	/* "put" the event to the bottom */
-	position = this->event_count;
-
-	/* then bubble it up */
-	while (position > 1 && timeval_cmp(&this->heap[position >> 1]->time,
-									   &event->time) > 0)
+	event = event_get(this);
+	event->job = job;
+	event->tick = time2tick(&tv, TRUE);
+	event->id = 0;
+	if (cancelable)
 	{
-		/* parent has to be fired after the new event, move up */
-		this->heap[position] = this->heap[position >> 1];
-		position >>= 1;
+		do
+		{
+			id = ++this->last_id;
+		}
+		while (!id || this->ids->get(this->ids, (void*)(uintptr_t)id));
+		event->id = id;
+		this->ids->put(this->ids, (void*)(uintptr_t)id, event);
 	}
-	this->heap[position] = event;
+	link_event(this, event);
+	this->event_count++;
 
-	this->condvar->signal(this->condvar);
+	if (event->tick < this->next)
+	{	/* fires before the scheduler thread wakes up */
+		this->condvar->signal(this->condvar);
+	}
 	this->mutex->unlock(this->mutex);
+	return id;
+}
+
+METHOD(scheduler_t, schedule_job_tv, void,
+	private_scheduler_t *this, job_t *job, timeval_t tv)
+{
+	add_event(this, job, tv, FALSE);
 }
 
 METHOD(scheduler_t, schedule_job, void,
@@ -300,17 +518,67 @@ METHOD(scheduler_t, schedule_job_ms, void,
 	schedule_job_tv(this, job, tv);
 }
 
+METHOD(scheduler_t, schedule_job_cancelable, u_int,
+	private_scheduler_t *this, job_t *job, u_int32_t s)
+{
+	timeval_t tv;
+
+	time_monotonic(&tv);
+	tv.tv_sec += s;
+
+	return add_event(this, job, tv, TRUE);
+}
+
+METHOD(scheduler_t, cancel_job, bool,
+	private_scheduler_t *this, u_int id)
+{
+	event_t *event;
+	job_t *job;
+
+	this->mutex->lock(this->mutex);
+	event = this->ids->remove(this->ids, (void*)(uintptr_t)id);
+	if (!event)
+	{
+		this->mutex->unlock(this->mutex);
+		return FALSE;
+	}
+	unlink_event(event);
+	this->event_count--;
+	job = event->job;
+	event_put(this, event);
+	this->mutex->unlock(this->mutex);
+
+	job->status = JOB_STATUS_CANCELED;
+	job->destroy(job);
+	return TRUE;
+}
+
 METHOD(scheduler_t, destroy, void,
 	private_scheduler_t *this)
 {
 	event_t *event;
+	int wheel, slot;
+
 	this->condvar->destroy(this->condvar);
 	this->mutex->destroy(this->mutex);
-	while ((event = remove_event(this)) != NULL)
+	for (wheel = 0; wheel < WHEELS; wheel++)
 	{
-		event_destroy(event);
+		for (slot = 0; slot < WHEEL_SIZE; slot++)
+		{
+			while ((event = this->wheels[wheel][slot]) != NULL)
+			{
+				this->wheels[wheel][slot] = event->next;
+				event->job->destroy(event->job);
+				free(event);
+			}
+		}
+	}
+	while ((event = this->cache) != NULL)
+	{
+		this->cache = event->next;
+		free(event);
 	}
-	free(this->heap);
+	this->ids->destroy(this->ids);
 	free(this);
 }
 
@@ -328,19 +596,20 @@ scheduler_t * scheduler_create()
 			.schedule_job = _schedule_job,
 			.schedule_job_ms = _schedule_job_ms,
 			.schedule_job_tv = _schedule_job_tv,
+			.schedule_job_cancelable = _schedule_job_cancelable,
+			.cancel_job = _cancel_job,
 			.destroy = _destroy,
 		},
-		.heap_size = HEAP_SIZE_DEFAULT,
+		.current = current_tick(),
+		.next = ~(u_int64_t)0,
+		.ids = hashtable_create(id_hash, id_equals, 1024),
 		.mutex = mutex_create(MUTEX_TYPE_DEFAULT),
 		.condvar = condvar_create(CONDVAR_TYPE_DEFAULT),
 	);
 
-	this->heap = (event_t**)calloc(this->heap_size + 1, sizeof(event_t*));
-
 	job = callback_job_create_with_prio((callback_job_cb_t)schedule, this,
 										NULL, return_false, JOB_PRIO_CRITICAL);
 	lib->processor->queue_job(lib->processor, (job_t*)job);
 
 	return &this->public;
 }
-
@@ -31,52 +31,24 @@ typedef struct scheduler_t scheduler_t;
 /**
  * The scheduler queues timed events which are then passed to the processor.
  *
- * The scheduler is implemented as a heap. A heap is a special kind of tree-
- * based data structure that satisfies the following property: if B is a child
- * node of A, then key(A) >= (or <=) key(B). So either the element with the
- * greatest (max-heap) or the smallest (min-heap) key is the root of the heap.
- * We use a min-heap with the key being the absolute unix time at which an
- * event is scheduled. So the root is always the event that will fire next.
+ * The scheduler is implemented as a hierarchical timing wheel. Time is
+ * divided into ticks of a few milliseconds, and each of the four wheels has
+ * 256 slots holding a list of events. The first wheel holds the events
+ * firing within the next 256 ticks, one slot per tick. Each slot of the
+ * second wheel covers 256 ticks, each slot of the third 256 * 256 ticks, and
+ * so on.
  *
- * An earlier implementation of the scheduler used a sorted linked list to store
- * the events. That had the advantage that removing the next event was extremely
- * fast, also, adding an event scheduled before or after all other events was
- * equally fast (all in O(1)). The problem was, though, that adding an event
- * in-between got slower, as the number of events grew larger (O(n)).
- * For each connection there could be several events: IKE-rekey, NAT-keepalive,
- * retransmissions, expire (half-open), and others. So a gateway that probably
- * has to handle thousands of concurrent connnections has to be able to queue a
- * large number of events as fast as possible. Locking makes this even worse, to
- * provide thread-safety, no events can be processed, while an event is queued,
- * so making the insertion fast is even more important.
+ * Adding an event is done in O(1): the distance to its firing time selects
+ * the wheel, the firing time itself the slot. Once the first wheel completed
+ * a turn, the events of the next slot in the second wheel get redistributed
+ * ("cascaded") to the first wheel, and likewise for higher wheels. Every
+ * event gets cascaded at most three times, and all events of an expired slot
+ * are passed to the processor as a batch.
  *
- * That's the advantage of the heap. Adding an element to the heap can be
- * achieved in O(log n) - on the other hand, removing the root node also
- * requires O(log n) operations. Consider 10000 queued events. Inserting a new
- * event in the list implementation required up to 10000 comparisons. In the
- * heap implementation, the worst case is about 13.3 comparisons. That's a
- * drastic improvement.
- *
- * The implementation itself uses a binary tree mapped to a one-based array to
- * store the elements. This reduces storage overhead and simplifies navigation:
- * the children of the node at position n are at position 2n and 2n+1 (likewise
- * the parent node of the node at position n is at position [n/2]). Thus,
- * navigating up and down the tree is reduced to simple index computations.
- *
- * Adding an element to the heap works as follows: The heap is always filled
- * from left to right, until a row is full, then the next row is filled. Mapped
- * to an array this gets as simple as putting the new element to the first free
- * position. In a one-based array that position equals the number of elements
- * currently stored in the heap. Then the heap property has to be restored, i.e.
- * the new element has to be "bubbled up" the tree until the parent node's key
- * is smaller or the element got the new root of the tree.
- *
- * Removing the next event from the heap works similarly. The event itself is
- * the root node and stored at position 1 of the array. After removing it, the
- * root has to be replaced and the heap property has to be restored. This is
- * done by moving the bottom element (last row, rightmost element) to the root
- * and then "seep it down" by swapping it with child nodes until none of the
- * children has a smaller key or it is again a leaf node.
+ * Most events for IKE_SAs (retransmits, DPD, rekeying) are coarse and often
+ * obsolete before they fire. Events scheduled with schedule_job_cancelable()
+ * can be removed in O(1) with cancel_job(), so they do not pile up. Events
+ * fire with a granularity of a tick, but never before their scheduled time.
  */
 struct scheduler_t {
 
@@ -84,7 +56,7 @@ struct scheduler_t {
 	 * Adds a event to the queue, using a relative time offset in s.
 	 *
 	 * @param job			job to schedule
-	 * @param time			relative time to schedule job, in s
+	 * @param s				relative time to schedule job, in s
 	 */
 	void (*schedule_job) (scheduler_t *this, job_t *job, u_int32_t s);
 
@@ -92,7 +64,7 @@ struct scheduler_t {
 	 * Adds a event to the queue, using a relative time offset in ms.
 	 *
 	 * @param job			job to schedule
-	 * @param time			relative time to schedule job, in ms
+	 * @param ms			relative time to schedule job, in ms
 	 */
 	void (*schedule_job_ms) (scheduler_t *this, job_t *job, u_int32_t ms);
 
@@ -103,10 +75,32 @@ struct scheduler_t {
 	 * function.
 	 *
 	 * @param job			job to schedule
-	 * @param time			absolut time to schedule job
+	 * @param tv			absolut time to schedule job
 	 */
 	void (*schedule_job_tv) (scheduler_t *this, job_t *job, timeval_t tv);
 
+	/**
+	 * Adds a event to the queue, using a relative time offset in s, and
+	 * returns an identifier to cancel it.
+	 *
+	 * @param job			job to schedule
+	 * @param s				relative time to schedule job, in s
+	 * @return				identifier to cancel the job, never 0
+	 */
+	u_int (*schedule_job_cancelable) (scheduler_t *this, job_t *job,
+									  u_int32_t s);
+
+	/**
+	 * Cancel a job scheduled with schedule_job_cancelable().
+	 *
+	 * The job gets destroyed if it has not been passed to the processor yet.
+	 * Otherwise, or if it has already been canceled, nothing happens.
+	 *
+	 * @param id			identifier returned by schedule_job_cancelable()
+	 * @return				TRUE if the job got canceled
+	 */
+	bool (*cancel_job) (scheduler_t *this, u_int id);
+
 	/**
 	 * Returns number of jobs scheduled.
 	 *
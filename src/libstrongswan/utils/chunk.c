@@ -655,6 +655,96 @@ u_int32_t chunk_hash(chunk_t chunk)
 	return chunk_hash_inc(chunk, chunk.len);
 }
 
+/**
+ * Read a 64 bit little endian value
+ */
+static inline u_int64_t sip_read(u_char *data, size_t len)
+{
+	u_int64_t value = 0;
+
+	while (len--)
+	{
+		value = (value << 8) | data[len];
+	}
+	return value;
+}
+
+/**
+ * Rotate a 64 bit value to the left
+ */
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+/**
+ * A single SipRound
+ */
+#define SIP_ROUND() ({ \
+	v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+	v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+})
+
+/**
+ * Process a 64 bit message block with two SipRounds
+ */
+#define SIP_COMPRESS(m) ({ \
+	v3 ^= (m); SIP_ROUND(); SIP_ROUND(); v0 ^= (m); \
+})
+
+/**
+ * SipHash-2-4 over an optional 64 bit prefix followed by the chunk
+ */
+static u_int64_t siphash(chunk_t chunk, u_char *key, bool prefixed,
+						 u_int64_t prefix)
+{
+	u_int64_t v0, v1, v2, v3, k0, k1, m, len;
+
+	k0 = sip_read(key, 8);
+	k1 = sip_read(key + 8, 8);
+	v0 = k0 ^ 0x736f6d6570736575ULL;
+	v1 = k1 ^ 0x646f72616e646f6dULL;
+	v2 = k0 ^ 0x6c7967656e657261ULL;
+	v3 = k1 ^ 0x7465646279746573ULL;
+
+	len = chunk.len;
+	if (prefixed)
+	{
+		SIP_COMPRESS(prefix);
+		len += sizeof(prefix);
+	}
+	while (chunk.len >= 8)
+	{
+		m = sip_read(chunk.ptr, 8);
+		SIP_COMPRESS(m);
+		chunk = chunk_skip(chunk, 8);
+	}
+	m = (len << 56) | sip_read(chunk.ptr, chunk.len);
+	SIP_COMPRESS(m);
+
+	v2 ^= 0xff;
+	SIP_ROUND();
+	SIP_ROUND();
+	SIP_ROUND();
+	SIP_ROUND();
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * Described in header.
+ */
+u_int64_t chunk_mac_inc(chunk_t chunk, u_char *key, u_int64_t hash)
+{
+	return siphash(chunk, key, TRUE, hash);
+}
+
+/**
+ * Described in header.
+ */
+u_int64_t chunk_mac(chunk_t chunk, u_char *key)
+{
+	return siphash(chunk, key, FALSE, 0);
+}
+
 /**
  * Described in header.
  */
@@ -310,6 +310,37 @@ u_int32_t chunk_hash(chunk_t chunk);
  */
 u_int32_t chunk_hash_inc(chunk_t chunk, u_int32_t hash);
 
+/**
+ * Length of the key used by chunk_mac()
+ */
+#define CHUNK_MAC_KEY_LEN 16
+
+/**
+ * Computes a 64 bit keyed hash (SipHash-2-4) of the given chunk.
+ *
+ * In contrast to chunk_hash(), colliding inputs can't be found without
+ * knowing the key. This makes it suitable for hash tables filled with data
+ * controlled by an attacker, or as a short MAC (e.g. for cookies).
+ *
+ * @param chunk			data to hash
+ * @param key			key of CHUNK_MAC_KEY_LEN bytes
+ * @return				hash value
+ */
+u_int64_t chunk_mac(chunk_t chunk, u_char *key);
+
+/**
+ * Incremental version of chunk_mac. Use this to hash two or more chunks.
+ *
+ * The result equals the SipHash-2-4 of the 64 bit hash (little endian)
+ * followed by the chunk.
+ *
+ * @param chunk			data to hash
+ * @param key			key of CHUNK_MAC_KEY_LEN bytes
+ * @param hash			previous hash value
+ * @return				hash value
+ */
+u_int64_t chunk_mac_inc(chunk_t chunk, u_char *key, u_int64_t hash);
+
 /**
  * printf hook function for chunk_t.
  *
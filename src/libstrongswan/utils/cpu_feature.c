@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include "cpu_feature.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+
+/**
+ * Feature bits in ECX of cpuid leaf 1
+ */
+enum {
+	CPUID1_ECX_SSE3 =		(1<<0),
+	CPUID1_ECX_PCLMULQDQ =	(1<<1),
+	CPUID1_ECX_SSSE3 =		(1<<9),
+	CPUID1_ECX_SSE41 =		(1<<19),
+	CPUID1_ECX_SSE42 =		(1<<20),
+	CPUID1_ECX_AESNI =		(1<<25),
+	CPUID1_ECX_AVX =		(1<<28),
+	CPUID1_ECX_RDRAND =		(1<<30),
+};
+
+/**
+ * Feature bits in EDX of cpuid leaf 1
+ */
+enum {
+	CPUID1_EDX_SSE2 =		(1<<26),
+};
+
+/**
+ * Get cpuid for info, return eax, ebx, ecx and edx.
+ * -fPIC requires to save ebx on IA-32.
+ */
+static void cpuid(u_int op, u_int *a, u_int *b, u_int *c, u_int *d)
+{
+#ifdef __x86_64__
+	asm("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d) : "a" (op));
+#else /* __i386__ */
+	asm("pushl %%ebx;"
+		"cpuid;"
+		"movl %%ebx, %1;"
+		"popl %%ebx;"
+		: "=a" (*a), "=r" (*b), "=c" (*c), "=d" (*d) : "a" (op));
+#endif /* __x86_64__ / __i386__*/
+}
+
+/**
+ * Check a cpuid register bit for a feature, return the feature if set
+ */
+static inline cpu_feature_t f2f(u_int reg, u_int bit, cpu_feature_t feature)
+{
+	return (reg & bit) ? feature : 0;
+}
+
+/**
+ * See header
+ */
+cpu_feature_t cpu_feature_get_all()
+{
+	u_int a, b, c, d;
+	cpu_feature_t f = 0;
+
+	cpuid(0, &a, &b, &c, &d);
+	if (a < 1)
+	{	/* leaf 1 not supported */
+		return 0;
+	}
+	cpuid(1, &a, &b, &c, &d);
+
+	f |= f2f(d, CPUID1_EDX_SSE2, CPU_FEATURE_SSE2);
+	f |= f2f(c, CPUID1_ECX_SSE3, CPU_FEATURE_SSE3);
+	f |= f2f(c, CPUID1_ECX_SSSE3, CPU_FEATURE_SSSE3);
+	f |= f2f(c, CPUID1_ECX_SSE41, CPU_FEATURE_SSE41);
+	f |= f2f(c, CPUID1_ECX_SSE42, CPU_FEATURE_SSE42);
+	f |= f2f(c, CPUID1_ECX_AESNI, CPU_FEATURE_AESNI);
+	f |= f2f(c, CPUID1_ECX_PCLMULQDQ, CPU_FEATURE_PCLMULQDQ);
+	f |= f2f(c, CPUID1_ECX_AVX, CPU_FEATURE_AVX);
+	f |= f2f(c, CPUID1_ECX_RDRAND, CPU_FEATURE_RDRAND);
+
+	return f;
+}
+
+#else /* !x86 */
+
+/**
+ * See header
+ */
+cpu_feature_t cpu_feature_get_all()
+{
+	return 0;
+}
+
+#endif /* x86 */
+
+/**
+ * See header
+ */
+bool cpu_feature_available(cpu_feature_t feature)
+{
+	return (cpu_feature_get_all() & feature) == feature;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013 revosec AG
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.  See <http://www.fsf.org/copyleft/gpl.txt>.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/**
+ * @defgroup cpu_feature cpu_feature
+ * @{ @ingroup utils
+ */
+
+#ifndef CPU_FEATURE_H_
+#define CPU_FEATURE_H_
+
+#include <library.h>
+
+typedef enum cpu_feature_t cpu_feature_t;
+
+/**
+ * CPU feature flags, as reported by cpuid() on x86/x86_64.
+ */
+enum cpu_feature_t {
+	/** Streaming SIMD Extensions 2 */
+	CPU_FEATURE_SSE2 =					(1<<0),
+	/** Streaming SIMD Extensions 3 */
+	CPU_FEATURE_SSE3 =					(1<<1),
+	/** Supplemental Streaming SIMD Extensions 3 */
+	CPU_FEATURE_SSSE3 =					(1<<2),
+	/** Streaming SIMD Extensions 4.1 */
+	CPU_FEATURE_SSE41 =					(1<<3),
+	/** Streaming SIMD Extensions 4.2 */
+	CPU_FEATURE_SSE42 =					(1<<4),
+	/** Intel AES New Instructions */
+	CPU_FEATURE_AESNI =					(1<<5),
+	/** Carry-less multiplication */
+	CPU_FEATURE_PCLMULQDQ =				(1<<6),
+	/** Advanced Vector Extensions */
+	CPU_FEATURE_AVX =					(1<<7),
+	/** RDRAND random number generator */
+	CPU_FEATURE_RDRAND =				(1<<8),
+};
+
+/**
+ * Get a bitmask for all supported CPU features.
+ *
+ * On platforms not supporting cpuid(), 0 is returned.
+ *
+ * @return			bitmask of supported CPU features
+ */
+cpu_feature_t cpu_feature_get_all();
+
+/**
+ * Check if a set of CPU features is available.
+ *
+ * @param feature	feature(s) to check for
+ * @return			TRUE if all features are available
+ */
+bool cpu_feature_available(cpu_feature_t feature);
+
+#endif /** CPU_FEATURE_H_ @}*/
@@ -21,6 +21,7 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
 
 #include "identification.h"
 
@@ -646,7 +647,8 @@ static bool compare_dn(chunk_t t_dn, chunk_t o_dn, int *wc)
 METHOD(identification_t, equals_dn, bool,
 	private_identification_t *this, identification_t *other)
 {
-	return compare_dn(this->encoded, other->get_encoding(other), NULL);
+	return this->type == other->get_type(other) &&
+		   compare_dn(this->encoded, other->get_encoding(other), NULL);
 }
 
 METHOD(identification_t, equals_strcasecmp,  bool,
@@ -656,7 +658,8 @@ METHOD(identification_t, equals_strcasecmp,  bool,
 
 	/* we do some extra sanity checks to check for invalid IDs with a
 	 * terminating null in it. */
-	if (this->encoded.len == encoded.len &&
+	if (this->type == other->get_type(other) &&
+		this->encoded.len == encoded.len &&
 		memchr(this->encoded.ptr, 0, this->encoded.len) == NULL &&
 		memchr(encoded.ptr, 0, encoded.len) == NULL &&
 		strncasecmp(this->encoded.ptr, encoded.ptr, this->encoded.len) == 0)
@@ -666,6 +669,73 @@ METHOD(identification_t, equals_strcasecmp,  bool,
 	return FALSE;
 }
 
+/**
+ * Hash data ignoring the case of characters
+ */
+static u_int hash_lower(chunk_t data, u_int hash)
+{
+	u_char buf[64];
+	size_t len, i;
+
+	while (data.len)
+	{
+		len = min(data.len, sizeof(buf));
+		for (i = 0; i < len; i++)
+		{
+			buf[i] = tolower(data.ptr[i]);
+		}
+		hash = chunk_hash_inc(chunk_create(buf, len), hash);
+		data = chunk_skip(data, len);
+	}
+	return hash;
+}
+
+METHOD(identification_t, hash_binary, u_int,
+	private_identification_t *this, u_int inc)
+{
+	u_int hash;
+
+	hash = chunk_hash_inc(chunk_from_thing(this->type), inc);
+	if (this->type != ID_ANY && this->encoded.len)
+	{
+		hash = chunk_hash_inc(this->encoded, hash);
+	}
+	return hash;
+}
+
+METHOD(identification_t, hash_dn, u_int,
+	private_identification_t *this, u_int inc)
+{
+	enumerator_t *enumerator;
+	chunk_t oid, data;
+	u_char type;
+	u_int hash;
+
+	/* RDNs of some string types are compared case-insensitive, so we hash
+	 * all of them that way */
+	hash = chunk_hash_inc(chunk_from_thing(this->type), inc);
+	enumerator = create_rdn_enumerator(this->encoded);
+	while (enumerator->enumerate(enumerator, &oid, &type, &data))
+	{
+		if (oid.len)
+		{
+			hash = chunk_hash_inc(oid, hash);
+		}
+		hash = hash_lower(data, hash);
+	}
+	enumerator->destroy(enumerator);
+	return hash;
+}
+
+METHOD(identification_t, hash_strcasecmp, u_int,
+	private_identification_t *this, u_int inc)
+{
+	u_int hash;
+
+	hash = chunk_hash_inc(chunk_from_thing(this->type), inc);
+	return hash_lower(this->encoded, hash);
+}
+
 METHOD(identification_t, matches_binary, id_match_t,
 	private_identification_t *this, identification_t *other)
 {
@@ -867,6 +937,7 @@ static private_identification_t *identification_create(id_type_t type)
 		case ID_ANY:
 			this->public.matches = _matches_any;
 			this->public.equals = _equals_binary;
+			this->public.hash = _hash_binary;
 			this->public.contains_wildcards = return_true;
 			break;
 		case ID_FQDN:
@@ -874,15 +945,18 @@ static private_identification_t *identification_create(id_type_t type)
 		case ID_USER_ID:
 			this->public.matches = _matches_string;
 			this->public.equals = _equals_strcasecmp;
+			this->public.hash = _hash_strcasecmp;
 			this->public.contains_wildcards = _contains_wildcards_memchr;
 			break;
 		case ID_DER_ASN1_DN:
 			this->public.equals = _equals_dn;
+			this->public.hash = _hash_dn;
 			this->public.matches = _matches_dn;
 			this->public.contains_wildcards = _contains_wildcards_dn;
 			break;
 		default:
 			this->public.equals = _equals_binary;
+			this->public.hash = _hash_binary;
 			this->public.matches = _matches_binary;
 			this->public.contains_wildcards = return_false;
 			break;
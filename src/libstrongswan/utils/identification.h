@@ -221,11 +221,24 @@ struct identification_t {
 	/**
 	 * Check if two identification_t objects are equal.
 	 *
+	 * IDs of different types are never equal.
+	 *
 	 * @param other		other identification_t object
 	 * @return 			TRUE if the IDs are equal
 	 */
 	bool (*equals) (identification_t *this, identification_t *other);
 
+	/**
+	 * Hash an identification_t object.
+	 *
+	 * Objects considered equal by equals() get the same hash value, which
+	 * allows identities to be used as hashtable keys.
+	 *
+	 * @param inc		value to incorporate into the hash
+	 * @return			hash value
+	 */
+	u_int (*hash) (identification_t *this, u_int inc);
+
 	/**
 	 * Check if an ID matches a wildcard ID.
 	 *
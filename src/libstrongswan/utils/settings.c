@@ -32,7 +32,10 @@
 #include "settings.h"
 
 #include "collections/linked_list.h"
+#include "collections/hashtable.h"
 #include "threading/rwlock.h"
+#include "threading/spinlock.h"
+#include "utils/chunk.h"
 #include "utils/debug.h"
 
 #define MAX_INCLUSION_LEVEL		10
@@ -40,6 +43,9 @@
 typedef struct private_settings_t private_settings_t;
 typedef struct section_t section_t;
 typedef struct kv_t kv_t;
+typedef struct node_t node_t;
+typedef struct snapshot_t snapshot_t;
+typedef struct private_settings_key_t private_settings_key_t;
 
 /**
  * private data of settings
@@ -65,6 +71,26 @@ struct private_settings_t {
 	 * lock to safely access the settings
 	 */
 	rwlock_t *lock;
+
+	/**
+	 * compiled snapshot of "top" used by readers, NULL if not yet compiled
+	 */
+	snapshot_t *snapshot;
+
+	/**
+	 * snapshots replaced while readers were active, as snapshot_t
+	 */
+	linked_list_t *retired;
+
+	/**
+	 * number of threads currently reading from a snapshot
+	 */
+	refcount_t readers;
+
+	/**
+	 * generation of the settings, incremented on each change
+	 */
+	volatile u_int generation;
 };
 
 /**
@@ -104,6 +130,84 @@ struct kv_t {
 	char *value;
 };
 
+/**
+ * Immutable, hashed copy of a section, as used in snapshots
+ */
+struct node_t {
+
+	/**
+	 * name of the section
+	 */
+	char *name;
+
+	/**
+	 * subsections, char* => node_t
+	 */
+	hashtable_t *sections;
+
+	/**
+	 * key value pairs, char* => kv_t
+	 */
+	hashtable_t *kv;
+};
+
+/**
+ * Read-only snapshot of the settings tree, readable without locking
+ */
+struct snapshot_t {
+
+	/**
+	 * top level node
+	 */
+	node_t *top;
+
+	/**
+	 * generation of the settings the snapshot was compiled from
+	 */
+	u_int generation;
+};
+
+/**
+ * Private data of a settings_key_t handle
+ */
+struct private_settings_key_t {
+
+	/**
+	 * public interface
+	 */
+	settings_key_t public;
+
+	/**
+	 * settings the key is resolved against
+	 */
+	private_settings_t *settings;
+
+	/**
+	 * formatted section names and key, the last element is the key
+	 */
+	char **path;
+
+	/**
+	 * number of elements in path
+	 */
+	int count;
+
+	/**
+	 * generation the cached value was resolved in, 0 if not resolved
+	 */
+	volatile u_int generation;
+
+	/**
+	 * cached value, NULL if not found
+	 */
+	char * volatile value;
+
+	/**
+	 * serializes updates of the cached value
+	 */
+	spinlock_t *lock;
+};
+
 /**
  * create a key/value pair
  */
@@ -226,6 +330,213 @@ static bool print_key(char *buf, int len, char *start, char *key, va_list args)
 	return res;
 }
 
+/**
+ * Get the name of a key segment, printed to buf only if it is a format string
+ */
+static char *segment_name(char *buf, int len, char *start, char *key,
+						  va_list args)
+{
+	if (!strchr(key, '%'))
+	{
+		return key;
+	}
+	if (!print_key(buf, len, start, key, args))
+	{
+		return NULL;
+	}
+	return buf;
+}
+
+/**
+ * Hash function for section names and keys
+ */
+static u_int node_hash(char *key)
+{
+	return chunk_hash(chunk_from_str(key));
+}
+
+/**
+ * Equality function for section names and keys
+ */
+static bool node_equals(char *key, char *other_key)
+{
+	return streq(key, other_key);
+}
+
+/**
+ * Compile a section to a hashed node, recursively
+ */
+static node_t *node_create(section_t *section)
+{
+	enumerator_t *enumerator;
+	section_t *sub;
+	node_t *this, *node;
+	kv_t *kv;
+
+	INIT(this,
+		.name = strdupnull(section->name),
+		.sections = hashtable_create((hashtable_hash_t)node_hash,
+									 (hashtable_equals_t)node_equals,
+									 section->sections->get_count(section->sections)),
+		.kv = hashtable_create((hashtable_hash_t)node_hash,
+							   (hashtable_equals_t)node_equals,
+							   section->kv->get_count(section->kv)),
+	);
+
+	enumerator = section->sections->create_enumerator(section->sections);
+	while (enumerator->enumerate(enumerator, &sub))
+	{
+		node = node_create(sub);
+		this->sections->put(this->sections, node->name, node);
+	}
+	enumerator->destroy(enumerator);
+
+	enumerator = section->kv->create_enumerator(section->kv);
+	while (enumerator->enumerate(enumerator, &kv))
+	{
+		kv = kv_create(kv->key, kv->value);
+		this->kv->put(this->kv, kv->key, kv);
+	}
+	enumerator->destroy(enumerator);
+	return this;
+}
+
+/**
+ * Destroy a compiled node, recursively
+ */
+static void node_destroy(node_t *this)
+{
+	enumerator_t *enumerator;
+	node_t *node;
+	kv_t *kv;
+	char *key;
+
+	enumerator = this->sections->create_enumerator(this->sections);
+	while (enumerator->enumerate(enumerator, &key, &node))
+	{
+		node_destroy(node);
+	}
+	enumerator->destroy(enumerator);
+	this->sections->destroy(this->sections);
+
+	enumerator = this->kv->create_enumerator(this->kv);
+	while (enumerator->enumerate(enumerator, &key, &kv))
+	{
+		kv_destroy(kv);
+	}
+	enumerator->destroy(enumerator);
+	this->kv->destroy(this->kv);
+
+	free(this->name);
+	free(this);
+}
+
+/**
+ * Destroy a snapshot
+ */
+static void snapshot_destroy(snapshot_t *this)
+{
+	node_destroy(this->top);
+	free(this);
+}
+
+/**
+ * Get the current snapshot, compile it if necessary.
+ * The snapshot stays valid until snapshot_release() is called.
+ */
+static snapshot_t *snapshot_acquire(private_settings_t *this)
+{
+	snapshot_t *snapshot;
+
+	ref_get(&this->readers);
+	snapshot = this->snapshot;
+	if (snapshot)
+	{
+		return snapshot;
+	}
+	this->lock->read_lock(this->lock);
+	snapshot = this->snapshot;
+	if (!snapshot)
+	{
+		INIT(snapshot,
+			.top = node_create(this->top),
+			.generation = this->generation,
+		);
+		if (!cas_ptr((void**)&this->snapshot, NULL, snapshot))
+		{	/* compiled concurrently by another reader */
+			snapshot_destroy(snapshot);
+			snapshot = this->snapshot;
+		}
+	}
+	this->lock->unlock(this->lock);
+	return snapshot;
+}
+
+/**
+ * Release a snapshot acquired with snapshot_acquire()
+ */
+static void snapshot_release(private_settings_t *this)
+{
+	ignore_result(ref_put(&this->readers));
+}
+
+/**
+ * Drop the current snapshot after the tree changed, write lock must be held.
+ * Replaced snapshots are destroyed as soon as no readers are active.
+ */
+static void snapshot_invalidate(private_settings_t *this)
+{
+	snapshot_t *snapshot;
+
+	this->generation++;
+	snapshot = this->snapshot;
+	/* readers can't compile while we hold the write lock, the CAS serves as
+	 * barrier before we check for active readers */
+	if (snapshot && cas_ptr((void**)&this->snapshot, snapshot, NULL))
+	{
+		this->retired->insert_last(this->retired, snapshot);
+	}
+	if (!this->readers)
+	{
+		while (this->retired->remove_first(this->retired,
+										   (void**)&snapshot) == SUCCESS)
+		{
+			snapshot_destroy(snapshot);
+		}
+	}
+}
+
+/**
+ * Find the key/value pair for a key in a compiled snapshot node
+ */
+static kv_t *node_find_value(node_t *node, char *start, char *key,
+							 va_list args, char *buf, int len)
+{
+	char *pos, *name;
+
+	while (node)
+	{
+		pos = strchr(key, '.');
+		if (pos)
+		{
+			*pos = '\0';
+			pos++;
+		}
+		name = segment_name(buf, len, start, key, args);
+		if (!name)
+		{
+			return NULL;
+		}
+		if (!pos)
+		{
+			return node->kv->get(node->kv, name);
+		}
+		node = node->sections->get(node->sections, name);
+		key = pos;
+	}
+	return NULL;
+}
+
 /**
  * Find a section by a given key, using buffered key, reusable buffer.
  * If "ensure" is TRUE, the sections are created if they don't exist.
@@ -370,26 +681,26 @@ static kv_t *find_value_buffered(section_t *section, char *start, char *key,
 }
 
 /**
- * Find the string value for a key (thread-safe).
+ * Find the string value for a key (thread-safe, lock-free).
  */
-static char *find_value(private_settings_t *this, section_t *section,
-						char *key, va_list args)
+static char *find_value(private_settings_t *this, char *key, va_list args)
 {
 	char buf[128], keybuf[512], *value = NULL;
+	snapshot_t *snapshot;
 	kv_t *kv;
 
 	if (snprintf(keybuf, sizeof(keybuf), "%s", key) >= sizeof(keybuf))
 	{
 		return NULL;
 	}
-	this->lock->read_lock(this->lock);
-	kv = find_value_buffered(section, keybuf, keybuf, args, buf, sizeof(buf),
-							 FALSE);
+	snapshot = snapshot_acquire(this);
+	kv = node_find_value(snapshot->top, keybuf, keybuf, args, buf,
+						 sizeof(buf));
 	if (kv)
 	{
 		value = kv->value;
 	}
-	this->lock->unlock(this->lock);
+	snapshot_release(this);
 	return value;
 }
 
@@ -424,6 +735,7 @@ static void set_value(private_settings_t *this, section_t *section,
 			kv->value = strdup(value);
 			this->contents->insert_last(this->contents, kv->value);
 		}
+		snapshot_invalidate(this);
 	}
 	this->lock->unlock(this->lock);
 }
@@ -435,7 +747,7 @@ METHOD(settings_t, get_str, char*,
 	va_list args;
 
 	va_start(args, def);
-	value = find_value(this, this->top, key, args);
+	value = find_value(this, key, args);
 	va_end(args);
 	if (value)
 	{
@@ -476,7 +788,7 @@ METHOD(settings_t, get_bool, bool,
 	va_list args;
 
 	va_start(args, def);
-	value = find_value(this, this->top, key, args);
+	value = find_value(this, key, args);
 	va_end(args);
 	return settings_value_as_bool(value, def);
 }
@@ -506,7 +818,7 @@ METHOD(settings_t, get_int, int,
 	va_list args;
 
 	va_start(args, def);
-	value = find_value(this, this->top, key, args);
+	value = find_value(this, key, args);
 	va_end(args);
 	return settings_value_as_int(value, def);
 }
@@ -536,7 +848,7 @@ METHOD(settings_t, get_double, double,
 	va_list args;
 
 	va_start(args, def);
-	value = find_value(this, this->top, key, args);
+	value = find_value(this, key, args);
 	va_end(args);
 	return settings_value_as_double(value, def);
 }
@@ -582,7 +894,7 @@ METHOD(settings_t, get_time, u_int32_t,
 	va_list args;
 
 	va_start(args, def);
-	value = find_value(this, this->top, key, args);
+	value = find_value(this, key, args);
 	va_end(args);
 	return settings_value_as_time(value, def);
 }
@@ -651,7 +963,7 @@ METHOD(settings_t, set_default_str, bool,
 	va_list args;
 
 	va_start(args, value);
-	old = find_value(this, this->top, key, args);
+	old = find_value(this, key, args);
 	va_end(args);
 
 	if (!old)
@@ -724,6 +1036,182 @@ METHOD(settings_t, create_key_value_enumerator, enumerator_t*,
 					(void*)kv_filter, this->lock, (void*)this->lock->unlock);
 }
 
+/**
+ * Resolve the value of a key handle against the current snapshot
+ */
+static char *key_resolve(private_settings_key_t *this)
+{
+	snapshot_t *snapshot;
+	node_t *node;
+	kv_t *kv = NULL;
+	char *value = NULL;
+	int i;
+
+	snapshot = snapshot_acquire(this->settings);
+	node = snapshot->top;
+	for (i = 0; node && i < this->count - 1; i++)
+	{
+		node = node->sections->get(node->sections, this->path[i]);
+	}
+	if (node)
+	{
+		kv = node->kv->get(node->kv, this->path[this->count - 1]);
+	}
+	if (kv)
+	{
+		value = kv->value;
+	}
+	this->lock->lock(this->lock);
+	/* invalidate the cached value while updating it, see key_value() */
+	this->generation = 0;
+#ifdef HAVE_GCC_ATOMIC_OPERATIONS
+	__sync_synchronize();
+#endif
+	this->value = value;
+#ifdef HAVE_GCC_ATOMIC_OPERATIONS
+	__sync_synchronize();
+#endif
+	this->generation = snapshot->generation;
+	this->lock->unlock(this->lock);
+	snapshot_release(this->settings);
+	return value;
+}
+
+/**
+ * Get the value of a key handle, the cached value is used if still current
+ */
+static char *key_value(private_settings_key_t *this)
+{
+#ifdef HAVE_GCC_ATOMIC_OPERATIONS
+	u_int generation;
+	char *value;
+
+	generation = this->generation;
+	__sync_synchronize();
+	value = this->value;
+	__sync_synchronize();
+	if (generation == this->generation &&
+		generation == this->settings->generation)
+	{
+		return value;
+	}
+#endif /* HAVE_GCC_ATOMIC_OPERATIONS */
+	return key_resolve(this);
+}
+
+METHOD(settings_key_t, key_get_str, char*,
+	private_settings_key_t *this, char *def)
+{
+	char *value;
+
+	value = key_value(this);
+	if (value)
+	{
+		return value;
+	}
+	return def;
+}
+
+METHOD(settings_key_t, key_get_bool, bool,
+	private_settings_key_t *this, bool def)
+{
+	return settings_value_as_bool(key_value(this), def);
+}
+
+METHOD(settings_key_t, key_get_int, int,
+	private_settings_key_t *this, int def)
+{
+	return settings_value_as_int(key_value(this), def);
+}
+
+METHOD(settings_key_t, key_get_double, double,
+	private_settings_key_t *this, double def)
+{
+	return settings_value_as_double(key_value(this), def);
+}
+
+METHOD(settings_key_t, key_get_time, u_int32_t,
+	private_settings_key_t *this, u_int32_t def)
+{
+	return settings_value_as_time(key_value(this), def);
+}
+
+METHOD(settings_key_t, key_destroy, void,
+	private_settings_key_t *this)
+{
+	while (this->count--)
+	{
+		free(this->path[this->count]);
+	}
+	free(this->path);
+	this->lock->destroy(this->lock);
+	free(this);
+}
+
+METHOD(settings_t, create_key, settings_key_t*,
+	private_settings_t *this, char *key, ...)
+{
+	private_settings_key_t *handle;
+	char buf[128], keybuf[512], *pos, *name;
+	va_list args;
+	int count = 1;
+
+	if (snprintf(keybuf, sizeof(keybuf), "%s", key) >= sizeof(keybuf))
+	{
+		return NULL;
+	}
+	for (pos = keybuf; *pos; pos++)
+	{
+		if (*pos == '.')
+		{
+			count++;
+		}
+	}
+
+	INIT(handle,
+		.public = {
+			.get_str = _key_get_str,
+			.get_bool = _key_get_bool,
+			.get_int = _key_get_int,
+			.get_double = _key_get_double,
+			.get_time = _key_get_time,
+			.destroy = _key_destroy,
+		},
+		.settings = this,
+		.path = calloc(count, sizeof(char*)),
+		.lock = spinlock_create(),
+	);
+
+	va_start(args, key);
+	key = keybuf;
+	while (handle->count < count)
+	{
+		pos = strchr(key, '.');
+		if (pos)
+		{
+			*pos = '\0';
+		}
+		name = segment_name(buf, sizeof(buf), keybuf, key, args);
+		if (!name)
+		{
+			break;
+		}
+		handle->path[handle->count++] = strdup(name);
+		if (pos)
+		{
+			key = pos + 1;
+		}
+	}
+	va_end(args);
+
+	if (handle->count < count)
+	{
+		key_destroy(handle);
+		return NULL;
+	}
+	return &handle->public;
+}
+
 /**
  * parse text, truncate "skip" chars, delimited by term respecting brackets.
  *
@@ -1171,6 +1659,7 @@ static bool load_files_internal(private_settings_t *this, section_t *parent,
 	{
 		this->contents->insert_last(this->contents, text);
 	}
+	snapshot_invalidate(this);
 	this->lock->unlock(this->lock);
 
 	section_destroy(section);
@@ -1205,6 +1694,11 @@ METHOD(settings_t, destroy, void,
 	   private_settings_t *this)
 {
 	section_destroy(this->top);
+	if (this->snapshot)
+	{
+		snapshot_destroy(this->snapshot);
+	}
+	this->retired->destroy_function(this->retired, (void*)snapshot_destroy);
 	this->contents->destroy_function(this->contents, (void*)free);
 	this->lock->destroy(this->lock);
 	free(this);
@@ -1232,6 +1726,7 @@ settings_t *settings_create(char *file)
 			.set_default_str = _set_default_str,
 			.create_section_enumerator = _create_section_enumerator,
 			.create_key_value_enumerator = _create_key_value_enumerator,
+			.create_key = _create_key,
 			.load_files = _load_files,
 			.load_files_section = _load_files_section,
 			.destroy = _destroy,
@@ -1239,6 +1734,8 @@ settings_t *settings_create(char *file)
 		.top = section_create(NULL),
 		.contents = linked_list_create(),
 		.lock = rwlock_create(RWLOCK_TYPE_DEFAULT),
+		.retired = linked_list_create(),
+		.generation = 1,
 	);
 
 	load_files(this, file, FALSE);
@@ -23,6 +23,7 @@
 #define SETTINGS_H_
 
 typedef struct settings_t settings_t;
+typedef struct settings_key_t settings_key_t;
 
 #include "utils.h"
 #include "collections/enumerator.h"
@@ -67,6 +68,62 @@ double settings_value_as_double(char *value, double def);
  */
 u_int32_t settings_value_as_time(char *value, u_int32_t def);
 
+/**
+ * Handle to a pre-resolved settings key.
+ *
+ * The key is formatted once when the handle is created. Reading a value
+ * through the handle requires neither locking nor formatting, as long as the
+ * settings did not change since the last read. Changes made later, e.g. by
+ * reloading the config files, are reflected by the handle.
+ */
+struct settings_key_t {
+
+	/**
+	 * Get the value of the key as a string.
+	 *
+	 * @param def		value returned if key not found
+	 * @return			value pointing to internal string
+	 */
+	char* (*get_str)(settings_key_t *this, char *def);
+
+	/**
+	 * Get the value of the key as boolean.
+	 *
+	 * @param def		value returned if key not found
+	 * @return			value of the key
+	 */
+	bool (*get_bool)(settings_key_t *this, bool def);
+
+	/**
+	 * Get the value of the key as integer.
+	 *
+	 * @param def		value returned if key not found
+	 * @return			value of the key
+	 */
+	int (*get_int)(settings_key_t *this, int def);
+
+	/**
+	 * Get the value of the key as double.
+	 *
+	 * @param def		value returned if key not found
+	 * @return			value of the key
+	 */
+	double (*get_double)(settings_key_t *this, double def);
+
+	/**
+	 * Get the value of the key as time value.
+	 *
+	 * @param def		value returned if key not found
+	 * @return			value of the key (in seconds)
+	 */
+	u_int32_t (*get_time)(settings_key_t *this, u_int32_t def);
+
+	/**
+	 * Destroy a settings_key_t handle.
+	 */
+	void (*destroy)(settings_key_t *this);
+};
+
 /**
  * Generic configuration options read from a config file.
  *
@@ -96,6 +153,11 @@ u_int32_t settings_value_as_time(char *value, u_int32_t def);
  * Currently only a limited set of printf format specifiers are supported
  * (namely %s, %d and %N, see implementation for details).
  *
+ * Values are read from an immutable, hashed snapshot of the settings, which
+ * is compiled on first access and replaced whenever the settings change. Reads
+ * do not lock, settings_t.create_key() additionally avoids formatting keys
+ * for frequently read values.
+ *
  * \section includes Including other files
  * Other files can be included, using the include statement e.g.
  * @code
@@ -268,6 +330,17 @@ struct settings_t {
 	enumerator_t* (*create_key_value_enumerator)(settings_t *this,
 												 char *section, ...);
 
+	/**
+	 * Create a handle to read the value of a key repeatedly.
+	 *
+	 * The handle must be destroyed before this settings instance.
+	 *
+	 * @param key		key including sections, printf style format
+	 * @param ...		argument list for key
+	 * @return			key handle, NULL if key is invalid
+	 */
+	settings_key_t* (*create_key)(settings_t *this, char *key, ...);
+
 	/**
 	 * Load settings from the files matching the given pattern.
 	 *
@@ -268,6 +268,8 @@ static int list_flags[] = {
 	LIST_OCSP,
 	LIST_ALGS,
 	LIST_PLUGINS,
+	LIST_RADIUS,
+	LIST_POOLS,
 	LIST_ALL
 };
 
@@ -435,6 +437,10 @@ static void exit_usage(char *error)
 	printf("    stroke listcerts|listcainfos|listcrls|listall\n");
 	printf("  Show list of supported algorithms:\n");
 	printf("    stroke listalgs\n");
+	printf("  Show RADIUS server health and statistics:\n");
+	printf("    stroke listradius\n");
+	printf("  Show IP address pool utilization and fragmentation:\n");
+	printf("    stroke listpools\n");
 	printf("  Reload authority and attribute certificates:\n");
 	printf("    stroke rereadcacerts|rereadocspcerts|rereadaacerts|rereadacerts\n");
 	printf("  Reload secrets and crls:\n");
@@ -568,6 +574,8 @@ int main(int argc, char *argv[])
 		case STROKE_LIST_OCSP:
 		case STROKE_LIST_ALGS:
 		case STROKE_LIST_PLUGINS:
+		case STROKE_LIST_RADIUS:
+		case STROKE_LIST_POOLS:
 		case STROKE_LIST_ALL:
 			res = list(token->kw, argc > 2 && strcmp(argv[2], "--utc") == 0);
 			break;
@@ -67,8 +67,12 @@ enum list_flag_t {
 	LIST_ALGS =			0x0400,
 	/** list plugin information */
 	LIST_PLUGINS =		0x0800,
+	/** list RADIUS server statistics */
+	LIST_RADIUS =		0x1000,
+	/** list IP address pool utilization */
+	LIST_POOLS =		0x2000,
 	/** all list options */
-	LIST_ALL =			0x0FFF,
+	LIST_ALL =			0x3FFF,
 };
 
 typedef enum reread_flag_t reread_flag_t;